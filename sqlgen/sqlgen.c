@@ -19,12 +19,22 @@
 #include <ctype.h>
 #include <limits.h>
 
+#if defined(SQLGEN_ANALYZE)
+#include <sqlite3.h>
+#endif
+
 #define DEFAULT_PREFIX "sqlgen"
 #define DEFAULT_MALLOC "malloc"
 #define DEFAULT_FREE "free"
 #define DEFAULT_LOG_DBG "printf"
 #define DEFAULT_LOG_ERR "printf"
 #define DEFAULT_LOG_SQL_ERR "sqlgen_error"
+/* Bulk insert statements must stay below SQLITE_MAX_VARIABLE_NUMBER, which
+ * defaults to 999 in SQLite versions prior to 3.32.0 */
+#define BULK_MAX_VARIABLES 999
+#define BULK_MAX_ROWS 64
+/* With the "spin" busy policy, how long open() waits for the lock of a PRAGMA */
+#define OPEN_BUSY_TIMEOUT_MS 5000
 #define PREFIX(sv, data) \
         (sv).len ? (sv) : str_view(DEFAULT_PREFIX), (sv).len ? (data) : DEFAULT_PREFIX
 #define MALLOC(sv, data) \
@@ -536,6 +546,7 @@ struct cfg
     unsigned custom_api         : 1;
     unsigned custom_api_decl    : 1;
     unsigned forwards_compat    : 1;
+    unsigned analyze            : 1;
 };
 
 static int
@@ -611,6 +622,15 @@ parse_cmdline(int argc, char** argv, struct cfg* cfg)
         }
         else if (strcmp(argv[i], "--debug-layer") == 0)
             cfg->debug_layer = 1;
+        else if (strcmp(argv[i], "--analyze") == 0)
+        {
+#if defined(SQLGEN_ANALYZE)
+            cfg->analyze = 1;
+#else
+            fprintf(stderr, "Error: --analyze requires sqlgen to be built with SQLGEN_ANALYZE\n");
+            return -1;
+#endif
+        }
         else
         {
             fprintf(stderr, "Error: Unknown option \"%s\"\n", argv[i]);
@@ -679,6 +699,7 @@ enum token
     TOK_RPAREN = ')',
     TOK_COMMA = ',',
     TOK_OPTION = 256,
+    TOK_PRAGMA,
     TOK_DOXYGEN,
     TOK_STRING,
     TOK_LABEL,
@@ -797,6 +818,11 @@ scan_next_token(struct parser* p)
             p->head += sizeof("%option") - 1;
             return TOK_OPTION;
         }
+        if (memcmp(p->data + p->head, "%pragma", sizeof("%pragma") - 1) == 0)
+        {
+            p->head += sizeof("%pragma") - 1;
+            return TOK_PRAGMA;
+        }
         if (memcmp(p->data + p->head, "%header-preamble", sizeof("%header-preamble") - 1) == 0)
         {
             p->head += sizeof("%header-preamble") - 1;
@@ -919,6 +945,8 @@ struct arg
     const char* printf_fmt;
     unsigned nullable : 1;
     unsigned update : 1;
+    unsigned read_key : 1; /* Looked up by "read-first" */
+    unsigned conflict_key : 1; /* Upsert conflict target from "on-conflict" */
     /* Used for blob types where the "length" is implicit */
     unsigned has_hidden_len_param : 1;
 };
@@ -1008,6 +1036,23 @@ migration_alloc(int version)
     return m;
 }
 
+struct pragma
+{
+    struct pragma* next;
+    struct str_view name;
+    struct str_view value;
+};
+
+static struct pragma*
+pragma_alloc(struct str_view name, struct str_view value)
+{
+    struct pragma* pr = malloc(sizeof *pr);
+    pr->next = NULL;
+    pr->name = name;
+    pr->value = value;
+    return pr;
+}
+
 enum query_type
 {
     QUERY_NONE,
@@ -1029,10 +1074,20 @@ struct query
     struct str_view table_name;
     struct str_view return_name;
     struct str_view doxygen;
+    struct arg* return_arg; /* Set if the return value has a type */
     struct arg* in_args;
     struct arg* cb_args;
     struct arg* bind_args;
+    struct arg* shard_key;  /* Set if the query is routed by "shard-key" */
     enum query_type type;
+    int cache_entries;      /* Size of the result cache, 0 if not cached */
+    unsigned batch : 1;
+    unsigned bulk : 1;
+    unsigned cursor : 1;
+    unsigned columns : 1;
+    unsigned read_first : 1;
+    unsigned upsert_status : 1; /* Upsert with "on-conflict", returns what it did */
+    unsigned require_index : 1; /* --analyze fails if the plan has a full scan */
 };
 
 static struct query*
@@ -1059,6 +1114,59 @@ query_group_alloc(void)
     return g;
 }
 
+enum busy_policy
+{
+    BUSY_SPIN,
+    BUSY_FAIL,
+    BUSY_TIMEOUT,
+    BUSY_BACKOFF
+};
+
+enum profile
+{
+    PROFILE_NONE,
+    PROFILE_THROUGHPUT,
+    PROFILE_LATENCY,
+    PROFILE_LOW_MEMORY
+};
+
+/*!
+ * \brief The PRAGMAs each %option profile="..." applies when a connection is
+ * opened, in the order they are executed. A %pragma with the same name
+ * replaces the profile's value.
+ */
+static const struct {
+    const char* name;
+    const char* pragmas[8][2];
+} profiles[] = {
+    {"", {{NULL}}},
+    {"throughput", {
+        {"journal_mode", "WAL"},
+        {"synchronous", "NORMAL"},
+        {"temp_store", "MEMORY"},
+        {"cache_size", "-65536"},
+        {"mmap_size", "268435456"},
+        {"journal_size_limit", "67108864"},
+        {NULL}}},
+    {"latency", {
+        {"journal_mode", "WAL"},
+        {"synchronous", "NORMAL"},
+        {"temp_store", "MEMORY"},
+        {"cache_size", "-16384"},
+        {"mmap_size", "268435456"},
+        {"journal_size_limit", "16777216"},
+        {"wal_autocheckpoint", "256"},
+        {NULL}}},
+    {"low-memory", {
+        {"journal_mode", "WAL"},
+        {"synchronous", "NORMAL"},
+        {"temp_store", "FILE"},
+        {"cache_size", "-512"},
+        {"mmap_size", "0"},
+        {"journal_size_limit", "4194304"},
+        {NULL}}},
+};
+
 struct root
 {
     struct str_view prefix;
@@ -1077,6 +1185,25 @@ struct root
     struct function* functions;
     struct migration* upgrade;
     struct migration* downgrade;
+    struct pragma* pragmas;
+    enum profile profile;
+    enum busy_policy busy_policy;
+    int busy_timeout_ms;
+    int busy_min_ms;
+    int busy_max_ms;
+    int group_commit_ops;
+    int group_commit_us;
+    int shards;             /* Number of shards, 0 if not sharded */
+    int checkpoint_pages;   /* WAL size that triggers a checkpoint, 0 if disabled */
+    int checkpoint_ms;
+    unsigned prepare_eager : 1;
+    unsigned pool : 1;
+    unsigned pool_thread_affine : 1;
+    unsigned async : 1;
+    unsigned split : 1;
+    unsigned profile_layer : 1;
+    unsigned tenants : 1;
+    unsigned deadlines : 1;
 };
 
 static void
@@ -1085,6 +1212,92 @@ root_init(struct root* root)
     memset(root, 0, sizeof *root);
 }
 
+/*!
+ * \brief Parses the value of %option busy="...". Accepted values are
+ * "spin", "fail", "timeout:<ms>" and "backoff:<min>,<max>".
+ */
+static int
+parse_busy_option(struct root* root, struct str_view value, const char* data)
+{
+    char buf[64];
+    char extra;
+    if (value.len >= (int)sizeof(buf))
+        return -1;
+    memcpy(buf, data + value.off, value.len);
+    buf[value.len] = '\0';
+
+    if (strcmp(buf, "spin") == 0)
+        root->busy_policy = BUSY_SPIN;
+    else if (strcmp(buf, "fail") == 0)
+        root->busy_policy = BUSY_FAIL;
+    else if (sscanf(buf, "timeout:%d%c", &root->busy_timeout_ms, &extra) == 1)
+    {
+        if (root->busy_timeout_ms <= 0)
+            return -1;
+        root->busy_policy = BUSY_TIMEOUT;
+    }
+    else if (sscanf(buf, "backoff:%d,%d%c", &root->busy_min_ms, &root->busy_max_ms, &extra) == 2)
+    {
+        if (root->busy_min_ms <= 0 || root->busy_max_ms < root->busy_min_ms)
+            return -1;
+        root->busy_policy = BUSY_BACKOFF;
+    }
+    else
+        return -1;
+
+    return 0;
+}
+
+/*!
+ * \brief Parses the value of %option group-commit="...", which is the maximum
+ * number of writes per transaction, optionally followed by how many
+ * microseconds the writer waits for more: "<ops>[:<us>]".
+ */
+static int
+parse_group_commit_option(struct root* root, struct str_view value, const char* data)
+{
+    char buf[64];
+    char extra;
+    if (value.len >= (int)sizeof(buf))
+        return -1;
+    memcpy(buf, data + value.off, value.len);
+    buf[value.len] = '\0';
+
+    root->group_commit_us = 0;
+    if (sscanf(buf, "%d:%d%c", &root->group_commit_ops, &root->group_commit_us, &extra) != 2 &&
+        sscanf(buf, "%d%c", &root->group_commit_ops, &extra) != 1)
+        return -1;
+    if (root->group_commit_ops < 1 || root->group_commit_ops > 4096 || root->group_commit_us < 0)
+        return -1;
+
+    return 0;
+}
+
+/*!
+ * \brief Parses the value of %option checkpoint="...", which is the WAL size
+ * in pages that triggers a checkpoint, optionally followed by the number of
+ * milliseconds after which a checkpoint runs anyway: "<pages>[:<ms>]".
+ */
+static int
+parse_checkpoint_option(struct root* root, struct str_view value, const char* data)
+{
+    char buf[64];
+    char extra;
+    if (value.len >= (int)sizeof(buf))
+        return -1;
+    memcpy(buf, data + value.off, value.len);
+    buf[value.len] = '\0';
+
+    root->checkpoint_ms = 0;
+    if (sscanf(buf, "%d:%d%c", &root->checkpoint_pages, &root->checkpoint_ms, &extra) != 2 &&
+        sscanf(buf, "%d%c", &root->checkpoint_pages, &extra) != 1)
+        return -1;
+    if (root->checkpoint_pages < 1 || root->checkpoint_ms < 0)
+        return -1;
+
+    return 0;
+}
+
 static enum token
 scan_block(struct parser* p, int expect_opening_brace)
 {
@@ -1158,6 +1371,31 @@ parse(struct parser* p, struct root* root, struct cfg* cfg)
                     { cfg->custom_api_decl = 1; break; }
                 else if (cstr_eq_str("forwards-compat", option, p->data))
                     { cfg->forwards_compat = 1; break; }
+                else if (cstr_eq_str("pool", option, p->data))
+                    { root->pool = 1; break; }
+                else if (cstr_eq_str("pool-thread-affine", option, p->data))
+                    { root->pool = 1; root->pool_thread_affine = 1; break; }
+                else if (cstr_eq_str("async", option, p->data))
+                    { root->async = 1; break; }
+                else if (cstr_eq_str("read-write-split", option, p->data))
+                    { root->split = 1; break; }
+                else if (cstr_eq_str("profile-layer", option, p->data))
+                    { root->profile_layer = 1; break; }
+                else if (cstr_eq_str("tenant-cache", option, p->data))
+                    { root->tenants = 1; break; }
+                else if (cstr_eq_str("deadlines", option, p->data))
+                    { root->deadlines = 1; break; }
+
+                /* Options with an integer argument */
+                if (cstr_eq_str("shards", option, p->data))
+                {
+                    if (scan_next_token(p) != '=')
+                        return print_error(p, "Error: Expecting '='\n");
+                    if (scan_next_token(p) != TOK_INTEGER || p->value.integer < 1)
+                        return print_error(p, "Error: Expected a positive integer for option \"shards\"\n");
+                    root->shards = p->value.integer;
+                    break;
+                }
 
                 if (scan_next_token(p) != '=')
                     return print_error(p, "Error: Expecting '='\n");
@@ -1176,10 +1414,64 @@ parse(struct parser* p, struct root* root, struct cfg* cfg)
                     root->log_err = p->value.str;
                 else if (cstr_eq_str("log-sql-error", option, p->data))
                     root->log_sql_err = p->value.str;
+                else if (cstr_eq_str("prepare", option, p->data))
+                {
+                    if (cstr_eq_str("eager", p->value.str, p->data))
+                        root->prepare_eager = 1;
+                    else if (cstr_eq_str("lazy", p->value.str, p->data))
+                        root->prepare_eager = 0;
+                    else
+                        return print_error(p, "Error: Expected \"lazy\" or \"eager\" for option \"prepare\"\n");
+                }
+                else if (cstr_eq_str("busy", option, p->data))
+                {
+                    if (parse_busy_option(root, p->value.str, p->data) < 0)
+                        return print_error(p, "Error: Expected \"spin\", \"fail\", \"timeout:<ms>\" or \"backoff:<min>,<max>\" for option \"busy\"\n");
+                }
+                else if (cstr_eq_str("group-commit", option, p->data))
+                {
+                    /* Writes are grouped by the executor's writer thread */
+                    if (parse_group_commit_option(root, p->value.str, p->data) < 0)
+                        return print_error(p, "Error: Expected \"<ops>\" or \"<ops>:<us>\" for option \"group-commit\"\n");
+                    root->async = 1;
+                }
+                else if (cstr_eq_str("checkpoint", option, p->data))
+                {
+                    /* Checkpoints are run by the pool */
+                    if (parse_checkpoint_option(root, p->value.str, p->data) < 0)
+                        return print_error(p, "Error: Expected \"<pages>\" or \"<pages>:<ms>\" for option \"checkpoint\"\n");
+                    root->pool = 1;
+                }
+                else if (cstr_eq_str("profile", option, p->data))
+                {
+                    int i;
+                    for (i = PROFILE_THROUGHPUT; i != sizeof(profiles) / sizeof(*profiles); ++i)
+                        if (cstr_eq_str(profiles[i].name, p->value.str, p->data))
+                            break;
+                    if (i == sizeof(profiles) / sizeof(*profiles))
+                        return print_error(p, "Error: Expected \"throughput\", \"latency\" or \"low-memory\" for option \"profile\"\n");
+                    root->profile = (enum profile)i;
+                }
                 else
                     return print_error(p, "Unknown option \"%.*s\"\n", option.len, p->data + option.off);
             } break;
 
+            case TOK_PRAGMA: {
+                struct str_view name;
+                struct pragma** l;
+                if (scan_next_token(p) != TOK_LABEL)
+                    return print_error(p, "Error: Expected pragma name after %%pragma\n");
+                name = p->value.str;
+                if (scan_next_token(p) != '=')
+                    return print_error(p, "Error: Expecting '='\n");
+                if (scan_next_token(p) != TOK_STRING)
+                    return print_error(p, "Error: Expected string for %%pragma\n");
+
+                /* Keep pragmas in the order they were written */
+                for (l = &root->pragmas; *l; l = &(*l)->next) {}
+                *l = pragma_alloc(name, p->value.str);
+            } break;
+
             case TOK_HEADER_PREAMBLE: {
                 if (scan_block(p, 1) != TOK_STRING)
                     return -1;
@@ -1460,10 +1752,26 @@ parse(struct parser* p, struct root* root, struct cfg* cfg)
                         if (scan_next_token(p) != TOK_LABEL)
                             return print_error(p, "Error: Expected return value after \"return\"\n");
                         query->return_name = p->value.str;
+
+                        /* "return <type> <name>" writes the value to an
+                         * out-parameter instead of returning it as an int */
+                        tok = scan_next_token(p);
+                        if (tok != TOK_LABEL)
+                            goto switch_next_stmt;
+                        query->return_arg = arg_alloc(query->return_name, p->value.str, p->data);
+                        if (query->return_arg == NULL)
+                            goto switch_next_stmt;  /* Label is a query attribute */
+                        if (strcmp(query->return_arg->sql_type, "int") != 0 &&
+                            strcmp(query->return_arg->sql_type, "int64") != 0)
+                        {
+                            return print_error(p, "Error: Unsupported return type \"%.*s\". Must be an integer type\n",
+                                query->return_name.len, p->data + query->return_name.off);
+                        }
+                        query->return_name = p->value.str;
                     } goto expect_next_stmt;
 
                     case TOK_CALLBACK: {
-                    expect_next_cb_param: tok = scan_next_token(p);
+                        tok = scan_next_token(p);
                     switch_next_cb_param:
                         switch (tok)
                         {
@@ -1511,15 +1819,21 @@ parse(struct parser* p, struct root* root, struct cfg* cfg)
                                     args->next = arg;
                                 }
 
-                                /* Param can have a "null" qualifier on the end */
-                                if ((tok = scan_next_token(p)) == TOK_LABEL)
+                                /* Param can have "null" and "len" qualifiers on the
+                                 * end. Any other label ends the list and is parsed
+                                 * as a query attribute */
+                                while ((tok = scan_next_token(p)) == TOK_LABEL)
                                 {
                                     if (cstr_eq_str("null", p->value.str, p->data))
                                         arg->nullable = 1;
+                                    else if (cstr_eq_str("len", p->value.str, p->data))
+                                    {
+                                        if (!cstr_eq_str("const char*", arg->type, p->data))
+                                            return print_error(p, "Error: \"len\" is only supported for \"const char*\" callback parameters\n");
+                                        arg->has_hidden_len_param = 1;
+                                    }
                                     else
-                                        return print_error(p, "Error: Unknown parameter qualifier \"%.*s\"\n",
-                                            p->value.str.len, p->data + p->value.str.off);
-                                    goto expect_next_cb_param;
+                                        goto switch_next_stmt;
                                 }
                             } goto switch_next_cb_param;
 
@@ -1527,6 +1841,91 @@ parse(struct parser* p, struct root* root, struct cfg* cfg)
                         }
                     }
 
+                    /* Attributes */
+                    case TOK_LABEL: {
+                        if (cstr_eq_str("batch", p->value.str, p->data))
+                            query->batch = 1;
+                        else if (cstr_eq_str("bulk", p->value.str, p->data))
+                            query->bulk = 1;
+                        else if (cstr_eq_str("cursor", p->value.str, p->data))
+                            query->cursor = 1;
+                        else if (cstr_eq_str("columns", p->value.str, p->data))
+                            query->columns = 1;
+                        else if (cstr_eq_str("require-index", p->value.str, p->data))
+                            query->require_index = 1;
+                        else if (cstr_eq_str("read-first", p->value.str, p->data))
+                        {
+                            do
+                            {
+                                struct arg* a;
+                                struct str_view find;
+                                if (scan_next_token(p) != TOK_LABEL)
+                                    return print_error(p, "Error: Expected column name after \"read-first\"\n");
+                                find = p->value.str;
+
+                                for (a = query->in_args; a; a = a->next)
+                                    if (str_eq_str(a->name, find, p->data))
+                                    {
+                                        a->read_key = 1;
+                                        break;
+                                    }
+                                if (a == NULL)
+                                    return print_error(p, "Error: \"read-first %.*s\" specified, but no argument with this name exists in the function's parameter list\n",
+                                            find.len, p->data + find.off);
+                            } while ((tok = scan_next_token(p)) == ',');
+                            query->read_first = 1;
+                            goto switch_next_stmt;
+                        }
+                        else if (cstr_eq_str("shard-key", p->value.str, p->data))
+                        {
+                            struct arg* a;
+                            struct str_view find;
+                            if (scan_next_token(p) != TOK_LABEL)
+                                return print_error(p, "Error: Expected argument name after \"shard-key\"\n");
+                            find = p->value.str;
+
+                            for (a = query->in_args; a; a = a->next)
+                                if (str_eq_str(a->name, find, p->data))
+                                    break;
+                            if (a == NULL)
+                                return print_error(p, "Error: \"shard-key %.*s\" specified, but no argument with this name exists in the function's parameter list\n",
+                                        find.len, p->data + find.off);
+                            query->shard_key = a;
+                        }
+                        else if (cstr_eq_str("on-conflict", p->value.str, p->data))
+                        {
+                            do
+                            {
+                                struct arg* a;
+                                struct str_view find;
+                                if (scan_next_token(p) != TOK_LABEL)
+                                    return print_error(p, "Error: Expected column name after \"on-conflict\"\n");
+                                find = p->value.str;
+
+                                for (a = query->in_args; a; a = a->next)
+                                    if (str_eq_str(a->name, find, p->data))
+                                    {
+                                        a->conflict_key = 1;
+                                        break;
+                                    }
+                                if (a == NULL)
+                                    return print_error(p, "Error: \"on-conflict %.*s\" specified, but no argument with this name exists in the function's parameter list\n",
+                                            find.len, p->data + find.off);
+                            } while ((tok = scan_next_token(p)) == ',');
+                            query->upsert_status = 1;
+                            goto switch_next_stmt;
+                        }
+                        else if (cstr_eq_str("cache", p->value.str, p->data))
+                        {
+                            if (scan_next_token(p) != TOK_INTEGER || p->value.integer <= 0)
+                                return print_error(p, "Error: Expected number of entries after \"cache\"\n");
+                            query->cache_entries = p->value.integer;
+                        }
+                        else
+                            return print_error(p, "Error: Unknown query attribute \"%.*s\"\n",
+                                p->value.str.len, p->data + p->value.str.off);
+                    } goto expect_next_stmt;
+
                     case '}': break;
                     default:
                         return print_error(p, "Error: Expecting \"type\", \"table\", \"stmt\" or \"return\"\n");
@@ -1751,1024 +2150,6573 @@ return_arg_must_not_exist_in_function_argument_list(const struct root* root, con
     return 0;
 }
 
-static void
-set_bind_defaults(struct root* root, const char* data)
+static int
+batch_queries_must_have_arguments(const struct root* root, const char* data)
 {
-    struct query_group* g;
-    struct query* q;
-
-    /* If "bind" was not specified, default to using the function arguments list */
+    const struct query_group* g;
+    const struct query* q;
     for (q = root->queries; q; q = q->next)
-        if (q->bind_args == NULL)
-            q->bind_args = q->in_args;
+    {
+        if (q->batch && q->in_args == NULL)
+        {
+            fprintf(stderr, "Error: Query \"%.*s\" has no arguments, so it can't be batched\n",
+                q->name.len, data + q->name.off);
+            return -1;
+        }
+        else if (q->batch && q->return_arg)
+        {
+            fprintf(stderr, "Error: Query \"%.*s\" returns a typed value, so it can't be batched\n",
+                q->name.len, data + q->name.off);
+            return -1;
+        }
+    }
     for (g = root->query_groups; g; g = g->next)
         for (q = g->queries; q; q = q->next)
-            if (q->bind_args == NULL)
-                q->bind_args = q->in_args;
+        {
+            if (q->batch && q->in_args == NULL)
+            {
+                fprintf(stderr, "Error: Query \"%.*s,%.*s\" has no arguments, so it can't be batched\n",
+                    g->name.len, data + g->name.off, q->name.len, data + q->name.off);
+                return -1;
+            }
+            else if (q->batch && q->return_arg)
+            {
+                fprintf(stderr, "Error: Query \"%.*s,%.*s\" returns a typed value, so it can't be batched\n",
+                    g->name.len, data + g->name.off, q->name.len, data + q->name.off);
+                return -1;
+            }
+        }
+
+    return 0;
 }
 
 static int
-post_parse(struct root* root, const char* data)
+check_bulk_query(const struct query_group* g, const struct query* q, const char* data)
 {
-    if (return_arg_must_not_exist_in_function_argument_list(root, data) < 0)
-        return -1;
+    if (!q->bulk)
+        return 0;
 
-    set_bind_defaults(root, data);
+    if (q->table_name.len == 0 || q->stmt.len ||
+        (q->type != QUERY_INSERT_NEW && q->type != QUERY_INSERT_OR_GET && q->type != QUERY_UPSERT))
+    {
+        fprintf(stderr, "Error: Query \"%.*s%s%.*s\": \"bulk\" is only supported for insert-new, insert-or-get and upsert queries using \"table\"\n",
+            g ? g->name.len : 0, g ? data + g->name.off : "", g ? "," : "",
+            q->name.len, data + q->name.off);
+        return -1;
+    }
+    if (q->in_args == NULL)
+    {
+        fprintf(stderr, "Error: Query \"%.*s%s%.*s\" has no arguments, so it can't be bulk inserted\n",
+            g ? g->name.len : 0, g ? data + g->name.off : "", g ? "," : "",
+            q->name.len, data + q->name.off);
+        return -1;
+    }
 
     return 0;
 }
 
-/* ----------------------------------------------------------------------------
- * Generate
- * ------------------------------------------------------------------------- */
+static int
+bulk_queries_must_insert_into_table(const struct root* root, const char* data)
+{
+    const struct query_group* g;
+    const struct query* q;
+    for (q = root->queries; q; q = q->next)
+        if (check_bulk_query(NULL, q, data) < 0)
+            return -1;
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            if (check_bulk_query(g, q, data) < 0)
+                return -1;
 
-static void
-write_func_name(struct mstream* ms, const struct query_group* g, const struct query* q, const char* data)
+    return 0;
+}
+
+static int
+check_read_first_query(const struct query_group* g, const struct query* q, const char* data)
 {
-    if (g)
+    if (!q->read_first)
+        return 0;
+
+    if (q->type != QUERY_INSERT_OR_GET || q->table_name.len == 0 || q->stmt.len)
     {
-        mstream_str(ms, g->name, data);
-        mstream_putc(ms, '_');
+        fprintf(stderr, "Error: Query \"%.*s%s%.*s\": \"read-first\" is only supported for insert-or-get queries using \"table\"\n",
+            g ? g->name.len : 0, g ? data + g->name.off : "", g ? "," : "",
+            q->name.len, data + q->name.off);
+        return -1;
     }
-    mstream_str(ms, q->name, data);
+
+    return 0;
 }
 
-static void
-write_func_param_list(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+static int
+read_first_queries_must_insert_or_get(const struct root* root, const char* data)
 {
-    struct arg* a;
+    const struct query_group* g;
+    const struct query* q;
+    for (q = root->queries; q; q = q->next)
+        if (check_read_first_query(NULL, q, data) < 0)
+            return -1;
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            if (check_read_first_query(g, q, data) < 0)
+                return -1;
 
-    mstream_fmt(ms, "struct %S* ctx", PREFIX(root->prefix, data));
+    return 0;
+}
 
-    for (a = q->in_args; a; a = a->next)
+static int
+check_upsert_status_query(const struct query_group* g, const struct query* q, const char* data)
+{
+    if (!q->upsert_status)
+        return 0;
+
+    if (q->type != QUERY_UPSERT || q->table_name.len == 0 || q->stmt.len)
     {
-        mstream_fmt(ms, ", %S %S", a->type, data, a->name, data);
-        if (a->has_hidden_len_param)
-            mstream_fmt(ms, ", int %S_len", a->name, data);
+        fprintf(stderr, "Error: Query \"%.*s%s%.*s\": \"on-conflict\" is only supported for upsert queries using \"table\"\n",
+            g ? g->name.len : 0, g ? data + g->name.off : "", g ? "," : "",
+            q->name.len, data + q->name.off);
+        return -1;
     }
-
-    if (q->cb_args)
-        mstream_cstr(ms, ", int (*on_row)(");
-
-    for (a = q->cb_args; a; a = a->next)
+    if (q->return_name.len || q->cb_args)
     {
-        if (a != q->cb_args)
-            mstream_cstr(ms, ", ");
-        mstream_fmt(ms, "%S %S", a->type, data, a->name, data);
-        if (a->has_hidden_len_param)
-            mstream_fmt(ms, ", int %S_len", a->name, data);
+        fprintf(stderr, "Error: Query \"%.*s%s%.*s\": \"on-conflict\" upserts return whether the row was inserted, updated or unchanged, so they can't have a \"return\" or \"callback\"\n",
+            g ? g->name.len : 0, g ? data + g->name.off : "", g ? "," : "",
+            q->name.len, data + q->name.off);
+        return -1;
     }
 
-    if (q->cb_args)
-        mstream_cstr(ms, ", void* user_data), void* user_data");
+    return 0;
 }
 
-static void
-write_func_decl(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+static int
+upsert_status_queries_must_upsert(const struct root* root, const char* data)
 {
-    mstream_cstr(ms, "static int" NL);
-    write_func_name(ms, g, q, data);
-    mstream_putc(ms, '(');
-    write_func_param_list(ms, root, g, q, data);
-    mstream_putc(ms, ')');
-}
+    const struct query_group* g;
+    const struct query* q;
+    for (q = root->queries; q; q = q->next)
+        if (check_upsert_status_query(NULL, q, data) < 0)
+            return -1;
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            if (check_upsert_status_query(g, q, data) < 0)
+                return -1;
+
+    return 0;
+}
+
+static int
+check_cursor_query(const struct query_group* g, const struct query* q, const char* data)
+{
+    if (!q->cursor && !q->columns)
+        return 0;
+
+    if (q->type != QUERY_SELECT_ALL || q->cb_args == NULL || q->return_name.len)
+    {
+        fprintf(stderr, "Error: Query \"%.*s%s%.*s\": \"%s\" is only supported for select-all queries with a \"callback\" and no \"return\"\n",
+            g ? g->name.len : 0, g ? data + g->name.off : "", g ? "," : "",
+            q->name.len, data + q->name.off, q->cursor ? "cursor" : "columns");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+cursor_queries_must_select_all(const struct root* root, const char* data)
+{
+    const struct query_group* g;
+    const struct query* q;
+    for (q = root->queries; q; q = q->next)
+        if (check_cursor_query(NULL, q, data) < 0)
+            return -1;
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            if (check_cursor_query(g, q, data) < 0)
+                return -1;
+
+    return 0;
+}
+
+static int
+check_shard_query(const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    const char* feature = q->bulk ? "bulk" : q->cursor ? "cursor" : q->columns ? "columns" : NULL;
+
+    if (root->shards == 0)
+    {
+        if (q->shard_key == NULL)
+            return 0;
+        fprintf(stderr, "Error: Query \"%.*s%s%.*s\": \"shard-key\" requires %%option shards\n",
+            g ? g->name.len : 0, g ? data + g->name.off : "", g ? "," : "",
+            q->name.len, data + q->name.off);
+        return -1;
+    }
+
+    if (feature)
+    {
+        fprintf(stderr, "Error: Query \"%.*s%s%.*s\": \"%s\" is not supported with %%option shards\n",
+            g ? g->name.len : 0, g ? data + g->name.off : "", g ? "," : "",
+            q->name.len, data + q->name.off, feature);
+        return -1;
+    }
+    /* Select-all queries without a key run on every shard */
+    if (q->shard_key == NULL && q->type != QUERY_SELECT_ALL)
+    {
+        fprintf(stderr, "Error: Query \"%.*s%s%.*s\" needs a \"shard-key\" to know which shard to run on\n",
+            g ? g->name.len : 0, g ? data + g->name.off : "", g ? "," : "",
+            q->name.len, data + q->name.off);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+sharded_queries_must_have_key(const struct root* root, const char* data)
+{
+    const struct query_group* g;
+    const struct query* q;
+
+    if (root->shards && (root->pool || root->async || root->split))
+    {
+        fprintf(stderr, "Error: %%option shards can't be combined with %%option %s\n",
+            root->pool ? "pool" : root->async ? "async" : "read-write-split");
+        return -1;
+    }
+
+    for (q = root->queries; q; q = q->next)
+        if (check_shard_query(root, NULL, q, data) < 0)
+            return -1;
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            if (check_shard_query(root, g, q, data) < 0)
+                return -1;
+
+    return 0;
+}
+
+static int
+deadlines_need_a_connection(const struct root* root)
+{
+    if (root->deadlines && (root->split || root->shards))
+    {
+        fprintf(stderr, "Error: %%option deadlines can't be combined with %%option %s\n",
+            root->split ? "read-write-split" : "shards");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+is_str_view(const struct arg* a, const char* data)
+{
+    return cstr_eq_str("struct str_view", a->type, data) ||
+           cstr_eq_str("struct strview", a->type, data);
+}
+
+static int
+check_cache_query(const struct query_group* g, const struct query* q, const char* data)
+{
+    const struct arg* a;
+
+    if (!q->cache_entries)
+        return 0;
+
+    if ((q->type != QUERY_SELECT_FIRST && q->type != QUERY_EXISTS) || q->table_name.len == 0)
+    {
+        fprintf(stderr, "Error: Query \"%.*s%s%.*s\": \"cache\" is only supported for select-first and exists queries with a \"table\"\n",
+            g ? g->name.len : 0, g ? data + g->name.off : "", g ? "," : "",
+            q->name.len, data + q->name.off);
+        return -1;
+    }
+    if (q->type == QUERY_SELECT_FIRST && q->return_name.len == 0 && q->cb_args == NULL)
+    {
+        fprintf(stderr, "Error: Query \"%.*s%s%.*s\" has no \"return\" or \"callback\", so there is nothing to cache\n",
+            g ? g->name.len : 0, g ? data + g->name.off : "", g ? "," : "",
+            q->name.len, data + q->name.off);
+        return -1;
+    }
+    for (a = q->cb_args; a; a = a->next)
+        if (is_str_view(a, data) || strcmp(a->sql_type, "blob") == 0)
+        {
+            fprintf(stderr, "Error: Query \"%.*s%s%.*s\": \"cache\" doesn't support callback parameters of type \"%.*s\"\n",
+                g ? g->name.len : 0, g ? data + g->name.off : "", g ? "," : "",
+                q->name.len, data + q->name.off, a->type.len, data + a->type.off);
+            return -1;
+        }
+
+    return 0;
+}
+
+static int
+cached_queries_must_select_first(const struct root* root, const char* data)
+{
+    const struct query_group* g;
+    const struct query* q;
+    for (q = root->queries; q; q = q->next)
+        if (check_cache_query(NULL, q, data) < 0)
+            return -1;
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            if (check_cache_query(g, q, data) < 0)
+                return -1;
+
+    return 0;
+}
+
+static void
+set_bind_defaults(struct root* root, const char* data)
+{
+    struct query_group* g;
+    struct query* q;
+
+    /* If "bind" was not specified, default to using the function arguments list */
+    for (q = root->queries; q; q = q->next)
+        if (q->bind_args == NULL)
+            q->bind_args = q->in_args;
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            if (q->bind_args == NULL)
+                q->bind_args = q->in_args;
+}
+
+static int
+post_parse(struct root* root, const char* data)
+{
+    if (return_arg_must_not_exist_in_function_argument_list(root, data) < 0)
+        return -1;
+    if (batch_queries_must_have_arguments(root, data) < 0)
+        return -1;
+    if (bulk_queries_must_insert_into_table(root, data) < 0)
+        return -1;
+    if (read_first_queries_must_insert_or_get(root, data) < 0)
+        return -1;
+    if (upsert_status_queries_must_upsert(root, data) < 0)
+        return -1;
+    if (cursor_queries_must_select_all(root, data) < 0)
+        return -1;
+    if (cached_queries_must_select_first(root, data) < 0)
+        return -1;
+    if (sharded_queries_must_have_key(root, data) < 0)
+        return -1;
+    if (deadlines_need_a_connection(root) < 0)
+        return -1;
+
+    set_bind_defaults(root, data);
+
+    return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Generate
+ * ------------------------------------------------------------------------- */
+
+static void
+write_func_name(struct mstream* ms, const struct query_group* g, const struct query* q, const char* data)
+{
+    if (g)
+    {
+        mstream_str(ms, g->name, data);
+        mstream_putc(ms, '_');
+    }
+    mstream_str(ms, q->name, data);
+}
+
+/*!
+ * \brief Queries that only read from the database. The async executor runs
+ * them on the reader connections, everything else goes to the writer.
+ */
+static int
+query_is_read_only(const struct query* q)
+{
+    return q->type == QUERY_EXISTS ||
+           q->type == QUERY_SELECT_FIRST ||
+           q->type == QUERY_SELECT_ALL;
+}
+
+/*!
+ * \brief Cached queries stay on the writer, because that is the connection
+ * whose writes invalidate the cache.
+ */
+static int
+query_runs_on_reader(const struct query* q)
+{
+    return query_is_read_only(q) && !q->cache_entries;
+}
+
+/*!
+ * \brief Checks if any cached query reads from a table. Only queries before
+ * "stop" are searched, which is used to visit every table only once.
+ */
+static int
+table_is_cached(const struct root* root, struct str_view table, const struct query* stop, const char* data)
+{
+    const struct query_group* g;
+    const struct query* q;
+    for (q = root->queries; q && q != stop; q = q->next)
+        if (q->cache_entries && str_eq_str(q->table_name, table, data))
+            return 1;
+    if (q == stop && stop)
+        return 0;
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q && q != stop; q = q->next)
+            if (q->cache_entries && str_eq_str(q->table_name, table, data))
+                return 1;
+    return 0;
+}
+
+static int
+has_cached_queries(const struct root* root)
+{
+    const struct query_group* g;
+    const struct query* q;
+    for (q = root->queries; q; q = q->next)
+        if (q->cache_entries)
+            return 1;
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            if (q->cache_entries)
+                return 1;
+    return 0;
+}
+
+/*!
+ * \brief Queries that write to a table read by a cached query advance the
+ * table's generation, which makes all entries cached from it stale. A write
+ * query using "stmt" may touch any table, so it advances all of them. This
+ * can't be left to the update hook, which isn't called for WITHOUT ROWID
+ * tables or when a DELETE without WHERE truncates the table.
+ */
+static void
+write_cache_invalidate(struct mstream* ms, const struct root* root, const struct query* q, const char* data)
+{
+    if (query_is_read_only(q))
+        return;
+    if (q->table_name.len && table_is_cached(root, q->table_name, NULL, data))
+        mstream_fmt(ms, "    ctx->cache_gen.%S++;" NL, q->table_name, data);
+    else if (q->table_name.len == 0 && has_cached_queries(root))
+        mstream_fmt(ms, "    %S_cache_clear(ctx);" NL, PREFIX(root->prefix, data));
+}
+
+/*!
+ * \brief How a forwarded call affects the ownership of the writer.
+ */
+enum split_route
+{
+    SPLIT_CALL,          /* Released again after the call */
+    SPLIT_HOLD,          /* Stays owned if the call succeeded (begin) */
+    SPLIT_UNHOLD,        /* Also drops a hold if the call succeeded (release) */
+    SPLIT_UNHOLD_ALWAYS, /* Always drops a hold (rollback_to) */
+    SPLIT_END,           /* Drops the transaction's holds if the call succeeded (commit) */
+    SPLIT_END_ALWAYS     /* Always drops the transaction's holds (rollback) */
+};
+
+/*!
+ * \brief Writes the start of the block that forwards a call on a split
+ * context. The caller writes the function name, then finishes the call with
+ * write_split_route_end().
+ */
+static void
+write_split_route_begin(struct mstream* ms, const struct root* root, int read_only, const char* data)
+{
+    mstream_cstr(ms, "    if (ctx->split)" NL "    {" NL);
+    mstream_fmt (ms, "        struct %S* split_ctx = %S_split_acquire(ctx->split, %d);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), read_only);
+    mstream_cstr(ms, "        int split_ret = ");
+}
+
+static void
+write_split_route_end(struct mstream* ms, const struct root* root, enum split_route route, const char* data)
+{
+    switch (route)
+    {
+        case SPLIT_CALL:
+            mstream_fmt(ms, "        %S_split_release(ctx->split, split_ctx);" NL, PREFIX(root->prefix, data));
+            break;
+        case SPLIT_HOLD:
+            mstream_cstr(ms, "        if (split_ret == 0)" NL);
+            mstream_cstr(ms, "            ctx->split->tx_depth++;" NL);
+            mstream_cstr(ms, "        else" NL);
+            mstream_fmt (ms, "            %S_split_release(ctx->split, split_ctx);" NL, PREFIX(root->prefix, data));
+            break;
+        case SPLIT_UNHOLD:
+            mstream_cstr(ms, "        if (split_ret == 0 && ctx->split->tx_depth > 0)" NL "        {" NL);
+            mstream_cstr(ms, "            ctx->split->tx_depth--;" NL);
+            mstream_fmt (ms, "            %S_split_release(ctx->split, split_ctx);" NL, PREFIX(root->prefix, data));
+            mstream_cstr(ms, "        }" NL);
+            mstream_fmt (ms, "        %S_split_release(ctx->split, split_ctx);" NL, PREFIX(root->prefix, data));
+            break;
+        case SPLIT_UNHOLD_ALWAYS:
+            mstream_cstr(ms, "        if (ctx->split->tx_depth > 0)" NL "        {" NL);
+            mstream_cstr(ms, "            ctx->split->tx_depth--;" NL);
+            mstream_fmt (ms, "            %S_split_release(ctx->split, split_ctx);" NL, PREFIX(root->prefix, data));
+            mstream_cstr(ms, "        }" NL);
+            mstream_fmt (ms, "        %S_split_release(ctx->split, split_ctx);" NL, PREFIX(root->prefix, data));
+            break;
+        case SPLIT_END:
+            mstream_cstr(ms, "        if (split_ret == 0)" NL);
+            mstream_fmt (ms, "            %S_split_end_tx(ctx->split);" NL, PREFIX(root->prefix, data));
+            mstream_fmt (ms, "        %S_split_release(ctx->split, split_ctx);" NL, PREFIX(root->prefix, data));
+            break;
+        case SPLIT_END_ALWAYS:
+            mstream_fmt (ms, "        %S_split_end_tx(ctx->split);" NL, PREFIX(root->prefix, data));
+            mstream_fmt (ms, "        %S_split_release(ctx->split, split_ctx);" NL, PREFIX(root->prefix, data));
+            break;
+    }
+    mstream_cstr(ms, "        return split_ret;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+}
+
+static void
+write_split_in_args(struct mstream* ms, const char* ctx_name, const struct query* q, const char* data)
+{
+    struct arg* a;
+
+    mstream_fmt(ms, "(%s", ctx_name);
+    for (a = q->in_args; a; a = a->next)
+    {
+        mstream_fmt(ms, ", %S", a->name, data);
+        if (a->has_hidden_len_param)
+            mstream_fmt(ms, ", %S_len", a->name, data);
+    }
+}
+
+/*!
+ * \brief Writes "(<ctx_name>, <in args>[, <return>][, on_row, user_data]);"
+ */
+static void
+write_split_query_call(struct mstream* ms, const char* ctx_name, const struct query* q, const char* data)
+{
+    write_split_in_args(ms, ctx_name, q, data);
+    if (q->return_arg)
+        mstream_fmt(ms, ", %S", q->return_arg->name, data);
+    if (q->cb_args)
+        mstream_cstr(ms, ", on_row, user_data");
+    mstream_cstr(ms, ");" NL);
+}
+
+/*!
+ * \brief Forwards a query function to the reader or writer connection.
+ */
+static void
+write_split_route_query(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    if (!root->split)
+        return;
+    write_split_route_begin(ms, root, query_runs_on_reader(q), data);
+    write_func_name(ms, g, q, data);
+    write_split_query_call(ms, "split_ctx", q, data);
+    write_split_route_end(ms, root, SPLIT_CALL, data);
+}
+
+/*!
+ * \brief Forwards a function of the form "name(ctx, <args>)" where the
+ * argument list is passed in verbatim.
+ */
+static void
+write_split_route_cstr(struct mstream* ms, const struct root* root, const char* func, const char* args,
+    int read_only, enum split_route route, const char* data)
+{
+    if (!root->split)
+        return;
+    write_split_route_begin(ms, root, read_only, data);
+    mstream_fmt(ms, "%S_%s(split_ctx%s);" NL, PREFIX(root->prefix, data), func, args);
+    write_split_route_end(ms, root, route, data);
+}
+
+/*!
+ * \brief Forwards a %function to the writer. The caller opens the body as a
+ * new block afterwards, see function_body_is_nested().
+ */
+static void
+write_split_route_function(struct mstream* ms, const struct root* root, const struct query_group* g, const struct function* f, const char* data)
+{
+    const struct arg* a;
+
+    if (!root->split)
+        return;
+    write_split_route_begin(ms, root, 0, data);
+    if (g)
+        mstream_fmt(ms, "%S_", g->name, data);
+    mstream_fmt(ms, "%S(split_ctx", f->name, data);
+    for (a = f->args; a; a = a->next)
+        mstream_fmt(ms, ", %S", a->name, data);
+    mstream_cstr(ms, ");" NL);
+    write_split_route_end(ms, root, SPLIT_CALL, data);
+}
+
+/*!
+ * \brief A %function that is forwarded to other connections first has its body
+ * opened as a new block, so that any declarations at its start are still
+ * valid C89.
+ */
+static int
+function_body_is_nested(const struct root* root)
+{
+    return root->split || root->shards;
+}
+
+/*!
+ * \brief Writes the expression that picks the shard of a query's "shard-key".
+ */
+static void
+write_shard_of_key(struct mstream* ms, const struct root* root, const struct arg* a, const char* data)
+{
+    if (strcmp(a->sql_type, "text") != 0 && strcmp(a->sql_type, "blob") != 0)
+        mstream_fmt(ms, "%S_shard_of_int((long long)%S)", PREFIX(root->prefix, data), a->name, data);
+    else if (is_str_view(a, data))
+        mstream_fmt(ms, "%S_shard_of_bytes(%S.data, %S.len)",
+            PREFIX(root->prefix, data), a->name, data, a->name, data);
+    else if (a->has_hidden_len_param)
+        mstream_fmt(ms, "%S_shard_of_bytes(%S, %S_len)",
+            PREFIX(root->prefix, data), a->name, data, a->name, data);
+    else
+        mstream_fmt(ms, "%S_shard_of_bytes(%S, %S ? (int)strlen(%S) : 0)",
+            PREFIX(root->prefix, data), a->name, data, a->name, data, a->name, data);
+}
+
+/*!
+ * \brief Forwards a query function on a sharded context. Queries with a
+ * "shard-key" run on the shard the key hashes to. Select-all queries without
+ * one run on every shard in turn, and stop early if the callback does.
+ */
+static void
+write_shard_route_query(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    if (!root->shards)
+        return;
+
+    mstream_cstr(ms, "    if (ctx->shards)" NL "    {" NL);
+    if (q->shard_key)
+    {
+        mstream_fmt (ms, "        struct %S* shard_ctx = ctx->shards[", PREFIX(root->prefix, data));
+        write_shard_of_key(ms, root, q->shard_key, data);
+        mstream_cstr(ms, "];" NL);
+        mstream_cstr(ms, "        return ");
+        write_func_name(ms, g, q, data);
+        write_split_query_call(ms, "shard_ctx", q, data);
+    }
+    else
+    {
+        mstream_cstr(ms, "        int shard;" NL);
+        mstream_fmt (ms, "        for (shard = 0; shard != %d; ++shard)" NL, root->shards);
+        mstream_cstr(ms, "            if ((ret = ");
+        write_func_name(ms, g, q, data);
+        write_split_in_args(ms, "ctx->shards[shard]", q, data);
+        if (q->return_arg)
+            mstream_fmt(ms, ", %S", q->return_arg->name, data);
+        if (q->cb_args)
+            mstream_cstr(ms, ", on_row, user_data");
+        mstream_cstr(ms, ")) != 0)" NL);
+        mstream_cstr(ms, "                return ret;" NL);
+        mstream_cstr(ms, "        return 0;" NL);
+    }
+    mstream_cstr(ms, "    }" NL NL);
+}
+
+/*!
+ * \brief Writes a block that runs "<prefix>_<func>(ctx, <args>)" on every shard,
+ * where the argument list is passed in verbatim. All shards run even if one
+ * of them fails, in which case the result is -1.
+ */
+static void
+write_shard_route_cstr(struct mstream* ms, const struct root* root, const char* func, const char* args, const char* data)
+{
+    if (!root->shards)
+        return;
+
+    mstream_cstr(ms, "    if (ctx->shards)" NL "    {" NL);
+    mstream_cstr(ms, "        int shard, shard_failed = 0;" NL);
+    mstream_fmt (ms, "        for (shard = 0; shard != %d; ++shard)" NL, root->shards);
+    mstream_fmt (ms, "            shard_failed += %S_%s(ctx->shards[shard]%s) != 0;" NL,
+        PREFIX(root->prefix, data), func, args);
+    mstream_cstr(ms, "        return shard_failed ? -1 : 0;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+}
+
+/*!
+ * \brief Runs a %function on every shard in turn, until one of them returns
+ * something other than 0.
+ */
+static void
+write_shard_route_function(struct mstream* ms, const struct root* root, const struct query_group* g, const struct function* f, const char* data)
+{
+    const struct arg* a;
+
+    if (!root->shards)
+        return;
+    mstream_cstr(ms, "    if (ctx->shards)" NL "    {" NL);
+    mstream_cstr(ms, "        int shard, shard_ret;" NL);
+    mstream_fmt (ms, "        for (shard = 0; shard != %d; ++shard)" NL, root->shards);
+    mstream_cstr(ms, "            if ((shard_ret = ");
+    if (g)
+        mstream_fmt(ms, "%S_", g->name, data);
+    mstream_fmt(ms, "%S(ctx->shards[shard]", f->name, data);
+    for (a = f->args; a; a = a->next)
+        mstream_fmt(ms, ", %S", a->name, data);
+    mstream_cstr(ms, ")) != 0)" NL);
+    mstream_cstr(ms, "                return shard_ret;" NL);
+    mstream_cstr(ms, "        return 0;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+}
+
+/*!
+ * \brief Writes "int (*on_row)(<callback args>, void* user_data)"
+ */
+static void
+write_on_row_decl(struct mstream* ms, const struct query* q, const char* data)
+{
+    struct arg* a;
+
+    mstream_cstr(ms, "int (*on_row)(");
+    for (a = q->cb_args; a; a = a->next)
+    {
+        mstream_fmt(ms, "%S %S, ", a->type, data, a->name, data);
+        if (a->has_hidden_len_param)
+            mstream_fmt(ms, "int %S_len, ", a->name, data);
+    }
+    mstream_cstr(ms, "void* user_data)");
+}
+
+static void
+write_func_callback_param(struct mstream* ms, const struct query* q, const char* data)
+{
+    if (q->cb_args)
+    {
+        mstream_cstr(ms, ", ");
+        write_on_row_decl(ms, q, data);
+        mstream_cstr(ms, ", void* user_data");
+    }
+}
+
+static void
+write_func_param_list(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    struct arg* a;
+
+    mstream_fmt(ms, "struct %S* ctx", PREFIX(root->prefix, data));
+
+    for (a = q->in_args; a; a = a->next)
+    {
+        mstream_fmt(ms, ", %S %S", a->type, data, a->name, data);
+        if (a->has_hidden_len_param)
+            mstream_fmt(ms, ", int %S_len", a->name, data);
+    }
+
+    if (q->return_arg)
+        mstream_fmt(ms, ", %S* %S", q->return_arg->type, data, q->return_arg->name, data);
+
+    write_func_callback_param(ms, q, data);
+}
+
+static void
+write_func_decl(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    mstream_cstr(ms, "static int" NL);
+    write_func_name(ms, g, q, data);
+    mstream_putc(ms, '(');
+    write_func_param_list(ms, root, g, q, data);
+    mstream_putc(ms, ')');
+}
+
+static void
+write_dbg_func_decl(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    mstream_cstr(ms, "static int" NL "dbg_");
+    write_func_name(ms, g, q, data);
+    mstream_putc(ms, '(');
+    write_func_param_list(ms, root, g, q, data);
+    mstream_putc(ms, ')');
+}
+
+static void
+write_func_ptr_decl(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    mstream_cstr(ms, "int (*");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, ")(");
+    write_func_param_list(ms, root, g, q, data);
+    mstream_putc(ms, ')');
+}
+
+static void
+write_args_struct_name(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    mstream_fmt(ms, "struct %S_", PREFIX(root->prefix, data));
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_args");
+}
+
+static void
+write_args_struct(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    struct arg* a;
+
+    write_args_struct_name(ms, root, g, q, data);
+    mstream_cstr(ms, NL "{" NL);
+    for (a = q->in_args; a; a = a->next)
+    {
+        mstream_fmt(ms, "    %S %S;" NL, a->type, data, a->name, data);
+        if (a->has_hidden_len_param)
+            mstream_fmt(ms, "    int %S_len;" NL, a->name, data);
+    }
+    mstream_cstr(ms, "};" NL NL);
+}
+
+static void
+write_batch_func_param_list(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    mstream_fmt(ms, "struct %S* ctx, const ", PREFIX(root->prefix, data));
+    write_args_struct_name(ms, root, g, q, data);
+    mstream_cstr(ms, "* rows, int count, int* results");
+    write_func_callback_param(ms, q, data);
+}
+
+static void
+write_batch_func_ptr_decl(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    mstream_cstr(ms, "int (*");
+    mstream_str(ms, q->name, data);
+    mstream_cstr(ms, "_batch)(");
+    write_batch_func_param_list(ms, root, g, q, data);
+    mstream_putc(ms, ')');
+}
+
+/*!
+ * \brief Writes the check that rejects a negative row count before any row
+ * is touched. Used by batch and bulk functions.
+ */
+static void
+write_negative_count_check(struct mstream* ms, const struct root* root, const char* data)
+{
+    mstream_cstr(ms, "    if (count < 0)" NL "    {" NL);
+    mstream_fmt (ms, "        %S(\"Invalid row count %%d\\n\", count);" NL, LOG_ERR(root->log_err, data));
+    mstream_cstr(ms, "        return -1;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+}
+
+/*
+ * The batch variant calls the regular query function for every row. This
+ * reuses the cached statement, and all rows are executed within a single
+ * savepoint, which means the caller may or may not already be in a
+ * transaction.
+ */
+static void
+write_batch_func(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    struct arg* a;
+
+    mstream_cstr(ms, "static int" NL);
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_batch(");
+    write_batch_func_param_list(ms, root, g, q, data);
+    mstream_cstr(ms, ")" NL "{" NL);
+
+    mstream_cstr(ms, "    int i, ret;" NL);
+    write_negative_count_check(ms, root, data);
+    mstream_fmt (ms, "    if (%S_savepoint(ctx) != 0)" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        return -1;" NL NL);
+
+    mstream_cstr(ms, "    for (i = 0; i != count; ++i)" NL "    {" NL);
+    mstream_cstr(ms, "        ret = ");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "(ctx");
+    for (a = q->in_args; a; a = a->next)
+    {
+        mstream_fmt(ms, ", rows[i].%S", a->name, data);
+        if (a->has_hidden_len_param)
+            mstream_fmt(ms, ", rows[i].%S_len", a->name, data);
+    }
+    if (q->cb_args)
+        mstream_cstr(ms, ", on_row, user_data");
+    mstream_cstr(ms, ");" NL);
+    mstream_cstr(ms, "        if (results)" NL);
+    mstream_cstr(ms, "            results[i] = ret;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    mstream_fmt (ms, "    if (%S_release(ctx) != 0)" NL "    {" NL, PREFIX(root->prefix, data));
+    /* A sharded release() already rolled back whatever it couldn't release */
+    if (root->shards)
+        mstream_cstr(ms, "        if (ctx->shards == NULL)" NL "    ");
+    mstream_fmt (ms, "        %S_rollback_to(ctx);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        return -1;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+    mstream_cstr(ms, "    return 0;" NL);
+    mstream_cstr(ms, "}" NL NL);
+}
+
+/*!
+ * \brief Writes "table (col1, col2) VALUES (?, ?)" for insert queries.
+ * \param[in] rows Number of value lists to write. Long lists are wrapped
+ * over multiple lines.
+ */
+static void
+write_sqlite_insert_values(struct mstream* ms, const struct query* q, int rows, const char* data)
+{
+    struct arg* a;
+    int row, rows_per_line = 0;
+
+    /* Each value list "(?, ?)" is 3*n characters wide including separator */
+    for (a = q->in_args; a; a = a->next)
+        rows_per_line += 3;
+    rows_per_line = rows_per_line < 60 ? 60 / rows_per_line : 1;
+
+    mstream_fmt(ms, "%S (", q->table_name, data);
+    for (a = q->in_args; a; a = a->next)
+    {
+        if (a != q->in_args) mstream_cstr(ms, ", ");
+        mstream_fmt(ms, "%S", a->name, data);
+    }
+    mstream_cstr(ms, ") VALUES (");
+    for (row = 0; row != rows; ++row)
+    {
+        if (row != 0 && row % rows_per_line == 0)
+            mstream_cstr(ms, ", \"" NL "            \"(");
+        else if (row != 0)
+            mstream_cstr(ms, ", (");
+        for (a = q->in_args; a; a = a->next)
+        {
+            if (a != q->in_args)
+                mstream_cstr(ms, ", ");
+            mstream_cstr(ms, "?");
+        }
+        mstream_cstr(ms, ")");
+    }
+}
+
+/*!
+ * \brief Writes how a step loop handles SQLITE_BUSY.
+ * With the default "spin" policy the statement is stepped again right away.
+ * All other policies wait inside SQLite's busy handler, so by the time
+ * sqlite3_step() returns SQLITE_BUSY it is an error.
+ * \param[in] label The label to jump to in order to step again.
+ * \param[in] has_ctx Whether "ctx" is in scope for counting the retry.
+ */
+static void
+write_busy_case(struct mstream* ms, const struct root* root, const char* label, int has_ctx)
+{
+    if (root->busy_policy != BUSY_SPIN)
+        return;
+    if (has_ctx)
+        mstream_fmt(ms, "        case SQLITE_BUSY: ctx->busy.retries++; goto %s;" NL, label);
+    else
+        mstream_fmt(ms, "        case SQLITE_BUSY: goto %s;" NL, label);
+}
+
+/*!
+ * \brief Writes the label a step loop jumps to for retrying, if the busy
+ * policy needs one.
+ */
+static void
+write_busy_label(struct mstream* ms, const struct root* root, const char* label)
+{
+    if (root->busy_policy == BUSY_SPIN)
+        mstream_fmt(ms, "%s:" NL, label);
+}
+
+/*!
+ * \brief Writes how a step loop handles SQLITE_INTERRUPT with
+ * %option deadlines. It isn't an error, so nothing is logged, and the caller
+ * gets TIMEOUT or CANCELLED instead of -1.
+ * \param[in] q The query whose statement is reset, or NULL if the statement
+ * is left alone.
+ */
+static void
+write_interrupt_case(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* stmt_suffix, const char* data)
+{
+    if (!root->deadlines)
+        return;
+    mstream_cstr(ms, "        case SQLITE_INTERRUPT:" NL);
+    if (q)
+    {
+        mstream_cstr(ms, "            sqlite3_reset(ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_fmt (ms, "%s);" NL, stmt_suffix);
+    }
+    mstream_fmt(ms, "            return %S_interrupted(ctx);" NL, PREFIX(root->prefix, data));
+}
+
+/*!
+ * \brief Writes the ON CONFLICT clause of upsert statements. With
+ * "on-conflict", only the other columns are set, and only if one of them
+ * changed, so that repeating an upsert doesn't rewrite the row.
+ */
+static void
+write_sqlite_upsert_conflict(struct mstream* ms, const struct query* q, const char* data)
+{
+    struct arg* a;
+    char first;
+
+    if (!q->upsert_status)
+    {
+        mstream_cstr(ms, " \"" NL "            \"ON CONFLICT DO UPDATE SET ");
+        for (a = q->in_args; a; a = a->next)
+        {
+            if (a != q->in_args)
+                mstream_cstr(ms, ", ");
+            mstream_fmt(ms, "%S=excluded.%S", a->name, data, a->name, data);
+        }
+        return;
+    }
+
+    mstream_cstr(ms, " \"" NL "            \"ON CONFLICT (");
+    first = 1;
+    for (a = q->in_args; a; a = a->next)
+        if (a->conflict_key)
+        {
+            if (!first)
+                mstream_cstr(ms, ", ");
+            mstream_fmt(ms, "%S", a->name, data);
+            first = 0;
+        }
+
+    /* Nothing left to update if all columns are part of the key */
+    for (a = q->in_args; a; a = a->next)
+        if (!a->conflict_key)
+            break;
+    if (a == NULL)
+    {
+        mstream_cstr(ms, ") DO NOTHING");
+        return;
+    }
+
+    mstream_cstr(ms, ") DO UPDATE SET ");
+    first = 1;
+    for (a = q->in_args; a; a = a->next)
+        if (!a->conflict_key)
+        {
+            if (!first)
+                mstream_cstr(ms, ", ");
+            mstream_fmt(ms, "%S=excluded.%S", a->name, data, a->name, data);
+            first = 0;
+        }
+
+    mstream_cstr(ms, " \"" NL "            \"WHERE (");
+    first = 1;
+    for (a = q->in_args; a; a = a->next)
+        if (!a->conflict_key)
+        {
+            if (!first)
+                mstream_cstr(ms, ", ");
+            mstream_fmt(ms, "%S", a->name, data);
+            first = 0;
+        }
+    mstream_cstr(ms, ") IS NOT (");
+    first = 1;
+    for (a = q->in_args; a; a = a->next)
+        if (!a->conflict_key)
+        {
+            if (!first)
+                mstream_cstr(ms, ", ");
+            mstream_fmt(ms, "excluded.%S", a->name, data);
+            first = 0;
+        }
+    mstream_cstr(ms, ")");
+}
+
+/*!
+ * \brief Writes the SQL of a query as a C string literal, split over
+ * multiple lines and indented for use as a function argument.
+ */
+static void
+write_sqlite_stmt_sql(struct mstream* ms, const struct query* q, const char* data)
+{
+    struct arg* a;
+
+    if (q->stmt.len)
+    {
+        int p = 0;
+        for (; p != q->stmt.len; ++p)
+            if (!isspace(data[q->stmt.off + p]))
+                break;
+
+        mstream_cstr(ms, "            \"");
+        for (; p != q->stmt.len; ++p)
+        {
+            if (data[q->stmt.off + p] == '\n')
+            {
+                for (; p != q->stmt.len; ++p)
+                    if (!isspace(data[q->stmt.off + p + 1]))
+                        break;
+                if (p + 1 < q->stmt.len)
+                    mstream_cstr(ms, " \"" NL "            \"");
+            }
+            else if (data[q->stmt.off + p] != '\r')
+            {
+                char c = data[q->stmt.off + p];
+                if (c == '"')
+                    mstream_putc(ms, '\\');
+                mstream_putc(ms, c);
+            }
+        }
+        mstream_cstr(ms, "\"");
+    }
+    else switch (q->type)
+    {
+        case QUERY_NONE: break;
+        case QUERY_UPSERT:
+            mstream_cstr(ms, "            \"INSERT INTO ");
+            write_sqlite_insert_values(ms, q, 1, data);
+            write_sqlite_upsert_conflict(ms, q, data);
+
+            if (q->return_name.len || q->cb_args)
+            {
+                mstream_cstr(ms, " \"" NL);
+                mstream_cstr(ms, "            \" RETURNING ");
+                if (q->return_name.len)
+                    mstream_fmt(ms, "%S", q->return_name, data);
+                for (a = q->cb_args; a; a = a->next)
+                {
+                    if (a != q->cb_args || q->return_name.len)
+                        mstream_cstr(ms, ", ");
+                    mstream_fmt(ms, "%S", a->name, data);
+                }
+            }
+            mstream_cstr(ms, ";\"");
+
+            break;
+
+        case QUERY_INSERT_NEW:
+            mstream_cstr(ms, "            \"INSERT INTO ");
+            write_sqlite_insert_values(ms, q, 1, data);
+
+            if (q->return_name.len || q->cb_args)
+            {
+                mstream_cstr(ms, "\"" NL);
+                mstream_cstr(ms, "            \" RETURNING ");
+                if (q->return_name.len)
+                    mstream_fmt(ms, "%S", q->return_name, data);
+                for (a = q->cb_args; a; a = a->next)
+                {
+                    if (a != q->cb_args || q->return_name.len)
+                        mstream_cstr(ms, ", ");
+                    mstream_fmt(ms, "%S", a->name, data);
+                }
+            }
+            mstream_cstr(ms, ";\"");
+
+            break;
+
+        case QUERY_INSERT_OR_GET:
+            if (q->return_name.len || q->cb_args)
+                mstream_cstr(ms, "            \"INSERT INTO ");
+            else
+                mstream_cstr(ms, "            \"INSERT OR IGNORE INTO ");
+            write_sqlite_insert_values(ms, q, 1, data);
+
+            if (q->return_name.len || q->cb_args)
+            {
+                /*
+                 * Have to re-insert a value to trigger the RETURNING statement.
+                 * In SQLite, a column named "rowid" is guaranteed to always exist,
+                 * and its datatype is trivial to copy.
+                 */
+                mstream_cstr(ms, " \"" NL);
+                mstream_cstr(ms, "            \"ON CONFLICT DO UPDATE SET rowid=rowid RETURNING ");
+                if (q->return_name.len)
+                    mstream_fmt(ms, "%S", q->return_name, data);
+                for (a = q->cb_args; a; a = a->next)
+                {
+                    if (a != q->cb_args || q->return_name.len)
+                        mstream_cstr(ms, ", ");
+                    mstream_fmt(ms, "%S", a->name, data);
+                }
+            }
+            mstream_cstr(ms, ";\"");
+
+            break;
+
+        case QUERY_DELETE:
+        case QUERY_UPDATE: {
+            char first;
+            mstream_cstr(ms, "            \"");
+            mstream_cstr(ms, q->type == QUERY_UPDATE ? "UPDATE" : "DELETE FROM");
+
+            mstream_fmt(ms, " %S ",
+                    q->table_name, data);
+            if (q->type == QUERY_UPDATE)
+                mstream_cstr(ms, "SET ");
+
+            /* SET ... */
+            first = 1;
+            for (a = q->in_args; a; a = a->next)
+                if (a->update)
+                {
+                    if (!first)
+                        mstream_cstr(ms, ", ");
+                    mstream_fmt(ms, "%S=?", a->name, data);
+                    first = 0;
+                }
+
+            /* WHERE ... */
+            first = 1;
+            for (a = q->in_args; a; a = a->next)
+                if (!a->update)
+                {
+                    if (first)
+                        mstream_cstr(ms, " WHERE ");
+                    else
+                        mstream_cstr(ms, " AND ");
+                    mstream_fmt(ms, "%S=?", a->name, data);
+                    first = 0;
+                }
+
+            /* RETURNING ... */
+            if (q->return_name.len || q->cb_args)
+            {
+                mstream_cstr(ms, " \"" NL);
+                mstream_cstr(ms, "            \"RETURNING ");
+                if (q->return_name.len)
+                    mstream_fmt(ms, "%S", q->return_name, data);
+                for (a = q->cb_args; a; a = a->next)
+                {
+                    if (a != q->cb_args || q->return_name.len)
+                        mstream_cstr(ms, ", ");
+                    mstream_fmt(ms, "%S", a->name, data);
+                }
+            }
+
+            mstream_cstr(ms, ";\"");
+        } break;
+
+        case QUERY_EXISTS:
+            mstream_fmt(ms, "            \"SELECT 1 FROM %S", q->table_name, data);
+            for (a = q->in_args; a; a = a->next)
+            {
+                if (a == q->in_args) mstream_cstr(ms, " \"" NL "            \"WHERE ");
+                else                 mstream_cstr(ms, " AND ");
+                mstream_fmt(ms, "%S=?", a->name, data);
+            }
+            mstream_cstr(ms, " LIMIT 1;\"");
+            break;
+
+        case QUERY_SELECT_FIRST:
+        case QUERY_SELECT_ALL:
+            mstream_cstr(ms, "            \"SELECT ");
+            if (q->return_name.len)
+                mstream_fmt(ms, "%S", q->return_name, data);
+            for (a = q->cb_args; a; a = a->next)
+            {
+                if (a != q->cb_args || q->return_name.len) mstream_cstr(ms, ", ");
+                mstream_fmt(ms, "%S", a->name, data);
+            }
+            mstream_fmt(ms, " FROM %S", q->table_name, data);
+
+            for (a = q->in_args; a; a = a->next)
+            {
+                if (a == q->in_args) mstream_cstr(ms, " \"" NL "            \"WHERE ");
+                else                 mstream_cstr(ms, " AND ");
+                mstream_fmt(ms, "%S=?", a->name, data);
+            }
+
+            if (q->type == QUERY_SELECT_FIRST)
+                mstream_cstr(ms, " LIMIT 1");
+
+            mstream_cstr(ms, ";\"");
+            break;
+    }
+}
+
+/*!
+ * \brief Checks whether a query looks its row up before writing it. These are
+ * "read-first" insert-or-gets and "on-conflict" upserts.
+ */
+static int
+query_has_lookup(const struct query* q)
+{
+    return q->read_first || q->upsert_status;
+}
+
+/*!
+ * \brief Writes the SELECT that "read-first" insert-or-get queries run before
+ * the insert. It looks the row up by the "read-first" columns and returns the
+ * same columns as the insert's RETURNING clause. "on-conflict" upserts look
+ * the row up by the conflict target instead, and only check that it exists.
+ */
+static void
+write_sqlite_lookup_stmt_sql(struct mstream* ms, const struct query* q, const char* data)
+{
+    struct arg* a;
+    char first = 1;
+
+    mstream_cstr(ms, "            \"SELECT ");
+    if (q->return_name.len)
+        mstream_fmt(ms, "%S", q->return_name, data);
+    for (a = q->cb_args; a; a = a->next)
+    {
+        if (a != q->cb_args || q->return_name.len)
+            mstream_cstr(ms, ", ");
+        mstream_fmt(ms, "%S", a->name, data);
+    }
+    if (q->return_name.len == 0 && q->cb_args == NULL)
+        mstream_cstr(ms, "1");
+    mstream_fmt(ms, " FROM %S", q->table_name, data);
+
+    for (a = q->in_args; a; a = a->next)
+        if (a->read_key || a->conflict_key)
+        {
+            if (first) mstream_cstr(ms, " \"" NL "            \"WHERE ");
+            else       mstream_cstr(ms, " AND ");
+            mstream_fmt(ms, "%S=?", a->name, data);
+            first = 0;
+        }
+    mstream_cstr(ms, " LIMIT 1;\"");
+}
+
+/*!
+ * \param[in] stmt_suffix Appended to the statement's name in the context
+ * structure.
+ */
+static void
+write_sqlite_prepare_stmt(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q,
+    const char* stmt_suffix, const char* data)
+{
+    /* Statements are prepared up front by prepare_all() */
+    if (root->prepare_eager)
+        return;
+
+    mstream_cstr(ms, "    if (ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_fmt(ms, "%s == NULL)" NL, stmt_suffix);
+    mstream_cstr(ms, "        if ((ret = sqlite3_prepare_v2(ctx->db," NL);
+    write_sqlite_stmt_sql(ms, q, data);
+    mstream_cstr(ms, "," NL);
+
+    mstream_cstr(ms, "            -1, &ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_fmt(ms, "%s, NULL)) != SQLITE_OK)" NL, stmt_suffix);
+    mstream_cstr(ms, "        {" NL);
+    mstream_fmt(ms, "            %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+                LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "            return -1;" NL);
+    mstream_cstr(ms, "        }" NL NL);
+}
+
+/*!
+ * \brief Writes the sqlite3_bind_xxx() call for a single argument.
+ * \param[in] stmt_suffix Appended to the statement's name in the context
+ * structure.
+ * \param[in] index Expression for the parameter index.
+ * \param[in] value_prefix Prepended to the argument's name, e.g. to access a
+ * member of a structure.
+ */
+static void
+write_sqlite_bind_value(struct mstream* ms, const struct query_group* g, const struct query* q, const char* stmt_suffix,
+    const struct arg* a, const char* index, const char* value_prefix, const char* data)
+{
+    if (a->nullable)
+    {
+        mstream_fmt(ms, "%s%S %s %s ? sqlite3_bind_null(ctx->", value_prefix, a->name, data, a->compare_op, a->null_value);
+        write_func_name(ms, g, q, data);
+        mstream_fmt(ms, "%s, %s) : ", stmt_suffix, index);
+    }
+    mstream_fmt(ms, "sqlite3_bind_%s(ctx->", a->sql_type);
+    write_func_name(ms, g, q, data);
+    mstream_fmt(ms, "%s, %s, %s%s%S", stmt_suffix, index, a->cast_to_sql, value_prefix, a->name, data);
+
+    if (cstr_eq_str("struct str_view", a->type, data))
+        mstream_fmt(ms, ".data, %s%S.len, SQLITE_STATIC", value_prefix, a->name, data);
+    else if (cstr_eq_str("struct strview", a->type, data))
+        mstream_fmt(ms, ".data, %s%S.len, SQLITE_STATIC", value_prefix, a->name, data);
+    else if (cstr_eq_str("const char*", a->type, data))
+        mstream_cstr(ms, ", -1, SQLITE_STATIC");
+    else if (cstr_eq_str("const void*", a->type, data))
+        mstream_fmt(ms, ", %s%S_len, SQLITE_STATIC", value_prefix, a->name, data);
+    mstream_cstr(ms, ")");
+}
+
+static void
+write_sqlite_bind_args(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q,
+    const char* stmt_suffix, const char* data)
+{
+    struct arg* a;
+    char index[sizeof("-2147483648")];
+    int i = 1;
+    int update_pass = 1;
+    int first = 1;
+
+    if (q->bind_args == NULL)
+        return;
+
+again:
+    a = q->bind_args;
+    for (; a; a = a->next)
+    {
+        if (a->update != update_pass)
+            continue;
+
+        if (first) mstream_cstr(ms, "    if ((ret = ");
+        else mstream_cstr(ms, " ||" NL "        (ret = ");
+        first = 0;
+
+        sprintf(index, "%d", i);
+        write_sqlite_bind_value(ms, g, q, stmt_suffix, a, index, "", data);
+        mstream_cstr(ms, ") != SQLITE_OK");
+
+        i++;
+    }
+
+    if (update_pass--)
+        goto again;
+
+    mstream_cstr(ms, ")" NL "    {" NL);
+    mstream_fmt(ms, "        %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+        LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "        return -1;" NL "    }" NL NL);
+}
+
+static int
+bulk_chunk_rows(const struct query* q)
+{
+    const struct arg* a;
+    int args = 0;
+    for (a = q->in_args; a; a = a->next)
+        args++;
+    return BULK_MAX_VARIABLES / args < BULK_MAX_ROWS ?
+        BULK_MAX_VARIABLES / args : BULK_MAX_ROWS;
+}
+
+/*!
+ * \brief Writes the multi-row insert statement used by bulk functions as a
+ * C string literal. Unlike the single-row statement there is no RETURNING
+ * clause. Existing rows of insert-or-get queries are skipped with ON CONFLICT
+ * rather than OR IGNORE, so that rows violating a NOT NULL or CHECK constraint
+ * still fail the insert.
+ * \param[in] rows Number of value lists in the statement.
+ */
+static void
+write_sqlite_bulk_stmt_sql(struct mstream* ms, const struct query* q, int rows, const char* data)
+{
+    mstream_cstr(ms, "            \"INSERT INTO ");
+    write_sqlite_insert_values(ms, q, rows, data);
+
+    if (q->type == QUERY_INSERT_OR_GET)
+        mstream_cstr(ms, " \"" NL "            \"ON CONFLICT DO NOTHING");
+    else if (q->type == QUERY_UPSERT)
+        write_sqlite_upsert_conflict(ms, q, data);
+    mstream_cstr(ms, ";\"");
+}
+
+/*!
+ * \param[in] stmt_suffix Appended to the statement's name in the context
+ * structure.
+ * \param[in] rows Number of value lists in the statement.
+ */
+static void
+write_sqlite_prepare_bulk_stmt(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q,
+    const char* stmt_suffix, int rows, const char* data)
+{
+    /* Statements are prepared up front by prepare_all() */
+    if (root->prepare_eager)
+        return;
+
+    mstream_cstr(ms, "    if (ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_fmt(ms, "%s == NULL)" NL, stmt_suffix);
+    mstream_cstr(ms, "        if ((ret = sqlite3_prepare_v2(ctx->db," NL);
+    write_sqlite_bulk_stmt_sql(ms, q, rows, data);
+    mstream_cstr(ms, "," NL);
+
+    mstream_cstr(ms, "            -1, &ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_fmt(ms, "%s, NULL)) != SQLITE_OK)" NL, stmt_suffix);
+    mstream_cstr(ms, "        {" NL);
+    mstream_fmt(ms, "            %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+                LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "            return -1;" NL);
+    mstream_cstr(ms, "        }" NL NL);
+}
+
+/*!
+ * \brief Writes the bind calls for one row of a bulk insert.
+ * \param[in] row_expr Expression for the row index into the "rows" array.
+ * \param[in] param_expr Expression for the first parameter index of the row,
+ * or NULL if the statement only has a single row.
+ */
+static void
+write_sqlite_bulk_bind_row(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q,
+    const char* stmt_suffix, const char* row_expr, const char* param_expr, const char* indent, const char* data)
+{
+    struct arg* a;
+    char index[64];
+    char value_prefix[64];
+    int i = 1;
+
+    sprintf(value_prefix, "rows[%s].", row_expr);
+    for (a = q->in_args; a; a = a->next, i++)
+    {
+        if (a == q->in_args) mstream_fmt(ms, "%sif ((ret = ", indent);
+        else mstream_fmt(ms, " ||" NL "%s    (ret = ", indent);
+
+        if (param_expr)
+            sprintf(index, "%s + %d", param_expr, i);
+        else
+            sprintf(index, "%d", i);
+        write_sqlite_bind_value(ms, g, q, stmt_suffix, a, index, value_prefix, data);
+        mstream_cstr(ms, ") != SQLITE_OK");
+    }
+
+    mstream_fmt(ms, ")" NL "%s{" NL, indent);
+    mstream_fmt(ms, "%s    %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+        indent, LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_fmt(ms, "%s    goto bulk_failed;" NL, indent);
+    mstream_fmt(ms, "%s}" NL, indent);
+}
+
+static void
+write_bulk_func_param_list(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    mstream_fmt(ms, "struct %S* ctx, const ", PREFIX(root->prefix, data));
+    write_args_struct_name(ms, root, g, q, data);
+    mstream_cstr(ms, "* rows, int count");
+}
+
+static void
+write_bulk_func_ptr_decl(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    mstream_cstr(ms, "int (*");
+    mstream_str(ms, q->name, data);
+    mstream_cstr(ms, "_bulk)(");
+    write_bulk_func_param_list(ms, root, g, q, data);
+    mstream_putc(ms, ')');
+}
+
+/*
+ * The bulk variant inserts rows in fixed-size chunks using a multi-row
+ * VALUES statement. Rows that don't fill a whole chunk are inserted one at a
+ * time using a second, single-row statement. Everything runs within a
+ * savepoint, so either all rows are inserted or none are.
+ */
+static void
+write_bulk_func(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    const struct arg* a;
+    int chunk_rows = bulk_chunk_rows(q);
+    int args = 0;
+    char param_expr[32];
+
+    for (a = q->in_args; a; a = a->next)
+        args++;
+
+    mstream_cstr(ms, "static int" NL);
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_bulk(");
+    write_bulk_func_param_list(ms, root, g, q, data);
+    mstream_cstr(ms, ")" NL "{" NL);
+    mstream_cstr(ms, "    int ret, row, i;" NL);
+    write_negative_count_check(ms, root, data);
+    if (root->split)
+    {
+        write_split_route_begin(ms, root, 0, data);
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_bulk(split_ctx, rows, count);" NL);
+        write_split_route_end(ms, root, SPLIT_CALL, data);
+    }
+    write_cache_invalidate(ms, root, q, data);
+
+    write_sqlite_prepare_bulk_stmt(ms, root, g, q, "_bulk", chunk_rows, data);
+    write_sqlite_prepare_bulk_stmt(ms, root, g, q, "_bulk_tail", 1, data);
+
+    mstream_fmt (ms, "    if (%S_savepoint(ctx) != 0)" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        return -1;" NL NL);
+
+    mstream_fmt (ms, "    for (row = 0; count - row >= %d; row += %d)" NL "    {" NL, chunk_rows, chunk_rows);
+    mstream_fmt (ms, "        for (i = 0; i != %d; ++i)" NL, chunk_rows);
+    if (args == 1)
+        strcpy(param_expr, "i");
+    else
+        sprintf(param_expr, "i * %d", args);
+    write_sqlite_bulk_bind_row(ms, root, g, q, "_bulk", "row + i", param_expr, "            ", data);
+    mstream_fmt (ms, "        if (%S_exec_stmt(ctx, ctx->", PREFIX(root->prefix, data));
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_bulk) != 0)" NL);
+    mstream_cstr(ms, "            goto bulk_failed;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    mstream_cstr(ms, "    for (; row != count; ++row)" NL "    {" NL);
+    write_sqlite_bulk_bind_row(ms, root, g, q, "_bulk_tail", "row", NULL, "        ", data);
+    mstream_fmt (ms, "        if (%S_exec_stmt(ctx, ctx->", PREFIX(root->prefix, data));
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_bulk_tail) != 0)" NL);
+    mstream_cstr(ms, "            goto bulk_failed;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    mstream_fmt (ms, "    if (%S_release(ctx) != 0)" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        goto bulk_failed;" NL NL);
+    mstream_cstr(ms, "    return 0;" NL NL);
+
+    mstream_cstr(ms, "bulk_failed:" NL);
+    mstream_fmt (ms, "    %S_rollback_to(ctx);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return -1;" NL);
+    mstream_cstr(ms, "}" NL NL);
+}
+
+/*!
+ * \brief Writes the expression that reads column "i" of the current row as
+ * the type of argument "a".
+ */
+static void
+write_sqlite_column_value(struct mstream* ms, const struct query_group* g, const struct query* q, const char* stmt_suffix,
+    const struct arg* a, int i, const char* data)
+{
+    if (a->nullable)
+    {
+        mstream_cstr(ms, "sqlite3_column_type(ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_fmt(ms, "%s, %d) == SQLITE_NULL ? ", stmt_suffix, i);
+        mstream_cstr(ms, a->null_value);
+        mstream_cstr(ms, " : ");
+    }
+
+    mstream_fmt(ms, "%ssqlite3_column_%s(ctx->", a->cast_from_sql, a->sql_type);
+    write_func_name(ms, g, q, data);
+    mstream_fmt(ms, "%s, %d)", stmt_suffix, i);
+}
+
+/*!
+ * \brief Declares the local variables that string views are assembled in
+ * before being passed to the callback. They are prefixed with "row_" so that
+ * they don't collide with the function's arguments.
+ */
+static void
+write_str_view_locals(struct mstream* ms, const struct query* q, const char* data)
+{
+    struct arg* a;
+    for (a = q->cb_args; a; a = a->next)
+        if (is_str_view(a, data))
+            mstream_fmt(ms, "    %S row_%S;" NL, a->type, data, a->name, data);
+}
+
+/*!
+ * \brief Writes the assignments that fill in a string view from column "i"
+ * using the length SQLite already knows. A NULL column results in a NULL
+ * pointer with length 0.
+ * \param[in] dst_prefix Prepended to the argument's name to form the string
+ * view being filled in, e.g. "row->".
+ */
+static void
+write_sqlite_str_view_value(struct mstream* ms, const struct query_group* g, const struct query* q, const char* stmt_suffix,
+    const char* indent, const char* dst_prefix, const struct arg* a, int i, const char* data)
+{
+    mstream_fmt(ms, "%s%s%S.data = (const char*)sqlite3_column_text(ctx->", indent, dst_prefix, a->name, data);
+    write_func_name(ms, g, q, data);
+    mstream_fmt(ms, "%s, %d);" NL, stmt_suffix, i);
+    mstream_fmt(ms, "%s%s%S.len = sqlite3_column_bytes(ctx->", indent, dst_prefix, a->name, data);
+    write_func_name(ms, g, q, data);
+    mstream_fmt(ms, "%s, %d);" NL, stmt_suffix, i);
+}
+
+static void
+write_sqlite_exec_callback(struct mstream* ms, const struct query_group* g, const struct query* q, const char* stmt_suffix, const char* data)
+{
+    struct arg* a = q->cb_args;
+    int i = q->return_name.len ? 1 : 0;
+
+    for (; a; a = a->next, i++)
+        if (is_str_view(a, data))
+            write_sqlite_str_view_value(ms, g, q, stmt_suffix, "            ", "row_", a, i, data);
+
+    a = q->cb_args;
+    i = q->return_name.len ? 1 : 0;
+    mstream_cstr(ms, "            ret = on_row(" NL);
+    for (; a; a = a->next, i++)
+    {
+        mstream_cstr(ms, "                ");
+        if (is_str_view(a, data))
+            mstream_fmt(ms, "row_%S", a->name, data);
+        else
+            write_sqlite_column_value(ms, g, q, stmt_suffix, a, i, data);
+        mstream_cstr(ms, "," NL);
+        if (a->has_hidden_len_param)
+        {
+            mstream_cstr(ms, "                sqlite3_column_bytes(ctx->");
+            write_func_name(ms, g, q, data);
+            mstream_fmt(ms, "%s, %d)," NL, stmt_suffix, i);
+        }
+    }
+    mstream_cstr(ms, "                user_data);" NL);
+}
+
+static void
+write_row_struct_name(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    mstream_fmt(ms, "struct %S_", PREFIX(root->prefix, data));
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_row");
+}
+
+static void
+write_row_struct(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    struct arg* a;
+
+    write_row_struct_name(ms, root, g, q, data);
+    mstream_cstr(ms, NL "{" NL);
+    for (a = q->cb_args; a; a = a->next)
+    {
+        mstream_fmt(ms, "    %S %S;" NL, a->type, data, a->name, data);
+        if (a->has_hidden_len_param)
+            mstream_fmt(ms, "    int %S_len;" NL, a->name, data);
+    }
+    mstream_cstr(ms, "};" NL NL);
+}
+
+static void
+write_cursor_func_ptr_decls(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q,
+    const char* indent, const char* data)
+{
+    struct arg* a;
+
+    mstream_fmt(ms, "%sint (*%S_open_cursor)(struct %S* ctx", indent, q->name, data, PREFIX(root->prefix, data));
+    for (a = q->in_args; a; a = a->next)
+    {
+        mstream_fmt(ms, ", %S %S", a->type, data, a->name, data);
+        if (a->has_hidden_len_param)
+            mstream_fmt(ms, ", int %S_len", a->name, data);
+    }
+    mstream_cstr(ms, ");" NL);
+
+    mstream_fmt(ms, "%sint (*%S_next)(struct %S* ctx, ", indent, q->name, data, PREFIX(root->prefix, data));
+    write_row_struct_name(ms, root, g, q, data);
+    mstream_cstr(ms, "* row);" NL);
+
+    mstream_fmt(ms, "%svoid (*%S_close_cursor)(struct %S* ctx);" NL, indent, q->name, data, PREFIX(root->prefix, data));
+}
+
+/*
+ * Cursors step a statement of their own instead of calling on_row() for every
+ * row, so the regular query function can still be used while a cursor is
+ * open. open_cursor() binds the arguments, next() fills in one row at a time
+ * and close_cursor() resets the statement. Only one cursor per query can be
+ * open on a connection.
+ *
+ * The cursor's state is kept next to its statement: 1 while rows may follow,
+ * 0 once it is closed or has returned all rows, and -1 after an error. Once
+ * next() has returned 0 or an error, it keeps doing so until the cursor is
+ * opened again, instead of stepping the reset statement, which would start
+ * the query over.
+ */
+static void
+write_cursor_funcs(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    struct arg* a;
+    int i;
+
+    /* open_cursor() closes the previous cursor of a split context */
+    if (root->split)
+    {
+        mstream_cstr(ms, "static void" NL);
+        write_func_name(ms, g, q, data);
+        mstream_fmt(ms, "_close_cursor(struct %S* ctx);" NL NL, PREFIX(root->prefix, data));
+    }
+
+    /* open_cursor() */
+    mstream_cstr(ms, "static int" NL);
+    write_func_name(ms, g, q, data);
+    mstream_fmt(ms, "_open_cursor(struct %S* ctx", PREFIX(root->prefix, data));
+    for (a = q->in_args; a; a = a->next)
+    {
+        mstream_fmt(ms, ", %S %S", a->type, data, a->name, data);
+        if (a->has_hidden_len_param)
+            mstream_fmt(ms, ", int %S_len", a->name, data);
+    }
+    mstream_cstr(ms, ")" NL "{" NL);
+    if (!root->prepare_eager || q->bind_args)
+        mstream_cstr(ms, "    int ret;" NL);
+    if (root->split)
+    {
+        /* The cursor pins an idle reader until close_cursor(), or the writer
+         * if this thread owns it. Opening it again first gives up the
+         * connection it had, which may not be the right one anymore. */
+        mstream_cstr(ms, "    if (ctx->split)" NL "    {" NL);
+        mstream_fmt (ms, "        struct %S* split_ctx;" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        int split_ret;" NL);
+        mstream_cstr(ms, "        if (ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_cursor_ctx)" NL);
+        mstream_cstr(ms, "            ");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_close_cursor(ctx);" NL);
+        mstream_fmt (ms, "        split_ctx = %S_split_acquire(ctx->split, 1);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        split_ret = ");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_open_cursor");
+        write_split_in_args(ms, "split_ctx", q, data);
+        mstream_cstr(ms, ");" NL);
+        mstream_cstr(ms, "        if (split_ret == 0)" NL);
+        mstream_cstr(ms, "            ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_cursor_ctx = split_ctx;" NL);
+        mstream_cstr(ms, "        else" NL);
+        mstream_fmt (ms, "            %S_split_release(ctx->split, split_ctx);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        return split_ret;" NL);
+        mstream_cstr(ms, "    }" NL NL);
+    }
+    write_sqlite_prepare_stmt(ms, root, g, q, "_cursor", data);
+    /* In case the previous cursor was not closed */
+    mstream_cstr(ms, "    sqlite3_reset(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_cursor);" NL);
+    if (q->bind_args)
+    {
+        /* Binding can fail, which leaves the cursor closed */
+        mstream_cstr(ms, "    ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_cursor_state = 0;" NL);
+    }
+    write_sqlite_bind_args(ms, root, g, q, "_cursor", data);
+    mstream_cstr(ms, "    ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_cursor_state = 1;" NL);
+    mstream_cstr(ms, "    return 0;" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    /* next() */
+    mstream_cstr(ms, "static int" NL);
+    write_func_name(ms, g, q, data);
+    mstream_fmt(ms, "_next(struct %S* ctx, ", PREFIX(root->prefix, data));
+    write_row_struct_name(ms, root, g, q, data);
+    mstream_cstr(ms, "* row)" NL "{" NL);
+    mstream_cstr(ms, "    int ret;" NL);
+    if (root->split)
+    {
+        /* Runs on the pinned connection, or acts like a closed cursor */
+        mstream_cstr(ms, "    if (ctx->split)" NL);
+        mstream_cstr(ms, "        return ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_cursor_ctx ? ");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_next(ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_cursor_ctx, row) : 0;" NL NL);
+    }
+    mstream_cstr(ms, "    if (ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_cursor_state != 1)" NL);
+    mstream_cstr(ms, "        return ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_cursor_state;" NL NL);
+    write_busy_label(ms, root, "next_step");
+    mstream_cstr(ms, "    ret = sqlite3_step(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_cursor);" NL);
+    mstream_cstr(ms, "    switch (ret)" NL "    {" NL);
+    mstream_cstr(ms, "        case SQLITE_ROW:" NL);
+    for (a = q->cb_args, i = 0; a; a = a->next, i++)
+    {
+        if (is_str_view(a, data))
+        {
+            write_sqlite_str_view_value(ms, g, q, "_cursor", "            ", "row->", a, i, data);
+            continue;
+        }
+        mstream_fmt(ms, "            row->%S = ", a->name, data);
+        write_sqlite_column_value(ms, g, q, "_cursor", a, i, data);
+        mstream_cstr(ms, ";" NL);
+        if (a->has_hidden_len_param)
+        {
+            mstream_fmt(ms, "            row->%S_len = sqlite3_column_bytes(ctx->", a->name, data);
+            write_func_name(ms, g, q, data);
+            mstream_fmt(ms, "_cursor, %d);" NL, i);
+        }
+    }
+    mstream_cstr(ms, "            return 1;" NL);
+    write_busy_case(ms, root, "next_step", 1);
+    if (root->deadlines)
+    {
+        mstream_cstr(ms, "        case SQLITE_INTERRUPT:" NL);
+        mstream_cstr(ms, "            ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_cursor_state = -1;" NL);
+        mstream_cstr(ms, "            sqlite3_reset(ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_cursor);" NL);
+        mstream_fmt (ms, "            return %S_interrupted(ctx);" NL, PREFIX(root->prefix, data));
+    }
+    mstream_cstr(ms, "        case SQLITE_DONE:" NL);
+    mstream_cstr(ms, "            ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_cursor_state = 0;" NL);
+    mstream_cstr(ms, "            sqlite3_reset(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_cursor);" NL);
+    mstream_cstr(ms, "            return 0;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+    mstream_fmt (ms, "    %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+        LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "    ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_cursor_state = -1;" NL);
+    mstream_cstr(ms, "    sqlite3_reset(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_cursor);" NL);
+    mstream_cstr(ms, "    return -1;" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    /* close_cursor() */
+    mstream_cstr(ms, "static void" NL);
+    write_func_name(ms, g, q, data);
+    mstream_fmt(ms, "_close_cursor(struct %S* ctx)" NL "{" NL, PREFIX(root->prefix, data));
+    if (root->split)
+    {
+        mstream_cstr(ms, "    if (ctx->split)" NL "    {" NL);
+        mstream_fmt (ms, "        struct %S* split_ctx = ctx->", PREFIX(root->prefix, data));
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_cursor_ctx;" NL);
+        mstream_cstr(ms, "        if (split_ctx)" NL "        {" NL);
+        mstream_cstr(ms, "            ");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_close_cursor(split_ctx);" NL);
+        mstream_cstr(ms, "            ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_cursor_ctx = NULL;" NL);
+        mstream_fmt (ms, "            %S_split_release(ctx->split, split_ctx);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        }" NL);
+        mstream_cstr(ms, "        return;" NL);
+        mstream_cstr(ms, "    }" NL NL);
+    }
+    mstream_cstr(ms, "    sqlite3_reset(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_cursor);" NL);
+    mstream_cstr(ms, "    ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_cursor_state = 0;" NL);
+    mstream_cstr(ms, "}" NL NL);
+}
+
+static int
+is_var_length_column(const struct arg* a)
+{
+    return strcmp(a->sql_type, "text") == 0 || strcmp(a->sql_type, "blob") == 0;
+}
+
+static int
+has_columns_queries(const struct root* root)
+{
+    const struct query_group* g;
+    const struct query* q;
+    for (q = root->queries; q; q = q->next)
+        if (q->columns)
+            return 1;
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            if (q->columns)
+                return 1;
+    return 0;
+}
+
+static void
+write_columns_struct_name(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    mstream_fmt(ms, "struct %S_", PREFIX(root->prefix, data));
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_columns");
+}
+
+/*!
+ * \brief Writes the structure of caller-provided buffers filled in by
+ * fetch_columns(). Integer columns are widened to int64_t. Text and blob
+ * columns use an offsets array with one more entry than rows, and a data
+ * buffer of "_capacity" bytes. Nullable columns have a validity bitmap.
+ */
+static void
+write_columns_struct(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    struct arg* a;
+
+    write_columns_struct_name(ms, root, g, q, data);
+    mstream_cstr(ms, NL "{" NL);
+    for (a = q->cb_args; a; a = a->next)
+    {
+        if (is_var_length_column(a))
+        {
+            mstream_fmt(ms, "    int32_t* %S_offsets;" NL, a->name, data);
+            mstream_fmt(ms, "    char* %S_data;" NL, a->name, data);
+            mstream_fmt(ms, "    int32_t %S_capacity;" NL, a->name, data);
+        }
+        else
+            mstream_fmt(ms, "    int64_t* %S;" NL, a->name, data);
+        if (a->nullable)
+        {
+            mstream_fmt(ms, "    uint8_t* %S_validity;" NL, a->name, data);
+            mstream_fmt(ms, "    int64_t %S_null_count;" NL, a->name, data);
+        }
+    }
+    mstream_cstr(ms, "    int length;" NL);
+    mstream_cstr(ms, "    int truncated;" NL);
+    mstream_cstr(ms, "};" NL NL);
+}
+
+static void
+write_arrow_c_data_interface(struct mstream* ms)
+{
+    mstream_cstr(ms,
+        "#ifndef ARROW_C_DATA_INTERFACE" NL
+        "#define ARROW_C_DATA_INTERFACE" NL NL
+        "#define ARROW_FLAG_DICTIONARY_ORDERED 1" NL
+        "#define ARROW_FLAG_NULLABLE 2" NL
+        "#define ARROW_FLAG_MAP_KEYS_SORTED 4" NL NL
+        "struct ArrowSchema" NL
+        "{" NL
+        "    const char* format;" NL
+        "    const char* name;" NL
+        "    const char* metadata;" NL
+        "    int64_t flags;" NL
+        "    int64_t n_children;" NL
+        "    struct ArrowSchema** children;" NL
+        "    struct ArrowSchema* dictionary;" NL
+        "    void (*release)(struct ArrowSchema*);" NL
+        "    void* private_data;" NL
+        "};" NL NL
+        "struct ArrowArray" NL
+        "{" NL
+        "    int64_t length;" NL
+        "    int64_t null_count;" NL
+        "    int64_t offset;" NL
+        "    int64_t n_buffers;" NL
+        "    int64_t n_children;" NL
+        "    const void** buffers;" NL
+        "    struct ArrowArray** children;" NL
+        "    struct ArrowArray* dictionary;" NL
+        "    void (*release)(struct ArrowArray*);" NL
+        "    void* private_data;" NL
+        "};" NL NL
+        "#endif" NL NL);
+}
+
+static void
+write_columns_func_ptr_decls(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q,
+    const char* indent, const char* data)
+{
+    struct arg* a;
+
+    mstream_fmt(ms, "%sint (*%S_fetch_columns)(struct %S* ctx", indent, q->name, data, PREFIX(root->prefix, data));
+    for (a = q->in_args; a; a = a->next)
+    {
+        mstream_fmt(ms, ", %S %S", a->type, data, a->name, data);
+        if (a->has_hidden_len_param)
+            mstream_fmt(ms, ", int %S_len", a->name, data);
+    }
+    mstream_cstr(ms, ", ");
+    write_columns_struct_name(ms, root, g, q, data);
+    mstream_cstr(ms, "* out, int max_rows);" NL);
+
+    mstream_fmt(ms, "%sint (*%S_fetch_more_columns)(struct %S* ctx, ", indent, q->name, data, PREFIX(root->prefix, data));
+    write_columns_struct_name(ms, root, g, q, data);
+    mstream_cstr(ms, "* out, int max_rows);" NL);
+
+    mstream_fmt(ms, "%svoid (*%S_close_columns)(struct %S* ctx);" NL, indent, q->name, data, PREFIX(root->prefix, data));
+
+    mstream_fmt(ms, "%sint (*%S_export_arrow)(const ", indent, q->name, data);
+    write_columns_struct_name(ms, root, g, q, data);
+    mstream_cstr(ms, "* columns, struct ArrowArray* array, struct ArrowSchema* schema);" NL);
+}
+
+/*
+ * The Arrow export doesn't copy any of the caller's buffers. It only
+ * allocates the ArrowArray/ArrowSchema children, which are freed again by
+ * the release callbacks. Each child array owns its buffer list, so that a
+ * consumer can move children out of the parent as the C Data Interface
+ * allows.
+ */
+static void
+write_arrow_export_funcs(struct mstream* ms, const struct root* root, const char* data)
+{
+    mstream_fmt (ms, "static void" NL "%S_arrow_release_child_array(struct ArrowArray* array)" NL "{" NL,
+        PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S(array->private_data);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "    array->release = NULL;" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    mstream_fmt (ms, "static void" NL "%S_arrow_release_array(struct ArrowArray* array)" NL "{" NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int64_t i;" NL);
+    mstream_cstr(ms, "    for (i = 0; i != array->n_children; ++i)" NL);
+    mstream_cstr(ms, "        if (array->children[i]->release)" NL);
+    mstream_cstr(ms, "            array->children[i]->release(array->children[i]);" NL);
+    mstream_fmt (ms, "    %S(array->private_data);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "    array->release = NULL;" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    mstream_fmt (ms, "static void" NL "%S_arrow_release_child_schema(struct ArrowSchema* schema)" NL "{" NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    schema->release = NULL;" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    mstream_fmt (ms, "static void" NL "%S_arrow_release_schema(struct ArrowSchema* schema)" NL "{" NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int64_t i;" NL);
+    mstream_cstr(ms, "    for (i = 0; i != schema->n_children; ++i)" NL);
+    mstream_cstr(ms, "        if (schema->children[i]->release)" NL);
+    mstream_cstr(ms, "            schema->children[i]->release(schema->children[i]);" NL);
+    mstream_fmt (ms, "    %S(schema->private_data);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "    schema->release = NULL;" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    mstream_fmt (ms, "static int" NL "%S_arrow_export(int64_t length, int n, const char** names, const char** formats," NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    const int64_t* flags, const int64_t* null_counts, const int* n_buffers, const void* (*buffers)[3]," NL);
+    mstream_cstr(ms, "    struct ArrowArray* array, struct ArrowSchema* schema)" NL "{" NL);
+    mstream_cstr(ms, "    struct ArrowArray* child_arrays;" NL);
+    mstream_cstr(ms, "    struct ArrowSchema* child_schemas;" NL);
+    mstream_cstr(ms, "    int i;" NL NL);
+    mstream_cstr(ms, "    memset(array, 0, sizeof *array);" NL);
+    mstream_cstr(ms, "    memset(schema, 0, sizeof *schema);" NL NL);
+    mstream_cstr(ms, "    /* Child structures are followed by the list of child pointers, and for" NL);
+    mstream_cstr(ms, "     * the array, by the parent's single (validity) buffer */" NL);
+    mstream_fmt (ms, "    child_arrays = %S(n * (sizeof(struct ArrowArray) + sizeof(struct ArrowArray*)) + sizeof(void*));" NL,
+        MALLOC(root->malloc, data));
+    mstream_cstr(ms, "    if (child_arrays == NULL)" NL);
+    mstream_cstr(ms, "        return -1;" NL);
+    mstream_fmt (ms, "    child_schemas = %S(n * (sizeof(struct ArrowSchema) + sizeof(struct ArrowSchema*)));" NL,
+        MALLOC(root->malloc, data));
+    mstream_cstr(ms, "    if (child_schemas == NULL)" NL "    {" NL);
+    mstream_fmt (ms, "        %S(child_arrays);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "        return -1;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    mstream_cstr(ms, "    array->length = length;" NL);
+    mstream_cstr(ms, "    array->n_buffers = 1;" NL);
+    mstream_cstr(ms, "    array->children = (struct ArrowArray**)(child_arrays + n);" NL);
+    mstream_cstr(ms, "    array->buffers = (const void**)(array->children + n);" NL);
+    mstream_cstr(ms, "    array->buffers[0] = NULL;" NL);
+    mstream_cstr(ms, "    array->private_data = child_arrays;" NL);
+    mstream_fmt (ms, "    array->release = %S_arrow_release_array;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    schema->format = \"+s\";" NL);
+    mstream_cstr(ms, "    schema->name = \"\";" NL);
+    mstream_cstr(ms, "    schema->n_children = n;" NL);
+    mstream_cstr(ms, "    schema->children = (struct ArrowSchema**)(child_schemas + n);" NL);
+    mstream_cstr(ms, "    schema->private_data = child_schemas;" NL);
+    mstream_fmt (ms, "    schema->release = %S_arrow_release_schema;" NL NL, PREFIX(root->prefix, data));
+
+    mstream_cstr(ms, "    for (i = 0; i != n; ++i)" NL "    {" NL);
+    mstream_cstr(ms, "        struct ArrowArray* child = &child_arrays[i];" NL);
+    mstream_cstr(ms, "        struct ArrowSchema* child_schema = &child_schemas[i];" NL);
+    mstream_fmt (ms, "        const void** child_buffers = %S(sizeof(buffers[i]));" NL, MALLOC(root->malloc, data));
+    mstream_cstr(ms, "        if (child_buffers == NULL)" NL "        {" NL);
+    mstream_cstr(ms, "            array->release(array);" NL);
+    mstream_cstr(ms, "            schema->release(schema);" NL);
+    mstream_cstr(ms, "            return -1;" NL);
+    mstream_cstr(ms, "        }" NL);
+    mstream_cstr(ms, "        memcpy(child_buffers, buffers[i], sizeof(buffers[i]));" NL NL);
+    mstream_cstr(ms, "        memset(child, 0, sizeof *child);" NL);
+    mstream_cstr(ms, "        child->length = length;" NL);
+    mstream_cstr(ms, "        child->null_count = null_counts[i];" NL);
+    mstream_cstr(ms, "        child->n_buffers = n_buffers[i];" NL);
+    mstream_cstr(ms, "        child->buffers = child_buffers;" NL);
+    mstream_cstr(ms, "        child->private_data = (void*)child_buffers;" NL);
+    mstream_fmt (ms, "        child->release = %S_arrow_release_child_array;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        array->children[i] = child;" NL);
+    mstream_cstr(ms, "        array->n_children++;" NL NL);
+    mstream_cstr(ms, "        memset(child_schema, 0, sizeof *child_schema);" NL);
+    mstream_cstr(ms, "        child_schema->format = formats[i];" NL);
+    mstream_cstr(ms, "        child_schema->name = names[i];" NL);
+    mstream_cstr(ms, "        child_schema->flags = flags[i];" NL);
+    mstream_fmt (ms, "        child_schema->release = %S_arrow_release_child_schema;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        schema->children[i] = child_schema;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+    mstream_cstr(ms, "    return 0;" NL);
+    mstream_cstr(ms, "}" NL NL);
+}
+
+/*
+ * Columns queries step a statement of their own, so that a fetch can span
+ * several calls. fetch_columns() binds the arguments and decodes up to
+ * "max_rows" rows into the caller's buffers, and fetch_more_columns()
+ * continues with the next rows. Text and blob values are copied, so the
+ * buffers stay valid after the next call. If there are more rows than
+ * "max_rows", or a row does not fit into one of the data buffers, then the
+ * call stops early and sets "truncated". The statement then stays on the row
+ * that didn't fit, and the next fetch_more_columns() starts with it.
+ * close_columns() resets the statement without fetching the remaining rows.
+ *
+ * The state is 1 while rows may follow, 2 if the current row still has to be
+ * decoded, 0 once the query is closed or done, and -1 after an error. On a
+ * split context the statement runs on a connection that stays pinned while
+ * rows are left, like a cursor's.
+ */
+static void
+write_columns_funcs(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    struct arg* a;
+    int i, n;
+
+    /* fetch_more_columns() */
+    mstream_cstr(ms, "static int" NL);
+    write_func_name(ms, g, q, data);
+    mstream_fmt(ms, "_fetch_more_columns(struct %S* ctx, ", PREFIX(root->prefix, data));
+    write_columns_struct_name(ms, root, g, q, data);
+    mstream_cstr(ms, "* out, int max_rows)" NL "{" NL);
+    mstream_cstr(ms, "    int ret, row;" NL);
+    for (a = q->cb_args, i = 0; a; a = a->next, i++)
+        if (is_var_length_column(a))
+        {
+            mstream_fmt(ms, "    const void* col%d;" NL, i);
+            mstream_fmt(ms, "    int col%d_len;" NL, i);
+        }
+    mstream_cstr(ms, NL);
+
+    mstream_cstr(ms, "    out->length = 0;" NL);
+    mstream_cstr(ms, "    out->truncated = 0;" NL);
+    for (a = q->cb_args; a; a = a->next)
+    {
+        if (is_var_length_column(a))
+            mstream_fmt(ms, "    out->%S_offsets[0] = 0;" NL, a->name, data);
+        if (a->nullable)
+            mstream_fmt(ms, "    out->%S_null_count = 0;" NL, a->name, data);
+    }
+    mstream_cstr(ms, NL);
+
+    if (root->split)
+    {
+        /* Runs on the pinned connection, which is given back once all rows
+         * were fetched */
+        mstream_cstr(ms, "    if (ctx->split)" NL "    {" NL);
+        mstream_fmt (ms, "        struct %S* split_ctx = ctx->", PREFIX(root->prefix, data));
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_columns_ctx;" NL);
+        mstream_cstr(ms, "        if (split_ctx == NULL)" NL);
+        mstream_cstr(ms, "            return 0;" NL);
+        mstream_cstr(ms, "        row = ");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_fetch_more_columns(split_ctx, out, max_rows);" NL);
+        mstream_cstr(ms, "        if (!out->truncated)" NL "        {" NL);
+        mstream_cstr(ms, "            ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_columns_ctx = NULL;" NL);
+        mstream_fmt (ms, "            %S_split_release(ctx->split, split_ctx);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        }" NL);
+        mstream_cstr(ms, "        return row;" NL);
+        mstream_cstr(ms, "    }" NL NL);
+    }
+
+    mstream_cstr(ms, "    if (ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_columns_state <= 0)" NL);
+    mstream_cstr(ms, "        return ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_columns_state;" NL NL);
+
+    mstream_cstr(ms, "    for (row = 0; ; ++row)" NL "    {" NL);
+    mstream_cstr(ms, "        if (ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_columns_state == 2)" NL "        {" NL);
+    mstream_cstr(ms, "            /* The row that stopped the previous call */" NL);
+    mstream_cstr(ms, "            ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_columns_state = 1;" NL);
+    mstream_cstr(ms, "            ret = SQLITE_ROW;" NL);
+    mstream_cstr(ms, "        }" NL);
+    mstream_cstr(ms, "        else" NL "        {" NL);
+    write_busy_label(ms, root, "next_step");
+    mstream_cstr(ms, "            ret = sqlite3_step(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_columns);" NL);
+    if (root->busy_policy == BUSY_SPIN)
+        mstream_cstr(ms, "            if (ret == SQLITE_BUSY) { ctx->busy.retries++; goto next_step; }" NL);
+    mstream_cstr(ms, "        }" NL);
+    mstream_cstr(ms, "        if (ret == SQLITE_DONE)" NL "        {" NL);
+    mstream_cstr(ms, "            ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_columns_state = 0;" NL);
+    mstream_cstr(ms, "            sqlite3_reset(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_columns);" NL);
+    mstream_cstr(ms, "            break;" NL);
+    mstream_cstr(ms, "        }" NL);
+    mstream_cstr(ms, "        if (ret != SQLITE_ROW)" NL);
+    mstream_cstr(ms, "            goto fetch_failed;" NL);
+    mstream_cstr(ms, "        if (row == max_rows)" NL);
+    mstream_cstr(ms, "            goto truncated;" NL NL);
+
+    /* Make sure all variable length values fit before writing anything */
+    for (a = q->cb_args, i = 0; a; a = a->next, i++)
+    {
+        if (!is_var_length_column(a))
+            continue;
+        mstream_fmt(ms, "        col%d = sqlite3_column_%s(ctx->", i, a->sql_type);
+        write_func_name(ms, g, q, data);
+        mstream_fmt(ms, "_columns, %d);" NL, i);
+        mstream_fmt(ms, "        col%d_len = sqlite3_column_bytes(ctx->", i);
+        write_func_name(ms, g, q, data);
+        mstream_fmt(ms, "_columns, %d);" NL, i);
+        mstream_fmt(ms, "        if (col%d_len > out->%S_capacity - out->%S_offsets[row])" NL,
+            i, a->name, data, a->name, data);
+        mstream_cstr(ms, "            goto truncated;" NL);
+    }
+
+    for (a = q->cb_args, i = 0; a; a = a->next, i++)
+    {
+        const char* indent = "        ";
+        if (a->nullable)
+        {
+            mstream_cstr(ms, "        if (sqlite3_column_type(ctx->");
+            write_func_name(ms, g, q, data);
+            mstream_fmt(ms, "_columns, %d) == SQLITE_NULL)" NL "        {" NL, i);
+            mstream_fmt(ms, "            out->%S_validity[row >> 3] &= (uint8_t)~(1u << (row & 7));" NL, a->name, data);
+            mstream_fmt(ms, "            out->%S_null_count++;" NL, a->name, data);
+            if (is_var_length_column(a))
+                mstream_fmt(ms, "            out->%S_offsets[row + 1] = out->%S_offsets[row];" NL, a->name, data, a->name, data);
+            else
+                mstream_fmt(ms, "            out->%S[row] = 0;" NL, a->name, data);
+            mstream_cstr(ms, "        }" NL);
+            mstream_cstr(ms, "        else" NL "        {" NL);
+            mstream_fmt(ms, "            out->%S_validity[row >> 3] |= (uint8_t)(1u << (row & 7));" NL, a->name, data);
+            indent = "            ";
+        }
+        if (is_var_length_column(a))
+        {
+            mstream_fmt(ms, "%sif (col%d_len > 0)" NL, indent, i);
+            mstream_fmt(ms, "%s    memcpy(out->%S_data + out->%S_offsets[row], col%d, col%d_len);" NL,
+                indent, a->name, data, a->name, data, i, i);
+            mstream_fmt(ms, "%sout->%S_offsets[row + 1] = out->%S_offsets[row] + col%d_len;" NL,
+                indent, a->name, data, a->name, data, i);
+        }
+        else
+        {
+            mstream_fmt(ms, "%sout->%S[row] = sqlite3_column_int64(ctx->", indent, a->name, data);
+            write_func_name(ms, g, q, data);
+            mstream_fmt(ms, "_columns, %d);" NL, i);
+        }
+        if (a->nullable)
+            mstream_cstr(ms, "        }" NL);
+    }
+    mstream_cstr(ms, "    }" NL NL);
+    mstream_cstr(ms, "    out->length = row;" NL);
+    mstream_cstr(ms, "    return row;" NL NL);
+    mstream_cstr(ms, "truncated:" NL);
+    mstream_cstr(ms, "    ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_columns_state = 2;" NL);
+    mstream_cstr(ms, "    out->truncated = 1;" NL);
+    mstream_cstr(ms, "    out->length = row;" NL);
+    mstream_cstr(ms, "    return row;" NL NL);
+    mstream_cstr(ms, "fetch_failed:" NL);
+    mstream_fmt (ms, "    %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+        LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "    ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_columns_state = -1;" NL);
+    mstream_cstr(ms, "    sqlite3_reset(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_columns);" NL);
+    mstream_cstr(ms, "    return -1;" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    /* close_columns() */
+    mstream_cstr(ms, "static void" NL);
+    write_func_name(ms, g, q, data);
+    mstream_fmt(ms, "_close_columns(struct %S* ctx)" NL "{" NL, PREFIX(root->prefix, data));
+    if (root->split)
+    {
+        mstream_cstr(ms, "    if (ctx->split)" NL "    {" NL);
+        mstream_fmt (ms, "        struct %S* split_ctx = ctx->", PREFIX(root->prefix, data));
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_columns_ctx;" NL);
+        mstream_cstr(ms, "        if (split_ctx)" NL "        {" NL);
+        mstream_cstr(ms, "            ");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_close_columns(split_ctx);" NL);
+        mstream_cstr(ms, "            ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_columns_ctx = NULL;" NL);
+        mstream_fmt (ms, "            %S_split_release(ctx->split, split_ctx);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        }" NL);
+        mstream_cstr(ms, "        return;" NL);
+        mstream_cstr(ms, "    }" NL NL);
+    }
+    mstream_cstr(ms, "    sqlite3_reset(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_columns);" NL);
+    mstream_cstr(ms, "    ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_columns_state = 0;" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    /* fetch_columns() */
+    mstream_cstr(ms, "static int" NL);
+    write_func_name(ms, g, q, data);
+    mstream_fmt(ms, "_fetch_columns(struct %S* ctx", PREFIX(root->prefix, data));
+    for (a = q->in_args; a; a = a->next)
+    {
+        mstream_fmt(ms, ", %S %S", a->type, data, a->name, data);
+        if (a->has_hidden_len_param)
+            mstream_fmt(ms, ", int %S_len", a->name, data);
+    }
+    mstream_cstr(ms, ", ");
+    write_columns_struct_name(ms, root, g, q, data);
+    mstream_cstr(ms, "* out, int max_rows)" NL "{" NL);
+    if (!root->prepare_eager || q->bind_args)
+        mstream_cstr(ms, "    int ret;" NL);
+    if (root->split)
+    {
+        /* Like open_cursor(), this gives up the connection of the previous
+         * fetch first, and only keeps the new one while rows are left */
+        mstream_cstr(ms, "    if (ctx->split)" NL "    {" NL);
+        mstream_fmt (ms, "        struct %S* split_ctx;" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        int split_ret;" NL);
+        mstream_cstr(ms, "        if (ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_columns_ctx)" NL);
+        mstream_cstr(ms, "            ");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_close_columns(ctx);" NL);
+        mstream_fmt (ms, "        split_ctx = %S_split_acquire(ctx->split, 1);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        split_ret = ");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_fetch_columns");
+        write_split_in_args(ms, "split_ctx", q, data);
+        mstream_cstr(ms, ", out, max_rows);" NL);
+        mstream_cstr(ms, "        if (split_ret >= 0 && out->truncated)" NL);
+        mstream_cstr(ms, "            ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_columns_ctx = split_ctx;" NL);
+        mstream_cstr(ms, "        else" NL);
+        mstream_fmt (ms, "            %S_split_release(ctx->split, split_ctx);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        return split_ret;" NL);
+        mstream_cstr(ms, "    }" NL NL);
+    }
+    write_sqlite_prepare_stmt(ms, root, g, q, "_columns", data);
+    /* In case the previous fetch has rows left */
+    mstream_cstr(ms, "    sqlite3_reset(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_columns);" NL);
+    if (q->bind_args)
+    {
+        /* Binding can fail, which leaves the query closed */
+        mstream_cstr(ms, "    ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_columns_state = 0;" NL);
+    }
+    write_sqlite_bind_args(ms, root, g, q, "_columns", data);
+    mstream_cstr(ms, "    ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_columns_state = 1;" NL);
+    mstream_cstr(ms, "    return ");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_fetch_more_columns(ctx, out, max_rows);" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    /* export_arrow() */
+    for (a = q->cb_args, n = 0; a; a = a->next)
+        n++;
+    mstream_cstr(ms, "static int" NL);
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_export_arrow(const ");
+    write_columns_struct_name(ms, root, g, q, data);
+    mstream_cstr(ms, "* columns, struct ArrowArray* array, struct ArrowSchema* schema)" NL "{" NL);
+    mstream_cstr(ms, "    static const char* names[] = {");
+    for (a = q->cb_args; a; a = a->next)
+        mstream_fmt(ms, "%s\"%S\"", a == q->cb_args ? "" : ", ", a->name, data);
+    mstream_cstr(ms, "};" NL);
+    mstream_cstr(ms, "    static const char* formats[] = {");
+    for (a = q->cb_args; a; a = a->next)
+        mstream_fmt(ms, "%s\"%s\"", a == q->cb_args ? "" : ", ",
+            strcmp(a->sql_type, "text") == 0 ? "u" : strcmp(a->sql_type, "blob") == 0 ? "z" : "l");
+    mstream_cstr(ms, "};" NL);
+    mstream_cstr(ms, "    static const int64_t flags[] = {");
+    for (a = q->cb_args; a; a = a->next)
+        mstream_fmt(ms, "%s%s", a == q->cb_args ? "" : ", ", a->nullable ? "ARROW_FLAG_NULLABLE" : "0");
+    mstream_cstr(ms, "};" NL);
+    mstream_cstr(ms, "    static const int n_buffers[] = {");
+    for (a = q->cb_args; a; a = a->next)
+        mstream_fmt(ms, "%s%d", a == q->cb_args ? "" : ", ", is_var_length_column(a) ? 3 : 2);
+    mstream_cstr(ms, "};" NL);
+    mstream_fmt (ms, "    int64_t null_counts[%d];" NL, n);
+    mstream_fmt (ms, "    const void* buffers[%d][3];" NL NL, n);
+    for (a = q->cb_args, i = 0; a; a = a->next, i++)
+    {
+        if (a->nullable)
+        {
+            mstream_fmt(ms, "    null_counts[%d] = columns->%S_null_count;" NL, i, a->name, data);
+            mstream_fmt(ms, "    buffers[%d][0] = columns->%S_validity;" NL, i, a->name, data);
+        }
+        else
+        {
+            mstream_fmt(ms, "    null_counts[%d] = 0;" NL, i);
+            mstream_fmt(ms, "    buffers[%d][0] = NULL;" NL, i);
+        }
+        if (is_var_length_column(a))
+        {
+            mstream_fmt(ms, "    buffers[%d][1] = columns->%S_offsets;" NL, i, a->name, data);
+            mstream_fmt(ms, "    buffers[%d][2] = columns->%S_data;" NL, i, a->name, data);
+        }
+        else
+        {
+            mstream_fmt(ms, "    buffers[%d][1] = columns->%S;" NL, i, a->name, data);
+            mstream_fmt(ms, "    buffers[%d][2] = NULL;" NL, i);
+        }
+    }
+    mstream_fmt (ms, NL "    return %S_arrow_export(columns->length, %d, names, formats," NL,
+        PREFIX(root->prefix, data), n);
+    mstream_cstr(ms, "        flags, null_counts, n_buffers, buffers, array, schema);" NL);
+    mstream_cstr(ms, "}" NL NL);
+}
+
+static void
+write_sqlite_return_column(struct mstream* ms, const struct query_group* g, const struct query* q, const char* stmt_suffix, const char* data)
+{
+    if (q->return_arg)
+    {
+        mstream_fmt(ms, "            *%S = %ssqlite3_column_%s(ctx->",
+            q->return_arg->name, data, q->return_arg->cast_from_sql, q->return_arg->sql_type);
+        write_func_name(ms, g, q, data);
+        mstream_fmt(ms, "%s, 0);" NL, stmt_suffix);
+        mstream_cstr(ms, "            found = 1;" NL);
+    }
+    else
+    {
+        mstream_fmt(ms, "            %S = sqlite3_column_int(ctx->", q->return_name, data);
+        write_func_name(ms, g, q, data);
+        mstream_fmt(ms, "%s, 0);" NL, stmt_suffix);
+    }
+}
+
+/*!
+ * \brief Untyped return values are returned directly. Typed return values
+ * were written to the out-parameter, so only success or failure is returned.
+ */
+static void
+write_sqlite_return_value(struct mstream* ms, const struct query* q, const char* indent, const char* data)
+{
+    if (q->return_arg)
+        mstream_fmt(ms, "%sreturn found ? 0 : -1;" NL, indent);
+    else
+        mstream_fmt(ms, "%sreturn %S;" NL, indent, q->return_name, data);
+}
+
+/*!
+ * \brief Writes the code that prepares the lookup statement of a query, if
+ * needed, and binds its key columns.
+ */
+static void
+write_sqlite_lookup_bind(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    struct arg* a;
+    char index[sizeof("-2147483648")];
+    int i = 1;
+
+    if (!root->prepare_eager)
+    {
+        mstream_cstr(ms, "    if (ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_lookup == NULL)" NL);
+        mstream_cstr(ms, "        if ((ret = sqlite3_prepare_v2(ctx->db," NL);
+        write_sqlite_lookup_stmt_sql(ms, q, data);
+        mstream_cstr(ms, "," NL);
+        mstream_cstr(ms, "            -1, &ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_lookup, NULL)) != SQLITE_OK)" NL);
+        mstream_cstr(ms, "        {" NL);
+        mstream_fmt (ms, "            %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+            LOG_SQL_ERR(root->log_sql_err, data));
+        mstream_cstr(ms, "            return -1;" NL);
+        mstream_cstr(ms, "        }" NL NL);
+    }
+
+    for (a = q->in_args; a; a = a->next)
+        if (a->read_key || a->conflict_key)
+        {
+            if (i == 1) mstream_cstr(ms, "    if ((ret = ");
+            else        mstream_cstr(ms, " ||" NL "        (ret = ");
+            sprintf(index, "%d", i++);
+            write_sqlite_bind_value(ms, g, q, "_lookup", a, index, "", data);
+            mstream_cstr(ms, ") != SQLITE_OK");
+        }
+    mstream_cstr(ms, ")" NL "    {" NL);
+    mstream_fmt (ms, "        %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+        LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "        return -1;" NL "    }" NL NL);
+}
+
+/*
+ * "read-first" insert-or-get queries look the row up before inserting. Hits
+ * only need a read transaction, so they don't take the write lock or append
+ * to the WAL. On a miss, the insert runs as usual and still returns the row
+ * if another connection inserted it in the meantime.
+ */
+static void
+write_sqlite_read_first(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    if (!q->read_first)
+        return;
+
+    write_sqlite_lookup_bind(ms, root, g, q, data);
+
+    write_busy_label(ms, root, "lookup_step");
+    mstream_cstr(ms, "    ret = sqlite3_step(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_lookup);" NL);
+    mstream_cstr(ms, "    switch (ret)" NL "    {" NL);
+    write_busy_case(ms, root, "lookup_step", 1);
+    write_interrupt_case(ms, root, g, q, "_lookup", data);
+    mstream_cstr(ms, "        case SQLITE_ROW:" NL);
+    if (q->return_name.len)
+        write_sqlite_return_column(ms, g, q, "_lookup", data);
+    if (q->cb_args)
+        write_sqlite_exec_callback(ms, g, q, "_lookup", data);
+    mstream_cstr(ms, "            sqlite3_reset(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_lookup);" NL);
+    if (q->return_name.len && q->cb_args)
+    {
+        mstream_cstr(ms, "            if (ret < 0)" NL);
+        mstream_cstr(ms, "                return ret;" NL);
+    }
+    if (q->return_name.len)
+        write_sqlite_return_value(ms, q, "            ", data);
+    else if (q->cb_args)
+        mstream_cstr(ms, "            return ret;" NL);
+    else
+        mstream_cstr(ms, "            return 0;" NL);
+    mstream_cstr(ms, "        case SQLITE_DONE:" NL);
+    mstream_cstr(ms, "            sqlite3_reset(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_lookup);" NL);
+    mstream_cstr(ms, "            break;" NL);
+    mstream_cstr(ms, "        default:" NL);
+    mstream_fmt (ms, "            %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+        LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "            sqlite3_reset(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_lookup);" NL);
+    mstream_cstr(ms, "            return -1;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+}
+
+/*!
+ * \brief Writes the code that rolls back the transaction an "on-conflict"
+ * upsert started itself, if it did.
+ */
+static void
+write_upsert_status_rollback(struct mstream* ms, const struct root* root, const char* indent, const char* data)
+{
+    mstream_fmt(ms, "%sif (own_tx)" NL, indent);
+    mstream_fmt(ms, "%s    %S_rollback(ctx);" NL, indent, PREFIX(root->prefix, data));
+}
+
+/*
+ * "on-conflict" upserts return 1 if the row was inserted, 2 if it was updated
+ * and 0 if it was left unchanged. The row is looked up by the conflict target
+ * first: if the upsert then changes a row, it was an update if the row
+ * existed and an insert otherwise. An unchanged row isn't counted by
+ * sqlite3_changes(). Outside of a transaction, both statements run in one
+ * started with BEGIN IMMEDIATE, so that no other connection can insert or
+ * delete the row in between.
+ */
+static void
+write_sqlite_upsert_status_exec(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    write_sqlite_lookup_bind(ms, root, g, q, data);
+
+    mstream_cstr(ms, "    own_tx = sqlite3_get_autocommit(ctx->db);" NL);
+    mstream_fmt (ms, "    if (own_tx && %S_begin_immediate(ctx) != 0)" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        return -1;" NL NL);
+
+    write_busy_label(ms, root, "lookup_step");
+    mstream_cstr(ms, "    ret = sqlite3_step(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_lookup);" NL);
+    mstream_cstr(ms, "    sqlite3_reset(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_lookup);" NL);
+    mstream_cstr(ms, "    switch (ret)" NL "    {" NL);
+    write_busy_case(ms, root, "lookup_step", 1);
+    if (root->deadlines)
+    {
+        mstream_cstr(ms, "        case SQLITE_INTERRUPT:" NL);
+        write_upsert_status_rollback(ms, root, "            ", data);
+        mstream_fmt (ms, "            return %S_interrupted(ctx);" NL, PREFIX(root->prefix, data));
+    }
+    mstream_cstr(ms, "        case SQLITE_ROW: existed = 1; break;" NL);
+    mstream_cstr(ms, "        case SQLITE_DONE: existed = 0; break;" NL);
+    mstream_cstr(ms, "        default:" NL);
+    mstream_fmt (ms, "            %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+        LOG_SQL_ERR(root->log_sql_err, data));
+    write_upsert_status_rollback(ms, root, "            ", data);
+    mstream_cstr(ms, "            return -1;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    write_busy_label(ms, root, "next_step");
+    mstream_cstr(ms, "    ret = sqlite3_step(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, ");" NL);
+    mstream_cstr(ms, "    switch (ret)" NL "    {" NL);
+    write_busy_case(ms, root, "next_step", 1);
+    if (root->deadlines)
+    {
+        mstream_cstr(ms, "        case SQLITE_INTERRUPT:" NL);
+        mstream_cstr(ms, "            sqlite3_reset(ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, ");" NL);
+        write_upsert_status_rollback(ms, root, "            ", data);
+        mstream_fmt (ms, "            return %S_interrupted(ctx);" NL, PREFIX(root->prefix, data));
+    }
+    mstream_cstr(ms, "        case SQLITE_DONE:" NL);
+    mstream_cstr(ms, "            sqlite3_reset(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, ");" NL);
+    mstream_cstr(ms, "            ret = sqlite3_changes(ctx->db) == 0 ? 0 : existed ? 2 : 1;" NL);
+    mstream_fmt (ms, "            if (own_tx && %S_commit(ctx) != 0)" NL "            {" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "                %S_rollback(ctx);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "                return -1;" NL);
+    mstream_cstr(ms, "            }" NL);
+    mstream_cstr(ms, "            return ret;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+    mstream_fmt (ms, "    %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+        LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "    sqlite3_reset(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, ");" NL);
+    write_upsert_status_rollback(ms, root, "    ", data);
+    mstream_cstr(ms, "    return -1;" NL);
+}
+
+static void
+write_sqlite_exec(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    if (q->upsert_status)
+    {
+        write_sqlite_upsert_status_exec(ms, root, g, q, data);
+        return;
+    }
+
+    switch (q->type)
+    {
+        case QUERY_NONE: break;
+        /*
+         * Exists should return:
+         *   1 if a row was found.
+         *   0 if no rows were found.
+         *   -1 if an error occurs.
+         */
+        case QUERY_EXISTS:
+            write_busy_label(ms, root, "next_step");
+            mstream_cstr(ms, "    ret = sqlite3_step(ctx->");
+            write_func_name(ms, g, q, data);
+            mstream_cstr(ms, ");" NL);
+            mstream_cstr(ms, "    switch (ret)" NL "    {" NL);
+            write_busy_case(ms, root, "next_step", 1);
+            write_interrupt_case(ms, root, g, q, "", data);
+            mstream_cstr(ms, "        case SQLITE_ROW:" NL);
+            mstream_cstr(ms, "            sqlite3_reset(ctx->");
+            write_func_name(ms, g, q, data);
+            mstream_cstr(ms, "); " NL);
+            mstream_cstr(ms, "            return 1;" NL);
+            mstream_cstr(ms, "        case SQLITE_DONE:" NL);
+            mstream_cstr(ms, "            sqlite3_reset(ctx->");
+            write_func_name(ms, g, q, data);
+            mstream_cstr(ms, ");" NL);
+            mstream_cstr(ms, "            return 0;" NL);
+            mstream_cstr(ms, "    }" NL NL);
+            mstream_fmt(ms, "    %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+                        LOG_SQL_ERR(root->log_sql_err, data));
+            mstream_cstr(ms, "    sqlite3_reset(ctx->");
+            write_func_name(ms, g, q, data);
+            mstream_cstr(ms, ");" NL);
+            mstream_cstr(ms, "    return -1;" NL);
+            break;
+
+        /*
+         * All of these query types either return a single value, or return
+         * nothing. Both "callback" and "return" statements can be used.
+         *
+         * If both "return" and "callback" are specified, then "return" has
+         * a higher priority this value is returned. If the callback function
+         * returns negative (error occurs), then we must return -1 instead of
+         * the return value.
+         *
+         * If only "callback" is specified, then we return the value returned
+         * by the callback.
+         *
+         * If only "return" is specified, then we return the value returned by
+         * the callback.
+         */
+        case QUERY_INSERT_NEW:
+        case QUERY_INSERT_OR_GET:
+        case QUERY_UPSERT:
+        case QUERY_SELECT_FIRST:
+            write_busy_label(ms, root, "next_step");
+            mstream_cstr(ms, "    ret = sqlite3_step(ctx->");
+            write_func_name(ms, g, q, data);
+            mstream_cstr(ms, ");" NL);
+            mstream_cstr(ms, "    switch (ret)" NL "    {" NL);
+            write_busy_case(ms, root, "next_step", 1);
+            write_interrupt_case(ms, root, g, q, "", data);
+
+            if (q->return_name.len || q->cb_args)
+                mstream_cstr(ms, "        case SQLITE_ROW:" NL);
+
+            if (q->return_name.len)
+                write_sqlite_return_column(ms, g, q, "", data);
+
+            if (q->cb_args)
+            {
+                write_sqlite_exec_callback(ms, g, q, "", data);
+                if (q->return_name.len)
+                {
+                    mstream_cstr(ms, "            if (ret < 0)" NL);
+                    mstream_cstr(ms, "            {" NL);
+                    mstream_cstr(ms, "                sqlite3_reset(ctx->");
+                    write_func_name(ms, g, q, data);
+                    mstream_cstr(ms, ");" NL);
+                    mstream_cstr(ms, "                return ret;" NL);
+                    mstream_cstr(ms, "            }" NL);
+                }
+                else
+                {
+                    mstream_cstr(ms, "            sqlite3_reset(ctx->");
+                    write_func_name(ms, g, q, data);
+                    mstream_cstr(ms, ");" NL);
+                    mstream_cstr(ms, "            return ret;" NL);
+                }
+            }
+            if (q->return_name.len || q->cb_args)
+                mstream_cstr(ms, "        case SQLITE_DONE: goto done;" NL);
+            else
+            {
+                mstream_cstr(ms, "        case SQLITE_DONE:" NL);
+                mstream_cstr(ms, "            sqlite3_reset(ctx->");
+                write_func_name(ms, g, q, data);
+                mstream_cstr(ms, ");" NL);
+                mstream_cstr(ms, "            return 0;" NL);
+            }
+
+            mstream_cstr(ms, "    }" NL NL);
+
+            /* We want to print an error in all cases except for "insert-new",
+             * because there, an error case is expected behavior */
+            if (q->type != QUERY_INSERT_NEW)
+                mstream_fmt(ms,
+                    "    %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+                    LOG_SQL_ERR(root->log_sql_err, data));
+            if (q->return_name.len || q->cb_args)
+                mstream_cstr(ms, "done:" NL);
+            mstream_cstr(ms, "    sqlite3_reset(ctx->");
+            write_func_name(ms, g, q, data);
+            mstream_cstr(ms, ");" NL);
+            if (q->return_name.len)
+                write_sqlite_return_value(ms, q, "    ", data);
+            else
+                mstream_cstr(ms, "    return -1;" NL);
+            break;
+
+        /*
+         * These query types return multiple values.
+         */
+        case QUERY_UPDATE:
+        case QUERY_DELETE:
+        case QUERY_SELECT_ALL:
+            mstream_cstr(ms, "next_step:" NL);
+            mstream_cstr(ms, "    ret = sqlite3_step(ctx->");
+            write_func_name(ms, g, q, data);
+            mstream_cstr(ms, ");" NL);
+            mstream_cstr(ms, "    switch (ret)" NL "    {" NL);
+            mstream_cstr(ms, "        case SQLITE_ROW:" NL);
+
+            if (q->return_name.len)
+                write_sqlite_return_column(ms, g, q, "", data);
+
+            if (q->cb_args)
+                write_sqlite_exec_callback(ms, g, q, "", data);
+
+            if (q->cb_args)
+                mstream_cstr(ms, "            if (ret == 0) goto next_step;" NL);
+
+            if (q->cb_args)
+            {
+                mstream_cstr(ms, "            sqlite3_reset(ctx->");
+                write_func_name(ms, g, q, data);
+                mstream_cstr(ms, ");" NL);
+                if (q->return_name.len)
+                {
+                    mstream_cstr(ms, "            if (ret < 0) return -1;" NL);
+                    write_sqlite_return_value(ms, q, "            ", data);
+                }
+                else
+                    mstream_cstr(ms, "            return ret;" NL);
+            }
+            else
+                mstream_cstr(ms, "            goto next_step;" NL);
+
+            write_busy_case(ms, root, "next_step", 1);
+            write_interrupt_case(ms, root, g, q, "", data);
+            mstream_cstr(ms, "        case SQLITE_DONE:" NL);
+            mstream_cstr(ms, "            sqlite3_reset(ctx->");
+            write_func_name(ms, g, q, data);
+            mstream_cstr(ms, ");" NL);
+            if (q->return_name.len)
+                write_sqlite_return_value(ms, q, "            ", data);
+            else
+                mstream_cstr(ms, "            return 0;" NL);
+
+            mstream_cstr(ms, "    }" NL NL);
+            mstream_fmt(ms, "    %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+                        LOG_SQL_ERR(root->log_sql_err, data));
+            mstream_cstr(ms, "    sqlite3_reset(ctx->");
+            write_func_name(ms, g, q, data);
+            mstream_cstr(ms, ");" NL);
+            mstream_cstr(ms, "    return -1;" NL);
+            break;
+    }
+}
+
+/*
+ * Result caches. Every cached query owns a fixed-size open-addressing table
+ * in the context structure, keyed on the function's arguments. Tables are
+ * invalidated in bulk: each table a cached query reads from has a generation
+ * counter, and an entry is only valid while its generation matches. Writes
+ * through generated queries and the connection's update hook advance the
+ * counter, so no entry ever has to be visited to invalidate it.
+ *
+ * Variable length keys and text columns are copied into a buffer owned by the
+ * entry, which is reused when the entry is replaced.
+ */
+enum cache_key_kind
+{
+    CACHE_KEY_VALUE,
+    CACHE_KEY_TEXT,
+    CACHE_KEY_VIEW,
+    CACHE_KEY_BLOB
+};
+
+static enum cache_key_kind
+cache_key_kind(const struct arg* a, const char* data)
+{
+    if (is_str_view(a, data))
+        return CACHE_KEY_VIEW;
+    if (a->has_hidden_len_param)
+        return CACHE_KEY_BLOB;
+    if (strcmp(a->sql_type, "text") == 0)
+        return CACHE_KEY_TEXT;
+    return CACHE_KEY_VALUE;
+}
+
+static int
+cache_needs_buffer(const struct query* q, const char* data)
+{
+    const struct arg* a;
+    for (a = q->in_args; a; a = a->next)
+        if (cache_key_kind(a, data) != CACHE_KEY_VALUE)
+            return 1;
+    for (a = q->cb_args; a; a = a->next)
+        if (strcmp(a->sql_type, "text") == 0)
+            return 1;
+    return 0;
+}
+
+static int
+any_cache_needs_buffer(const struct root* root, const char* data)
+{
+    const struct query_group* g;
+    const struct query* q;
+    for (q = root->queries; q; q = q->next)
+        if (q->cache_entries && cache_needs_buffer(q, data))
+            return 1;
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            if (q->cache_entries && cache_needs_buffer(q, data))
+                return 1;
+    return 0;
+}
+
+/*! \brief Number of slots, rounded up to a power of two for masking */
+static int
+cache_slots(const struct query* q)
+{
+    int slots = 1;
+    while (slots < q->cache_entries)
+        slots *= 2;
+    return slots;
+}
+
+/*! \brief Number of consecutive slots a key may be stored in */
+static int
+cache_window(const struct query* q)
+{
+    return cache_slots(q) < 4 ? cache_slots(q) : 4;
+}
+
+static void
+write_cache_entry_struct_name(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    mstream_fmt(ms, "struct %S_", PREFIX(root->prefix, data));
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_cache_entry");
+}
+
+static void
+write_cache_entry_struct(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    const struct arg* a;
+
+    write_cache_entry_struct_name(ms, root, g, q, data);
+    mstream_cstr(ms, NL "{" NL);
+    mstream_cstr(ms, "    sqlite3_uint64 gen;" NL);
+    mstream_cstr(ms, "    unsigned long hash;" NL);
+    if (cache_needs_buffer(q, data))
+    {
+        mstream_cstr(ms, "    char* buf;" NL);
+        mstream_cstr(ms, "    size_t buf_size;" NL);
+    }
+    mstream_cstr(ms, "    int used;" NL);
+    mstream_cstr(ms, "    int found;" NL);
+    if (q->return_arg)
+        mstream_fmt(ms, "    %S value;" NL, q->return_arg->type, data);
+    else if (q->return_name.len)
+        mstream_cstr(ms, "    int value;" NL);
+    for (a = q->in_args; a; a = a->next)
+        switch (cache_key_kind(a, data))
+        {
+            case CACHE_KEY_VALUE:
+                mstream_fmt(ms, "    %S key_%S;" NL, a->type, data, a->name, data);
+                break;
+            case CACHE_KEY_TEXT:
+                mstream_fmt(ms, "    const char* key_%S;" NL, a->name, data);
+                break;
+            case CACHE_KEY_VIEW:
+            case CACHE_KEY_BLOB:
+                mstream_fmt(ms, "    const char* key_%S;" NL, a->name, data);
+                mstream_fmt(ms, "    int key_%S_len;" NL, a->name, data);
+                break;
+        }
+    for (a = q->cb_args; a; a = a->next)
+        mstream_fmt(ms, "    %S col_%S;" NL, a->type, data, a->name, data);
+    mstream_cstr(ms, "};" NL NL);
+}
+
+static void
+write_cache_free_query(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    if (!q->cache_entries)
+        return;
+    mstream_cstr(ms, "    if (ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_cache)" NL "    {" NL);
+    if (cache_needs_buffer(q, data))
+    {
+        mstream_fmt (ms, "        for (i = 0; i != %d; ++i)" NL, cache_slots(q));
+        mstream_cstr(ms, "            if (ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_cache[i].buf)" NL);
+        mstream_fmt (ms, "                %S(ctx->", FREE(root->free, data));
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_cache[i].buf);" NL);
+    }
+    mstream_fmt (ms, "        %S(ctx->", FREE(root->free, data));
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_cache);" NL);
+    mstream_cstr(ms, "        ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_cache = NULL;" NL);
+    mstream_cstr(ms, "    }" NL);
+}
+
+/*!
+ * \brief Writes "ctx->cache_gen.<table>++;" for the first cached query of
+ * every table, so that each counter is only advanced once.
+ */
+static void
+write_cache_bump_table(struct mstream* ms, const struct root* root, const struct query* q, const char* indent, const char* data)
+{
+    if (q->cache_entries && !table_is_cached(root, q->table_name, q, data))
+        mstream_fmt(ms, "%sctx->cache_gen.%S++;" NL, indent, q->table_name, data);
+}
+
+static void
+write_cache_update_hook_table(struct mstream* ms, const struct root* root, const struct query* q, const char* data)
+{
+    if (q->cache_entries && !table_is_cached(root, q->table_name, q, data))
+    {
+        mstream_fmt(ms, "    if (sqlite3_stricmp(table, \"%S\") == 0)" NL, q->table_name, data);
+        mstream_fmt(ms, "        ctx->cache_gen.%S++;" NL, q->table_name, data);
+    }
+}
+
+/*!
+ * \brief Writes the helpers shared by all caches, and the functions that
+ * invalidate them. Must come after the context structure.
+ */
+static void
+write_cache_funcs(struct mstream* ms, const struct root* root, const char* data)
+{
+    const struct query_group* g;
+    const struct query* q;
+
+    /* FNV-1a */
+    mstream_fmt (ms, "static unsigned long" NL "%S_cache_hash(unsigned long h, const void* data, size_t len)" NL "{" NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    const unsigned char* p = (const unsigned char*)data;" NL);
+    mstream_cstr(ms, "    while (len--)" NL);
+    mstream_cstr(ms, "        h = ((h ^ *p++) * 16777619UL) & 0xFFFFFFFFUL;" NL);
+    mstream_cstr(ms, "    return h;" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    if (any_cache_needs_buffer(root, data))
+    {
+        mstream_fmt (ms, "static int" NL "%S_cache_reserve(char** buf, size_t* size, size_t needed)" NL "{" NL,
+            PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    if (*size >= needed)" NL);
+        mstream_cstr(ms, "        return 0;" NL);
+        mstream_cstr(ms, "    if (*buf)" NL);
+        mstream_fmt (ms, "        %S(*buf);" NL, FREE(root->free, data));
+        mstream_fmt (ms, "    *buf = (char*)%S(needed);" NL, MALLOC(root->malloc, data));
+        mstream_cstr(ms, "    *size = *buf ? needed : 0;" NL);
+        mstream_cstr(ms, "    return *buf ? 0 : -1;" NL);
+        mstream_cstr(ms, "}" NL NL);
+
+        mstream_fmt (ms, "static const char*" NL "%S_cache_copy(char** p, const void* src, size_t len)" NL "{" NL,
+            PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    char* dst = *p;" NL);
+        mstream_cstr(ms, "    if (len)" NL);
+        mstream_cstr(ms, "        memcpy(dst, src, len);" NL);
+        mstream_cstr(ms, "    dst[len] = '\\0';" NL);
+        mstream_cstr(ms, "    *p += len + 1;" NL);
+        mstream_cstr(ms, "    return dst;" NL);
+        mstream_cstr(ms, "}" NL NL);
+    }
+
+    mstream_fmt (ms, "static void" NL "%S_cache_free(struct %S* ctx)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    if (any_cache_needs_buffer(root, data))
+        mstream_cstr(ms, "    int i;" NL);
+    for (q = root->queries; q; q = q->next)
+        write_cache_free_query(ms, root, NULL, q, data);
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            write_cache_free_query(ms, root, g, q, data);
+    mstream_cstr(ms, "}" NL NL);
+
+    /* Forgets everything that was cached, e.g. after the schema changed or a
+     * transaction was rolled back */
+    mstream_fmt (ms, "static void" NL "%S_cache_clear(struct %S* ctx)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    if (root->split)
+    {
+        mstream_cstr(ms, "    if (ctx->split)" NL "    {" NL);
+        mstream_fmt (ms, "        struct %S* split_ctx = %S_split_acquire(ctx->split, 0);" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_fmt (ms, "        %S_cache_clear(split_ctx);" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "        %S_split_release(ctx->split, split_ctx);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        return;" NL);
+        mstream_cstr(ms, "    }" NL);
+    }
+    if (root->shards)
+    {
+        mstream_cstr(ms, "    if (ctx->shards)" NL "    {" NL);
+        mstream_cstr(ms, "        int shard;" NL);
+        mstream_fmt (ms, "        for (shard = 0; shard != %d; ++shard)" NL, root->shards);
+        mstream_fmt (ms, "            %S_cache_clear(ctx->shards[shard]);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        return;" NL);
+        mstream_cstr(ms, "    }" NL);
+    }
+    for (q = root->queries; q; q = q->next)
+        write_cache_bump_table(ms, root, q, "    ", data);
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            write_cache_bump_table(ms, root, q, "    ", data);
+    mstream_cstr(ms, "}" NL NL);
+
+    /* Catches writes that don't go through a generated query, e.g. from
+     * %function bodies, triggers or foreign key actions */
+    mstream_fmt (ms, "static void" NL "%S_cache_update_hook(void* user_data, int op, const char* db_name, const char* table, sqlite3_int64 rowid)" NL "{" NL,
+        PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S* ctx = (struct %S*)user_data;" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    (void)op; (void)db_name; (void)rowid;" NL);
+    for (q = root->queries; q; q = q->next)
+        write_cache_update_hook_table(ms, root, q, data);
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            write_cache_update_hook_table(ms, root, q, data);
+    mstream_cstr(ms, "}" NL NL);
+
+    /* Anything read during the transaction may have been undone */
+    mstream_fmt (ms, "static void" NL "%S_cache_rollback_hook(void* user_data)" NL "{" NL,
+        PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_cache_clear((struct %S*)user_data);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+}
+
+/*
+ * With cached queries, the body of a %function is moved into a function of
+ * its own, so that the wrapper can tell whether the body changed anything
+ * after it returned. sqlite3_total_changes() also counts the rows the update
+ * hook misses, so every cache is cleared if it moved. The body can't be
+ * trusted to have written only to tables that aren't cached.
+ */
+static void
+write_cached_function(struct mstream* ms, const struct root* root, const struct query_group* g, const struct function* f, const char* data)
+{
+    const struct arg* a;
+
+    mstream_cstr(ms, "static int" NL);
+    if (g)
+        mstream_fmt(ms, "%S_", g->name, data);
+    mstream_fmt(ms, "%S_body(struct %S* ctx", f->name, data, PREFIX(root->prefix, data));
+    for (a = f->args; a; a = a->next)
+        mstream_fmt(ms, ", %S %S", a->type, data, a->name, data);
+    mstream_fmt(ms, ")" NL "{" NL "%S" NL "}" NL NL, f->body, data);
+
+    mstream_cstr(ms, "static int" NL);
+    if (g)
+        mstream_fmt(ms, "%S_", g->name, data);
+    mstream_fmt(ms, "%S(struct %S* ctx", f->name, data, PREFIX(root->prefix, data));
+    for (a = f->args; a; a = a->next)
+        mstream_fmt(ms, ", %S %S", a->type, data, a->name, data);
+    mstream_cstr(ms, ")" NL "{" NL);
+    mstream_cstr(ms, "    int ret, changes;" NL);
+    write_split_route_function(ms, root, g, f, data);
+    write_shard_route_function(ms, root, g, f, data);
+    mstream_cstr(ms, "    changes = sqlite3_total_changes(ctx->db);" NL);
+    mstream_cstr(ms, "    ret = ");
+    if (g)
+        mstream_fmt(ms, "%S_", g->name, data);
+    mstream_fmt(ms, "%S_body(ctx", f->name, data);
+    for (a = f->args; a; a = a->next)
+        mstream_fmt(ms, ", %S", a->name, data);
+    mstream_cstr(ms, ");" NL);
+    mstream_cstr(ms, "    if (sqlite3_total_changes(ctx->db) != changes)" NL);
+    mstream_fmt (ms, "        %S_cache_clear(ctx);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return ret;" NL);
+    mstream_cstr(ms, "}" NL NL);
+}
+
+static void
+write_cache_alloc_query(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    if (!q->cache_entries)
+        return;
+    mstream_cstr(ms, "    ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_fmt (ms, "_cache = %S(sizeof(*ctx->", MALLOC(root->malloc, data));
+    write_func_name(ms, g, q, data);
+    mstream_fmt (ms, "_cache) * %d);" NL, cache_slots(q));
+    mstream_cstr(ms, "    if (ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_cache == NULL)" NL);
+    mstream_cstr(ms, "        goto cache_failed;" NL);
+    mstream_cstr(ms, "    memset(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_cache, 0, sizeof(*ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_fmt (ms, "_cache) * %d);" NL, cache_slots(q));
+}
+
+/*!
+ * \brief Allocates the cache tables of a new context. Jumps to "cache_failed"
+ * if an allocation fails.
+ */
+static void
+write_cache_alloc(struct mstream* ms, const struct root* root, const char* data)
+{
+    const struct query_group* g;
+    const struct query* q;
+    for (q = root->queries; q; q = q->next)
+        write_cache_alloc_query(ms, root, NULL, q, data);
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            write_cache_alloc_query(ms, root, g, q, data);
+}
+
+/*!
+ * \brief Writes "ctx-><query>_cache[(cache_hash + <offset>) & <mask>]"
+ */
+static void
+write_cache_slot(struct mstream* ms, const struct query_group* g, const struct query* q, const char* offset, const char* data)
+{
+    mstream_cstr(ms, "ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_fmt(ms, "_cache[(cache_hash + %s) & %d]", offset, cache_slots(q) - 1);
+}
+
+/*!
+ * \brief Writes the body of a cached select-first or exists query. The
+ * arguments are hashed and looked up first. On a miss, the query runs as
+ * usual, but the row is decoded into a cache entry, which is then replayed
+ * the same way as a hit.
+ */
+static void
+write_cached_query_body(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    const struct arg* a;
+    int buffered = cache_needs_buffer(q, data);
+    char evict_expr[48];
+    int i;
+
+    mstream_cstr(ms, "    int ret, cache_i;" NL);
+    mstream_cstr(ms, "    unsigned long cache_hash = 2166136261UL;" NL);
+    if (buffered)
+    {
+        mstream_cstr(ms, "    size_t cache_size = 0;" NL);
+        mstream_cstr(ms, "    char* cache_p;" NL);
+    }
+    mstream_cstr(ms, "    ");
+    write_cache_entry_struct_name(ms, root, g, q, data);
+    mstream_cstr(ms, "* cache_e;" NL);
+    write_split_route_query(ms, root, g, q, data);
+    write_shard_route_query(ms, root, g, q, data);
+
+    /* Look up */
+    for (a = q->in_args; a; a = a->next)
+        switch (cache_key_kind(a, data))
+        {
+            case CACHE_KEY_VALUE:
+                mstream_fmt(ms, "    cache_hash = %S_cache_hash(cache_hash, &%S, sizeof %S);" NL,
+                    PREFIX(root->prefix, data), a->name, data, a->name, data);
+                break;
+            case CACHE_KEY_TEXT:
+                mstream_fmt(ms, "    if (%S)" NL, a->name, data);
+                mstream_fmt(ms, "        cache_hash = %S_cache_hash(cache_hash, %S, strlen(%S) + 1);" NL,
+                    PREFIX(root->prefix, data), a->name, data, a->name, data);
+                break;
+            case CACHE_KEY_VIEW:
+                mstream_fmt(ms, "    cache_hash = %S_cache_hash(cache_hash, %S.data, (size_t)%S.len);" NL,
+                    PREFIX(root->prefix, data), a->name, data, a->name, data);
+                mstream_fmt(ms, "    cache_hash = %S_cache_hash(cache_hash, &%S.len, sizeof %S.len);" NL,
+                    PREFIX(root->prefix, data), a->name, data, a->name, data);
+                break;
+            case CACHE_KEY_BLOB:
+                mstream_fmt(ms, "    cache_hash = %S_cache_hash(cache_hash, %S, (size_t)%S_len);" NL,
+                    PREFIX(root->prefix, data), a->name, data, a->name, data);
+                mstream_fmt(ms, "    cache_hash = %S_cache_hash(cache_hash, &%S_len, sizeof %S_len);" NL,
+                    PREFIX(root->prefix, data), a->name, data, a->name, data);
+                break;
+        }
+    mstream_fmt (ms, "    for (cache_i = 0; cache_i != %d; ++cache_i)" NL "    {" NL, cache_window(q));
+    mstream_cstr(ms, "        cache_e = &");
+    write_cache_slot(ms, g, q, "cache_i", data);
+    mstream_cstr(ms, ";" NL);
+    mstream_fmt (ms, "        if (!cache_e->used || cache_e->hash != cache_hash || cache_e->gen != ctx->cache_gen.%S)" NL,
+        q->table_name, data);
+    mstream_cstr(ms, "            continue;" NL);
+    for (a = q->in_args; a; a = a->next)
+        switch (cache_key_kind(a, data))
+        {
+            case CACHE_KEY_VALUE:
+                mstream_fmt(ms, "        if (cache_e->key_%S != %S)" NL, a->name, data, a->name, data);
+                mstream_cstr(ms, "            continue;" NL);
+                break;
+            case CACHE_KEY_TEXT:
+                mstream_fmt(ms, "        if ((cache_e->key_%S == NULL) != (%S == NULL) || (%S && strcmp(cache_e->key_%S, %S) != 0))" NL,
+                    a->name, data, a->name, data, a->name, data, a->name, data, a->name, data);
+                mstream_cstr(ms, "            continue;" NL);
+                break;
+            case CACHE_KEY_VIEW:
+                mstream_fmt(ms, "        if (cache_e->key_%S_len != (int)%S.len || (%S.len && memcmp(cache_e->key_%S, %S.data, (size_t)%S.len) != 0))" NL,
+                    a->name, data, a->name, data, a->name, data, a->name, data, a->name, data, a->name, data);
+                mstream_cstr(ms, "            continue;" NL);
+                break;
+            case CACHE_KEY_BLOB:
+                mstream_fmt(ms, "        if (cache_e->key_%S_len != %S_len || (%S_len && memcmp(cache_e->key_%S, %S, (size_t)%S_len) != 0))" NL,
+                    a->name, data, a->name, data, a->name, data, a->name, data, a->name, data, a->name, data);
+                mstream_cstr(ms, "            continue;" NL);
+                break;
+        }
+    mstream_cstr(ms, "        goto cache_hit;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    /* Miss: run the query */
+    write_sqlite_prepare_stmt(ms, root, g, q, "", data);
+    write_sqlite_bind_args(ms, root, g, q, "", data);
+
+    mstream_cstr(ms, "    /* Replace a free or stale entry in the probe window, otherwise evict one */" NL);
+    sprintf(evict_expr, "((cache_hash >> 8) & %d)", cache_window(q) - 1);
+    mstream_cstr(ms, "    cache_e = &");
+    write_cache_slot(ms, g, q, evict_expr, data);
+    mstream_cstr(ms, ";" NL);
+    mstream_fmt (ms, "    for (cache_i = 0; cache_i != %d; ++cache_i)" NL, cache_window(q));
+    mstream_cstr(ms, "        if (!");
+    write_cache_slot(ms, g, q, "cache_i", data);
+    mstream_cstr(ms, ".used ||" NL "            ");
+    write_cache_slot(ms, g, q, "cache_i", data);
+    mstream_fmt (ms, ".gen != ctx->cache_gen.%S)" NL, q->table_name, data);
+    mstream_cstr(ms, "        {" NL);
+    mstream_cstr(ms, "            cache_e = &");
+    write_cache_slot(ms, g, q, "cache_i", data);
+    mstream_cstr(ms, ";" NL);
+    mstream_cstr(ms, "            break;" NL);
+    mstream_cstr(ms, "        }" NL);
+    mstream_cstr(ms, "    cache_e->used = 0;" NL NL);
+
+    write_busy_label(ms, root, "next_step");
+    mstream_cstr(ms, "    ret = sqlite3_step(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, ");" NL);
+    mstream_cstr(ms, "    switch (ret)" NL "    {" NL);
+    write_busy_case(ms, root, "next_step", 1);
+    write_interrupt_case(ms, root, g, q, "", data);
+    mstream_cstr(ms, "        case SQLITE_ROW:" NL);
+    mstream_cstr(ms, "            cache_e->found = 1;" NL);
+    if (q->return_name.len)
+    {
+        mstream_fmt(ms, "            cache_e->value = %ssqlite3_column_%s(ctx->",
+            q->return_arg ? q->return_arg->cast_from_sql : "",
+            q->return_arg ? q->return_arg->sql_type : "int");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, ", 0);" NL);
+    }
+    for (a = q->cb_args, i = q->return_name.len ? 1 : 0; a; a = a->next, i++)
+    {
+        if (strcmp(a->sql_type, "text") == 0)
+        {
+            mstream_cstr(ms, "            cache_size += (size_t)sqlite3_column_bytes(ctx->");
+            write_func_name(ms, g, q, data);
+            mstream_fmt(ms, ", %d) + 1;" NL, i);
+            continue;
+        }
+        mstream_fmt(ms, "            cache_e->col_%S = ", a->name, data);
+        write_sqlite_column_value(ms, g, q, "", a, i, data);
+        mstream_cstr(ms, ";" NL);
+    }
+    mstream_cstr(ms, "            break;" NL);
+    mstream_cstr(ms, "        case SQLITE_DONE:" NL);
+    mstream_cstr(ms, "            cache_e->found = 0;" NL);
+    mstream_cstr(ms, "            break;" NL);
+    mstream_cstr(ms, "        default:" NL);
+    mstream_fmt (ms, "            %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+        LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "            sqlite3_reset(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, ");" NL);
+    mstream_cstr(ms, "            return -1;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    /* Copy out everything that points into the statement or the caller's memory */
+    if (buffered)
+    {
+        for (a = q->in_args; a; a = a->next)
+            switch (cache_key_kind(a, data))
+            {
+                case CACHE_KEY_VALUE: break;
+                case CACHE_KEY_TEXT:
+                    mstream_fmt(ms, "    cache_size += %S ? strlen(%S) + 1 : 0;" NL, a->name, data, a->name, data);
+                    break;
+                case CACHE_KEY_VIEW:
+                    mstream_fmt(ms, "    cache_size += (size_t)%S.len + 1;" NL, a->name, data);
+                    break;
+                case CACHE_KEY_BLOB:
+                    mstream_fmt(ms, "    cache_size += (size_t)%S_len + 1;" NL, a->name, data);
+                    break;
+            }
+        mstream_fmt (ms, "    if (%S_cache_reserve(&cache_e->buf, &cache_e->buf_size, cache_size) != 0)" NL "    {" NL,
+            PREFIX(root->prefix, data));
+        mstream_fmt (ms, "        %S(\"Failed to allocate cache entry\\n\");" NL, LOG_ERR(root->log_err, data));
+        mstream_cstr(ms, "        sqlite3_reset(ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, ");" NL);
+        mstream_cstr(ms, "        return -1;" NL);
+        mstream_cstr(ms, "    }" NL);
+        mstream_cstr(ms, "    cache_p = cache_e->buf;" NL);
+    }
+    for (a = q->in_args; a; a = a->next)
+        switch (cache_key_kind(a, data))
+        {
+            case CACHE_KEY_VALUE:
+                mstream_fmt(ms, "    cache_e->key_%S = %S;" NL, a->name, data, a->name, data);
+                break;
+            case CACHE_KEY_TEXT:
+                mstream_fmt(ms, "    cache_e->key_%S = %S ? %S_cache_copy(&cache_p, %S, strlen(%S)) : NULL;" NL,
+                    a->name, data, a->name, data, PREFIX(root->prefix, data), a->name, data, a->name, data);
+                break;
+            case CACHE_KEY_VIEW:
+                mstream_fmt(ms, "    cache_e->key_%S = %S_cache_copy(&cache_p, %S.data, (size_t)%S.len);" NL,
+                    a->name, data, PREFIX(root->prefix, data), a->name, data, a->name, data);
+                mstream_fmt(ms, "    cache_e->key_%S_len = (int)%S.len;" NL, a->name, data, a->name, data);
+                break;
+            case CACHE_KEY_BLOB:
+                mstream_fmt(ms, "    cache_e->key_%S = %S_cache_copy(&cache_p, %S, (size_t)%S_len);" NL,
+                    a->name, data, PREFIX(root->prefix, data), a->name, data, a->name, data);
+                mstream_fmt(ms, "    cache_e->key_%S_len = %S_len;" NL, a->name, data, a->name, data);
+                break;
+        }
+    for (a = q->cb_args, i = q->return_name.len ? 1 : 0; a; a = a->next, i++)
+    {
+        if (strcmp(a->sql_type, "text") != 0)
+            continue;
+        mstream_cstr(ms, "    if (cache_e->found && sqlite3_column_text(ctx->");
+        write_func_name(ms, g, q, data);
+        mstream_fmt (ms, ", %d) != NULL)" NL, i);
+        mstream_fmt (ms, "        cache_e->col_%S = %S_cache_copy(&cache_p, sqlite3_column_text(ctx->",
+            a->name, data, PREFIX(root->prefix, data));
+        write_func_name(ms, g, q, data);
+        mstream_fmt (ms, ", %d), (size_t)sqlite3_column_bytes(ctx->", i);
+        write_func_name(ms, g, q, data);
+        mstream_fmt (ms, ", %d));" NL, i);
+        mstream_cstr(ms, "    else" NL);
+        mstream_fmt (ms, "        cache_e->col_%S = %s;" NL, a->name, data, a->nullable ? a->null_value : "NULL");
+    }
+    mstream_cstr(ms, "    sqlite3_reset(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, ");" NL);
+    mstream_cstr(ms, "    cache_e->hash = cache_hash;" NL);
+    mstream_fmt (ms, "    cache_e->gen = ctx->cache_gen.%S;" NL, q->table_name, data);
+    mstream_cstr(ms, "    cache_e->used = 1;" NL NL);
+
+    /* Replay */
+    mstream_cstr(ms, "cache_hit:" NL);
+    if (q->type == QUERY_EXISTS)
+    {
+        mstream_cstr(ms, "    return cache_e->found;" NL);
+        return;
+    }
+    mstream_cstr(ms, "    if (!cache_e->found)" NL);
+    mstream_cstr(ms, "        return -1;" NL);
+    if (q->return_arg)
+        mstream_fmt(ms, "    *%S = cache_e->value;" NL, q->return_arg->name, data);
+    if (q->cb_args)
+    {
+        mstream_cstr(ms, "    ret = on_row(" NL);
+        for (a = q->cb_args; a; a = a->next)
+            mstream_fmt(ms, "        cache_e->col_%S," NL, a->name, data);
+        mstream_cstr(ms, "        user_data);" NL);
+        if (q->return_name.len)
+            mstream_cstr(ms, "    if (ret < 0)" NL "        return ret;" NL);
+        else
+            mstream_cstr(ms, "    return ret;" NL);
+    }
+    if (q->return_arg)
+        mstream_cstr(ms, "    return 0;" NL);
+    else if (q->return_name.len)
+        mstream_cstr(ms, "    return cache_e->value;" NL);
+}
+
+static void
+write_migration_sql_stmts(struct mstream* ms, const struct root* root, const struct migration* m, const char* data, const char* type)
+{
+    for (; m; m = m->next)
+    {
+        int p;
+        mstream_fmt(ms, "static const char* %S_%s%d =" NL, PREFIX(root->prefix, data), type, m->version);
+        mstream_cstr(ms, "    \"");
+        for (p = 0; p != m->sql.len; ++p)
+        {
+            if (data[m->sql.off + p] == '\n')
+            {
+                if (p + 1 < m->sql.len)
+                    mstream_cstr(ms, "\\n\"" NL "    \"");
+            }
+            else if (data[m->sql.off + p] != '\r')
+            {
+                char c = data[m->sql.off + p];
+                if (c == '"')
+                    mstream_putc(ms, '\\');
+                else if (c == '\\')
+                    mstream_putc(ms, '\\');
+                mstream_putc(ms, c);
+            }
+        }
+        mstream_cstr(ms, "\";" NL NL);
+    }
+}
+
+static void
+write_run_sql_stmts_func(struct mstream* ms, const struct root* root, const char* data)
+{
+    mstream_cstr(ms, "static int run_sqlite3_sql(sqlite3* db, const char* sql)" NL "{" NL);
+    mstream_cstr(ms, "    int ret;" NL);
+    mstream_cstr(ms, "    int sql_len;" NL);
+    mstream_cstr(ms, "    const char* sql_next;" NL);
+    mstream_cstr(ms, "    sqlite3_stmt* stmt;" NL NL);
+
+    mstream_cstr(ms, "    sql_len = (int)strlen(sql);" NL NL);
+
+    mstream_cstr(ms, "next_step:" NL);
+    mstream_cstr(ms, "    ret = sqlite3_prepare_v2(db, sql, sql_len, &stmt, &sql_next);" NL);
+    mstream_cstr(ms, "    if (ret != SQLITE_OK)" NL "    {" NL);
+    mstream_fmt (ms, "        %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(db));" NL, LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "        goto prepare_failed;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    write_busy_label(ms, root, "retry_step");
+    mstream_cstr(ms, "    switch (ret = sqlite3_step(stmt))" NL "    {" NL);
+    write_busy_case(ms, root, "retry_step", 0);
+    mstream_cstr(ms, "        case SQLITE_ROW:" NL);
+    mstream_cstr(ms, "        case SQLITE_DONE:" NL);
+    mstream_cstr(ms, "            sql_len -= (int)(sql_next - sql);" NL);
+    mstream_cstr(ms, "            sql = sql_next;" NL);
+    mstream_cstr(ms, "            for (; sql_len && isspace(*sql); ++sql, --sql_len) {}" NL);
+    mstream_cstr(ms, "            if (sql_len <= 0)" NL);
+    mstream_cstr(ms, "                break;" NL);
+    mstream_cstr(ms, "            sqlite3_finalize(stmt);" NL);
+    mstream_cstr(ms, "            goto next_step;" NL);
+    mstream_cstr(ms, "        default:" NL);
+    mstream_fmt (ms, "            %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(db));" NL, LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "            goto exec_failed;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    mstream_cstr(ms, "    sqlite3_finalize(stmt);" NL);
+    mstream_cstr(ms, "    return 0;" NL NL);
+
+    mstream_cstr(ms, "exec_failed    : sqlite3_finalize(stmt);" NL);
+    mstream_cstr(ms, "prepare_failed : return -1;" NL);
+    mstream_cstr(ms, "}" NL NL);
+}
+
+static void
+write_version_func(struct mstream* ms, const struct root* root, const char* data)
+{
+    mstream_fmt (ms, "static int %S_version(struct %S* ctx)" NL "{" NL, PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int ret, version = 0;" NL);
+    mstream_cstr(ms, "    sqlite3_stmt* stmt;" NL NL);
+    write_split_route_cstr(ms, root, "version", "", 1, SPLIT_CALL, data);
+    if (root->shards)
+    {
+        /* The schema is only as new as its oldest shard */
+        mstream_cstr(ms, "    if (ctx->shards)" NL "    {" NL);
+        mstream_cstr(ms, "        int shard;" NL);
+        mstream_fmt (ms, "        for (shard = 0; shard != %d; ++shard)" NL "        {" NL, root->shards);
+        mstream_fmt (ms, "            if ((ret = %S_version(ctx->shards[shard])) < 0)" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "                return -1;" NL);
+        mstream_cstr(ms, "            if (shard == 0 || ret < version)" NL);
+        mstream_cstr(ms, "                version = ret;" NL);
+        mstream_cstr(ms, "        }" NL);
+        mstream_cstr(ms, "        return version;" NL);
+        mstream_cstr(ms, "    }" NL NL);
+    }
+
+    mstream_cstr(ms, "    ret = sqlite3_prepare_v2(ctx->db, \"PRAGMA user_version;\", -1, &stmt, NULL);" NL);
+    mstream_cstr(ms, "    if (ret != SQLITE_OK)" NL "    {" NL);
+    mstream_fmt (ms, "        %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL, LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "        return -1;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    mstream_cstr(ms, "    ret = sqlite3_step(stmt);" NL);
+    mstream_cstr(ms, "    if (ret != SQLITE_ROW)" NL "    {" NL);
+    mstream_fmt (ms, "        %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL, LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "        sqlite3_finalize(stmt);" NL);
+    mstream_cstr(ms, "        return -1;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    mstream_cstr(ms, "    version = sqlite3_column_int(stmt, 0);" NL);
+    mstream_cstr(ms, "    sqlite3_finalize(stmt);" NL);
+    mstream_cstr(ms, "    return version;" NL);
+    mstream_cstr(ms, "}" NL NL);
+}
+
+static void
+write_downgrade_forward_compat_func(struct mstream* ms, const struct root* root, const char* data)
+{
+    mstream_fmt(ms, "static int %S_downgrade_forward_compat(sqlite3* db)" NL "{" NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int ret, i;" NL);
+    mstream_cstr(ms, "    sqlite3_stmt* stmt;" NL);
+    mstream_cstr(ms, "    const char* str;" NL);
+    mstream_cstr(ms, "    void* tmp;" NL);
+    mstream_cstr(ms, "    char** sql = NULL;" NL);
+    mstream_cstr(ms, "    int sql_num = 0;" NL);
+    mstream_cstr(ms, "    int success = -1;" NL);
+    mstream_fmt (ms, "    ret = sqlite3_prepare_v2(db, \"SELECT sql FROM %S_downgrades WHERE version >= %d ORDER BY version DESC;\", -1, &stmt, NULL);" NL,
+        PREFIX(root->prefix, data), root->downgrade ? root->downgrade->version + 1 : 0);
+    mstream_cstr(ms, "    if (ret != SQLITE_OK)" NL "    {" NL);
+    mstream_fmt (ms, "        %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(db));" NL,
+        LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_fmt (ms, "        return -1;" NL);
+    mstream_fmt (ms, "    }" NL NL);
+
+    mstream_cstr(ms, "next_step:" NL);
+    mstream_cstr(ms, "    ret = sqlite3_step(stmt);" NL);
+    mstream_cstr(ms, "    switch (ret)" NL "    {" NL);
+    mstream_cstr(ms, "        case SQLITE_ROW:" NL);
+    mstream_cstr(ms, "            tmp = realloc(sql, sizeof(char*) * (size_t)(sql_num + 1));" NL);
+    mstream_cstr(ms, "            if (tmp == NULL) goto done;" NL);
+    mstream_cstr(ms, "            sql = tmp;" NL NL);
+    mstream_cstr(ms, "            str = (const char*)sqlite3_column_text(stmt, 0);" NL);
+    mstream_cstr(ms, "            sql[sql_num] = malloc(strlen(str) + 1);" NL);
+    mstream_cstr(ms, "            if (sql[sql_num] == NULL) goto done;" NL);
+    mstream_cstr(ms, "            strcpy(sql[sql_num++], str);" NL NL);
+    mstream_cstr(ms, "            goto next_step;" NL);
+    write_busy_case(ms, root, "next_step", 0);
+    mstream_cstr(ms, "        case SQLITE_DONE:" NL);
+    mstream_cstr(ms, "            for (i = 0; i != sql_num; ++i)" NL);
+    mstream_cstr(ms, "            {" NL);
+    mstream_cstr(ms, "                if (run_sqlite3_sql(db, sql[i]) != 0)" NL);
+    mstream_cstr(ms, "                    goto done;" NL);
+    mstream_cstr(ms, "            }" NL);
+    mstream_cstr(ms, "            success = 0;" NL);
+    mstream_cstr(ms, "            goto done;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    mstream_fmt (ms, "    %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(db));" NL,
+        LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "done:" NL);
+    mstream_cstr(ms, "    for (i = 0; i != sql_num; ++i)" NL);
+    mstream_cstr(ms, "        if (sql[i])" NL);
+    mstream_cstr(ms, "            free(sql[i]);" NL);
+    mstream_cstr(ms, "    if (sql)" NL);
+    mstream_cstr(ms, "        free(sql);" NL);
+    mstream_cstr(ms, "    sqlite3_reset(stmt);" NL);
+    mstream_cstr(ms, "    return success;" NL);
+    mstream_cstr(ms, "}" NL NL);
+}
+
+static void
+write_migration_body(struct mstream* ms, const struct root* root, const char* data, char reinit_db, char forwards_compat)
+{
+    int max_version = 0;
+    struct migration* m;
+
+    /* List is already sorted */
+    for (m = root->upgrade; m; m = m->next)
+        max_version = m->version;
+
+    mstream_cstr(ms, "    int ret;" NL);
+    mstream_cstr(ms, "    int version;" NL);
+    mstream_cstr(ms, "    char* error;" NL);
+    if (!reinit_db)
+        mstream_cstr(ms, "    char buf[sizeof(\"PRAGMA user_version=+2147483648;\")];" NL NL);
+    if (reinit_db)
+    {
+        write_split_route_cstr(ms, root, "reinit", "", 0, SPLIT_CALL, data);
+        write_shard_route_cstr(ms, root, "reinit", "", data);
+    }
+    else
+    {
+        write_split_route_cstr(ms, root, "migrate_to", ", target_version", 0, SPLIT_CALL, data);
+        write_shard_route_cstr(ms, root, "migrate_to", ", target_version", data);
+    }
+    /* Schema changes don't invoke the update hook */
+    if (has_cached_queries(root))
+        mstream_fmt(ms, "    %S_cache_clear(ctx);" NL, PREFIX(root->prefix, data));
+
+    /* Ensure requested version is within range */
+    if (!reinit_db)
+    {
+        mstream_fmt (ms, "    if (target_version < 0 || target_version > %d)" NL "    {" NL, max_version);
+        mstream_fmt (ms, "        %S(\"Invalid version requested for migration: %%d. Support versions 0-%d\\n\", target_version);" NL,
+            LOG_ERR(root->log_err, data), max_version);
+        mstream_cstr(ms, "        return -1;" NL);
+        mstream_cstr(ms, "    }" NL NL);
+    }
+
+    /* Get current db version */
+    mstream_fmt (ms, "    version = %S_version(ctx);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (version < 0)" NL);
+    mstream_cstr(ms, "        return -1;" NL NL);
+
+    /* Begin transaction */
+    mstream_cstr(ms, "    ret = sqlite3_exec(ctx->db, \"BEGIN TRANSACTION;\", NULL, NULL, &error);" NL);
+    mstream_cstr(ms, "    if (ret != SQLITE_OK)" NL "    {" NL);
+    mstream_fmt (ms, "        %S(ret, error, sqlite3_errmsg(ctx->db));" NL, LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "        sqlite3_free(error);" NL);
+    mstream_cstr(ms, "        return -1;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    /* Downgrade code */
+    mstream_cstr(ms, "    switch (version)" NL "    {" NL);
+    mstream_cstr(ms, "        default:" NL);
+    if (forwards_compat)
+    {
+        mstream_fmt(ms, "            if (%S_downgrade_forward_compat(ctx->db) != 0)" NL,
+            PREFIX(root->prefix, data));
+        mstream_fmt(ms, "                goto migration_failed;" NL);
+        mstream_fmt(ms, "            version = %d;" NL,
+            root->downgrade ? root->downgrade->version + 1 : 0);
+        mstream_cstr(ms, "            /* fallthrough */" NL);
+    }
+    else
+    {
+        mstream_fmt(ms, "            %S(\"Database was created by a newer version of the software! "
+            "Can't downgrade, because forwards compatibility was disabled in sqlgen.\");" NL,
+            LOG_ERR(root->log_err, data));
+        mstream_cstr(ms, "            goto migration_failed;" NL);
+    }
+
+    for (m = root->downgrade; m; m = m->next)
+    {
+        mstream_fmt (ms, "        case %d:" NL, m->version + 1);
+        if (!reinit_db)
+        {
+            mstream_cstr(ms, "            if (version == target_version)" NL);
+            mstream_cstr(ms, "                break;" NL);
+        }
+        mstream_fmt (ms, "            if (run_sqlite3_sql(ctx->db, %S_downgrade%d) != 0)" NL,
+            PREFIX(root->prefix, data), m->version);
+        mstream_cstr(ms, "                goto migration_failed;" NL);
+
+        if (forwards_compat && m->version == 0)
+        {
+            mstream_fmt (ms, "            if (run_sqlite3_sql(ctx->db, \"DROP TABLE IF EXISTS %S_downgrades;\") != 0)" NL,
+                PREFIX(root->prefix, data));
+            mstream_cstr(ms, "                goto migration_failed;" NL);
+        }
+
+        mstream_fmt (ms, "            version = %d;" NL, m->version);
+    }
+    mstream_cstr(ms, "        case 0:" NL);
+    mstream_cstr(ms, "            break;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    /* Upgrade code */
+    mstream_cstr(ms, "    switch (version)" NL "    {" NL);
+    for (m = root->upgrade; m; m = m->next)
+    {
+        mstream_fmt(ms, "        case %d:" NL, m->version - 1);
+        if (!reinit_db)
+        {
+            mstream_cstr(ms, "            if (version == target_version)" NL);
+            mstream_cstr(ms, "                break;" NL);
+        }
+
+        /* The first migration also includes forward-compat code */
+        if (forwards_compat && m->version == 1)
+        {
+            struct migration* m2;
+            mstream_cstr(ms, "            if (run_sqlite3_sql(ctx->db," NL);
+            mstream_fmt (ms, "                \"CREATE TABLE IF NOT EXISTS %S_downgrades (\\n\"" NL,
+                PREFIX(root->prefix, data));
+            mstream_cstr(ms, "                \"    version INTEGER PRIMARY KEY NOT NULL,\\n\"" NL);
+            mstream_cstr(ms, "                \"    sql TEXT NOT NULL);\\n\"");
+
+            m2 = root->downgrade;
+            while (m2)
+            {
+                int p;
+
+                mstream_fmt(ms, NL "                "
+                    "\"INSERT OR IGNORE INTO %S_downgrades (version, sql) "
+                    "VALUES (%d, '",
+                    PREFIX(root->prefix, data), m2->version);
+
+                p = 0;
+                while (p != m2->sql.len)
+                {
+                    while (isspace(data[m2->sql.off + p]))
+                        p++;
+
+                    mstream_cstr(ms, "\"" NL "                    \"");
+                    while (p != m2->sql.len)
+                    {
+                        char c = data[m2->sql.off + p++];
+                        /* Escape SQL for insertion into table */
+                        if (c == '\'')
+                            mstream_putc(ms, '\'');
+                        /* Escape SQL for C string */
+                        else if (c == '"')
+                            mstream_putc(ms, '\\');
+                        else if (c == '\\')
+                            mstream_cstr(ms, "\\\\\\");
+                        else if (c == '\r')
+                            continue;
+                        else if (c == '\n')
+                        {
+                            mstream_cstr(ms, "\\\\n");
+                            break;
+                        }
+                        mstream_putc(ms, c);
+                    }
+                }
+
+                mstream_cstr(ms, "');\\n\"");
+
+                m2 = m2->next;
+            }
+            //mstream_cstr(ms, NL "                    \"');\"");
+            mstream_cstr(ms, ") != 0)" NL);
+            mstream_cstr(ms, "                goto migration_failed;" NL);
+        }
+        mstream_fmt(ms, "            if (run_sqlite3_sql(ctx->db, %S_upgrade%d) != 0)" NL, PREFIX(root->prefix, data), m->version);
+        mstream_cstr(ms, "                goto migration_failed;" NL);
+        mstream_fmt (ms, "            version = %d;" NL, m->version);
+    }
+    mstream_fmt (ms, "        case %d: break;" NL, max_version);
+    mstream_cstr(ms, "        default:" NL);
+    mstream_fmt(ms, "            %S(\"Failed to upgrade db: Unknown version %%d\\n\", version);" NL, LOG_ERR(root->log_err, data));
+    mstream_cstr(ms, "            goto migration_failed;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    /* Ensure that we have reached the target version */
+    if (!reinit_db)
+    {
+        mstream_cstr(ms, "    if (version != target_version)" NL "    {" NL);
+        mstream_fmt (ms, "        %S(\"Failed to migrate db to version %%d. Migration stopped at version %%d\", target_version, version);" NL,
+            LOG_ERR(root->log_err, data));
+        mstream_cstr(ms, "        goto migration_failed;" NL);
+        mstream_cstr(ms, "    }" NL NL);
+    }
+
+    /* Write new version to db */
+    if (reinit_db)
+        mstream_fmt(ms, "    ret = sqlite3_exec(ctx->db, \"PRAGMA user_version=%d;\", NULL, NULL, &error);" NL, max_version);
+    else
+    {
+        mstream_cstr(ms, "    sprintf(buf, \"PRAGMA user_version=%d;\", target_version);" NL);
+        mstream_cstr(ms, "    ret = sqlite3_exec(ctx->db, buf, NULL, NULL, &error);" NL);
+    }
+    mstream_cstr(ms, "    if (ret != SQLITE_OK)" NL "    {" NL);
+    mstream_fmt (ms, "        %S(ret, error, sqlite3_errmsg(ctx->db));" NL, LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "        sqlite3_free(error);" NL);
+    mstream_cstr(ms, "        goto migration_failed;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    /* Commit transaction */
+    mstream_cstr(ms, "    ret = sqlite3_exec(ctx->db, \"COMMIT TRANSACTION;\", NULL, NULL, &error);" NL);
+    mstream_cstr(ms, "    if (ret != SQLITE_OK)" NL "    {" NL);
+    mstream_fmt (ms, "        %S(ret, error, sqlite3_errmsg(ctx->db));" NL, LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "        sqlite3_free(error);" NL);
+    mstream_cstr(ms, "        goto migration_failed;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    mstream_cstr(ms, "    return 0;" NL NL);
+
+    /* Abort transaction */
+    mstream_cstr(ms, "migration_failed:" NL);
+    mstream_cstr(ms, "    ret = sqlite3_exec(ctx->db, \"ROLLBACK TRANSACTION;\", NULL, NULL, &error);" NL);
+    mstream_cstr(ms, "    if (ret != SQLITE_OK)" NL "    {" NL);
+    mstream_fmt (ms, "        %S(ret, error, sqlite3_errmsg(ctx->db));" NL, LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "        sqlite3_free(error);" NL);
+    mstream_cstr(ms, "    }" NL);
+    mstream_cstr(ms, "    return -1;" NL);
+}
+
+static void
+write_migration_to_func(struct mstream* ms, const struct root* root, const char* data, char forwards_compat)
+{
+    mstream_fmt(ms, "static int %S_migrate_to(struct %S* ctx, int target_version)" NL "{" NL, PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    write_migration_body(ms, root, data, 0, forwards_compat);
+    mstream_cstr(ms, "}" NL NL);
+}
+
+static void
+write_upgrade_func(struct mstream* ms, const struct root* root, const char* data)
+{
+    int max_version = 0;
+    struct migration* m = root->upgrade;
+    for (; m; m = m->next)  /* List is already sorted */
+        max_version = m->version;
+
+    mstream_fmt(ms, "static int %S_upgrade(struct %S* ctx)" NL "{" NL, PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    return %S_migrate_to(ctx, %d);" NL, PREFIX(root->prefix, data), max_version);
+    mstream_cstr(ms, "}" NL NL);
+}
+
+static void
+write_reinit_func(struct mstream* ms, const struct root* root, const char* data, char forwards_compat)
+{
+    mstream_fmt(ms, "static int %S_reinit(struct %S* ctx)" NL "{" NL, PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    write_migration_body(ms, root, data, 1, forwards_compat);
+    mstream_cstr(ms, "}" NL NL);
+}
+
+static int
+has_pragmas(const struct root* root)
+{
+    return root->pragmas != NULL || root->profile_layer != PROFILE_NONE;
+}
+
+/*!
+ * \brief Writes the table of PRAGMA statements executed on every new
+ * connection. The profile's PRAGMAs come first, except for those replaced by
+ * a %pragma of the same name, followed by all %pragma directives in the
+ * order they were written.
+ */
+static void
+write_pragma_table(struct mstream* ms, const struct root* root, const char* data)
+{
+    const struct pragma* pr;
+    int i;
+
+    mstream_fmt(ms, "static const char* %S_pragmas[] = {" NL, PREFIX(root->prefix, data));
+    for (i = 0; profiles[root->profile].pragmas[i][0]; ++i)
+    {
+        for (pr = root->pragmas; pr; pr = pr->next)
+            if (cstr_eq_str(profiles[root->profile].pragmas[i][0], pr->name, data))
+                break;
+        if (pr == NULL)
+            mstream_fmt(ms, "    \"PRAGMA %s=%s;\"," NL,
+                profiles[root->profile].pragmas[i][0],
+                profiles[root->profile].pragmas[i][1]);
+    }
+    for (pr = root->pragmas; pr; pr = pr->next)
+        mstream_fmt(ms, "    \"PRAGMA %S=%S;\"," NL, pr->name, data, pr->value, data);
+    mstream_cstr(ms, "};" NL NL);
+}
+
+/*
+ * Atomic operations and thread-local storage used by the generated code.
+ * Everything operates on 64-bit integers, which is what the Interlocked
+ * functions on Windows support. Compare-and-swap is needed by the pool and
+ * the read/write split, exchange only by the async executor, and add (which
+ * returns the previous value) by the executor and the split.
+ */
+static void
+write_atomics(struct mstream* ms, const struct root* root, const char* data)
+{
+    static const char* impl[2][5] = {
+        {
+            "_InterlockedCompareExchange64(p, 0, 0)",
+            "_InterlockedExchange64(p, value)",
+            "_InterlockedCompareExchange64(p, desired, expected) == expected",
+            "_InterlockedExchange64(p, value)",
+            "_InterlockedExchangeAdd64(p, value)"
+        },
+        {
+            "__atomic_load_n(p, __ATOMIC_ACQUIRE)",
+            "__atomic_store_n(p, value, __ATOMIC_RELEASE)",
+            "__atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)",
+            "__atomic_exchange_n(p, value, __ATOMIC_ACQ_REL)",
+            "__atomic_fetch_add(p, value, __ATOMIC_ACQ_REL)"
+        }
+    };
+    int i;
+
+    for (i = 0; i != 2; ++i)
+    {
+        if (i == 0)
+        {
+            mstream_cstr(ms, "#if defined(_MSC_VER)" NL);
+            mstream_cstr(ms, "#include <intrin.h>" NL);
+            mstream_fmt (ms, "#define %S_THREAD_LOCAL __declspec(thread)" NL NL, PREFIX(root->prefix, data));
+        }
+        else
+        {
+            mstream_cstr(ms, "#else" NL);
+            mstream_fmt (ms, "#define %S_THREAD_LOCAL __thread" NL NL, PREFIX(root->prefix, data));
+        }
+
+        mstream_fmt(ms, "static long long" NL "%S_atomic_load(volatile long long* p)" NL "{" NL, PREFIX(root->prefix, data));
+        mstream_fmt(ms, "    return %s;" NL "}" NL NL, impl[i][0]);
+        mstream_fmt(ms, "static void" NL "%S_atomic_store(volatile long long* p, long long value)" NL "{" NL, PREFIX(root->prefix, data));
+        mstream_fmt(ms, "    %s;" NL "}" NL NL, impl[i][1]);
+        if (root->pool || root->split || root->profile_layer)
+        {
+            mstream_fmt(ms, "static int" NL "%S_atomic_cas(volatile long long* p, long long expected, long long desired)" NL "{" NL, PREFIX(root->prefix, data));
+            mstream_fmt(ms, "    return %s;" NL "}" NL NL, impl[i][2]);
+        }
+        if (root->async || root->checkpoint_pages)
+        {
+            mstream_fmt(ms, "static long long" NL "%S_atomic_exchange(volatile long long* p, long long value)" NL "{" NL, PREFIX(root->prefix, data));
+            mstream_fmt(ms, "    return %s;" NL "}" NL NL, impl[i][3]);
+        }
+        if (root->async || root->split)
+        {
+            mstream_fmt(ms, "static long long" NL "%S_atomic_add(volatile long long* p, long long value)" NL "{" NL, PREFIX(root->prefix, data));
+            mstream_fmt(ms, "    return %s;" NL "}" NL NL, impl[i][4]);
+        }
+    }
+    mstream_cstr(ms, "#endif" NL NL);
+}
+
+/*
+ * The pool keeps its idle connections on a lock-free stack. The head stores
+ * the index of the top connection in the lower 32 bits, and a counter in the
+ * upper 32 bits that changes on every update, which prevents the ABA problem.
+ * The same stack holds the reader connections of a read/write split context.
+ */
+static void
+write_pool_stack(struct mstream* ms, const struct root* root, const char* data)
+{
+    mstream_fmt (ms, "struct %S_pool" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S** conns;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    volatile long long* next;" NL);
+    if (root->pool_thread_affine)
+        mstream_cstr(ms, "    volatile long long* state;" NL);
+    mstream_cstr(ms, "    volatile long long head;" NL);
+    mstream_cstr(ms, "    int count;" NL);
+    if (root->checkpoint_pages)
+    {
+        mstream_fmt (ms, "    struct %S* ckpt;" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "    %S_thread ckpt_thread;" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "    %S_sem ckpt_sem;" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "    %S_sem ckpt_lock;" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    volatile long long wal_frames;" NL);
+        mstream_cstr(ms, "    volatile long long ckpt_dirty;" NL);
+        mstream_cstr(ms, "    volatile long long ckpt_waking;" NL);
+        mstream_cstr(ms, "    volatile long long ckpt_stop;" NL);
+        mstream_cstr(ms, "    int ckpt_sems;" NL);
+        mstream_cstr(ms, "    int ckpt_started;" NL);
+        mstream_fmt (ms, "    struct %S_wal_stats ckpt_stats;" NL, PREFIX(root->prefix, data));
+    }
+    mstream_cstr(ms, "};" NL NL);
+
+    mstream_fmt (ms, "static long long" NL "%S_pool_head(long long head, long long link)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    unsigned long long tag = ((unsigned long long)head >> 32) + 1;" NL);
+    mstream_cstr(ms, "    return (long long)((tag << 32) | (unsigned long long)link);" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    mstream_fmt (ms, "static void" NL "%S_pool_push(struct %S_pool* pool, int slot)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    long long head;" NL);
+    mstream_cstr(ms, "    do {" NL);
+    mstream_fmt (ms, "        head = %S_atomic_load(&pool->head);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S_atomic_store(&pool->next[slot], head & 0xFFFFFFFF);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    } while (!%S_atomic_cas(&pool->head, head, %S_pool_head(head, slot + 1)));" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+
+    mstream_fmt (ms, "static int" NL "%S_pool_pop(struct %S_pool* pool)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    long long head, next;" NL);
+    mstream_cstr(ms, "    do {" NL);
+    mstream_fmt (ms, "        head = %S_atomic_load(&pool->head);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        if ((head & 0xFFFFFFFF) == 0)" NL);
+    mstream_cstr(ms, "            return -1;" NL);
+    mstream_fmt (ms, "        next = %S_atomic_load(&pool->next[(head & 0xFFFFFFFF) - 1]);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    } while (!%S_atomic_cas(&pool->head, head, %S_pool_head(head, next)));" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return (int)(head & 0xFFFFFFFF) - 1;" NL);
+    mstream_cstr(ms, "}" NL NL);
+}
+
+/*
+ * With %option checkpoint, the pool replaces SQLite's auto-checkpoint hook on
+ * every connection with its own WAL hook, so that no commit ever runs a
+ * checkpoint inline. The hook only records the size of the WAL, and wakes the
+ * checkpoint thread once it reaches the configured size. The thread has a
+ * connection of its own without a busy handler, and runs a PASSIVE checkpoint.
+ * If that copied every frame back, it tries to RESTART the WAL, or TRUNCATE it
+ * once it has grown far past the threshold. Both give up right away instead
+ * of waiting if a reader still uses the WAL.
+ */
+static void
+write_pool_checkpoint_funcs(struct mstream* ms, const struct root* root, const char* data)
+{
+    mstream_cstr(ms, "#if defined(_WIN32)" NL);
+    mstream_fmt (ms, "static long long" NL "%S_checkpoint_now(void)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    LARGE_INTEGER freq, now;" NL);
+    mstream_cstr(ms, "    QueryPerformanceFrequency(&freq);" NL);
+    mstream_cstr(ms, "    QueryPerformanceCounter(&now);" NL);
+    mstream_cstr(ms, "    return (long long)((double)now.QuadPart * 1e6 / (double)freq.QuadPart);" NL);
+    mstream_cstr(ms, "}" NL);
+    mstream_cstr(ms, "#else" NL);
+    mstream_fmt (ms, "static long long" NL "%S_checkpoint_now(void)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    struct timespec ts;" NL);
+    mstream_cstr(ms, "    clock_gettime(CLOCK_MONOTONIC, &ts);" NL);
+    mstream_cstr(ms, "    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;" NL);
+    mstream_cstr(ms, "}" NL);
+    mstream_cstr(ms, "#endif" NL NL);
+
+    /* Called by SQLite after every commit */
+    mstream_fmt (ms, "static int" NL "%S_pool_wal_hook(void* user_data, sqlite3* db, const char* name, int frames)" NL "{" NL,
+        PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_pool* pool = user_data;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    (void)db;" NL);
+    mstream_cstr(ms, "    (void)name;" NL);
+    mstream_fmt (ms, "    %S_atomic_store(&pool->wal_frames, frames);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_atomic_store(&pool->ckpt_dirty, 1);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    if (frames >= %d && %S_atomic_cas(&pool->ckpt_waking, 0, 1))" NL,
+        root->checkpoint_pages, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S_sem_post(&pool->ckpt_sem);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return SQLITE_OK;" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    mstream_fmt (ms, "static void" NL "%S_pool_checkpoint(struct %S_pool* pool)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int ret, frames = 0, copied = 0;" NL);
+    mstream_cstr(ms, "    int mode = SQLITE_CHECKPOINT_PASSIVE;" NL);
+    mstream_cstr(ms, "    int busy = 0;" NL);
+    mstream_fmt (ms, "    long long start = %S_checkpoint_now();" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    long long elapsed;" NL NL);
+    mstream_cstr(ms, "    ret = sqlite3_wal_checkpoint_v2(pool->ckpt->db, NULL, SQLITE_CHECKPOINT_PASSIVE, &frames, &copied);" NL);
+    mstream_cstr(ms, "    if (ret == SQLITE_OK && frames > 0 && copied == frames)" NL "    {" NL);
+    mstream_fmt (ms, "        mode = frames >= %d ? SQLITE_CHECKPOINT_TRUNCATE : SQLITE_CHECKPOINT_RESTART;" NL,
+        root->checkpoint_pages * 4);
+    mstream_cstr(ms, "        ret = sqlite3_wal_checkpoint_v2(pool->ckpt->db, NULL, mode, &frames, &copied);" NL);
+    mstream_cstr(ms, "        if (ret == SQLITE_OK)" NL);
+    mstream_fmt (ms, "            %S_atomic_store(&pool->wal_frames, 0);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    }" NL);
+    mstream_cstr(ms, "    else if (ret == SQLITE_OK && copied < frames)" NL);
+    mstream_cstr(ms, "        busy = 1;  /* A reader's snapshot is still in the WAL */" NL);
+    mstream_cstr(ms, "    if (ret == SQLITE_BUSY)" NL "    {" NL);
+    mstream_cstr(ms, "        /* A reader still uses the WAL, or another process is checkpointing */" NL);
+    mstream_cstr(ms, "        busy = 1;" NL);
+    mstream_cstr(ms, "        ret = SQLITE_OK;" NL);
+    mstream_cstr(ms, "    }" NL);
+    mstream_cstr(ms, "    else if (ret != SQLITE_OK)" NL);
+    mstream_fmt (ms, "        %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(pool->ckpt->db));" NL,
+        LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_fmt (ms, "    elapsed = %S_checkpoint_now() - start;" NL NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_sem_wait(&pool->ckpt_lock);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    pool->ckpt_stats.checkpoints++;" NL);
+    mstream_cstr(ms, "    if (ret != SQLITE_OK)" NL);
+    mstream_cstr(ms, "        pool->ckpt_stats.errors++;" NL);
+    mstream_cstr(ms, "    else if (busy)" NL);
+    mstream_cstr(ms, "        pool->ckpt_stats.busy++;" NL);
+    mstream_cstr(ms, "    else if (mode == SQLITE_CHECKPOINT_RESTART)" NL);
+    mstream_cstr(ms, "        pool->ckpt_stats.restarts++;" NL);
+    mstream_cstr(ms, "    else if (mode == SQLITE_CHECKPOINT_TRUNCATE)" NL);
+    mstream_cstr(ms, "        pool->ckpt_stats.truncates++;" NL);
+    mstream_cstr(ms, "    pool->ckpt_stats.last_us = elapsed;" NL);
+    mstream_cstr(ms, "    pool->ckpt_stats.total_us += elapsed;" NL);
+    mstream_cstr(ms, "    if (pool->ckpt_stats.max_us < elapsed)" NL);
+    mstream_cstr(ms, "        pool->ckpt_stats.max_us = elapsed;" NL);
+    mstream_fmt (ms, "    %S_sem_post(&pool->ckpt_lock);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+
+    mstream_fmt (ms, "static void" NL "%S_pool_checkpoint_run(struct %S_pool* pool)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    for (;;)" NL "    {" NL);
+    if (root->checkpoint_ms)
+        mstream_fmt (ms, "        %S_sem_wait_ms(&pool->ckpt_sem, %d);" NL, PREFIX(root->prefix, data), root->checkpoint_ms);
+    else
+        mstream_fmt (ms, "        %S_sem_wait(&pool->ckpt_sem);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        if (%S_atomic_load(&pool->ckpt_stop))" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "            return;" NL);
+    mstream_fmt (ms, "        %S_atomic_store(&pool->ckpt_waking, 0);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        /* Nothing to do if there were no commits since the last checkpoint */" NL);
+    mstream_fmt (ms, "        if (%S_atomic_exchange(&pool->ckpt_dirty, 0))" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            %S_pool_checkpoint(pool);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    }" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    mstream_cstr(ms, "#if defined(_WIN32)" NL);
+    mstream_fmt (ms, "static DWORD WINAPI" NL "%S_pool_checkpoint_entry(LPVOID pool)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_pool_checkpoint_run(pool);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return 0;" NL "}" NL NL);
+    mstream_fmt (ms, "static int" NL "%S_pool_checkpoint_start(struct %S_pool* pool)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    pool->ckpt_thread = CreateThread(NULL, 0, %S_pool_checkpoint_entry, pool, 0, NULL);" NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return pool->ckpt_thread == NULL ? -1 : 0;" NL "}" NL NL);
+    mstream_fmt (ms, "static void" NL "%S_pool_checkpoint_join(struct %S_pool* pool)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    WaitForSingleObject(pool->ckpt_thread, INFINITE);" NL);
+    mstream_cstr(ms, "    CloseHandle(pool->ckpt_thread);" NL "}" NL);
+    mstream_cstr(ms, "#else" NL);
+    mstream_fmt (ms, "static void*" NL "%S_pool_checkpoint_entry(void* pool)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_pool_checkpoint_run(pool);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return NULL;" NL "}" NL NL);
+    mstream_fmt (ms, "static int" NL "%S_pool_checkpoint_start(struct %S_pool* pool)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    return pthread_create(&pool->ckpt_thread, NULL, %S_pool_checkpoint_entry, pool) == 0 ? 0 : -1;" NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+    mstream_fmt (ms, "static void" NL "%S_pool_checkpoint_join(struct %S_pool* pool)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    pthread_join(pool->ckpt_thread, NULL);" NL "}" NL);
+    mstream_cstr(ms, "#endif" NL NL);
+
+    mstream_fmt (ms, "static void" NL "%S_pool_wal_stats(struct %S_pool* pool, struct %S_wal_stats* stats)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_sem_wait(&pool->ckpt_lock);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    *stats = pool->ckpt_stats;" NL);
+    mstream_fmt (ms, "    %S_sem_post(&pool->ckpt_lock);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    stats->wal_frames = (int)%S_atomic_load(&pool->wal_frames);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+}
+
+/*
+ * With thread affinity, a released connection is parked in a thread-local
+ * variable instead of being pushed onto the stack, so that the next
+ * acquire() on the same thread gets it back without touching any shared
+ * state. Other threads can still steal parked connections when the stack is
+ * empty.
+ */
+static void
+write_pool_funcs(struct mstream* ms, const struct root* root, const char* data)
+{
+    if (root->pool_thread_affine)
+    {
+        mstream_fmt(ms, "enum %S_pool_state" NL "{" NL, PREFIX(root->prefix, data));
+        mstream_fmt(ms, "    %S_POOL_LISTED," NL, PREFIX(root->prefix, data));
+        mstream_fmt(ms, "    %S_POOL_PARKED," NL, PREFIX(root->prefix, data));
+        mstream_fmt(ms, "    %S_POOL_USED" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "};" NL NL);
+        mstream_fmt(ms, "static %S_THREAD_LOCAL struct %S_pool* %S_parked_pool;" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_fmt(ms, "static %S_THREAD_LOCAL int %S_parked_slot;" NL NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    }
+
+    if (root->checkpoint_pages)
+        write_pool_checkpoint_funcs(ms, root, data);
+
+    /* close */
+    mstream_fmt (ms, "static void" NL "%S_pool_close(struct %S_pool* pool)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int i;" NL);
+    if (root->checkpoint_pages)
+    {
+        mstream_cstr(ms, "    if (pool->ckpt_started)" NL "    {" NL);
+        mstream_fmt (ms, "        %S_atomic_store(&pool->ckpt_stop, 1);" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "        %S_sem_post(&pool->ckpt_sem);" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "        %S_pool_checkpoint_join(pool);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    }" NL);
+    }
+    mstream_cstr(ms, "    for (i = 0; i != pool->count; ++i)" NL);
+    mstream_fmt (ms, "        %S_close(pool->conns[i]);" NL, PREFIX(root->prefix, data));
+    if (root->checkpoint_pages)
+    {
+        mstream_cstr(ms, "    if (pool->ckpt)" NL);
+        mstream_fmt (ms, "        %S_close(pool->ckpt);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    if (pool->ckpt_sems > 1)" NL);
+        mstream_fmt (ms, "        %S_sem_deinit(&pool->ckpt_lock);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    if (pool->ckpt_sems > 0)" NL);
+        mstream_fmt (ms, "        %S_sem_deinit(&pool->ckpt_sem);" NL, PREFIX(root->prefix, data));
+    }
+    mstream_cstr(ms, "    if (pool->conns)" NL);
+    mstream_fmt (ms, "        %S(pool->conns);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "    if (pool->next)" NL);
+    mstream_fmt (ms, "        %S((void*)pool->next);" NL, FREE(root->free, data));
+    if (root->pool_thread_affine)
+    {
+        mstream_cstr(ms, "    if (pool->state)" NL);
+        mstream_fmt (ms, "        %S((void*)pool->state);" NL, FREE(root->free, data));
+    }
+    mstream_fmt (ms, "    %S(pool);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "}" NL NL);
+
+    /* open */
+    mstream_fmt (ms, "static struct %S_pool*" NL "%S_pool_open(const char* uri, int connections)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int i;" NL);
+    mstream_fmt (ms, "    struct %S_pool* pool;" NL NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (connections <= 0)" NL);
+    mstream_cstr(ms, "        return NULL;" NL NL);
+    mstream_fmt (ms, "    pool = %S(sizeof *pool);" NL, MALLOC(root->malloc, data));
+    mstream_cstr(ms, "    if (pool == NULL)" NL);
+    mstream_cstr(ms, "        return NULL;" NL);
+    mstream_cstr(ms, "    memset(pool, 0, sizeof *pool);" NL NL);
+    mstream_fmt (ms, "    pool->conns = %S(sizeof(*pool->conns) * (size_t)connections);" NL, MALLOC(root->malloc, data));
+    mstream_fmt (ms, "    pool->next = %S(sizeof(*pool->next) * (size_t)connections);" NL, MALLOC(root->malloc, data));
+    if (root->pool_thread_affine)
+    {
+        mstream_fmt (ms, "    pool->state = %S(sizeof(*pool->state) * (size_t)connections);" NL, MALLOC(root->malloc, data));
+        mstream_cstr(ms, "    if (pool->conns == NULL || pool->next == NULL || pool->state == NULL)" NL);
+    }
+    else
+        mstream_cstr(ms, "    if (pool->conns == NULL || pool->next == NULL)" NL);
+    mstream_cstr(ms, "        goto open_failed;" NL NL);
+    if (root->checkpoint_pages)
+    {
+        mstream_fmt (ms, "    if (%S_sem_init(&pool->ckpt_sem) != 0)" NL "        goto open_failed;" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    pool->ckpt_sems++;" NL);
+        mstream_fmt (ms, "    if (%S_sem_init(&pool->ckpt_lock) != 0)" NL "        goto open_failed;" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    pool->ckpt_sems++;" NL);
+        mstream_fmt (ms, "    %S_sem_post(&pool->ckpt_lock);" NL NL, PREFIX(root->prefix, data));
+    }
+
+    mstream_cstr(ms, "    /* Each connection is only ever used by one thread at a time, so SQLite" NL);
+    mstream_cstr(ms, "     * doesn't need to serialize access to it */" NL);
+    mstream_cstr(ms, "    for (i = 0; i != connections; ++i)" NL "    {" NL);
+    mstream_fmt (ms, "        pool->conns[i] = %S_open_ex(uri, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX);" NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        if (pool->conns[i] == NULL)" NL);
+    mstream_cstr(ms, "            goto open_failed;" NL);
+    mstream_cstr(ms, "        pool->conns[i]->pool_slot = i;" NL);
+    if (root->checkpoint_pages)
+        mstream_fmt(ms, "        sqlite3_wal_hook(pool->conns[i]->db, %S_pool_wal_hook, pool);" NL, PREFIX(root->prefix, data));
+    if (root->pool_thread_affine)
+        mstream_fmt(ms, "        pool->state[i] = %S_POOL_LISTED;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        pool->count++;" NL);
+    /* Query functions don't prepare in eager mode, so no connection may be handed out unprepared */
+    if (root->prepare_eager)
+    {
+        mstream_fmt(ms, "        if (%S_prepare_all(pool->conns[i]) != 0)" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "            goto open_failed;" NL);
+    }
+    mstream_cstr(ms, "    }" NL NL);
+
+    if (root->checkpoint_pages)
+    {
+        mstream_cstr(ms, "    /* Checkpoints never wait for readers or writers, so no busy handler */" NL);
+        mstream_fmt (ms, "    pool->ckpt = %S_open_ex(uri, SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX);" NL,
+            PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    if (pool->ckpt == NULL)" NL);
+        mstream_cstr(ms, "        goto open_failed;" NL);
+        mstream_cstr(ms, "    sqlite3_busy_handler(pool->ckpt->db, NULL, NULL);" NL);
+        mstream_fmt (ms, "    if (%S_pool_checkpoint_start(pool) != 0)" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        goto open_failed;" NL);
+        mstream_cstr(ms, "    pool->ckpt_started = 1;" NL NL);
+    }
+    mstream_cstr(ms, "    for (i = connections; i-- > 0;)" NL);
+    mstream_fmt (ms, "        %S_pool_push(pool, i);" NL NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return pool;" NL NL);
+    mstream_cstr(ms, "open_failed:" NL);
+    mstream_fmt (ms, "    %S_pool_close(pool);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return NULL;" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    /* acquire */
+    mstream_fmt (ms, "static struct %S*" NL "%S_pool_acquire(struct %S_pool* pool)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int slot;" NL NL);
+    if (root->pool_thread_affine)
+    {
+        mstream_cstr(ms, "    /* Fast path: Reuse the connection this thread released last */" NL);
+        mstream_fmt (ms, "    if (%S_parked_pool == pool)" NL "    {" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "        %S_parked_pool = NULL;" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "        slot = %S_parked_slot;" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "        if (slot < pool->count && %S_atomic_cas(&pool->state[slot], %S_POOL_PARKED, %S_POOL_USED))" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_cstr(ms, "            return pool->conns[slot];" NL);
+        mstream_cstr(ms, "    }" NL NL);
+        mstream_fmt (ms, "    if ((slot = %S_pool_pop(pool)) >= 0)" NL "    {" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "        %S_atomic_store(&pool->state[slot], %S_POOL_USED);" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        return pool->conns[slot];" NL);
+        mstream_cstr(ms, "    }" NL NL);
+        mstream_cstr(ms, "    /* Steal a connection parked by another thread */" NL);
+        mstream_cstr(ms, "    for (slot = 0; slot != pool->count; ++slot)" NL);
+        mstream_fmt (ms, "        if (%S_atomic_cas(&pool->state[slot], %S_POOL_PARKED, %S_POOL_USED))" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_cstr(ms, "            return pool->conns[slot];" NL NL);
+        mstream_cstr(ms, "    return NULL;" NL);
+    }
+    else
+    {
+        mstream_fmt (ms, "    if ((slot = %S_pool_pop(pool)) < 0)" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        return NULL;" NL);
+        mstream_cstr(ms, "    return pool->conns[slot];" NL);
+    }
+    mstream_cstr(ms, "}" NL NL);
+
+    /* release */
+    mstream_fmt (ms, "static void" NL "%S_pool_release(struct %S_pool* pool, struct %S* ctx)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    if (root->pool_thread_affine)
+    {
+        mstream_cstr(ms, "    /* Only one connection can be parked per thread. The previous one goes" NL);
+        mstream_cstr(ms, "     * back onto the stack, unless another thread stole it */" NL);
+        mstream_fmt (ms, "    if (%S_parked_pool == pool && %S_parked_slot < pool->count)" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_fmt (ms, "        if (%S_atomic_cas(&pool->state[%S_parked_slot], %S_POOL_PARKED, %S_POOL_LISTED))" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_fmt (ms, "            %S_pool_push(pool, %S_parked_slot);" NL NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_fmt (ms, "    %S_atomic_store(&pool->state[ctx->pool_slot], %S_POOL_PARKED);" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_fmt (ms, "    %S_parked_pool = pool;" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "    %S_parked_slot = ctx->pool_slot;" NL, PREFIX(root->prefix, data));
+    }
+    else
+        mstream_fmt(ms, "    %S_pool_push(pool, ctx->pool_slot);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+}
+
+/*
+ * The async executor and the read/write split need threads and a way to
+ * sleep until a connection or a job becomes available.
+ * Windows has counting semaphores, elsewhere a semaphore is built from a
+ * mutex and a condition variable because macOS doesn't support unnamed POSIX
+ * semaphores.
+ */
+static void
+write_thread_includes(struct mstream* ms, const struct root* root, const char* data)
+{
+    mstream_cstr(ms, "#if defined(_WIN32)" NL);
+    mstream_cstr(ms, "#include <windows.h>" NL);
+    mstream_fmt (ms, "typedef HANDLE %S_thread;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "typedef HANDLE %S_sem;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "#else" NL);
+    mstream_cstr(ms, "#include <pthread.h>" NL);
+    mstream_cstr(ms, "#include <sched.h>" NL);
+    mstream_cstr(ms, "#include <unistd.h>" NL);
+    mstream_fmt (ms, "typedef pthread_t %S_thread;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "typedef struct" NL "{" NL);
+    mstream_cstr(ms, "    pthread_mutex_t mutex;" NL);
+    mstream_cstr(ms, "    pthread_cond_t cond;" NL);
+    mstream_cstr(ms, "    int count;" NL);
+    mstream_fmt (ms, "} %S_sem;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "#endif" NL NL);
+}
+
+/*
+ * Semaphores for the async executor and the read/write split. The generated
+ * code only waits on them after an atomic counter says that it has to, so
+ * they stay off the fast path.
+ */
+static void
+write_sem_funcs(struct mstream* ms, const struct root* root, const char* data)
+{
+    mstream_cstr(ms, "#if defined(_WIN32)" NL);
+    mstream_fmt (ms, "static int" NL "%S_sem_init(%S_sem* sem)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    *sem = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);" NL);
+    mstream_cstr(ms, "    return *sem == NULL ? -1 : 0;" NL "}" NL NL);
+    mstream_fmt (ms, "static void" NL "%S_sem_deinit(%S_sem* sem)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    CloseHandle(*sem);" NL "}" NL NL);
+    mstream_fmt (ms, "static void" NL "%S_sem_post(%S_sem* sem)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    ReleaseSemaphore(*sem, 1, NULL);" NL "}" NL NL);
+    mstream_fmt (ms, "static void" NL "%S_sem_wait(%S_sem* sem)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    WaitForSingleObject(*sem, INFINITE);" NL "}" NL NL);
+    if (root->checkpoint_ms)
+    {
+        mstream_fmt (ms, "static void" NL "%S_sem_wait_ms(%S_sem* sem, int ms)" NL "{" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    WaitForSingleObject(*sem, (DWORD)ms);" NL "}" NL NL);
+    }
+    if (root->group_commit_ops)
+    {
+        mstream_fmt (ms, "static int" NL "%S_sem_wait_us(%S_sem* sem, long long us)" NL "{" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    return WaitForSingleObject(*sem, (DWORD)((us + 999) / 1000)) == WAIT_OBJECT_0 ? 0 : -1;" NL "}" NL NL);
+    }
+    if (root->async || root->split)
+    {
+        mstream_fmt (ms, "static void" NL "%S_thread_yield(void)" NL "{" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    SwitchToThread();" NL "}" NL NL);
+    }
+    mstream_cstr(ms, "#else" NL);
+    mstream_fmt (ms, "static int" NL "%S_sem_init(%S_sem* sem)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    sem->count = 0;" NL);
+    mstream_cstr(ms, "    if (pthread_mutex_init(&sem->mutex, NULL) != 0)" NL);
+    mstream_cstr(ms, "        return -1;" NL);
+    mstream_cstr(ms, "    if (pthread_cond_init(&sem->cond, NULL) != 0)" NL "    {" NL);
+    mstream_cstr(ms, "        pthread_mutex_destroy(&sem->mutex);" NL);
+    mstream_cstr(ms, "        return -1;" NL "    }" NL);
+    mstream_cstr(ms, "    return 0;" NL "}" NL NL);
+    mstream_fmt (ms, "static void" NL "%S_sem_deinit(%S_sem* sem)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    pthread_cond_destroy(&sem->cond);" NL);
+    mstream_cstr(ms, "    pthread_mutex_destroy(&sem->mutex);" NL "}" NL NL);
+    mstream_fmt (ms, "static void" NL "%S_sem_post(%S_sem* sem)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    pthread_mutex_lock(&sem->mutex);" NL);
+    mstream_cstr(ms, "    sem->count++;" NL);
+    mstream_cstr(ms, "    pthread_cond_signal(&sem->cond);" NL);
+    mstream_cstr(ms, "    pthread_mutex_unlock(&sem->mutex);" NL "}" NL NL);
+    mstream_fmt (ms, "static void" NL "%S_sem_wait(%S_sem* sem)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    pthread_mutex_lock(&sem->mutex);" NL);
+    mstream_cstr(ms, "    while (sem->count == 0)" NL);
+    mstream_cstr(ms, "        pthread_cond_wait(&sem->cond, &sem->mutex);" NL);
+    mstream_cstr(ms, "    sem->count--;" NL);
+    mstream_cstr(ms, "    pthread_mutex_unlock(&sem->mutex);" NL "}" NL NL);
+    if (root->checkpoint_ms)
+    {
+        /* Returns early if posted, and doesn't tell whether it timed out */
+        mstream_fmt (ms, "static void" NL "%S_sem_wait_ms(%S_sem* sem, int ms)" NL "{" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    struct timespec ts;" NL);
+        mstream_cstr(ms, "    clock_gettime(CLOCK_REALTIME, &ts);" NL);
+        mstream_cstr(ms, "    ts.tv_sec += ms / 1000;" NL);
+        mstream_cstr(ms, "    ts.tv_nsec += (long)(ms % 1000) * 1000000;" NL);
+        mstream_cstr(ms, "    if (ts.tv_nsec >= 1000000000)" NL "    {" NL);
+        mstream_cstr(ms, "        ts.tv_sec++;" NL);
+        mstream_cstr(ms, "        ts.tv_nsec -= 1000000000;" NL);
+        mstream_cstr(ms, "    }" NL);
+        mstream_cstr(ms, "    pthread_mutex_lock(&sem->mutex);" NL);
+        mstream_cstr(ms, "    while (sem->count == 0)" NL);
+        mstream_cstr(ms, "        if (pthread_cond_timedwait(&sem->cond, &sem->mutex, &ts) != 0)" NL);
+        mstream_cstr(ms, "            break;" NL);
+        mstream_cstr(ms, "    if (sem->count > 0)" NL);
+        mstream_cstr(ms, "        sem->count--;" NL);
+        mstream_cstr(ms, "    pthread_mutex_unlock(&sem->mutex);" NL "}" NL NL);
+    }
+    if (root->group_commit_ops)
+    {
+        /* Returns 0 if posted, or -1 if it timed out */
+        mstream_fmt (ms, "static int" NL "%S_sem_wait_us(%S_sem* sem, long long us)" NL "{" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    struct timespec ts;" NL);
+        mstream_cstr(ms, "    int posted;" NL);
+        mstream_cstr(ms, "    clock_gettime(CLOCK_REALTIME, &ts);" NL);
+        mstream_cstr(ms, "    ts.tv_sec += (time_t)(us / 1000000);" NL);
+        mstream_cstr(ms, "    ts.tv_nsec += (long)(us % 1000000) * 1000;" NL);
+        mstream_cstr(ms, "    if (ts.tv_nsec >= 1000000000)" NL "    {" NL);
+        mstream_cstr(ms, "        ts.tv_sec++;" NL);
+        mstream_cstr(ms, "        ts.tv_nsec -= 1000000000;" NL);
+        mstream_cstr(ms, "    }" NL);
+        mstream_cstr(ms, "    pthread_mutex_lock(&sem->mutex);" NL);
+        mstream_cstr(ms, "    while (sem->count == 0)" NL);
+        mstream_cstr(ms, "        if (pthread_cond_timedwait(&sem->cond, &sem->mutex, &ts) != 0)" NL);
+        mstream_cstr(ms, "            break;" NL);
+        mstream_cstr(ms, "    posted = sem->count > 0;" NL);
+        mstream_cstr(ms, "    if (posted)" NL);
+        mstream_cstr(ms, "        sem->count--;" NL);
+        mstream_cstr(ms, "    pthread_mutex_unlock(&sem->mutex);" NL);
+        mstream_cstr(ms, "    return posted ? 0 : -1;" NL "}" NL NL);
+    }
+    /* Only the executor and the split spin on a pop */
+    if (root->async || root->split)
+    {
+        mstream_fmt (ms, "static void" NL "%S_thread_yield(void)" NL "{" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    sched_yield();" NL "}" NL NL);
+    }
+    mstream_cstr(ms, "#endif" NL NL);
+}
+
+/*
+ * A read/write split context is a "struct X" without a database of its own.
+ * Every function checks for ctx->split first and forwards the call to one of
+ * the connections owned by the split: read-only queries go to an idle reader
+ * opened with SQLITE_OPEN_READONLY, everything else goes to the single
+ * writer. The readers sit on the same lock-free stack the pool uses.
+ *
+ * Both resources are guarded by a benaphore: the counter says how many are
+ * free, and the semaphore is only touched if a thread has to wait. The writer
+ * is owned by a thread until the outermost begin()/savepoint() is matched,
+ * and while a thread owns the writer all of its queries, including reads, go
+ * to the writer so that they see the uncommitted changes. Holds are counted
+ * per call, and tx_depth counts the ones taken by the transaction, because
+ * commit() and rollback() end the whole transaction and drop all of those at
+ * once. Otherwise a savepoint that is never released would keep the writer
+ * owned forever. A cursor pins the connection it was opened on, a reader if
+ * possible, until it is closed or opened again. Columnar fetches that have
+ * rows left do the same.
+ */
+static void
+write_split_funcs(struct mstream* ms, const struct root* root, const char* data)
+{
+    mstream_fmt (ms, "struct %S_split" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S* writer;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_pool readers;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    volatile long long readers_free;" NL);
+    mstream_cstr(ms, "    volatile long long writer_free;" NL);
+    mstream_cstr(ms, "    volatile long long writer_owner;" NL);
+    mstream_cstr(ms, "    int writer_depth;" NL);
+    mstream_cstr(ms, "    int tx_depth;" NL);
+    mstream_fmt (ms, "    %S_sem readers_sem;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_sem writer_sem;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "};" NL NL);
+
+    mstream_cstr(ms, "/* Only the address is used, to identify the thread that owns the writer */" NL);
+    mstream_fmt (ms, "static %S_THREAD_LOCAL char %S_split_thread;" NL NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+
+    /* acquire */
+    mstream_fmt (ms, "static struct %S*" NL "%S_split_acquire(struct %S_split* split, int read_only)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    long long self = (long long)(size_t)&%S_split_thread;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int slot;" NL NL);
+    mstream_fmt (ms, "    if (%S_atomic_load(&split->writer_owner) == self)" NL "    {" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        split->writer_depth++;" NL);
+    mstream_cstr(ms, "        return split->writer;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+    mstream_cstr(ms, "    if (read_only && split->readers.count > 0)" NL "    {" NL);
+    mstream_fmt (ms, "        if (%S_atomic_add(&split->readers_free, -1) <= 0)" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            %S_sem_wait(&split->readers_sem);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        while ((slot = %S_pool_pop(&split->readers)) < 0)" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            %S_thread_yield();" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        return split->readers.conns[slot];" NL);
+    mstream_cstr(ms, "    }" NL NL);
+    mstream_fmt (ms, "    if (%S_atomic_add(&split->writer_free, -1) <= 0)" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S_sem_wait(&split->writer_sem);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_atomic_store(&split->writer_owner, self);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    split->writer_depth = 1;" NL);
+    mstream_cstr(ms, "    return split->writer;" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    /* release */
+    mstream_fmt (ms, "static void" NL "%S_split_release(struct %S_split* split, struct %S* ctx)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (ctx != split->writer)" NL "    {" NL);
+    mstream_fmt (ms, "        %S_pool_push(&split->readers, ctx->pool_slot);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        if (%S_atomic_add(&split->readers_free, 1) < 0)" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            %S_sem_post(&split->readers_sem);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        return;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+    mstream_cstr(ms, "    if (--split->writer_depth > 0)" NL);
+    mstream_cstr(ms, "        return;" NL);
+    mstream_fmt (ms, "    %S_atomic_store(&split->writer_owner, 0);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    if (%S_atomic_add(&split->writer_free, 1) < 0)" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S_sem_post(&split->writer_sem);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+
+    /* end_tx, only called by the thread that owns the writer, which still
+     * holds it for the commit() or rollback() itself */
+    mstream_fmt (ms, "static void" NL "%S_split_end_tx(struct %S_split* split)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    split->writer_depth -= split->tx_depth;" NL);
+    mstream_cstr(ms, "    split->tx_depth = 0;" NL);
+    mstream_cstr(ms, "}" NL NL);
+}
+
+/*!
+ * \brief Closes the connections owned by a split context. The context itself
+ * has no statements or database, so the regular close code that follows is
+ * harmless.
+ */
+static void
+write_split_close(struct mstream* ms, const struct root* root, const char* data)
+{
+    mstream_cstr(ms, "    if (ctx->split)" NL "    {" NL);
+    mstream_fmt (ms, "        struct %S_split* split = ctx->split;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        int i;" NL);
+    mstream_cstr(ms, "        if (split->writer)" NL);
+    mstream_fmt (ms, "            %S_close(split->writer);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        for (i = 0; i != split->readers.count; ++i)" NL);
+    mstream_fmt (ms, "            %S_close(split->readers.conns[i]);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        if (split->readers.conns)" NL);
+    mstream_fmt (ms, "            %S(split->readers.conns);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "        if (split->readers.next)" NL);
+    mstream_fmt (ms, "            %S((void*)split->readers.next);" NL, FREE(root->free, data));
+    mstream_fmt (ms, "        %S_sem_deinit(&split->readers_sem);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S_sem_deinit(&split->writer_sem);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S(split);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "    }" NL);
+}
+
+static void
+write_open_split_func(struct mstream* ms, const struct root* root, const char* data)
+{
+    mstream_fmt (ms, "static struct %S*" NL "%S_open_split(const char* uri, int readers)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int i;" NL);
+    mstream_fmt (ms, "    struct %S* ctx;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_split* split;" NL NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (readers < 0)" NL);
+    mstream_cstr(ms, "        return NULL;" NL NL);
+    mstream_fmt (ms, "    ctx = %S(sizeof *ctx);" NL, MALLOC(root->malloc, data));
+    mstream_cstr(ms, "    if (ctx == NULL)" NL);
+    mstream_cstr(ms, "        return NULL;" NL);
+    mstream_cstr(ms, "    memset(ctx, 0, sizeof *ctx);" NL);
+    mstream_fmt (ms, "    split = %S(sizeof *split);" NL, MALLOC(root->malloc, data));
+    mstream_cstr(ms, "    if (split == NULL)" NL);
+    mstream_cstr(ms, "        goto alloc_failed;" NL);
+    mstream_cstr(ms, "    memset(split, 0, sizeof *split);" NL);
+    mstream_fmt (ms, "    if (%S_sem_init(&split->readers_sem) != 0)" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        goto sem_failed;" NL);
+    mstream_fmt (ms, "    if (%S_sem_init(&split->writer_sem) != 0)" NL "    {" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S_sem_deinit(&split->readers_sem);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        goto sem_failed;" NL);
+    mstream_cstr(ms, "    }" NL);
+    mstream_cstr(ms, "    split->readers_free = readers;" NL);
+    mstream_cstr(ms, "    split->writer_free = 1;" NL);
+    mstream_cstr(ms, "    ctx->split = split;" NL NL);
+
+    mstream_cstr(ms, "    /* Each connection is only ever used by one thread at a time, so SQLite" NL);
+    mstream_cstr(ms, "     * doesn't need to serialize access to it */" NL);
+    mstream_fmt (ms, "    split->writer = %S_open_ex(uri, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX);" NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (split->writer == NULL)" NL);
+    mstream_cstr(ms, "        goto open_failed;" NL NL);
+
+    mstream_cstr(ms, "    if (readers > 0)" NL "    {" NL);
+    mstream_fmt (ms, "        split->readers.conns = %S(sizeof(*split->readers.conns) * (size_t)readers);" NL, MALLOC(root->malloc, data));
+    mstream_fmt (ms, "        split->readers.next = %S(sizeof(*split->readers.next) * (size_t)readers);" NL, MALLOC(root->malloc, data));
+    mstream_cstr(ms, "        if (split->readers.conns == NULL || split->readers.next == NULL)" NL);
+    mstream_cstr(ms, "            goto open_failed;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    mstream_cstr(ms, "    for (i = 0; i != readers; ++i)" NL "    {" NL);
+    mstream_fmt (ms, "        split->readers.conns[i] = %S_open_ex(uri, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX);" NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        if (split->readers.conns[i] == NULL)" NL);
+    mstream_cstr(ms, "            goto open_failed;" NL);
+    mstream_cstr(ms, "        split->readers.conns[i]->pool_slot = i;" NL);
+    mstream_cstr(ms, "        split->readers.count++;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+
+    mstream_cstr(ms, "    for (i = readers; i-- > 0;)" NL);
+    mstream_fmt (ms, "        %S_pool_push(&split->readers, i);" NL NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return ctx;" NL NL);
+    mstream_cstr(ms, "open_failed:" NL);
+    mstream_fmt (ms, "    %S_close(ctx);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return NULL;" NL NL);
+    mstream_cstr(ms, "sem_failed:" NL);
+    mstream_fmt (ms, "    %S(split);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "alloc_failed:" NL);
+    mstream_fmt (ms, "    %S(ctx);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "    return NULL;" NL);
+    mstream_cstr(ms, "}" NL NL);
+}
+
+/*
+ * A sharded context is a "struct X" without a database of its own, which owns
+ * one regular context per shard. Each shard is a separate database file with
+ * its own connection and statements, so writes to different shards don't
+ * contend for the same lock.
+ *
+ * Which shard a row lives in is decided by these hashes, so they must give
+ * the same result on every platform and must never change. Integers of any
+ * width hash the same, so a key can be passed as int in one query and as
+ * int64_t in another.
+ */
+static void
+write_shard_funcs(struct mstream* ms, const struct root* root, const char* data)
+{
+    mstream_fmt (ms, "static int" NL "%S_shard_of_int(long long key)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    unsigned long long h = (unsigned long long)key;" NL);
+    mstream_cstr(ms, "    h ^= h >> 33;" NL);
+    mstream_cstr(ms, "    h *= 0xff51afd7ed558ccdULL;" NL);
+    mstream_cstr(ms, "    h ^= h >> 33;" NL);
+    mstream_cstr(ms, "    h *= 0xc4ceb9fe1a85ec53ULL;" NL);
+    mstream_cstr(ms, "    h ^= h >> 33;" NL);
+    mstream_fmt (ms, "    return (int)(h %% %d);" NL, root->shards);
+    mstream_cstr(ms, "}" NL NL);
+
+    mstream_fmt (ms, "static int" NL "%S_shard_of_bytes(const void* key, int len)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    const unsigned char* p = (const unsigned char*)key;" NL);
+    mstream_cstr(ms, "    unsigned long h = 2166136261UL;" NL);
+    mstream_cstr(ms, "    int i;" NL);
+    mstream_cstr(ms, "    for (i = 0; i < len; ++i)" NL);
+    mstream_cstr(ms, "        h = ((h ^ p[i]) * 16777619UL) & 0xFFFFFFFFUL;" NL);
+    mstream_fmt (ms, "    return (int)(h %% %d);" NL, root->shards);
+    mstream_cstr(ms, "}" NL NL);
+}
 
 static void
-write_dbg_func_decl(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+write_shard_close(struct mstream* ms, const struct root* root, const char* data)
 {
-    mstream_cstr(ms, "static int" NL "dbg_");
-    write_func_name(ms, g, q, data);
-    mstream_putc(ms, '(');
-    write_func_param_list(ms, root, g, q, data);
-    mstream_putc(ms, ')');
+    mstream_cstr(ms, "    if (ctx->shards)" NL "    {" NL);
+    mstream_cstr(ms, "        int shard;" NL);
+    mstream_fmt (ms, "        for (shard = 0; shard != %d; ++shard)" NL, root->shards);
+    mstream_cstr(ms, "            if (ctx->shards[shard])" NL);
+    mstream_fmt (ms, "                %S_close(ctx->shards[shard]);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S(ctx->shards);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "    }" NL);
 }
 
 static void
-write_func_ptr_decl(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+write_open_shards_func(struct mstream* ms, const struct root* root, const char* data)
 {
-    mstream_cstr(ms, "int (*");
-    write_func_name(ms, g, q, data);
-    mstream_cstr(ms, ")(");
-    write_func_param_list(ms, root, g, q, data);
-    mstream_putc(ms, ')');
+    mstream_fmt (ms, "static struct %S*" NL "%S_open_shards(const char* const* uris)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int shard;" NL);
+    mstream_fmt (ms, "    struct %S* ctx = %S(sizeof *ctx);" NL, PREFIX(root->prefix, data), MALLOC(root->malloc, data));
+    mstream_cstr(ms, "    if (ctx == NULL)" NL);
+    mstream_cstr(ms, "        return NULL;" NL);
+    mstream_cstr(ms, "    memset(ctx, 0, sizeof *ctx);" NL NL);
+    mstream_fmt (ms, "    ctx->shards = %S(sizeof(*ctx->shards) * %d);" NL, MALLOC(root->malloc, data), root->shards);
+    mstream_cstr(ms, "    if (ctx->shards == NULL)" NL "    {" NL);
+    mstream_fmt (ms, "        %S(ctx);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "        return NULL;" NL);
+    mstream_cstr(ms, "    }" NL);
+    mstream_fmt (ms, "    memset(ctx->shards, 0, sizeof(*ctx->shards) * %d);" NL NL, root->shards);
+    mstream_fmt (ms, "    for (shard = 0; shard != %d; ++shard)" NL, root->shards);
+    mstream_fmt (ms, "        if ((ctx->shards[shard] = %S_open(uris[shard])) == NULL)" NL "        {" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            %S_close(ctx);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "            return NULL;" NL);
+    mstream_cstr(ms, "        }" NL NL);
+    mstream_cstr(ms, "    return ctx;" NL);
+    mstream_cstr(ms, "}" NL NL);
 }
 
+/*
+ * The tenant cache maps tenant IDs to open connections through a chained hash
+ * table, and keeps the connections in LRU order. All of it is guarded by a
+ * single lock: a semaphore posted once, which works as a mutex. The lock is
+ * never held while a database is opened, upgraded or closed.
+ *
+ * A connection is checked out by one caller at a time. A tenant that is being
+ * opened is in the hash table already, checked out by the thread opening it,
+ * so the file is never opened a second time. Threads asking for a tenant that
+ * is checked out count themselves in "waiters" and sleep on wait_sem, which
+ * is posted once per waiter whenever any tenant is given back or fails to
+ * open. They then look the tenant up again. Connections that fall off the end
+ * of the LRU are pushed onto the "closing" list, and a background thread
+ * closes them. Connections that are checked out are never evicted.
+ */
 static void
-write_sqlite_prepare_stmt(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+write_tenant_funcs(struct mstream* ms, const struct root* root, const char* data)
 {
-    struct arg* a;
+    mstream_fmt (ms, "struct %S_tenant" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_tenant* lru_prev;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_tenant* lru_next;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_tenant* hash_next;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S* ctx;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    unsigned long hash;" NL);
+    mstream_cstr(ms, "    int in_use;" NL);
+    mstream_cstr(ms, "    char id[1];" NL);
+    mstream_cstr(ms, "};" NL NL);
+
+    mstream_fmt (ms, "struct %S_tenants" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_tenant** buckets;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    unsigned long bucket_mask;" NL);
+    mstream_fmt (ms, "    struct %S_tenant* lru_head;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_tenant* lru_tail;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_tenant* closing;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    char* uri_fmt;" NL);
+    mstream_cstr(ms, "    int uri_split;" NL);
+    mstream_cstr(ms, "    int max_open;" NL);
+    mstream_cstr(ms, "    int open;" NL);
+    mstream_cstr(ms, "    int waiters;" NL);
+    mstream_cstr(ms, "    int sems;" NL);
+    mstream_cstr(ms, "    int started;" NL);
+    mstream_fmt (ms, "    %S_sem lock;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_sem closer_sem;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_sem wait_sem;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_thread closer;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "};" NL NL);
+
+    /* Tenant IDs become part of a file path */
+    mstream_fmt (ms, "static int" NL "%S_tenant_id_is_valid(const char* tenant_id)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (tenant_id == NULL || *tenant_id == '\\0' || *tenant_id == '.')" NL);
+    mstream_cstr(ms, "        return 0;" NL);
+    mstream_cstr(ms, "    for (; *tenant_id; ++tenant_id)" NL);
+    mstream_cstr(ms, "        if (*tenant_id == '/' || *tenant_id == '\\\\')" NL);
+    mstream_cstr(ms, "            return 0;" NL);
+    mstream_cstr(ms, "    return 1;" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-    mstream_cstr(ms, "    if (ctx->");
-    write_func_name(ms, g, q, data);
-    mstream_cstr(ms, " == NULL)" NL);
-    mstream_cstr(ms, "        if ((ret = sqlite3_prepare_v2(ctx->db," NL);
+    /* FNV-1a */
+    mstream_fmt (ms, "static unsigned long" NL "%S_tenant_hash(const char* tenant_id)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    unsigned long hash = 2166136261UL;" NL);
+    mstream_cstr(ms, "    for (; *tenant_id; ++tenant_id)" NL);
+    mstream_cstr(ms, "        hash = ((hash ^ (unsigned char)*tenant_id) * 16777619UL) & 0xFFFFFFFFUL;" NL);
+    mstream_cstr(ms, "    return hash;" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-    if (q->stmt.len)
-    {
-        int p = 0;
-        for (; p != q->stmt.len; ++p)
-            if (!isspace(data[q->stmt.off + p]))
-                break;
+    mstream_fmt (ms, "static struct %S_tenant*" NL "%S_tenants_find(struct %S_tenants* tenants, const char* tenant_id, unsigned long hash)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_tenant* tenant = tenants->buckets[hash & tenants->bucket_mask];" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    for (; tenant; tenant = tenant->hash_next)" NL);
+    mstream_cstr(ms, "        if (tenant->hash == hash && strcmp(tenant->id, tenant_id) == 0)" NL);
+    mstream_cstr(ms, "            return tenant;" NL);
+    mstream_cstr(ms, "    return NULL;" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-        mstream_cstr(ms, "            \"");
-        for (; p != q->stmt.len; ++p)
-        {
-            if (data[q->stmt.off + p] == '\n')
-            {
-                for (; p != q->stmt.len; ++p)
-                    if (!isspace(data[q->stmt.off + p + 1]))
-                        break;
-                if (p + 1 < q->stmt.len)
-                    mstream_cstr(ms, " \"" NL "            \"");
-            }
-            else if (data[q->stmt.off + p] != '\r')
-            {
-                char c = data[q->stmt.off + p];
-                if (c == '"')
-                    mstream_putc(ms, '\\');
-                mstream_putc(ms, c);
-            }
-        }
-        mstream_cstr(ms, "\"," NL);
-    }
-    else switch (q->type)
-    {
-        case QUERY_NONE: break;
-        case QUERY_UPSERT:
-            mstream_fmt(ms, "            \"INSERT INTO %S (", q->table_name, data);
+    mstream_fmt (ms, "static void" NL "%S_tenants_unhash(struct %S_tenants* tenants, struct %S_tenant* tenant)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_tenant** link = &tenants->buckets[tenant->hash & tenants->bucket_mask];" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    while (*link != tenant)" NL);
+    mstream_cstr(ms, "        link = &(*link)->hash_next;" NL);
+    mstream_cstr(ms, "    *link = tenant->hash_next;" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-            for (a = q->in_args; a; a = a->next)
-            {
-                if (a != q->in_args)
-                    mstream_cstr(ms, ", ");
-                mstream_fmt(ms, "%S", a->name, data);
-            }
-            mstream_cstr(ms, ") VALUES (");
-            for (a = q->in_args; a; a = a->next)
-            {
-                if (a != q->in_args) mstream_cstr(ms, ", ");
-                mstream_cstr(ms, "?");
-            }
-            mstream_cstr(ms, ")");
+    mstream_fmt (ms, "static void" NL "%S_tenants_lru_unlink(struct %S_tenants* tenants, struct %S_tenant* tenant)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (tenant->lru_prev)" NL);
+    mstream_cstr(ms, "        tenant->lru_prev->lru_next = tenant->lru_next;" NL);
+    mstream_cstr(ms, "    else" NL);
+    mstream_cstr(ms, "        tenants->lru_head = tenant->lru_next;" NL);
+    mstream_cstr(ms, "    if (tenant->lru_next)" NL);
+    mstream_cstr(ms, "        tenant->lru_next->lru_prev = tenant->lru_prev;" NL);
+    mstream_cstr(ms, "    else" NL);
+    mstream_cstr(ms, "        tenants->lru_tail = tenant->lru_prev;" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-            mstream_cstr(ms, " \"" NL "            \"ON CONFLICT DO UPDATE SET ");
-            for (a = q->in_args; a; a = a->next)
-            {
-                if (a != q->in_args)
-                    mstream_cstr(ms, ", ");
-                mstream_fmt(ms, "%S=excluded.%S", a->name, data, a->name, data);
-            }
+    mstream_fmt (ms, "static void" NL "%S_tenants_lru_push(struct %S_tenants* tenants, struct %S_tenant* tenant)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    tenant->lru_prev = NULL;" NL);
+    mstream_cstr(ms, "    tenant->lru_next = tenants->lru_head;" NL);
+    mstream_cstr(ms, "    if (tenants->lru_head)" NL);
+    mstream_cstr(ms, "        tenants->lru_head->lru_prev = tenant;" NL);
+    mstream_cstr(ms, "    else" NL);
+    mstream_cstr(ms, "        tenants->lru_tail = tenant;" NL);
+    mstream_cstr(ms, "    tenants->lru_head = tenant;" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-            if (q->return_name.len || q->cb_args)
-            {
-                mstream_cstr(ms, " \"" NL);
-                mstream_cstr(ms, "            \" RETURNING ");
-                if (q->return_name.len)
-                    mstream_fmt(ms, "%S", q->return_name, data);
-                for (a = q->cb_args; a; a = a->next)
-                {
-                    if (a != q->cb_args || q->return_name.len)
-                        mstream_cstr(ms, ", ");
-                    mstream_fmt(ms, "%S", a->name, data);
-                }
-            }
-            mstream_cstr(ms, ";\"," NL);
+    /* Called with the lock held */
+    mstream_fmt (ms, "static void" NL "%S_tenants_evict(struct %S_tenants* tenants)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_tenant* tenant = tenants->lru_tail;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    while (tenants->open > tenants->max_open && tenant != NULL)" NL "    {" NL);
+    mstream_fmt (ms, "        struct %S_tenant* prev = tenant->lru_prev;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        if (!tenant->in_use)" NL "        {" NL);
+    mstream_fmt (ms, "            %S_tenants_lru_unlink(tenants, tenant);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            %S_tenants_unhash(tenants, tenant);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "            tenant->hash_next = tenants->closing;" NL);
+    mstream_cstr(ms, "            tenants->closing = tenant;" NL);
+    mstream_cstr(ms, "            tenants->open--;" NL);
+    mstream_fmt (ms, "            %S_sem_post(&tenants->closer_sem);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        }" NL);
+    mstream_cstr(ms, "        tenant = prev;" NL);
+    mstream_cstr(ms, "    }" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-            break;
+    /* Called with the lock held */
+    mstream_fmt (ms, "static void" NL "%S_tenants_wake(struct %S_tenants* tenants)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    for (; tenants->waiters > 0; tenants->waiters--)" NL);
+    mstream_fmt (ms, "        %S_sem_post(&tenants->wait_sem);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
 
-        case QUERY_INSERT_NEW:
-            mstream_fmt(ms, "            \"INSERT INTO %S (", q->table_name, data);
+    /*
+     * The closer thread is posted once per evicted tenant, and once more by
+     * tenants_close(), so an empty list means that it should stop.
+     */
+    mstream_fmt (ms, "static void" NL "%S_tenants_closer_run(struct %S_tenants* tenants)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_tenant* tenant;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    for (;;)" NL "    {" NL);
+    mstream_fmt (ms, "        %S_sem_wait(&tenants->closer_sem);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S_sem_wait(&tenants->lock);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        tenant = tenants->closing;" NL);
+    mstream_cstr(ms, "        if (tenant)" NL);
+    mstream_cstr(ms, "            tenants->closing = tenant->hash_next;" NL);
+    mstream_fmt (ms, "        %S_sem_post(&tenants->lock);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        if (tenant == NULL)" NL);
+    mstream_cstr(ms, "            return;" NL NL);
+    mstream_fmt (ms, "        %S_close(tenant->ctx);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S(tenant);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "    }" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-            for (a = q->in_args; a; a = a->next)
-            {
-                if (a != q->in_args) mstream_cstr(ms, ", ");
-                mstream_fmt(ms, "%S", a->name, data);
-            }
-            mstream_cstr(ms, ") VALUES (");
-            for (a = q->in_args; a; a = a->next)
-            {
-                if (a != q->in_args)
-                    mstream_cstr(ms, ", ");
-                mstream_cstr(ms, "?");
-            }
-            mstream_cstr(ms, ")\"" NL);
+    mstream_cstr(ms, "#if defined(_WIN32)" NL);
+    mstream_fmt (ms, "static DWORD WINAPI" NL "%S_tenants_closer_entry(LPVOID tenants)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_tenants_closer_run(tenants);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return 0;" NL "}" NL NL);
+    mstream_fmt (ms, "static int" NL "%S_tenants_closer_start(struct %S_tenants* tenants)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    tenants->closer = CreateThread(NULL, 0, %S_tenants_closer_entry, tenants, 0, NULL);" NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return tenants->closer == NULL ? -1 : 0;" NL "}" NL NL);
+    mstream_fmt (ms, "static void" NL "%S_tenants_closer_join(struct %S_tenants* tenants)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    WaitForSingleObject(tenants->closer, INFINITE);" NL);
+    mstream_cstr(ms, "    CloseHandle(tenants->closer);" NL "}" NL);
+    mstream_cstr(ms, "#else" NL);
+    mstream_fmt (ms, "static void*" NL "%S_tenants_closer_entry(void* tenants)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_tenants_closer_run(tenants);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return NULL;" NL "}" NL NL);
+    mstream_fmt (ms, "static int" NL "%S_tenants_closer_start(struct %S_tenants* tenants)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    return pthread_create(&tenants->closer, NULL, %S_tenants_closer_entry, tenants) == 0 ? 0 : -1;" NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+    mstream_fmt (ms, "static void" NL "%S_tenants_closer_join(struct %S_tenants* tenants)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    pthread_join(tenants->closer, NULL);" NL "}" NL);
+    mstream_cstr(ms, "#endif" NL NL);
+
+    /* close */
+    mstream_fmt (ms, "static void" NL "%S_tenants_close(struct %S_tenants* tenants)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_tenant* tenant;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (tenants->started)" NL "    {" NL);
+    mstream_fmt (ms, "        %S_sem_post(&tenants->closer_sem);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S_tenants_closer_join(tenants);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    }" NL);
+    mstream_cstr(ms, "    while ((tenant = tenants->lru_head) != NULL)" NL "    {" NL);
+    mstream_cstr(ms, "        tenants->lru_head = tenant->lru_next;" NL);
+    mstream_fmt (ms, "        %S_close(tenant->ctx);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S(tenant);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "    }" NL);
+    mstream_cstr(ms, "    if (tenants->sems > 2)" NL);
+    mstream_fmt (ms, "        %S_sem_deinit(&tenants->wait_sem);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (tenants->sems > 1)" NL);
+    mstream_fmt (ms, "        %S_sem_deinit(&tenants->closer_sem);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (tenants->sems > 0)" NL);
+    mstream_fmt (ms, "        %S_sem_deinit(&tenants->lock);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (tenants->uri_fmt)" NL);
+    mstream_fmt (ms, "        %S(tenants->uri_fmt);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "    if (tenants->buckets)" NL);
+    mstream_fmt (ms, "        %S(tenants->buckets);" NL, FREE(root->free, data));
+    mstream_fmt (ms, "    %S(tenants);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "}" NL NL);
 
-            mstream_cstr(ms, "            \" RETURNING ");
-            if (q->return_name.len)
-                mstream_fmt(ms, "%S", q->return_name, data);
-            for (a = q->cb_args; a; a = a->next)
-            {
-                if (a != q->cb_args || q->return_name.len)
-                    mstream_cstr(ms, ", ");
-                mstream_fmt(ms, "%S", a->name, data);
-            }
-            mstream_cstr(ms, ";\"," NL);
+    /* open */
+    mstream_fmt (ms, "static struct %S_tenants*" NL "%S_tenants_open(const char* uri_fmt, int max_open)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_tenants* tenants;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    const char* split = strstr(uri_fmt, \"%s\");" NL);
+    mstream_cstr(ms, "    unsigned long buckets = 16;" NL NL);
+    mstream_cstr(ms, "    if (split == NULL || strstr(split + 2, \"%s\") != NULL)" NL "    {" NL);
+    mstream_fmt (ms, "        %S(\"Tenant URI \\\"%%s\\\" must contain \\\"%%%%s\\\" exactly once\\n\", uri_fmt);" NL,
+        LOG_ERR(root->log_err, data));
+    mstream_cstr(ms, "        return NULL;" NL "    }" NL);
+    mstream_cstr(ms, "    if (max_open < 1)" NL "        return NULL;" NL);
+    mstream_cstr(ms, "    while (buckets < (unsigned long)max_open * 2)" NL);
+    mstream_cstr(ms, "        buckets *= 2;" NL NL);
+    mstream_fmt (ms, "    tenants = %S(sizeof *tenants);" NL, MALLOC(root->malloc, data));
+    mstream_cstr(ms, "    if (tenants == NULL)" NL "        return NULL;" NL);
+    mstream_cstr(ms, "    memset(tenants, 0, sizeof *tenants);" NL);
+    mstream_cstr(ms, "    tenants->bucket_mask = buckets - 1;" NL);
+    mstream_cstr(ms, "    tenants->uri_split = (int)(split - uri_fmt);" NL);
+    mstream_cstr(ms, "    tenants->max_open = max_open;" NL NL);
+    mstream_fmt (ms, "    tenants->buckets = %S(sizeof(*tenants->buckets) * buckets);" NL, MALLOC(root->malloc, data));
+    mstream_cstr(ms, "    if (tenants->buckets == NULL)" NL "        goto open_failed;" NL);
+    mstream_cstr(ms, "    memset(tenants->buckets, 0, sizeof(*tenants->buckets) * buckets);" NL);
+    mstream_fmt (ms, "    tenants->uri_fmt = %S(strlen(uri_fmt) + 1);" NL, MALLOC(root->malloc, data));
+    mstream_cstr(ms, "    if (tenants->uri_fmt == NULL)" NL "        goto open_failed;" NL);
+    mstream_cstr(ms, "    strcpy(tenants->uri_fmt, uri_fmt);" NL NL);
+    mstream_fmt (ms, "    if (%S_sem_init(&tenants->lock) != 0)" NL "        goto open_failed;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    tenants->sems++;" NL);
+    mstream_fmt (ms, "    %S_sem_post(&tenants->lock);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    if (%S_sem_init(&tenants->closer_sem) != 0)" NL "        goto open_failed;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    tenants->sems++;" NL);
+    mstream_fmt (ms, "    if (%S_sem_init(&tenants->wait_sem) != 0)" NL "        goto open_failed;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    tenants->sems++;" NL);
+    mstream_fmt (ms, "    if (%S_tenants_closer_start(tenants) != 0)" NL "        goto open_failed;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    tenants->started = 1;" NL NL);
+    mstream_cstr(ms, "    return tenants;" NL NL);
+    mstream_cstr(ms, "open_failed:" NL);
+    mstream_fmt (ms, "    %S_tenants_close(tenants);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return NULL;" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-            break;
+    /* get */
+    mstream_fmt (ms, "static struct %S*" NL "%S_tenant_get(struct %S_tenants* tenants, const char* tenant_id)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_tenant* tenant;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S* ctx;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    char* uri;" NL);
+    mstream_cstr(ms, "    size_t len;" NL);
+    mstream_cstr(ms, "    unsigned long hash;" NL NL);
+    mstream_fmt (ms, "    if (!%S_tenant_id_is_valid(tenant_id))" NL "    {" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S(\"Invalid tenant ID \\\"%%s\\\"\\n\", tenant_id ? tenant_id : \"\");" NL,
+        LOG_ERR(root->log_err, data));
+    mstream_cstr(ms, "        return NULL;" NL "    }" NL);
+    mstream_fmt (ms, "    hash = %S_tenant_hash(tenant_id);" NL NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    for (;;)" NL "    {" NL);
+    mstream_fmt (ms, "        %S_sem_wait(&tenants->lock);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        tenant = %S_tenants_find(tenants, tenant_id, hash);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        if (tenant == NULL)" NL);
+    mstream_cstr(ms, "            break;" NL);
+    mstream_cstr(ms, "        if (!tenant->in_use)" NL "        {" NL);
+    mstream_cstr(ms, "            tenant->in_use = 1;" NL);
+    mstream_fmt (ms, "            %S_tenants_lru_unlink(tenants, tenant);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            %S_tenants_lru_push(tenants, tenant);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            %S_sem_post(&tenants->lock);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "            return tenant->ctx;" NL "        }" NL NL);
+    mstream_cstr(ms, "        /* Another thread is using, opening or upgrading this tenant */" NL);
+    mstream_cstr(ms, "        tenants->waiters++;" NL);
+    mstream_fmt (ms, "        %S_sem_post(&tenants->lock);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S_sem_wait(&tenants->wait_sem);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    }" NL NL);
 
-        case QUERY_INSERT_OR_GET:
-            if (q->return_name.len || q->cb_args)
-                mstream_fmt(ms, "            \"INSERT INTO %S (", q->table_name, data);
-            else
-                mstream_fmt(ms, "            \"INSERT OR IGNORE INTO %S (", q->table_name, data);
+    mstream_cstr(ms, "    len = strlen(tenant_id);" NL);
+    mstream_fmt (ms, "    tenant = %S(sizeof *tenant + len);" NL, MALLOC(root->malloc, data));
+    mstream_cstr(ms, "    if (tenant == NULL)" NL "    {" NL);
+    mstream_fmt (ms, "        %S_sem_post(&tenants->lock);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        return NULL;" NL "    }" NL);
+    mstream_cstr(ms, "    memset(tenant, 0, sizeof *tenant);" NL);
+    mstream_cstr(ms, "    memcpy(tenant->id, tenant_id, len + 1);" NL);
+    mstream_cstr(ms, "    tenant->hash = hash;" NL);
+    mstream_cstr(ms, "    tenant->in_use = 1;" NL);
+    mstream_cstr(ms, "    tenant->hash_next = tenants->buckets[hash & tenants->bucket_mask];" NL);
+    mstream_cstr(ms, "    tenants->buckets[hash & tenants->bucket_mask] = tenant;" NL);
+    mstream_fmt (ms, "    %S_sem_post(&tenants->lock);" NL NL, PREFIX(root->prefix, data));
+
+    mstream_cstr(ms, "    ctx = NULL;" NL);
+    mstream_fmt (ms, "    uri = %S(strlen(tenants->uri_fmt) - 2 + len + 1);" NL, MALLOC(root->malloc, data));
+    mstream_cstr(ms, "    if (uri != NULL)" NL "    {" NL);
+    mstream_cstr(ms, "        memcpy(uri, tenants->uri_fmt, (size_t)tenants->uri_split);" NL);
+    mstream_cstr(ms, "        memcpy(uri + tenants->uri_split, tenant_id, len);" NL);
+    mstream_cstr(ms, "        strcpy(uri + tenants->uri_split + len, tenants->uri_fmt + tenants->uri_split + 2);" NL);
+    mstream_fmt (ms, "        ctx = %S_open(uri);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S(uri);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "    }" NL);
+    mstream_fmt (ms, "    if (ctx != NULL && (%S_upgrade(ctx) != 0", PREFIX(root->prefix, data));
+    if (root->prepare_eager)
+        mstream_fmt (ms, " || %S_prepare_all(ctx) != 0", PREFIX(root->prefix, data));
+    mstream_cstr(ms, "))" NL "    {" NL);
+    mstream_fmt (ms, "        %S_close(ctx);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        ctx = NULL;" NL "    }" NL NL);
+
+    mstream_fmt (ms, "    %S_sem_wait(&tenants->lock);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (ctx == NULL)" NL "    {" NL);
+    mstream_fmt (ms, "        %S_tenants_unhash(tenants, tenant);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S_tenants_wake(tenants);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S_sem_post(&tenants->lock);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S(tenant);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "        return NULL;" NL "    }" NL);
+    mstream_cstr(ms, "    ctx->tenant = tenant;" NL);
+    mstream_cstr(ms, "    tenant->ctx = ctx;" NL);
+    mstream_fmt (ms, "    %S_tenants_lru_push(tenants, tenant);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    tenants->open++;" NL);
+    mstream_fmt (ms, "    %S_tenants_evict(tenants);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_sem_post(&tenants->lock);" NL NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return ctx;" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-            for (a = q->in_args; a; a = a->next)
-            {
-                if (a != q->in_args) mstream_cstr(ms, ", ");
-                mstream_fmt(ms, "%S", a->name, data);
-            }
-            mstream_cstr(ms, ") VALUES (");
-            for (a = q->in_args; a; a = a->next)
-            {
-                if (a != q->in_args)
-                    mstream_cstr(ms, ", ");
-                mstream_cstr(ms, "?");
-            }
-            mstream_cstr(ms, ")");
+    /* release */
+    mstream_fmt (ms, "static void" NL "%S_tenant_release(struct %S_tenants* tenants, struct %S* ctx)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_sem_wait(&tenants->lock);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    ctx->tenant->in_use = 0;" NL);
+    mstream_fmt (ms, "    %S_tenants_evict(tenants);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_tenants_wake(tenants);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_sem_post(&tenants->lock);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+}
 
-            if (q->return_name.len || q->cb_args)
-            {
-                /*
-                 * Have to re-insert a value to trigger the RETURNING statement.
-                 * In SQLite, a column named "rowid" is guaranteed to always exist,
-                 * and its datatype is trivial to copy.
-                 */
-                mstream_cstr(ms, " \"" NL);
-                mstream_cstr(ms, "            \"ON CONFLICT DO UPDATE SET rowid=rowid RETURNING ");
-                if (q->return_name.len)
-                    mstream_fmt(ms, "%S", q->return_name, data);
-                for (a = q->cb_args; a; a = a->next)
-                {
-                    if (a != q->cb_args || q->return_name.len)
-                        mstream_cstr(ms, ", ");
-                    mstream_fmt(ms, "%S", a->name, data);
-                }
-            }
-            mstream_cstr(ms, ";\"," NL);
+/*
+ * The executor owns one writer thread and N reader threads, each with its own
+ * connection. Every worker drains its own lock-free MPSC queue (Vyukov's
+ * intrusive queue), so submitting a query never takes a lock. Read-only
+ * queries are distributed over the readers round-robin.
+ *
+ * "pending" counts queued jobs minus waiting workers. A worker only sleeps on
+ * the semaphore if it drops below zero, and a producer only posts it if the
+ * worker is asleep, so the semaphore is not touched while the worker is busy.
+ *
+ * Finished jobs either call their completion callback on the worker thread,
+ * or are pushed onto the "done" queue, in which case notify_fd is written
+ * to and executor_poll() delivers the callbacks on the caller's thread.
+ *
+ * With group commit, the writer wraps each job it dequeues in a transaction
+ * together with whatever else arrives within the configured window, and only
+ * completes the jobs once the transaction has been committed.
+ */
+static void
+write_executor_funcs(struct mstream* ms, const struct root* root, const char* data)
+{
+    /* Structures */
+    mstream_fmt (ms, "struct %S_job" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    volatile long long next;" NL);
+    mstream_fmt (ms, "    int (*run)(struct %S* ctx, struct %S_job* job);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    void (*on_done)(int result, void* user_data);" NL);
+    mstream_cstr(ms, "    void* user_data;" NL);
+    mstream_cstr(ms, "    int result;" NL);
+    mstream_cstr(ms, "};" NL NL);
+
+    mstream_fmt (ms, "struct %S_queue" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    volatile long long head;" NL);
+    mstream_cstr(ms, "    volatile long long pending;" NL);
+    mstream_fmt (ms, "    struct %S_job* tail;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_job stub;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_sem sem;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "};" NL NL);
+
+    mstream_fmt (ms, "struct %S_worker" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_executor* exec;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S* ctx;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_queue queue;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_job stop;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_thread thread;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "};" NL NL);
+
+    mstream_fmt (ms, "struct %S_executor" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_worker* workers; /* [0] is the writer */" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_queue done;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    volatile long long next_reader;" NL);
+    mstream_cstr(ms, "    int readers;" NL);
+    mstream_cstr(ms, "    int count;" NL);
+    mstream_cstr(ms, "    int started;" NL);
+    mstream_cstr(ms, "    int notify_fd;" NL);
+    mstream_cstr(ms, "};" NL NL);
+
+    /* Queue */
+    mstream_fmt (ms, "static void" NL "%S_queue_init(struct %S_queue* queue)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    queue->stub.next = 0;" NL);
+    mstream_cstr(ms, "    queue->head = (long long)(size_t)&queue->stub;" NL);
+    mstream_cstr(ms, "    queue->tail = &queue->stub;" NL);
+    mstream_cstr(ms, "    queue->pending = 0;" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-            break;
+    mstream_fmt (ms, "static void" NL "%S_queue_push(struct %S_queue* queue, struct %S_job* job)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_job* prev;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_atomic_store(&job->next, 0);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    prev = (struct %S_job*)(size_t)%S_atomic_exchange(&queue->head, (long long)(size_t)job);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_atomic_store(&prev->next, (long long)(size_t)job);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
 
-        case QUERY_DELETE:
-        case QUERY_UPDATE: {
-            char first;
-            mstream_cstr(ms, "            \"");
-            mstream_cstr(ms, q->type == QUERY_UPDATE ? "UPDATE" : "DELETE FROM");
+    mstream_cstr(ms, "/* Must only be called by the consumer. Returns NULL if the queue is empty, or" NL);
+    mstream_cstr(ms, " * if a producer has not finished linking its job yet */" NL);
+    mstream_fmt (ms, "static struct %S_job*" NL "%S_queue_pop(struct %S_queue* queue)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_job* tail = queue->tail;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_job* next = (struct %S_job*)(size_t)%S_atomic_load(&tail->next);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (tail == &queue->stub)" NL "    {" NL);
+    mstream_cstr(ms, "        if (next == NULL)" NL);
+    mstream_cstr(ms, "            return NULL;" NL);
+    mstream_cstr(ms, "        queue->tail = tail = next;" NL);
+    mstream_fmt (ms, "        next = (struct %S_job*)(size_t)%S_atomic_load(&next->next);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    }" NL);
+    mstream_cstr(ms, "    if (next != NULL)" NL "    {" NL);
+    mstream_cstr(ms, "        queue->tail = next;" NL);
+    mstream_cstr(ms, "        return tail;" NL);
+    mstream_cstr(ms, "    }" NL);
+    mstream_fmt (ms, "    if (tail != (struct %S_job*)(size_t)%S_atomic_load(&queue->head))" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        return NULL;" NL);
+    mstream_cstr(ms, "    /* Last job in the queue. Put the stub back so it can be unlinked */" NL);
+    mstream_fmt (ms, "    %S_queue_push(queue, &queue->stub);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    next = (struct %S_job*)(size_t)%S_atomic_load(&tail->next);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (next == NULL)" NL);
+    mstream_cstr(ms, "        return NULL;" NL);
+    mstream_cstr(ms, "    queue->tail = next;" NL);
+    mstream_cstr(ms, "    return tail;" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-            mstream_fmt(ms, " %S ",
-                    q->table_name, data);
-            if (q->type == QUERY_UPDATE)
-                mstream_cstr(ms, "SET ");
+    mstream_fmt (ms, "static void" NL "%S_queue_post(struct %S_queue* queue, struct %S_job* job)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_queue_push(queue, job);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    if (%S_atomic_add(&queue->pending, 1) < 0)" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S_sem_post(&queue->sem);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
 
-            /* SET ... */
-            first = 1;
-            for (a = q->in_args; a; a = a->next)
-                if (a->update)
-                {
-                    if (!first)
-                        mstream_cstr(ms, ", ");
-                    mstream_fmt(ms, "%S=?", a->name, data);
-                    first = 0;
-                }
+    mstream_fmt (ms, "static struct %S_job*" NL "%S_queue_wait(struct %S_queue* queue)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_job* job;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    if (%S_atomic_add(&queue->pending, -1) <= 0)" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S_sem_wait(&queue->sem);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    while ((job = %S_queue_pop(queue)) == NULL)" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S_thread_yield();" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return job;" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-            /* WHERE ... */
-            first = 1;
-            for (a = q->in_args; a; a = a->next)
-                if (!a->update)
-                {
-                    if (first)
-                        mstream_cstr(ms, " WHERE ");
-                    else
-                        mstream_cstr(ms, " AND ");
-                    mstream_fmt(ms, "%S=?", a->name, data);
-                    first = 0;
-                }
+    if (root->group_commit_ops)
+    {
+        mstream_cstr(ms, "#if defined(_WIN32)" NL);
+        mstream_fmt (ms, "static long long" NL "%S_group_now(void)" NL "{" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    LARGE_INTEGER freq, now;" NL);
+        mstream_cstr(ms, "    QueryPerformanceFrequency(&freq);" NL);
+        mstream_cstr(ms, "    QueryPerformanceCounter(&now);" NL);
+        mstream_cstr(ms, "    return (long long)((double)now.QuadPart * 1e6 / (double)freq.QuadPart);" NL);
+        mstream_cstr(ms, "}" NL);
+        mstream_cstr(ms, "#else" NL);
+        mstream_fmt (ms, "static long long" NL "%S_group_now(void)" NL "{" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    struct timespec ts;" NL);
+        mstream_cstr(ms, "    clock_gettime(CLOCK_MONOTONIC, &ts);" NL);
+        mstream_cstr(ms, "    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;" NL);
+        mstream_cstr(ms, "}" NL);
+        mstream_cstr(ms, "#endif" NL NL);
+
+        /* If the wait times out, the consumer takes back its decrement of
+         * "pending". A producer that saw the decrement has posted the
+         * semaphore though, and then the job it pushed is taken after all. */
+        mstream_cstr(ms, "/* Like queue_wait(), but gives up and returns NULL at the deadline */" NL);
+        mstream_fmt (ms, "static struct %S_job*" NL "%S_queue_wait_until(struct %S_queue* queue, long long deadline)" NL "{" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_fmt (ms, "    struct %S_job* job;" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    long long left;" NL);
+        mstream_fmt (ms, "    if (%S_atomic_add(&queue->pending, -1) <= 0)" NL "    {" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "        left = deadline - %S_group_now();" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "        if (left <= 0 || %S_sem_wait_us(&queue->sem, left) != 0)" NL "        {" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "            if (%S_atomic_add(&queue->pending, 1) < 0)" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "                return NULL;" NL);
+        mstream_fmt (ms, "            %S_sem_wait(&queue->sem);" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "            %S_atomic_add(&queue->pending, -1);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        }" NL);
+        mstream_cstr(ms, "    }" NL);
+        mstream_fmt (ms, "    while ((job = %S_queue_pop(queue)) == NULL)" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "        %S_thread_yield();" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    return job;" NL);
+        mstream_cstr(ms, "}" NL NL);
+    }
 
-            /* RETURNING ... */
-            if (q->return_name.len || q->cb_args)
-            {
-                mstream_cstr(ms, " \"" NL);
-                mstream_cstr(ms, "            \"RETURNING ");
-                if (q->return_name.len)
-                    mstream_fmt(ms, "%S", q->return_name, data);
-                for (a = q->cb_args; a; a = a->next)
-                {
-                    if (a != q->cb_args || q->return_name.len)
-                        mstream_cstr(ms, ", ");
-                    mstream_fmt(ms, "%S", a->name, data);
-                }
-            }
+    /* Workers */
+    mstream_fmt (ms, "static void" NL "%S_executor_complete(struct %S_executor* exec, struct %S_job* job)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (exec->notify_fd < 0)" NL "    {" NL);
+    mstream_cstr(ms, "        if (job->on_done)" NL);
+    mstream_cstr(ms, "            job->on_done(job->result, job->user_data);" NL);
+    mstream_fmt (ms, "        %S(job);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "        return;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+    mstream_fmt (ms, "    %S_queue_push(&exec->done, job);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "#if !defined(_WIN32)" NL "    {" NL);
+    mstream_cstr(ms, "        /* Works with both eventfd and pipes. If the write fails, then the" NL);
+    mstream_cstr(ms, "         * counter or pipe is full and a wakeup is pending anyway */" NL);
+    mstream_cstr(ms, "        unsigned long long one = 1;" NL);
+    mstream_cstr(ms, "        ssize_t written = write(exec->notify_fd, &one, sizeof one);" NL);
+    mstream_cstr(ms, "        (void)written;" NL);
+    mstream_cstr(ms, "    }" NL "#endif" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-            mstream_cstr(ms, ";\"," NL);
-        } break;
+    if (root->group_commit_ops)
+    {
+        mstream_fmt (ms, "static void" NL "%S_writer_run(struct %S_worker* worker)" NL "{" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_fmt (ms, "    struct %S_job* group[%d];" NL, PREFIX(root->prefix, data), root->group_commit_ops);
+        mstream_fmt (ms, "    struct %S_job* job;" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    long long deadline;" NL);
+        mstream_cstr(ms, "    int count, in_tx, i;" NL NL);
+        mstream_fmt (ms, "    job = %S_queue_wait(&worker->queue);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    while (job != &worker->stop)" NL "    {" NL);
+        mstream_cstr(ms, "        /* If the transaction can't be started, the job runs on its own */" NL);
+        mstream_fmt (ms, "        in_tx = %S_begin_immediate(worker->ctx) == 0;" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "        deadline = %S_group_now() + %d;" NL, PREFIX(root->prefix, data), root->group_commit_us);
+        mstream_cstr(ms, "        count = 0;" NL);
+        mstream_cstr(ms, "        for (;;)" NL "        {" NL);
+        mstream_cstr(ms, "            job->result = job->run(worker->ctx, job);" NL);
+        mstream_cstr(ms, "            group[count++] = job;" NL);
+        mstream_cstr(ms, "            job = NULL;" NL);
+        mstream_cstr(ms, "            if (!in_tx)" NL);
+        mstream_cstr(ms, "                break;" NL);
+        mstream_cstr(ms, "            /* Some errors roll back the whole transaction, which also undoes the" NL);
+        mstream_cstr(ms, "             * jobs before this one */" NL);
+        mstream_cstr(ms, "            if (sqlite3_get_autocommit(worker->ctx->db))" NL "            {" NL);
+        mstream_cstr(ms, "                for (i = 0; i != count - 1; ++i)" NL);
+        mstream_cstr(ms, "                    group[i]->result = -1;" NL);
+        mstream_cstr(ms, "                in_tx = 0;" NL);
+        mstream_cstr(ms, "                break;" NL);
+        mstream_cstr(ms, "            }" NL);
+        mstream_fmt (ms, "            if (count == %d)" NL, root->group_commit_ops);
+        mstream_cstr(ms, "                break;" NL);
+        mstream_fmt (ms, "            job = %S_queue_wait_until(&worker->queue, deadline);" NL,
+            PREFIX(root->prefix, data));
+        mstream_cstr(ms, "            if (job == NULL || job == &worker->stop)" NL);
+        mstream_cstr(ms, "                break;" NL);
+        mstream_cstr(ms, "        }" NL NL);
+        mstream_fmt (ms, "        if (in_tx && %S_commit(worker->ctx) != 0)" NL "        {" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "            if (!sqlite3_get_autocommit(worker->ctx->db))" NL);
+        mstream_fmt (ms, "                %S_rollback(worker->ctx);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "            for (i = 0; i != count; ++i)" NL);
+        mstream_cstr(ms, "                group[i]->result = -1;" NL);
+        mstream_cstr(ms, "        }" NL);
+        mstream_cstr(ms, "        /* Results are only delivered once they are durable */" NL);
+        mstream_cstr(ms, "        for (i = 0; i != count; ++i)" NL);
+        mstream_fmt (ms, "            %S_executor_complete(worker->exec, group[i]);" NL NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        if (job == NULL)" NL);
+        mstream_fmt (ms, "            job = %S_queue_wait(&worker->queue);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    }" NL);
+        mstream_cstr(ms, "}" NL NL);
+    }
 
-        case QUERY_EXISTS:
-            mstream_fmt(ms, "            \"SELECT 1 FROM %S", q->table_name, data);
-            for (a = q->in_args; a; a = a->next)
-            {
-                if (a == q->in_args) mstream_cstr(ms, " \"" NL "            \"WHERE ");
-                else                 mstream_cstr(ms, " AND ");
-                mstream_fmt(ms, "%S=?", a->name, data);
-            }
-            mstream_cstr(ms, " LIMIT 1;\"," NL);
-            break;
+    mstream_fmt (ms, "static void" NL "%S_worker_run(struct %S_worker* worker)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_job* job;" NL, PREFIX(root->prefix, data));
+    if (root->group_commit_ops)
+    {
+        mstream_cstr(ms, "    if (worker == &worker->exec->workers[0])" NL "    {" NL);
+        mstream_fmt (ms, "        %S_writer_run(worker);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        return;" NL "    }" NL);
+    }
+    mstream_fmt (ms, "    while ((job = %S_queue_wait(&worker->queue)) != &worker->stop)" NL "    {" NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        job->result = job->run(worker->ctx, job);" NL);
+    mstream_fmt (ms, "        %S_executor_complete(worker->exec, job);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    }" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-        case QUERY_SELECT_FIRST:
-        case QUERY_SELECT_ALL:
-            mstream_cstr(ms, "            \"SELECT ");
-            if (q->return_name.len)
-                mstream_fmt(ms, "%S", q->return_name, data);
-            for (a = q->cb_args; a; a = a->next)
-            {
-                if (a != q->cb_args || q->return_name.len) mstream_cstr(ms, ", ");
-                mstream_fmt(ms, "%S", a->name, data);
-            }
-            mstream_fmt(ms, " FROM %S", q->table_name, data);
+    mstream_cstr(ms, "#if defined(_WIN32)" NL);
+    mstream_fmt (ms, "static DWORD WINAPI" NL "%S_worker_entry(LPVOID worker)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_worker_run(worker);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return 0;" NL "}" NL NL);
+    mstream_fmt (ms, "static int" NL "%S_thread_start(struct %S_worker* worker)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    worker->thread = CreateThread(NULL, 0, %S_worker_entry, worker, 0, NULL);" NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return worker->thread == NULL ? -1 : 0;" NL "}" NL NL);
+    mstream_fmt (ms, "static void" NL "%S_thread_join(struct %S_worker* worker)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    WaitForSingleObject(worker->thread, INFINITE);" NL);
+    mstream_cstr(ms, "    CloseHandle(worker->thread);" NL "}" NL);
+    mstream_cstr(ms, "#else" NL);
+    mstream_fmt (ms, "static void*" NL "%S_worker_entry(void* worker)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_worker_run(worker);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return NULL;" NL "}" NL NL);
+    mstream_fmt (ms, "static int" NL "%S_thread_start(struct %S_worker* worker)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    return pthread_create(&worker->thread, NULL, %S_worker_entry, worker) == 0 ? 0 : -1;" NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+    mstream_fmt (ms, "static void" NL "%S_thread_join(struct %S_worker* worker)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    pthread_join(worker->thread, NULL);" NL "}" NL);
+    mstream_cstr(ms, "#endif" NL NL);
+
+    /* submit */
+    mstream_fmt (ms, "static void" NL "%S_executor_submit(struct %S_executor* exec, struct %S_job* job, int read_only)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_worker* worker = &exec->workers[0];" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (read_only && exec->readers > 0)" NL);
+    mstream_fmt (ms, "        worker = &exec->workers[1 + (int)((unsigned long long)%S_atomic_add(&exec->next_reader, 1) %% (unsigned)exec->readers)];" NL,
+        PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_queue_post(&worker->queue, job);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
 
-            for (a = q->in_args; a; a = a->next)
-            {
-                if (a == q->in_args) mstream_cstr(ms, " \"" NL "            \"WHERE ");
-                else                 mstream_cstr(ms, " AND ");
-                mstream_fmt(ms, "%S=?", a->name, data);
-            }
+    /* poll */
+    mstream_fmt (ms, "static int" NL "%S_executor_poll(struct %S_executor* exec)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_job* job;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int count = 0;" NL);
+    mstream_fmt (ms, "    while ((job = %S_queue_pop(&exec->done)) != NULL)" NL "    {" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        if (job->on_done)" NL);
+    mstream_cstr(ms, "            job->on_done(job->result, job->user_data);" NL);
+    mstream_fmt (ms, "        %S(job);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "        count++;" NL);
+    mstream_cstr(ms, "    }" NL);
+    mstream_cstr(ms, "    return count;" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-            if (q->type == QUERY_SELECT_FIRST)
-                mstream_cstr(ms, " LIMIT 1");
+    /* close */
+    mstream_fmt (ms, "static void" NL "%S_executor_close(struct %S_executor* exec)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int i;" NL NL);
+    mstream_cstr(ms, "    /* Workers process their entire queue before reaching the stop job */" NL);
+    mstream_cstr(ms, "    for (i = 0; i != exec->started; ++i)" NL);
+    mstream_fmt (ms, "        %S_queue_post(&exec->workers[i].queue, &exec->workers[i].stop);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    for (i = 0; i != exec->started; ++i)" NL);
+    mstream_fmt (ms, "        %S_thread_join(&exec->workers[i]);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_executor_poll(exec);" NL NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    for (i = 0; i != exec->count; ++i)" NL "    {" NL);
+    mstream_fmt (ms, "        %S_sem_deinit(&exec->workers[i].queue.sem);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S_close(exec->workers[i].ctx);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    }" NL);
+    mstream_cstr(ms, "    if (exec->workers)" NL);
+    mstream_fmt (ms, "        %S(exec->workers);" NL, FREE(root->free, data));
+    mstream_fmt (ms, "    %S(exec);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "}" NL NL);
 
-            mstream_cstr(ms, ";\"," NL);
-            break;
+    /* open */
+    mstream_fmt (ms, "static struct %S_executor*" NL "%S_executor_open(const char* uri, int readers, int notify_fd)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_executor* exec;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int i;" NL NL);
+    mstream_cstr(ms, "    if (readers < 0)" NL "        return NULL;" NL);
+    mstream_fmt (ms, "    exec = %S(sizeof *exec);" NL, MALLOC(root->malloc, data));
+    mstream_cstr(ms, "    if (exec == NULL)" NL "        return NULL;" NL);
+    mstream_cstr(ms, "    memset(exec, 0, sizeof *exec);" NL);
+    mstream_fmt (ms, "    %S_queue_init(&exec->done);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    exec->readers = readers;" NL);
+    mstream_cstr(ms, "    exec->notify_fd = notify_fd;" NL NL);
+    mstream_fmt (ms, "    exec->workers = %S(sizeof(*exec->workers) * (size_t)(readers + 1));" NL, MALLOC(root->malloc, data));
+    mstream_cstr(ms, "    if (exec->workers == NULL)" NL "        goto open_failed;" NL);
+    mstream_cstr(ms, "    memset(exec->workers, 0, sizeof(*exec->workers) * (size_t)(readers + 1));" NL NL);
+    mstream_cstr(ms, "    for (i = 0; i != readers + 1; ++i)" NL "    {" NL);
+    mstream_fmt (ms, "        struct %S_worker* worker = &exec->workers[i];" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        worker->exec = exec;" NL);
+    mstream_fmt (ms, "        worker->ctx = %S_open_ex(uri, i == 0 ?" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "            SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX :" NL);
+    mstream_cstr(ms, "            SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX);" NL);
+    mstream_cstr(ms, "        if (worker->ctx == NULL)" NL "            goto open_failed;" NL);
+    if (root->prepare_eager)
+    {
+        mstream_fmt (ms, "        if (%S_prepare_all(worker->ctx) != 0)" NL "        {" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "            %S_close(worker->ctx);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "            goto open_failed;" NL "        }" NL);
     }
+    mstream_fmt (ms, "        %S_queue_init(&worker->queue);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        if (%S_sem_init(&worker->queue.sem) != 0)" NL "        {" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            %S_close(worker->ctx);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "            goto open_failed;" NL "        }" NL);
+    mstream_cstr(ms, "        exec->count++;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+    mstream_cstr(ms, "    for (i = 0; i != exec->count; ++i)" NL "    {" NL);
+    mstream_fmt (ms, "        if (%S_thread_start(&exec->workers[i]) != 0)" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "            goto open_failed;" NL);
+    mstream_cstr(ms, "        exec->started++;" NL);
+    mstream_cstr(ms, "    }" NL NL);
+    mstream_cstr(ms, "    return exec;" NL NL);
+    mstream_cstr(ms, "open_failed:" NL);
+    mstream_fmt (ms, "    %S_executor_close(exec);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return NULL;" NL);
+    mstream_cstr(ms, "}" NL NL);
+}
 
-    mstream_cstr(ms, "            -1, &ctx->");
-    write_func_name(ms, g, q, data);
-    mstream_cstr(ms, ", NULL)) != SQLITE_OK)" NL);
-    mstream_cstr(ms, "        {" NL);
-    mstream_fmt(ms, "            %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
-                LOG_SQL_ERR(root->log_sql_err, data));
-    mstream_cstr(ms, "            return -1;" NL);
-    mstream_cstr(ms, "        }" NL NL);
+/*!
+ * \brief Text and blob arguments point into memory owned by the caller, which
+ * may be gone by the time the query runs, so async jobs keep a copy.
+ */
+static int
+async_arg_needs_copy(const struct arg* a)
+{
+    return strcmp(a->sql_type, "text") == 0 || strcmp(a->sql_type, "blob") == 0;
 }
 
 static void
-write_sqlite_bind_args(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+write_async_func_param_list(struct mstream* ms, const struct root* root, const struct query* q, const char* data)
 {
     struct arg* a;
-    int i = 1;
-    int update_pass = 1;
-    int first = 1;
 
-    if (q->bind_args == NULL)
-        return;
+    mstream_fmt(ms, "struct %S_executor* exec", PREFIX(root->prefix, data));
 
-again:
-    a = q->bind_args;
-    for (; a; a = a->next)
+    for (a = q->in_args; a; a = a->next)
     {
-        if (a->update != update_pass)
-            continue;
-
-        if (first) mstream_cstr(ms, "    if ((ret = ");
-        else mstream_cstr(ms, " ||" NL "        (ret = ");
-        first = 0;
+        mstream_fmt(ms, ", %S %S", a->type, data, a->name, data);
+        if (a->has_hidden_len_param)
+            mstream_fmt(ms, ", int %S_len", a->name, data);
+    }
 
-        if (a->nullable)
-        {
-            mstream_fmt(ms, "%S %s %s ? sqlite3_bind_null(ctx->", a->name, data, a->compare_op, a->null_value);
-            write_func_name(ms, g, q, data);
-            mstream_fmt(ms, ", %d) : ", i);
-        }
-        mstream_fmt(ms, "sqlite3_bind_%s(ctx->", a->sql_type);
-        write_func_name(ms, g, q, data);
-        mstream_fmt(ms, ", %d, %s%S", i, a->cast_to_sql, a->name, data);
-
-        if (cstr_eq_str("struct str_view", a->type, data))
-            mstream_fmt(ms, ".data, %S.len, SQLITE_STATIC", a->name, data);
-        else if (cstr_eq_str("struct strview", a->type, data))
-            mstream_fmt(ms, ".data, %S.len, SQLITE_STATIC", a->name, data);
-        else if (cstr_eq_str("const char*", a->type, data))
-            mstream_cstr(ms, ", -1, SQLITE_STATIC");
-        else if (cstr_eq_str("const void*", a->type, data))
-            mstream_fmt(ms, ", %S_len, SQLITE_STATIC", a->name, data);
-        mstream_cstr(ms, ")) != SQLITE_OK");
+    if (q->return_arg)
+        mstream_fmt(ms, ", %S* %S", q->return_arg->type, data, q->return_arg->name, data);
 
-        i++;
+    if (q->cb_args)
+    {
+        mstream_cstr(ms, ", ");
+        write_on_row_decl(ms, q, data);
     }
+    mstream_cstr(ms, ", void (*on_done)(int result, void* user_data), void* user_data");
+}
 
-    if (update_pass--)
-        goto again;
-
-    mstream_cstr(ms, ")" NL "    {" NL);
-    mstream_fmt(ms, "        %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
-        LOG_SQL_ERR(root->log_sql_err, data));
-    mstream_cstr(ms, "        return -1;" NL "    }" NL NL);
+static void
+write_async_func_ptr_decl(struct mstream* ms, const struct root* root, const struct query* q, const char* data)
+{
+    mstream_cstr(ms, "int (*");
+    mstream_str(ms, q->name, data);
+    mstream_cstr(ms, "_async)(");
+    write_async_func_param_list(ms, root, q, data);
+    mstream_putc(ms, ')');
 }
 
+/*
+ * The job structure stores a copy of all arguments. Strings and blobs are
+ * copied into the same allocation, right after the structure.
+ */
 static void
-write_sqlite_exec_callback(struct mstream* ms, const struct query_group* g, const struct query* q, const char* data)
+write_async_funcs(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
 {
-    struct arg* a = q->cb_args;
-    int i = q->return_name.len ? 1 : 0;
+    struct arg* a;
+    int copies = 0;
 
-    mstream_cstr(ms, "            ret = on_row(" NL);
-    for (; a; a = a->next, i++)
+    for (a = q->in_args; a; a = a->next)
+        if (async_arg_needs_copy(a))
+            copies = 1;
+
+    /* Job */
+    mstream_fmt(ms, "struct %S_", PREFIX(root->prefix, data));
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_job" NL "{" NL);
+    mstream_fmt(ms, "    struct %S_job job;" NL, PREFIX(root->prefix, data));
+    for (a = q->in_args; a; a = a->next)
     {
-        mstream_cstr(ms, "                ");
-        if (a->nullable)
+        mstream_fmt(ms, "    %S %S;" NL, a->type, data, a->name, data);
+        if (a->has_hidden_len_param)
+            mstream_fmt(ms, "    int %S_len;" NL, a->name, data);
+    }
+    if (q->return_arg)
+        mstream_fmt(ms, "    %S* %S;" NL, q->return_arg->type, data, q->return_arg->name, data);
+    if (q->cb_args)
+    {
+        mstream_cstr(ms, "    ");
+        write_on_row_decl(ms, q, data);
+        mstream_cstr(ms, ";" NL);
+    }
+    mstream_cstr(ms, "};" NL NL);
+
+    /* Runs on the worker thread */
+    mstream_fmt(ms, "static int" NL);
+    write_func_name(ms, g, q, data);
+    mstream_fmt(ms, "_async_run(struct %S* ctx, struct %S_job* job)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    if (q->in_args || q->return_arg || q->cb_args)
+    {
+        mstream_fmt(ms, "    struct %S_", PREFIX(root->prefix, data));
+        write_func_name(ms, g, q, data);
+        mstream_fmt(ms, "_job* j = (struct %S_", PREFIX(root->prefix, data));
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_job*)job;" NL);
+    }
+    else
+        mstream_cstr(ms, "    (void)job;" NL);
+    mstream_cstr(ms, "    return ");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "(ctx");
+    for (a = q->in_args; a; a = a->next)
+    {
+        mstream_fmt(ms, ", j->%S", a->name, data);
+        if (a->has_hidden_len_param)
+            mstream_fmt(ms, ", j->%S_len", a->name, data);
+    }
+    if (q->return_arg)
+        mstream_fmt(ms, ", j->%S", q->return_arg->name, data);
+    if (q->cb_args)
+        mstream_cstr(ms, ", j->on_row, job->user_data");
+    mstream_cstr(ms, ");" NL "}" NL NL);
+
+    /* Submit */
+    mstream_cstr(ms, "static int" NL);
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_async(");
+    write_async_func_param_list(ms, root, q, data);
+    mstream_cstr(ms, ")" NL "{" NL);
+    mstream_fmt(ms, "    struct %S_", PREFIX(root->prefix, data));
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_job* j;" NL);
+    if (copies)
+    {
+        mstream_cstr(ms, "    char* copy;" NL);
+        mstream_cstr(ms, "    size_t size = sizeof *j;" NL);
+        for (a = q->in_args; a; a = a->next)
         {
-            mstream_cstr(ms, "sqlite3_column_type(ctx->");
-            write_func_name(ms, g, q, data);
-            mstream_fmt(ms, ", %d) == SQLITE_NULL ? ", i);
-            mstream_cstr(ms, a->null_value);
-            mstream_cstr(ms, " : ");
+            if (!async_arg_needs_copy(a))
+                continue;
+            if (is_str_view(a, data))
+                mstream_fmt(ms, "    size += (size_t)%S.len;" NL, a->name, data);
+            else if (a->has_hidden_len_param)
+                mstream_fmt(ms, "    size += (size_t)%S_len;" NL, a->name, data);
+            else
+                mstream_fmt(ms, "    if (%S)" NL "        size += strlen(%S) + 1;" NL, a->name, data, a->name, data);
         }
+        mstream_fmt(ms, NL "    j = %S(size);" NL, MALLOC(root->malloc, data));
+    }
+    else
+        mstream_fmt(ms, NL "    j = %S(sizeof *j);" NL, MALLOC(root->malloc, data));
+    mstream_cstr(ms, "    if (j == NULL)" NL "        return -1;" NL);
+    if (copies)
+        mstream_cstr(ms, "    copy = (char*)(j + 1);" NL);
+    mstream_cstr(ms, NL);
 
-        mstream_fmt(ms, "%ssqlite3_column_%s(ctx->", a->cast_from_sql, a->sql_type);
-        write_func_name(ms, g, q, data);
-        mstream_fmt(ms, ", %d)," NL, i);
+    for (a = q->in_args; a; a = a->next)
+    {
+        mstream_fmt(ms, "    j->%S = %S;" NL, a->name, data, a->name, data);
         if (a->has_hidden_len_param)
+            mstream_fmt(ms, "    j->%S_len = %S_len;" NL, a->name, data, a->name, data);
+        if (!async_arg_needs_copy(a))
+            continue;
+        if (is_str_view(a, data))
         {
-            mstream_cstr(ms, "                sqlite3_column_bytes(ctx->");
-            write_func_name(ms, g, q, data);
-            mstream_fmt(ms, ", %d)," NL, i);
+            mstream_fmt(ms, "    if (%S.data)" NL "    {" NL, a->name, data);
+            mstream_fmt(ms, "        j->%S.data = memcpy(copy, %S.data, (size_t)%S.len);" NL,
+                a->name, data, a->name, data, a->name, data);
+            mstream_fmt(ms, "        copy += %S.len;" NL, a->name, data);
+        }
+        else if (a->has_hidden_len_param)
+        {
+            mstream_fmt(ms, "    if (%S)" NL "    {" NL, a->name, data);
+            mstream_fmt(ms, "        j->%S = memcpy(copy, %S, (size_t)%S_len);" NL,
+                a->name, data, a->name, data, a->name, data);
+            mstream_fmt(ms, "        copy += %S_len;" NL, a->name, data);
+        }
+        else
+        {
+            mstream_fmt(ms, "    if (%S)" NL "    {" NL, a->name, data);
+            mstream_fmt(ms, "        j->%S = strcpy(copy, %S);" NL, a->name, data, a->name, data);
+            mstream_fmt(ms, "        copy += strlen(%S) + 1;" NL, a->name, data);
         }
+        mstream_cstr(ms, "    }" NL);
     }
-    mstream_cstr(ms, "                user_data);" NL);
+    if (q->return_arg)
+        mstream_fmt(ms, "    j->%S = %S;" NL, q->return_arg->name, data, q->return_arg->name, data);
+    if (q->cb_args)
+        mstream_cstr(ms, "    j->on_row = on_row;" NL);
+    mstream_cstr(ms, "    j->job.run = ");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, "_async_run;" NL);
+    mstream_cstr(ms, "    j->job.on_done = on_done;" NL);
+    mstream_cstr(ms, "    j->job.user_data = user_data;" NL NL);
+    mstream_fmt(ms, "    %S_executor_submit(exec, &j->job, %d);" NL,
+        PREFIX(root->prefix, data), query_runs_on_reader(q));
+    mstream_cstr(ms, "    return 0;" NL);
+    mstream_cstr(ms, "}" NL NL);
 }
 
+/*
+ * The timeout and backoff policies are implemented as a busy handler instead
+ * of sqlite3_busy_timeout(), so that the time spent waiting can be counted.
+ * The timeout policy uses the same delays as SQLite's built-in handler.
+ */
 static void
-write_sqlite_exec(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+write_busy_timeout_handler(struct mstream* ms, const struct root* root, const char* name, int timeout_ms, const char* data)
 {
-    switch (q->type)
-    {
-        case QUERY_NONE: break;
-        /*
-         * Exists should return:
-         *   1 if a row was found.
-         *   0 if no rows were found.
-         *   -1 if an error occurs.
-         */
-        case QUERY_EXISTS:
-            mstream_cstr(ms, "next_step:" NL);
-            mstream_cstr(ms, "    ret = sqlite3_step(ctx->");
-            write_func_name(ms, g, q, data);
-            mstream_cstr(ms, ");" NL);
-            mstream_cstr(ms, "    switch (ret)" NL "    {" NL);
-            mstream_cstr(ms, "        case SQLITE_BUSY: goto next_step;" NL);
-            mstream_cstr(ms, "        case SQLITE_ROW:" NL);
-            mstream_cstr(ms, "            sqlite3_reset(ctx->");
-            write_func_name(ms, g, q, data);
-            mstream_cstr(ms, "); " NL);
-            mstream_cstr(ms, "            return 1;" NL);
-            mstream_cstr(ms, "        case SQLITE_DONE:" NL);
-            mstream_cstr(ms, "            sqlite3_reset(ctx->");
-            write_func_name(ms, g, q, data);
-            mstream_cstr(ms, ");" NL);
-            mstream_cstr(ms, "            return 0;" NL);
-            mstream_cstr(ms, "    }" NL NL);
-            mstream_fmt(ms, "    %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
-                        LOG_SQL_ERR(root->log_sql_err, data));
-            mstream_cstr(ms, "    sqlite3_reset(ctx->");
-            write_func_name(ms, g, q, data);
-            mstream_cstr(ms, ");" NL);
-            mstream_cstr(ms, "    return -1;" NL);
-            break;
-
-        /*
-         * All of these query types either return a single value, or return
-         * nothing. Both "callback" and "return" statements can be used.
-         *
-         * If both "return" and "callback" are specified, then "return" has
-         * a higher priority this value is returned. If the callback function
-         * returns negative (error occurs), then we must return -1 instead of
-         * the return value.
-         *
-         * If only "callback" is specified, then we return the value returned
-         * by the callback.
-         *
-         * If only "return" is specified, then we return the value returned by
-         * the callback.
-         */
-        case QUERY_INSERT_NEW:
-        case QUERY_INSERT_OR_GET:
-        case QUERY_UPSERT:
-        case QUERY_SELECT_FIRST:
-            mstream_cstr(ms, "next_step:" NL);
-            mstream_cstr(ms, "    ret = sqlite3_step(ctx->");
-            write_func_name(ms, g, q, data);
-            mstream_cstr(ms, ");" NL);
-            mstream_cstr(ms, "    switch (ret)" NL "    {" NL);
-            mstream_cstr(ms, "        case SQLITE_BUSY: goto next_step;" NL);
-
-            if (q->return_name.len || q->cb_args)
-                mstream_cstr(ms, "        case SQLITE_ROW:" NL);
-
-            if (q->return_name.len)
-            {
-                mstream_fmt(ms, "            %S = sqlite3_column_int(ctx->",
-                    q->return_name, data);
-                write_func_name(ms, g, q, data);
-                mstream_cstr(ms, ", 0);" NL);
-            }
-
-            if (q->cb_args)
-            {
-                write_sqlite_exec_callback(ms, g, q, data);
-                if (q->return_name.len)
-                {
-                    mstream_cstr(ms, "            if (ret < 0)" NL);
-                    mstream_cstr(ms, "            {" NL);
-                    mstream_cstr(ms, "                sqlite3_reset(ctx->");
-                    write_func_name(ms, g, q, data);
-                    mstream_cstr(ms, ");" NL);
-                    mstream_cstr(ms, "                return ret;" NL);
-                    mstream_cstr(ms, "            }" NL);
-                }
-                else
-                {
-                    mstream_cstr(ms, "            sqlite3_reset(ctx->");
-                    write_func_name(ms, g, q, data);
-                    mstream_cstr(ms, ");" NL);
-                    mstream_cstr(ms, "            return ret;" NL);
-                }
-            }
-            if (q->return_name.len || q->cb_args)
-                mstream_cstr(ms, "        case SQLITE_DONE: goto done;" NL);
-            else
-            {
-                mstream_cstr(ms, "        case SQLITE_DONE:" NL);
-                mstream_cstr(ms, "            sqlite3_reset(ctx->");
-                write_func_name(ms, g, q, data);
-                mstream_cstr(ms, ");" NL);
-                mstream_cstr(ms, "            return 0;" NL);
-            }
-
-            mstream_cstr(ms, "    }" NL NL);
-
-            /* We want to print an error in all cases except for "insert-new",
-             * because there, an error case is expected behavior */
-            if (q->type != QUERY_INSERT_NEW)
-                mstream_fmt(ms,
-                    "    %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
-                    LOG_SQL_ERR(root->log_sql_err, data));
-            if (q->return_name.len || q->cb_args)
-                mstream_cstr(ms, "done:" NL);
-            mstream_cstr(ms, "    sqlite3_reset(ctx->");
-            write_func_name(ms, g, q, data);
-            mstream_cstr(ms, ");" NL);
-            if (q->return_name.len)
-                mstream_fmt(ms, "    return %S;" NL, q->return_name, data);
-            else
-                mstream_cstr(ms, "    return -1;" NL);
-            break;
-
-        /*
-         * These query types return multiple values.
-         */
-        case QUERY_UPDATE:
-        case QUERY_DELETE:
-        case QUERY_SELECT_ALL:
-            mstream_cstr(ms, "next_step:" NL);
-            mstream_cstr(ms, "    ret = sqlite3_step(ctx->");
-            write_func_name(ms, g, q, data);
-            mstream_cstr(ms, ");" NL);
-            mstream_cstr(ms, "    switch (ret)" NL "    {" NL);
-            mstream_cstr(ms, "        case SQLITE_ROW:" NL);
+    mstream_fmt (ms, "static int" NL "%S_%s(void* user_data, int count)" NL "{" NL,
+        PREFIX(root->prefix, data), name);
+    mstream_cstr(ms, "    static const int delays[] = { 1, 2, 5, 10, 15, 20, 25, 25, 25, 50, 50, 100 };" NL);
+    mstream_fmt (ms, "    struct %S* ctx = user_data;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int delay = count < (int)(sizeof(delays) / sizeof(*delays)) ? delays[count] : 100;" NL NL);
+    mstream_cstr(ms, "    if (count == 0)" NL);
+    mstream_cstr(ms, "        ctx->busy.lock_wait_ms = 0;" NL);
+    mstream_fmt (ms, "    if (ctx->busy.lock_wait_ms + delay > %d)" NL, timeout_ms);
+    mstream_fmt (ms, "        delay = %d - ctx->busy.lock_wait_ms;" NL, timeout_ms);
+    mstream_cstr(ms, "    if (delay <= 0)" NL);
+    mstream_cstr(ms, "        return 0;" NL NL);
+    mstream_cstr(ms, "    sqlite3_sleep(delay);" NL);
+    mstream_cstr(ms, "    ctx->busy.lock_wait_ms += delay;" NL);
+    mstream_cstr(ms, "    ctx->busy.wait_ms += delay;" NL);
+    mstream_cstr(ms, "    ctx->busy.retries++;" NL);
+    mstream_cstr(ms, "    return 1;" NL);
+    mstream_cstr(ms, "}" NL NL);
+}
 
-            if (q->return_name.len)
-            {
-                mstream_fmt(ms, "            %S = sqlite3_column_int(ctx->",
-                    q->return_name, data);
-                write_func_name(ms, g, q, data);
-                mstream_cstr(ms, ", 0);" NL);
-            }
+static void
+write_busy_funcs(struct mstream* ms, const struct root* root, const char* data)
+{
+    if (root->busy_policy == BUSY_TIMEOUT)
+        write_busy_timeout_handler(ms, root, "busy_handler", root->busy_timeout_ms, data);
+    /*
+     * The spin policy has no busy handler. Spinning on a PRAGMA in open()
+     * could wait forever, so open() waits for a bounded time instead.
+     */
+    else if (root->busy_policy == BUSY_SPIN && has_pragmas(root))
+        write_busy_timeout_handler(ms, root, "open_busy_handler", OPEN_BUSY_TIMEOUT_MS, data);
+    else if (root->busy_policy == BUSY_BACKOFF)
+    {
+        /* Gives up once the delay grows past the maximum */
+        mstream_fmt (ms, "static int" NL "%S_busy_handler(void* user_data, int count)" NL "{" NL,
+            PREFIX(root->prefix, data));
+        mstream_fmt (ms, "    struct %S* ctx = user_data;" NL, PREFIX(root->prefix, data));
+        mstream_fmt (ms, "    int delay = %d;" NL, root->busy_min_ms);
+        mstream_fmt (ms, "    for (; count > 0 && delay <= %d; --count)" NL, root->busy_max_ms);
+        mstream_cstr(ms, "        delay *= 2;" NL);
+        mstream_fmt (ms, "    if (delay > %d)" NL, root->busy_max_ms);
+        mstream_cstr(ms, "        return 0;" NL NL);
+        mstream_cstr(ms, "    sqlite3_sleep(delay);" NL);
+        mstream_cstr(ms, "    ctx->busy.wait_ms += delay;" NL);
+        mstream_cstr(ms, "    ctx->busy.retries++;" NL);
+        mstream_cstr(ms, "    return 1;" NL);
+        mstream_cstr(ms, "}" NL NL);
+    }
 
-            if (q->cb_args)
-                write_sqlite_exec_callback(ms, g, q, data);
+    mstream_fmt (ms, "static void" NL "%S_busy_stats(struct %S* ctx, int* retries, int* wait_ms)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    if (root->split)
+    {
+        /* The numbers of a split context are the sum over all connections */
+        mstream_cstr(ms, "    if (ctx->split)" NL "    {" NL);
+        mstream_cstr(ms, "        int i, r, w;" NL);
+        mstream_fmt (ms, "        %S_busy_stats(ctx->split->writer, retries, wait_ms);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        for (i = 0; i != ctx->split->readers.count; ++i)" NL "        {" NL);
+        mstream_fmt (ms, "            %S_busy_stats(ctx->split->readers.conns[i], &r, &w);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "            if (retries)" NL);
+        mstream_cstr(ms, "                *retries += r;" NL);
+        mstream_cstr(ms, "            if (wait_ms)" NL);
+        mstream_cstr(ms, "                *wait_ms += w;" NL);
+        mstream_cstr(ms, "        }" NL);
+        mstream_cstr(ms, "        return;" NL);
+        mstream_cstr(ms, "    }" NL NL);
+    }
+    if (root->shards)
+    {
+        /* Same for a sharded context */
+        mstream_cstr(ms, "    if (ctx->shards)" NL "    {" NL);
+        mstream_cstr(ms, "        int shard, r, w;" NL);
+        mstream_cstr(ms, "        if (retries)" NL);
+        mstream_cstr(ms, "            *retries = 0;" NL);
+        mstream_cstr(ms, "        if (wait_ms)" NL);
+        mstream_cstr(ms, "            *wait_ms = 0;" NL);
+        mstream_fmt (ms, "        for (shard = 0; shard != %d; ++shard)" NL "        {" NL, root->shards);
+        mstream_fmt (ms, "            %S_busy_stats(ctx->shards[shard], &r, &w);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "            if (retries)" NL);
+        mstream_cstr(ms, "                *retries += r;" NL);
+        mstream_cstr(ms, "            if (wait_ms)" NL);
+        mstream_cstr(ms, "                *wait_ms += w;" NL);
+        mstream_cstr(ms, "        }" NL);
+        mstream_cstr(ms, "        return;" NL);
+        mstream_cstr(ms, "    }" NL NL);
+    }
+    mstream_cstr(ms, "    if (retries)" NL);
+    mstream_cstr(ms, "        *retries = ctx->busy.retries;" NL);
+    mstream_cstr(ms, "    if (wait_ms)" NL);
+    mstream_cstr(ms, "        *wait_ms = ctx->busy.wait_ms;" NL);
+    mstream_cstr(ms, "}" NL NL);
+}
 
-            if (q->cb_args)
-                mstream_cstr(ms, "            if (ret == 0) goto next_step;" NL);
+/*
+ * Deadlines are checked by a progress handler, which SQLite calls every
+ * DEADLINE_OPS virtual machine instructions, and which only exists while a
+ * deadline is set. Returning non-zero from it interrupts the statement, same
+ * as cancel() does from another thread, so the handler leaves a note to tell
+ * the two apart when the step loop sees SQLITE_INTERRUPT.
+ */
+static void
+write_deadline_funcs(struct mstream* ms, const struct root* root, const char* data)
+{
+    mstream_fmt (ms, "#define %S_DEADLINE_OPS 1000" NL NL, PREFIX(root->prefix, data));
+
+    mstream_cstr(ms, "#if defined(_WIN32)" NL);
+    mstream_fmt (ms, "static long long" NL "%S_deadline_now(void)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    LARGE_INTEGER freq, now;" NL);
+    mstream_cstr(ms, "    QueryPerformanceFrequency(&freq);" NL);
+    mstream_cstr(ms, "    QueryPerformanceCounter(&now);" NL);
+    mstream_cstr(ms, "    return (long long)((double)now.QuadPart * 1e6 / (double)freq.QuadPart);" NL);
+    mstream_cstr(ms, "}" NL);
+    mstream_cstr(ms, "#else" NL);
+    mstream_fmt (ms, "static long long" NL "%S_deadline_now(void)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    struct timespec ts;" NL);
+    mstream_cstr(ms, "    clock_gettime(CLOCK_MONOTONIC, &ts);" NL);
+    mstream_cstr(ms, "    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;" NL);
+    mstream_cstr(ms, "}" NL);
+    mstream_cstr(ms, "#endif" NL NL);
+
+    mstream_fmt (ms, "static int" NL "%S_deadline_handler(void* user_data)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S* ctx = user_data;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    if (%S_deadline_now() < ctx->deadline.at)" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        return 0;" NL);
+    mstream_cstr(ms, "    ctx->deadline.expired = 1;" NL);
+    mstream_cstr(ms, "    return 1;" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-            if (q->cb_args)
-            {
-                mstream_cstr(ms, "            sqlite3_reset(ctx->");
-                write_func_name(ms, g, q, data);
-                mstream_cstr(ms, ");" NL);
-                if (q->return_name.len)
-                {
-                    mstream_cstr(ms, "            if (ret < 0) return -1;" NL);
-                    mstream_fmt(ms, "            return %S;" NL, q->return_name, data);
-                }
-                else
-                    mstream_cstr(ms, "            return ret;" NL);
-            }
+    mstream_fmt (ms, "static int" NL "%S_interrupted(struct %S* ctx)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (ctx->deadline.expired)" NL "    {" NL);
+    mstream_cstr(ms, "        ctx->deadline.expired = 0;" NL);
+    mstream_fmt (ms, "        return %S_TIMEOUT;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    }" NL);
+    mstream_fmt (ms, "    return %S_CANCELLED;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
 
-            mstream_cstr(ms, "        case SQLITE_BUSY: goto next_step;" NL);
-            mstream_cstr(ms, "        case SQLITE_DONE:" NL);
-            mstream_cstr(ms, "            sqlite3_reset(ctx->");
-            write_func_name(ms, g, q, data);
-            mstream_cstr(ms, ");" NL);
-            if (q->return_name.len)
-                mstream_fmt(ms, "            return %S;" NL, q->return_name, data);
-            else
-                mstream_cstr(ms, "            return 0;" NL);
+    mstream_fmt (ms, "static int" NL "%S_set_deadline(struct %S* ctx, int timeout_ms)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (timeout_ms < 0)" NL "        return -1;" NL);
+    mstream_cstr(ms, "    ctx->deadline.expired = 0;" NL);
+    mstream_cstr(ms, "    if (timeout_ms == 0)" NL "    {" NL);
+    mstream_cstr(ms, "        sqlite3_progress_handler(ctx->db, 0, NULL, NULL);" NL);
+    mstream_cstr(ms, "        return 0;" NL "    }" NL);
+    mstream_fmt (ms, "    ctx->deadline.at = %S_deadline_now() + (long long)timeout_ms * 1000;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    sqlite3_progress_handler(ctx->db, %S_DEADLINE_OPS, %S_deadline_handler, ctx);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return 0;" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-            mstream_cstr(ms, "    }" NL NL);
-            mstream_fmt(ms, "    %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
-                        LOG_SQL_ERR(root->log_sql_err, data));
-            mstream_cstr(ms, "    sqlite3_reset(ctx->");
-            write_func_name(ms, g, q, data);
-            mstream_cstr(ms, ");" NL);
-            mstream_cstr(ms, "    return -1;" NL);
-            break;
-    }
+    /* sqlite3_interrupt() may be called from any thread */
+    mstream_fmt (ms, "static void" NL "%S_cancel(struct %S* ctx)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    sqlite3_interrupt(ctx->db);" NL);
+    mstream_cstr(ms, "}" NL NL);
 }
 
+/*
+ * How a sharded context undoes a transaction statement that failed on one of
+ * its shards, so that no shard is left with a transaction or savepoint the
+ * caller doesn't know about.
+ */
+enum shard_undo
+{
+    SHARD_UNDO_NONE,    /* Run on every shard regardless */
+    SHARD_UNDO_DONE,    /* Undo the shards that already succeeded */
+    SHARD_UNDO_PENDING  /* Undo the failed shard and the ones not run yet */
+};
+
+/* Transaction control statements. The SQL is a format string taking the prefix */
+static const struct {
+    const char* name;
+    const char* sql;
+    enum split_route split_route;
+    enum shard_undo shard_undo;
+    const char* shard_undo_func;
+} tx_stmts[] = {
+    { "begin",           "BEGIN;",                    SPLIT_HOLD,          SHARD_UNDO_DONE,    "rollback" },
+    { "begin_immediate", "BEGIN IMMEDIATE;",          SPLIT_HOLD,          SHARD_UNDO_DONE,    "rollback" },
+    { "commit",          "COMMIT;",                   SPLIT_END,           SHARD_UNDO_PENDING, "rollback" },
+    { "rollback",        "ROLLBACK;",                 SPLIT_END_ALWAYS,    SHARD_UNDO_NONE,    NULL },
+    { "savepoint",       "SAVEPOINT %S_savepoint;",   SPLIT_HOLD,          SHARD_UNDO_DONE,    "rollback_to" },
+    { "release",         "RELEASE %S_savepoint;",     SPLIT_UNHOLD,        SHARD_UNDO_PENDING, "rollback_to" },
+    { "rollback_to",     "ROLLBACK TO %S_savepoint;", SPLIT_UNHOLD_ALWAYS, SHARD_UNDO_NONE,    NULL }
+};
+
+/*!
+ * \brief Runs a transaction statement on every shard in turn. If it fails on
+ * one of them, the shards are undone as given by tx_stmts[i].shard_undo, so
+ * that either all of them or none of them end up in the new transaction or
+ * savepoint. Shards that already committed can't be undone though.
+ */
 static void
-write_migration_sql_stmts(struct mstream* ms, const struct root* root, const struct migration* m, const char* data, const char* type)
+write_shard_route_tx(struct mstream* ms, const struct root* root, int i, const char* data)
 {
-    for (; m; m = m->next)
+    if (!root->shards)
+        return;
+    if (tx_stmts[i].shard_undo == SHARD_UNDO_NONE)
     {
-        int p;
-        mstream_fmt(ms, "static const char* %S_%s%d =" NL, PREFIX(root->prefix, data), type, m->version);
-        mstream_cstr(ms, "    \"");
-        for (p = 0; p != m->sql.len; ++p)
-        {
-            if (data[m->sql.off + p] == '\n')
-            {
-                if (p + 1 < m->sql.len)
-                    mstream_cstr(ms, "\\n\"" NL "    \"");
-            }
-            else if (data[m->sql.off + p] != '\r')
-            {
-                char c = data[m->sql.off + p];
-                if (c == '"')
-                    mstream_putc(ms, '\\');
-                else if (c == '\\')
-                    mstream_putc(ms, '\\');
-                mstream_putc(ms, c);
-            }
-        }
-        mstream_cstr(ms, "\";" NL NL);
+        write_shard_route_cstr(ms, root, tx_stmts[i].name, "", data);
+        return;
     }
+
+    mstream_cstr(ms, "    if (ctx->shards)" NL "    {" NL);
+    mstream_cstr(ms, "        int shard, undo;" NL);
+    mstream_fmt (ms, "        for (shard = 0; shard != %d; ++shard)" NL, root->shards);
+    mstream_fmt (ms, "            if (%S_%s(ctx->shards[shard]) != 0)" NL "            {" NL,
+        PREFIX(root->prefix, data), tx_stmts[i].name);
+    if (tx_stmts[i].shard_undo == SHARD_UNDO_DONE)
+        mstream_cstr(ms, "                for (undo = 0; undo != shard; ++undo)" NL);
+    else
+        mstream_fmt (ms, "                for (undo = shard; undo != %d; ++undo)" NL, root->shards);
+    mstream_fmt (ms, "                    %S_%s(ctx->shards[undo]);" NL,
+        PREFIX(root->prefix, data), tx_stmts[i].shard_undo_func);
+    mstream_cstr(ms, "                return -1;" NL);
+    mstream_cstr(ms, "            }" NL);
+    mstream_cstr(ms, "        return 0;" NL);
+    mstream_cstr(ms, "    }" NL NL);
 }
 
 static void
-write_run_sql_stmts_func(struct mstream* ms, const struct root* root, const char* data)
+write_tx_stmt_exec(struct mstream* ms, const struct root* root, int i, const char* data)
 {
-    mstream_cstr(ms, "static int run_sqlite3_sql(sqlite3* db, const char* sql)" NL "{" NL);
-    mstream_cstr(ms, "    int ret;" NL);
-    mstream_cstr(ms, "    int sql_len;" NL);
-    mstream_cstr(ms, "    const char* sql_next;" NL);
-    mstream_cstr(ms, "    sqlite3_stmt* stmt;" NL NL);
+    if (root->prepare_eager)
+    {
+        mstream_fmt(ms, "%S_exec_stmt(ctx, ctx->tx.%s)", PREFIX(root->prefix, data), tx_stmts[i].name);
+        return;
+    }
 
-    mstream_cstr(ms, "    sql_len = (int)strlen(sql);" NL NL);
+    mstream_fmt(ms, "%S_tx_exec(ctx, &ctx->tx.%s, \"", PREFIX(root->prefix, data), tx_stmts[i].name);
+    mstream_fmt(ms, tx_stmts[i].sql, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "\")");
+}
 
-    mstream_cstr(ms, "next_step:" NL);
-    mstream_cstr(ms, "    ret = sqlite3_prepare_v2(db, sql, sql_len, &stmt, &sql_next);" NL);
-    mstream_cstr(ms, "    if (ret != SQLITE_OK)" NL "    {" NL);
-    mstream_fmt (ms, "        %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(db));" NL, LOG_SQL_ERR(root->log_sql_err, data));
-    mstream_cstr(ms, "        goto prepare_failed;" NL);
-    mstream_cstr(ms, "    }" NL NL);
+static void
+write_transaction_funcs(struct mstream* ms, const struct root* root, const char* data)
+{
+    int i;
 
-    mstream_cstr(ms, "retry_step:" NL);
-    mstream_cstr(ms, "    switch (ret = sqlite3_step(stmt))" NL "    {" NL);
-    mstream_cstr(ms, "        case SQLITE_BUSY: goto retry_step;" NL);
-    mstream_cstr(ms, "        case SQLITE_ROW:" NL);
+    /*
+     * Steps a statement that doesn't return any rows to completion. Used by
+     * the control statements below and by bulk inserts.
+     */
+    mstream_fmt (ms, "static int" NL "%S_exec_stmt(struct %S* ctx, sqlite3_stmt* stmt)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int ret;" NL);
+    write_busy_label(ms, root, "next_step");
+    mstream_cstr(ms, "    ret = sqlite3_step(stmt);" NL);
+    mstream_cstr(ms, "    switch (ret)" NL "    {" NL);
+    write_busy_case(ms, root, "next_step", 1);
+    if (root->deadlines)
+    {
+        mstream_cstr(ms, "        case SQLITE_INTERRUPT:" NL);
+        mstream_cstr(ms, "            sqlite3_reset(stmt);" NL);
+        mstream_fmt (ms, "            return %S_interrupted(ctx);" NL, PREFIX(root->prefix, data));
+    }
     mstream_cstr(ms, "        case SQLITE_DONE:" NL);
-    mstream_cstr(ms, "            sql_len -= (int)(sql_next - sql);" NL);
-    mstream_cstr(ms, "            sql = sql_next;" NL);
-    mstream_cstr(ms, "            for (; sql_len && isspace(*sql); ++sql, --sql_len) {}" NL);
-    mstream_cstr(ms, "            if (sql_len <= 0)" NL);
-    mstream_cstr(ms, "                break;" NL);
-    mstream_cstr(ms, "            sqlite3_finalize(stmt);" NL);
-    mstream_cstr(ms, "            goto next_step;" NL);
-    mstream_cstr(ms, "        default:" NL);
-    mstream_fmt (ms, "            %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(db));" NL, LOG_SQL_ERR(root->log_sql_err, data));
-    mstream_cstr(ms, "            goto exec_failed;" NL);
+    mstream_cstr(ms, "            sqlite3_reset(stmt);" NL);
+    mstream_cstr(ms, "            return 0;" NL);
     mstream_cstr(ms, "    }" NL NL);
+    mstream_fmt (ms, "    %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+        LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "    sqlite3_reset(stmt);" NL);
+    mstream_cstr(ms, "    return -1;" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-    mstream_cstr(ms, "    sqlite3_finalize(stmt);" NL);
-    mstream_cstr(ms, "    return 0;" NL NL);
+    /*
+     * All control statements share the same step loop. The statement is
+     * prepared on first use and cached in the context structure, same as
+     * the query statements.
+     */
+    if (!root->prepare_eager)
+    {
+        mstream_fmt (ms, "static int" NL "%S_tx_exec(struct %S* ctx, sqlite3_stmt** stmt, const char* sql)" NL "{" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_cstr(ms, "    int ret;" NL);
+        mstream_cstr(ms, "    if (*stmt == NULL)" NL);
+        mstream_cstr(ms, "        if ((ret = sqlite3_prepare_v2(ctx->db, sql, -1, stmt, NULL)) != SQLITE_OK)" NL);
+        mstream_cstr(ms, "        {" NL);
+        mstream_fmt (ms, "            %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+            LOG_SQL_ERR(root->log_sql_err, data));
+        mstream_cstr(ms, "            return -1;" NL);
+        mstream_cstr(ms, "        }" NL NL);
+        mstream_fmt (ms, "    return %S_exec_stmt(ctx, *stmt);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "}" NL NL);
+    }
 
-    mstream_cstr(ms, "exec_failed    : sqlite3_finalize(stmt);" NL);
-    mstream_cstr(ms, "prepare_failed : return -1;" NL);
-    mstream_cstr(ms, "}" NL NL);
+    /* Shards undo a failed begin() with rollback(), which comes after it */
+    if (root->shards)
+    {
+        mstream_fmt(ms, "static int %S_rollback(struct %S* ctx);" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_fmt(ms, "static int %S_rollback_to(struct %S* ctx);" NL NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    }
+
+    for (i = 0; i != sizeof(tx_stmts) / sizeof(*tx_stmts); ++i)
+    {
+        mstream_fmt(ms, "static int" NL "%S_%s(struct %S* ctx)" NL "{" NL,
+            PREFIX(root->prefix, data), tx_stmts[i].name, PREFIX(root->prefix, data));
+        write_split_route_cstr(ms, root, tx_stmts[i].name, "", 0, tx_stmts[i].split_route, data);
+        write_shard_route_tx(ms, root, i, data);
+        if (strcmp(tx_stmts[i].name, "rollback_to") == 0)
+        {
+            /* Unlike a full rollback, this doesn't invoke the rollback hook */
+            if (has_cached_queries(root))
+                mstream_fmt(ms, "    %S_cache_clear(ctx);" NL, PREFIX(root->prefix, data));
+            /* Rolling back to a savepoint leaves it on the stack, so it has to be
+             * released as well to undo one level of nesting */
+            mstream_cstr(ms, "    if (");
+            write_tx_stmt_exec(ms, root, i, data);
+            mstream_cstr(ms, " != 0)" NL);
+            mstream_cstr(ms, "        return -1;" NL);
+            mstream_fmt (ms, "    return %S_release(ctx);" NL, PREFIX(root->prefix, data));
+        }
+        else
+        {
+            mstream_cstr(ms, "    return ");
+            write_tx_stmt_exec(ms, root, i, data);
+            mstream_cstr(ms, ";" NL);
+        }
+        mstream_cstr(ms, "}" NL NL);
+    }
 }
 
 static void
-write_version_func(struct mstream* ms, const struct root* root, const char* data)
+write_prepare_query_stmts(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
 {
-    mstream_fmt (ms, "static int %S_version(struct %S* ctx)" NL "{" NL, PREFIX(root->prefix, data), PREFIX(root->prefix, data));
-    mstream_cstr(ms, "    int ret, version = 0;" NL);
-    mstream_cstr(ms, "    sqlite3_stmt* stmt;" NL NL);
+    mstream_fmt(ms, "    failed += %S_prepare_stmt(ctx, &ctx->", PREFIX(root->prefix, data));
+    write_func_name(ms, g, q, data);
+    if (g)
+        mstream_fmt(ms, ", \"%S.%S\"," NL, g->name, data, q->name, data);
+    else
+        mstream_fmt(ms, ", \"%S\"," NL, q->name, data);
+    write_sqlite_stmt_sql(ms, q, data);
+    mstream_cstr(ms, ");" NL);
 
-    mstream_cstr(ms, "    ret = sqlite3_prepare_v2(ctx->db, \"PRAGMA user_version;\", -1, &stmt, NULL);" NL);
-    mstream_cstr(ms, "    if (ret != SQLITE_OK)" NL "    {" NL);
-    mstream_fmt (ms, "        %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL, LOG_SQL_ERR(root->log_sql_err, data));
-    mstream_cstr(ms, "        return -1;" NL);
-    mstream_cstr(ms, "    }" NL NL);
+    if (q->bulk)
+    {
+        mstream_fmt(ms, "    failed += %S_prepare_stmt(ctx, &ctx->", PREFIX(root->prefix, data));
+        write_func_name(ms, g, q, data);
+        if (g)
+            mstream_fmt(ms, "_bulk, \"%S.%S_bulk\"," NL, g->name, data, q->name, data);
+        else
+            mstream_fmt(ms, "_bulk, \"%S_bulk\"," NL, q->name, data);
+        write_sqlite_bulk_stmt_sql(ms, q, bulk_chunk_rows(q), data);
+        mstream_cstr(ms, ");" NL);
 
-    mstream_cstr(ms, "    ret = sqlite3_step(stmt);" NL);
-    mstream_cstr(ms, "    if (ret != SQLITE_ROW)" NL "    {" NL);
-    mstream_fmt (ms, "        %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL, LOG_SQL_ERR(root->log_sql_err, data));
-    mstream_cstr(ms, "        sqlite3_finalize(stmt);" NL);
-    mstream_cstr(ms, "        return -1;" NL);
-    mstream_cstr(ms, "    }" NL NL);
+        mstream_fmt(ms, "    failed += %S_prepare_stmt(ctx, &ctx->", PREFIX(root->prefix, data));
+        write_func_name(ms, g, q, data);
+        if (g)
+            mstream_fmt(ms, "_bulk_tail, \"%S.%S_bulk_tail\"," NL, g->name, data, q->name, data);
+        else
+            mstream_fmt(ms, "_bulk_tail, \"%S_bulk_tail\"," NL, q->name, data);
+        write_sqlite_bulk_stmt_sql(ms, q, 1, data);
+        mstream_cstr(ms, ");" NL);
+    }
 
-    mstream_cstr(ms, "    version = sqlite3_column_int(stmt, 0);" NL);
-    mstream_cstr(ms, "    sqlite3_finalize(stmt);" NL);
-    mstream_cstr(ms, "    return version;" NL);
-    mstream_cstr(ms, "}" NL NL);
+    if (q->cursor)
+    {
+        mstream_fmt(ms, "    failed += %S_prepare_stmt(ctx, &ctx->", PREFIX(root->prefix, data));
+        write_func_name(ms, g, q, data);
+        if (g)
+            mstream_fmt(ms, "_cursor, \"%S.%S_cursor\"," NL, g->name, data, q->name, data);
+        else
+            mstream_fmt(ms, "_cursor, \"%S_cursor\"," NL, q->name, data);
+        write_sqlite_stmt_sql(ms, q, data);
+        mstream_cstr(ms, ");" NL);
+    }
+
+    if (q->columns)
+    {
+        mstream_fmt(ms, "    failed += %S_prepare_stmt(ctx, &ctx->", PREFIX(root->prefix, data));
+        write_func_name(ms, g, q, data);
+        if (g)
+            mstream_fmt(ms, "_columns, \"%S.%S_columns\"," NL, g->name, data, q->name, data);
+        else
+            mstream_fmt(ms, "_columns, \"%S_columns\"," NL, q->name, data);
+        write_sqlite_stmt_sql(ms, q, data);
+        mstream_cstr(ms, ");" NL);
+    }
+
+    if (query_has_lookup(q))
+    {
+        mstream_fmt(ms, "    failed += %S_prepare_stmt(ctx, &ctx->", PREFIX(root->prefix, data));
+        write_func_name(ms, g, q, data);
+        if (g)
+            mstream_fmt(ms, "_lookup, \"%S.%S_lookup\"," NL, g->name, data, q->name, data);
+        else
+            mstream_fmt(ms, "_lookup, \"%S_lookup\"," NL, q->name, data);
+        write_sqlite_lookup_stmt_sql(ms, q, data);
+        mstream_cstr(ms, ");" NL);
+    }
 }
 
+/*
+ * prepare_all() compiles every statement that hasn't been prepared yet. In
+ * eager mode, the query functions rely on this having been called, and
+ * statements are prepared with SQLITE_PREPARE_PERSISTENT because they live
+ * for as long as the connection does. Preparation continues after a failure
+ * so that all broken statements are reported at once.
+ */
 static void
-write_downgrade_forward_compat_func(struct mstream* ms, const struct root* root, const char* data)
+write_prepare_all_func(struct mstream* ms, const struct root* root, const char* data)
 {
-    mstream_fmt(ms, "static int %S_downgrade_forward_compat(sqlite3* db)" NL "{" NL,
-        PREFIX(root->prefix, data));
-    mstream_cstr(ms, "    int ret, i;" NL);
-    mstream_cstr(ms, "    sqlite3_stmt* stmt;" NL);
-    mstream_cstr(ms, "    const char* str;" NL);
-    mstream_cstr(ms, "    void* tmp;" NL);
-    mstream_cstr(ms, "    char** sql = NULL;" NL);
-    mstream_cstr(ms, "    int sql_num = 0;" NL);
-    mstream_cstr(ms, "    int success = -1;" NL);
-    mstream_fmt (ms, "    ret = sqlite3_prepare_v2(db, \"SELECT sql FROM %S_downgrades WHERE version >= %d ORDER BY version DESC;\", -1, &stmt, NULL);" NL,
-        PREFIX(root->prefix, data), root->downgrade ? root->downgrade->version + 1 : 0);
-    mstream_cstr(ms, "    if (ret != SQLITE_OK)" NL "    {" NL);
-    mstream_fmt (ms, "        %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(db));" NL,
+    const struct query_group* g;
+    const struct query* q;
+    int i;
+
+    mstream_fmt (ms, "static int" NL "%S_prepare_stmt(struct %S* ctx, sqlite3_stmt** stmt, const char* name, const char* sql)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int ret;" NL);
+    mstream_cstr(ms, "    if (*stmt != NULL)" NL);
+    mstream_cstr(ms, "        return 0;" NL NL);
+    if (root->prepare_eager)
+        mstream_cstr(ms, "    ret = sqlite3_prepare_v3(ctx->db, sql, -1, SQLITE_PREPARE_PERSISTENT, stmt, NULL);" NL);
+    else
+        mstream_cstr(ms, "    ret = sqlite3_prepare_v2(ctx->db, sql, -1, stmt, NULL);" NL);
+    mstream_cstr(ms, "    if (ret == SQLITE_OK)" NL);
+    mstream_cstr(ms, "        return 0;" NL NL);
+    mstream_fmt (ms, "    %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
         LOG_SQL_ERR(root->log_sql_err, data));
-    mstream_fmt (ms, "        return -1;" NL);
-    mstream_fmt (ms, "    }" NL NL);
+    mstream_fmt (ms, "    %S(\"Failed to prepare statement for \\\"%%s\\\"\\n\", name);" NL,
+        LOG_ERR(root->log_err, data));
+    mstream_cstr(ms, "    return 1;" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-    mstream_cstr(ms, "next_step:" NL);
-    mstream_cstr(ms, "    ret = sqlite3_step(stmt);" NL);
-    mstream_cstr(ms, "    switch (ret)" NL "    {" NL);
-    mstream_cstr(ms, "        case SQLITE_ROW:" NL);
-    mstream_cstr(ms, "            tmp = realloc(sql, sizeof(char*) * (size_t)(sql_num + 1));" NL);
-    mstream_cstr(ms, "            if (tmp == NULL) goto done;" NL);
-    mstream_cstr(ms, "            sql = tmp;" NL NL);
-    mstream_cstr(ms, "            str = (const char*)sqlite3_column_text(stmt, 0);" NL);
-    mstream_cstr(ms, "            sql[sql_num] = malloc(strlen(str) + 1);" NL);
-    mstream_cstr(ms, "            if (sql[sql_num] == NULL) goto done;" NL);
-    mstream_cstr(ms, "            strcpy(sql[sql_num++], str);" NL NL);
-    mstream_cstr(ms, "            goto next_step;" NL);
-    mstream_cstr(ms, "        case SQLITE_BUSY: goto next_step;" NL);
-    mstream_cstr(ms, "        case SQLITE_DONE:" NL);
-    mstream_cstr(ms, "            for (i = 0; i != sql_num; ++i)" NL);
-    mstream_cstr(ms, "            {" NL);
-    mstream_cstr(ms, "                if (run_sqlite3_sql(db, sql[i]) != 0)" NL);
-    mstream_cstr(ms, "                    goto done;" NL);
-    mstream_cstr(ms, "            }" NL);
-    mstream_cstr(ms, "            success = 0;" NL);
-    mstream_cstr(ms, "            goto done;" NL);
-    mstream_cstr(ms, "    }" NL NL);
+    mstream_fmt (ms, "static int" NL "%S_prepare_all(struct %S* ctx)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int failed = 0;" NL NL);
+    if (root->split)
+    {
+        mstream_cstr(ms, "    if (ctx->split)" NL "    {" NL);
+        mstream_cstr(ms, "        int i;" NL);
+        mstream_fmt (ms, "        failed += %S_prepare_all(ctx->split->writer) != 0;" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        for (i = 0; i != ctx->split->readers.count; ++i)" NL);
+        mstream_fmt (ms, "            failed += %S_prepare_all(ctx->split->readers.conns[i]) != 0;" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        return failed ? -1 : 0;" NL);
+        mstream_cstr(ms, "    }" NL NL);
+    }
+    write_shard_route_cstr(ms, root, "prepare_all", "", data);
 
-    mstream_fmt (ms, "    %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(db));" NL,
-        LOG_SQL_ERR(root->log_sql_err, data));
-    mstream_cstr(ms, "done:" NL);
-    mstream_cstr(ms, "    for (i = 0; i != sql_num; ++i)" NL);
-    mstream_cstr(ms, "        if (sql[i])" NL);
-    mstream_cstr(ms, "            free(sql[i]);" NL);
-    mstream_cstr(ms, "    if (sql)" NL);
-    mstream_cstr(ms, "        free(sql);" NL);
-    mstream_cstr(ms, "    sqlite3_reset(stmt);" NL);
-    mstream_cstr(ms, "    return success;" NL);
+    for (i = 0; i != sizeof(tx_stmts) / sizeof(*tx_stmts); ++i)
+    {
+        mstream_fmt(ms, "    failed += %S_prepare_stmt(ctx, &ctx->tx.%s, \"%s\", \"",
+            PREFIX(root->prefix, data), tx_stmts[i].name, tx_stmts[i].name);
+        mstream_fmt(ms, tx_stmts[i].sql, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "\");" NL);
+    }
+
+    for (q = root->queries; q; q = q->next)
+        write_prepare_query_stmts(ms, root, NULL, q, data);
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            write_prepare_query_stmts(ms, root, g, q, data);
+
+    mstream_cstr(ms, NL "    return failed ? -1 : 0;" NL);
     mstream_cstr(ms, "}" NL NL);
 }
 
+/*
+ * Per-statement and per-connection counters kept by SQLite. The statements
+ * are listed in a table of offsets into the context structure, so that
+ * query_stats() can look them up by index. A statement that has not been
+ * prepared yet reports zeros.
+ */
 static void
-write_migration_body(struct mstream* ms, const struct root* root, const char* data, char reinit_db, char forwards_compat)
+write_stmt_stats_entry(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* suffix, const char* data)
 {
-    int max_version = 0;
-    struct migration* m;
-
-    /* List is already sorted */
-    for (m = root->upgrade; m; m = m->next)
-        max_version = m->version;
-
-    mstream_cstr(ms, "    int ret;" NL);
-    mstream_cstr(ms, "    int version;" NL);
-    mstream_cstr(ms, "    char* error;" NL);
-    if (!reinit_db)
-        mstream_cstr(ms, "    char buf[sizeof(\"PRAGMA user_version=+2147483648;\")];" NL NL);
+    mstream_cstr(ms, "    { \"");
+    if (g)
+        mstream_fmt(ms, "%S.", g->name, data);
+    mstream_fmt(ms, "%S%s\", offsetof(struct %S, ", q->name, data, suffix, PREFIX(root->prefix, data));
+    write_func_name(ms, g, q, data);
+    mstream_fmt(ms, "%s) }," NL, suffix);
+}
 
-    /* Ensure requested version is within range */
-    if (!reinit_db)
+static void
+write_stmt_stats_query_entries(struct mstream* ms, const struct root* root, const struct query_group* g, const struct query* q, const char* data)
+{
+    write_stmt_stats_entry(ms, root, g, q, "", data);
+    if (q->bulk)
     {
-        mstream_fmt (ms, "    if (target_version < 0 || target_version > %d)" NL "    {" NL, max_version);
-        mstream_fmt (ms, "        %S(\"Invalid version requested for migration: %%d. Support versions 0-%d\\n\", target_version);" NL,
-            LOG_ERR(root->log_err, data), max_version);
-        mstream_cstr(ms, "        return -1;" NL);
-        mstream_cstr(ms, "    }" NL NL);
+        write_stmt_stats_entry(ms, root, g, q, "_bulk", data);
+        write_stmt_stats_entry(ms, root, g, q, "_bulk_tail", data);
     }
+    if (q->cursor)
+        write_stmt_stats_entry(ms, root, g, q, "_cursor", data);
+    if (q->columns)
+        write_stmt_stats_entry(ms, root, g, q, "_columns", data);
+    if (query_has_lookup(q))
+        write_stmt_stats_entry(ms, root, g, q, "_lookup", data);
+}
 
-    /* Get current db version */
-    mstream_fmt (ms, "    version = %S_version(ctx);" NL, PREFIX(root->prefix, data));
-    mstream_cstr(ms, "    if (version < 0)" NL);
-    mstream_cstr(ms, "        return -1;" NL NL);
+static const struct {
+    const char* field;
+    const char* op;
+    const char* value;
+} db_status_counters[] = {
+    { "cache_hits",          "CACHE_HIT",           "cur" },
+    { "cache_misses",        "CACHE_MISS",          "cur" },
+    { "cache_writes",        "CACHE_WRITE",         "cur" },
+    { "cache_spills",        "CACHE_SPILL",         "cur" },
+    { "cache_used",          "CACHE_USED",          "cur" },
+    { "lookaside_used",      "LOOKASIDE_USED",      "cur" },
+    { "lookaside_hits",      "LOOKASIDE_HIT",       "hi" },
+    { "lookaside_miss_size", "LOOKASIDE_MISS_SIZE", "hi" },
+    { "lookaside_miss_full", "LOOKASIDE_MISS_FULL", "hi" },
+    { "schema_used",         "SCHEMA_USED",         "cur" },
+    { "stmt_used",           "STMT_USED",           "cur" }
+};
 
-    /* Begin transaction */
-    mstream_cstr(ms, "    ret = sqlite3_exec(ctx->db, \"BEGIN TRANSACTION;\", NULL, NULL, &error);" NL);
-    mstream_cstr(ms, "    if (ret != SQLITE_OK)" NL "    {" NL);
-    mstream_fmt (ms, "        %S(ret, error, sqlite3_errmsg(ctx->db));" NL, LOG_SQL_ERR(root->log_sql_err, data));
-    mstream_cstr(ms, "        sqlite3_free(error);" NL);
-    mstream_cstr(ms, "        return -1;" NL);
-    mstream_cstr(ms, "    }" NL NL);
+static const struct {
+    const char* field;
+    const char* op;
+} stmt_status_counters[] = {
+    { "fullscan_steps", "FULLSCAN_STEP" },
+    { "sorts",          "SORT" },
+    { "autoindexes",    "AUTOINDEX" },
+    { "vm_steps",       "VM_STEP" },
+    { "reprepares",     "REPREPARE" },
+    { "runs",           "RUN" },
+    { "memused",        "MEMUSED" }
+};
 
-    /* Downgrade code */
-    mstream_cstr(ms, "    switch (version)" NL "    {" NL);
-    mstream_cstr(ms, "        default:" NL);
-    if (forwards_compat)
+static void
+write_stmt_stats_structs(struct mstream* ms, const struct root* root, const char* data)
+{
+    int i;
+
+    mstream_fmt (ms, "struct %S_stmt_stats" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    const char* name;   /* e.g. \"person.add\" or \"person.add_bulk\" */" NL);
+    mstream_cstr(ms, "    int prepared;       /* 0 if the statement hasn't been prepared yet */" NL);
+    for (i = 0; i != sizeof(stmt_status_counters) / sizeof(*stmt_status_counters); ++i)
+        mstream_fmt(ms, "    int %s;" NL, stmt_status_counters[i].field);
+    mstream_cstr(ms, "};" NL NL);
+
+    mstream_fmt (ms, "struct %S_db_stats" NL "{" NL, PREFIX(root->prefix, data));
+    for (i = 0; i != sizeof(db_status_counters) / sizeof(*db_status_counters); ++i)
+        mstream_fmt(ms, "    int %s;" NL, db_status_counters[i].field);
+    mstream_cstr(ms, "};" NL NL);
+}
+
+static void
+write_wal_stats_struct(struct mstream* ms, const struct root* root, const char* data)
+{
+    mstream_fmt (ms, "struct %S_wal_stats" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int wal_frames;       /* Frames in the WAL, as of the last commit or checkpoint */" NL);
+    mstream_cstr(ms, "    int checkpoints;      /* Number of checkpoints, including the ones below */" NL);
+    mstream_cstr(ms, "    int restarts;         /* Checkpoints that also restarted the WAL */" NL);
+    mstream_cstr(ms, "    int truncates;        /* Checkpoints that also truncated the WAL */" NL);
+    mstream_cstr(ms, "    int busy;             /* Checkpoints that stopped early because of readers */" NL);
+    mstream_cstr(ms, "    int errors;" NL);
+    mstream_cstr(ms, "    long long last_us;    /* Duration of the last checkpoint */" NL);
+    mstream_cstr(ms, "    long long max_us;" NL);
+    mstream_cstr(ms, "    long long total_us;" NL);
+    mstream_cstr(ms, "};" NL NL);
+}
+
+static void
+write_stmt_stats_funcs(struct mstream* ms, const struct root* root, const char* data)
+{
+    const struct query_group* g;
+    const struct query* q;
+    int i;
+
+    mstream_cstr(ms, "static const struct" NL "{" NL);
+    mstream_cstr(ms, "    const char* name;" NL);
+    mstream_cstr(ms, "    size_t offset;" NL);
+    mstream_fmt (ms, "} %S_stmts[] = {" NL, PREFIX(root->prefix, data));
+    for (q = root->queries; q; q = q->next)
+        write_stmt_stats_query_entries(ms, root, NULL, q, data);
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            write_stmt_stats_query_entries(ms, root, g, q, data);
+    for (i = 0; i != sizeof(tx_stmts) / sizeof(*tx_stmts); ++i)
+        mstream_fmt(ms, "    { \"%s\", offsetof(struct %S, tx.%s) }," NL,
+            tx_stmts[i].name, PREFIX(root->prefix, data), tx_stmts[i].name);
+    mstream_cstr(ms, "};" NL NL);
+
+    /* query_stats() */
+    mstream_fmt (ms, "static void" NL "%S_query_stats_add(struct %S* ctx, int query_id, struct %S_stmt_stats* stats)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    sqlite3_stmt* stmt = *(sqlite3_stmt**)((char*)ctx + %S_stmts[query_id].offset);" NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (stmt == NULL)" NL);
+    mstream_cstr(ms, "        return;" NL NL);
+    mstream_cstr(ms, "    stats->prepared = 1;" NL);
+    for (i = 0; i != sizeof(stmt_status_counters) / sizeof(*stmt_status_counters); ++i)
+        mstream_fmt(ms, "    stats->%s += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_%s, 0);" NL,
+            stmt_status_counters[i].field, stmt_status_counters[i].op);
+    mstream_cstr(ms, "}" NL NL);
+
+    mstream_fmt (ms, "static int" NL "%S_query_stats(struct %S* ctx, int query_id, struct %S_stmt_stats* stats)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    if (query_id < 0 || query_id >= (int)(sizeof(%S_stmts) / sizeof(*%S_stmts)))" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        return -1;" NL NL);
+    mstream_cstr(ms, "    memset(stats, 0, sizeof *stats);" NL);
+    mstream_fmt (ms, "    stats->name = %S_stmts[query_id].name;" NL, PREFIX(root->prefix, data));
+    if (root->split)
     {
-        mstream_fmt(ms, "            if (%S_downgrade_forward_compat(ctx->db) != 0)" NL,
-            PREFIX(root->prefix, data));
-        mstream_fmt(ms, "                goto migration_failed;" NL);
-        mstream_fmt(ms, "            version = %d;" NL,
-            root->downgrade ? root->downgrade->version + 1 : 0);
-        mstream_cstr(ms, "            /* fallthrough */" NL);
+        /* The numbers of a split context are the sum over all connections */
+        mstream_cstr(ms, "    if (ctx->split)" NL "    {" NL);
+        mstream_cstr(ms, "        int i;" NL);
+        mstream_fmt (ms, "        %S_query_stats_add(ctx->split->writer, query_id, stats);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        for (i = 0; i != ctx->split->readers.count; ++i)" NL);
+        mstream_fmt (ms, "            %S_query_stats_add(ctx->split->readers.conns[i], query_id, stats);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        return 0;" NL);
+        mstream_cstr(ms, "    }" NL);
     }
-    else
+    if (root->shards)
     {
-        mstream_fmt(ms, "            %S(\"Database was created by a newer version of the software! "
-            "Can't downgrade, because forwards compatibility was disabled in sqlgen.\");" NL,
-            LOG_ERR(root->log_err, data));
-        mstream_cstr(ms, "            goto migration_failed;" NL);
+        mstream_cstr(ms, "    if (ctx->shards)" NL "    {" NL);
+        mstream_cstr(ms, "        int shard;" NL);
+        mstream_fmt (ms, "        for (shard = 0; shard != %d; ++shard)" NL, root->shards);
+        mstream_fmt (ms, "            %S_query_stats_add(ctx->shards[shard], query_id, stats);" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "        return 0;" NL);
+        mstream_cstr(ms, "    }" NL);
     }
+    mstream_fmt (ms, "    %S_query_stats_add(ctx, query_id, stats);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return 0;" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-    for (m = root->downgrade; m; m = m->next)
+    /* db_stats() */
+    mstream_fmt (ms, "static int" NL "%S_db_stats_add(struct %S* ctx, struct %S_db_stats* stats)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int cur, hi;" NL);
+    for (i = 0; i != sizeof(db_status_counters) / sizeof(*db_status_counters); ++i)
     {
-        mstream_fmt (ms, "        case %d:" NL, m->version + 1);
-        if (!reinit_db)
-        {
-            mstream_cstr(ms, "            if (version == target_version)" NL);
-            mstream_cstr(ms, "                break;" NL);
-        }
-        mstream_fmt (ms, "            if (run_sqlite3_sql(ctx->db, %S_downgrade%d) != 0)" NL,
-            PREFIX(root->prefix, data), m->version);
-        mstream_cstr(ms, "                goto migration_failed;" NL);
-
-        if (forwards_compat && m->version == 0)
-        {
-            mstream_fmt (ms, "            if (run_sqlite3_sql(ctx->db, \"DROP TABLE IF EXISTS %S_downgrades;\") != 0)" NL,
-                PREFIX(root->prefix, data));
-            mstream_cstr(ms, "                goto migration_failed;" NL);
-        }
-
-        mstream_fmt (ms, "            version = %d;" NL, m->version);
+        mstream_fmt(ms, "    if (sqlite3_db_status(ctx->db, SQLITE_DBSTATUS_%s, &cur, &hi, 0) != SQLITE_OK)" NL,
+            db_status_counters[i].op);
+        mstream_cstr(ms, "        return -1;" NL);
+        mstream_fmt(ms, "    stats->%s += %s;" NL, db_status_counters[i].field, db_status_counters[i].value);
     }
-    mstream_cstr(ms, "        case 0:" NL);
-    mstream_cstr(ms, "            break;" NL);
-    mstream_cstr(ms, "    }" NL NL);
+    mstream_cstr(ms, "    return 0;" NL);
+    mstream_cstr(ms, "}" NL NL);
 
-    /* Upgrade code */
-    mstream_cstr(ms, "    switch (version)" NL "    {" NL);
-    for (m = root->upgrade; m; m = m->next)
+    mstream_fmt (ms, "static int" NL "%S_db_stats(struct %S* ctx, struct %S_db_stats* stats)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    memset(stats, 0, sizeof *stats);" NL);
+    if (root->split)
     {
-        mstream_fmt(ms, "        case %d:" NL, m->version - 1);
-        if (!reinit_db)
-        {
-            mstream_cstr(ms, "            if (version == target_version)" NL);
-            mstream_cstr(ms, "                break;" NL);
-        }
-
-        /* The first migration also includes forward-compat code */
-        if (forwards_compat && m->version == 1)
-        {
-            struct migration* m2;
-            mstream_cstr(ms, "            if (run_sqlite3_sql(ctx->db," NL);
-            mstream_fmt (ms, "                \"CREATE TABLE IF NOT EXISTS %S_downgrades (\\n\"" NL,
-                PREFIX(root->prefix, data));
-            mstream_cstr(ms, "                \"    version INTEGER PRIMARY KEY NOT NULL,\\n\"" NL);
-            mstream_cstr(ms, "                \"    sql TEXT NOT NULL);\\n\"");
-
-            m2 = root->downgrade;
-            while (m2)
-            {
-                int p;
+        mstream_cstr(ms, "    if (ctx->split)" NL "    {" NL);
+        mstream_cstr(ms, "        int i;" NL);
+        mstream_fmt (ms, "        if (%S_db_stats_add(ctx->split->writer, stats) != 0)" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "            return -1;" NL);
+        mstream_cstr(ms, "        for (i = 0; i != ctx->split->readers.count; ++i)" NL);
+        mstream_fmt (ms, "            if (%S_db_stats_add(ctx->split->readers.conns[i], stats) != 0)" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "                return -1;" NL);
+        mstream_cstr(ms, "        return 0;" NL);
+        mstream_cstr(ms, "    }" NL);
+    }
+    if (root->shards)
+    {
+        mstream_cstr(ms, "    if (ctx->shards)" NL "    {" NL);
+        mstream_cstr(ms, "        int shard;" NL);
+        mstream_fmt (ms, "        for (shard = 0; shard != %d; ++shard)" NL, root->shards);
+        mstream_fmt (ms, "            if (%S_db_stats_add(ctx->shards[shard], stats) != 0)" NL, PREFIX(root->prefix, data));
+        mstream_cstr(ms, "                return -1;" NL);
+        mstream_cstr(ms, "        return 0;" NL);
+        mstream_cstr(ms, "    }" NL);
+    }
+    mstream_fmt (ms, "    return %S_db_stats_add(ctx, stats);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+}
 
-                mstream_fmt(ms, NL "                "
-                    "\"INSERT OR IGNORE INTO %S_downgrades (version, sql) "
-                    "VALUES (%d, '",
-                    PREFIX(root->prefix, data), m2->version);
+/*
+ * explain_all() runs EXPLAIN QUERY PLAN on the statement of every query and
+ * reports each line of the plan. Lines that scan a table without an index,
+ * sort through a temporary b-tree or build an automatic index are flagged.
+ * The statements are prepared separately from the ones the query functions
+ * use, so this also works before anything has been prepared.
+ */
+static void
+write_explain_stmt_entry(struct mstream* ms, const struct query_group* g, const struct query* q, const char* data)
+{
+    mstream_cstr(ms, "    { \"");
+    if (g)
+        mstream_fmt(ms, "%S.", g->name, data);
+    mstream_fmt(ms, "%S\"," NL, q->name, data);
+    write_sqlite_stmt_sql(ms, q, data);
+    mstream_cstr(ms, " }," NL);
 
-                p = 0;
-                while (p != m2->sql.len)
-                {
-                    while (isspace(data[m2->sql.off + p]))
-                        p++;
+    if (query_has_lookup(q))
+    {
+        mstream_cstr(ms, "    { \"");
+        if (g)
+            mstream_fmt(ms, "%S.", g->name, data);
+        mstream_fmt(ms, "%S_lookup\"," NL, q->name, data);
+        write_sqlite_lookup_stmt_sql(ms, q, data);
+        mstream_cstr(ms, " }," NL);
+    }
+}
 
-                    mstream_cstr(ms, "\"" NL "                    \"");
-                    while (p != m2->sql.len)
-                    {
-                        char c = data[m2->sql.off + p++];
-                        /* Escape SQL for insertion into table */
-                        if (c == '\'')
-                            mstream_putc(ms, '\'');
-                        /* Escape SQL for C string */
-                        else if (c == '"')
-                            mstream_putc(ms, '\\');
-                        else if (c == '\\')
-                            mstream_cstr(ms, "\\\\\\");
-                        else if (c == '\r')
-                            continue;
-                        else if (c == '\n')
-                        {
-                            mstream_cstr(ms, "\\\\n");
-                            break;
-                        }
-                        mstream_putc(ms, c);
-                    }
-                }
+static void
+write_explain_struct(struct mstream* ms, const struct root* root, const char* data)
+{
+    mstream_fmt (ms, "struct %S_plan_row" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    const char* query;  /* e.g. \"person.add\" */" NL);
+    mstream_cstr(ms, "    const char* sql;" NL);
+    mstream_cstr(ms, "    const char* detail; /* e.g. \"SEARCH people USING INDEX ...\" */" NL);
+    mstream_cstr(ms, "    int full_scan;      /* Scans a table without using an index */" NL);
+    mstream_cstr(ms, "    int temp_btree;     /* Sorts or groups through a temporary b-tree */" NL);
+    mstream_cstr(ms, "    int auto_index;     /* Builds an automatic index for every run */" NL);
+    mstream_cstr(ms, "};" NL NL);
+}
 
-                mstream_cstr(ms, "');\\n\"");
+static void
+write_explain_func(struct mstream* ms, const struct root* root, const char* data)
+{
+    const struct query_group* g;
+    const struct query* q;
 
-                m2 = m2->next;
-            }
-            //mstream_cstr(ms, NL "                    \"');\"");
-            mstream_cstr(ms, ") != 0)" NL);
-            mstream_cstr(ms, "                goto migration_failed;" NL);
-        }
-        mstream_fmt(ms, "            if (run_sqlite3_sql(ctx->db, %S_upgrade%d) != 0)" NL, PREFIX(root->prefix, data), m->version);
-        mstream_cstr(ms, "                goto migration_failed;" NL);
-        mstream_fmt (ms, "            version = %d;" NL, m->version);
-    }
-    mstream_fmt (ms, "        case %d: break;" NL, max_version);
-    mstream_cstr(ms, "        default:" NL);
-    mstream_fmt(ms, "            %S(\"Failed to upgrade db: Unknown version %%d\\n\", version);" NL, LOG_ERR(root->log_err, data));
-    mstream_cstr(ms, "            goto migration_failed;" NL);
-    mstream_cstr(ms, "    }" NL NL);
+    mstream_cstr(ms, "static const struct" NL "{" NL);
+    mstream_cstr(ms, "    const char* name;" NL);
+    mstream_cstr(ms, "    const char* sql;" NL);
+    mstream_fmt (ms, "} %S_explain_stmts[] = {" NL, PREFIX(root->prefix, data));
+    for (q = root->queries; q; q = q->next)
+        write_explain_stmt_entry(ms, NULL, q, data);
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            write_explain_stmt_entry(ms, g, q, data);
+    mstream_cstr(ms, "    { NULL, NULL }" NL);
+    mstream_cstr(ms, "};" NL NL);
 
-    /* Ensure that we have reached the target version */
-    if (!reinit_db)
+    mstream_fmt (ms, "static int" NL "%S_explain_all(struct %S* ctx, void (*report_cb)(const struct %S_plan_row* row, void* user_data), void* user_data)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_plan_row row;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    sqlite3_stmt* stmt;" NL);
+    mstream_cstr(ms, "    char* sql;" NL);
+    mstream_cstr(ms, "    int i, ret, flagged = 0, failed = 0;" NL NL);
+    if (root->split)
     {
-        mstream_cstr(ms, "    if (version != target_version)" NL "    {" NL);
-        mstream_fmt (ms, "        %S(\"Failed to migrate db to version %%d. Migration stopped at version %%d\", target_version, version);" NL,
-            LOG_ERR(root->log_err, data));
-        mstream_cstr(ms, "        goto migration_failed;" NL);
-        mstream_cstr(ms, "    }" NL NL);
+        write_split_route_begin(ms, root, 1, data);
+        mstream_fmt(ms, "%S_explain_all(split_ctx, report_cb, user_data);" NL, PREFIX(root->prefix, data));
+        write_split_route_end(ms, root, SPLIT_CALL, data);
     }
-
-    /* Write new version to db */
-    if (reinit_db)
-        mstream_fmt(ms, "    ret = sqlite3_exec(ctx->db, \"PRAGMA user_version=%d;\", NULL, NULL, &error);" NL, max_version);
-    else
+    if (root->shards)
     {
-        mstream_cstr(ms, "    sprintf(buf, \"PRAGMA user_version=%d;\", target_version);" NL);
-        mstream_cstr(ms, "    ret = sqlite3_exec(ctx->db, buf, NULL, NULL, &error);" NL);
+        /* All shards have the same schema, so their plans are the same too */
+        mstream_cstr(ms, "    if (ctx->shards)" NL);
+        mstream_fmt (ms, "        return %S_explain_all(ctx->shards[0], report_cb, user_data);" NL NL, PREFIX(root->prefix, data));
     }
-    mstream_cstr(ms, "    if (ret != SQLITE_OK)" NL "    {" NL);
-    mstream_fmt (ms, "        %S(ret, error, sqlite3_errmsg(ctx->db));" NL, LOG_SQL_ERR(root->log_sql_err, data));
-    mstream_cstr(ms, "        sqlite3_free(error);" NL);
-    mstream_cstr(ms, "        goto migration_failed;" NL);
+    mstream_fmt (ms, "    for (i = 0; %S_explain_stmts[i].name; ++i)" NL "    {" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        if ((sql = sqlite3_mprintf(\"EXPLAIN QUERY PLAN %%s\", %S_explain_stmts[i].sql)) == NULL)" NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "            return -1;" NL);
+    mstream_cstr(ms, "        ret = sqlite3_prepare_v2(ctx->db, sql, -1, &stmt, NULL);" NL);
+    mstream_cstr(ms, "        sqlite3_free(sql);" NL);
+    mstream_cstr(ms, "        if (ret != SQLITE_OK)" NL "        {" NL);
+    mstream_fmt (ms, "            %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+        LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_fmt (ms, "            %S(\"Failed to explain \\\"%%s\\\"\\n\", %S_explain_stmts[i].name);" NL,
+        LOG_ERR(root->log_err, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "            failed = 1;" NL);
+    mstream_cstr(ms, "            continue;" NL);
+    mstream_cstr(ms, "        }" NL NL);
+    mstream_fmt (ms, "        row.query = %S_explain_stmts[i].name;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        row.sql = %S_explain_stmts[i].sql;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)" NL "        {" NL);
+    mstream_cstr(ms, "            row.detail = (const char*)sqlite3_column_text(stmt, 3);" NL);
+    mstream_cstr(ms, "            if (row.detail == NULL)" NL);
+    mstream_cstr(ms, "                continue;" NL);
+    /* "SCAN t USING [COVERING] INDEX i" walks an index, which is fine for
+     * ORDER BY. Older versions of SQLite say "SCAN TABLE t" */
+    mstream_cstr(ms, "            row.full_scan = strncmp(row.detail, \"SCAN \", 5) == 0" NL);
+    mstream_cstr(ms, "                && strstr(row.detail, \" USING \") == NULL" NL);
+    mstream_cstr(ms, "                && strstr(row.detail, \"CONSTANT ROW\") == NULL" NL);
+    mstream_cstr(ms, "                && strstr(row.detail, \"VIRTUAL TABLE\") == NULL;" NL);
+    mstream_cstr(ms, "            row.temp_btree = strstr(row.detail, \"TEMP B-TREE\") != NULL;" NL);
+    mstream_cstr(ms, "            row.auto_index = strstr(row.detail, \"AUTOMATIC\") != NULL;" NL);
+    mstream_cstr(ms, "            if (row.full_scan || row.temp_btree || row.auto_index)" NL);
+    mstream_cstr(ms, "                flagged++;" NL);
+    mstream_cstr(ms, "            if (report_cb)" NL);
+    mstream_cstr(ms, "                report_cb(&row, user_data);" NL);
+    mstream_cstr(ms, "        }" NL);
+    mstream_cstr(ms, "        if (ret != SQLITE_DONE)" NL "        {" NL);
+    mstream_fmt (ms, "            %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
+        LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(ms, "            failed = 1;" NL);
+    mstream_cstr(ms, "        }" NL);
+    mstream_cstr(ms, "        sqlite3_finalize(stmt);" NL);
     mstream_cstr(ms, "    }" NL NL);
+    mstream_cstr(ms, "    return failed ? -1 : flagged;" NL);
+    mstream_cstr(ms, "}" NL NL);
+}
 
-    /* Commit transaction */
-    mstream_cstr(ms, "    ret = sqlite3_exec(ctx->db, \"COMMIT TRANSACTION;\", NULL, NULL, &error);" NL);
-    mstream_cstr(ms, "    if (ret != SQLITE_OK)" NL "    {" NL);
-    mstream_fmt (ms, "        %S(ret, error, sqlite3_errmsg(ctx->db));" NL, LOG_SQL_ERR(root->log_sql_err, data));
-    mstream_cstr(ms, "        sqlite3_free(error);" NL);
-    mstream_cstr(ms, "        goto migration_failed;" NL);
-    mstream_cstr(ms, "    }" NL NL);
+static void
+write_split_interface_entries(struct mstream* ms, const struct root* root, const char* data)
+{
+    if (root->split)
+        mstream_fmt(ms, "    %S_open_split," NL, PREFIX(root->prefix, data));
+    if (root->shards)
+        mstream_fmt(ms, "    %S_open_shards," NL, PREFIX(root->prefix, data));
+}
 
-    mstream_cstr(ms, "    return 0;" NL NL);
+static void
+write_pool_interface_entries(struct mstream* ms, const struct root* root, const char* data)
+{
+    if (!root->pool)
+        return;
+    mstream_fmt(ms, "    %S_pool_open," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_pool_close," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_pool_acquire," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_pool_release," NL, PREFIX(root->prefix, data));
+    if (root->checkpoint_pages)
+        mstream_fmt(ms, "    %S_pool_wal_stats," NL, PREFIX(root->prefix, data));
+}
 
-    /* Abort transaction */
-    mstream_cstr(ms, "migration_failed:" NL);
-    mstream_cstr(ms, "    ret = sqlite3_exec(ctx->db, \"ROLLBACK TRANSACTION;\", NULL, NULL, &error);" NL);
-    mstream_cstr(ms, "    if (ret != SQLITE_OK)" NL "    {" NL);
-    mstream_fmt (ms, "        %S(ret, error, sqlite3_errmsg(ctx->db));" NL, LOG_SQL_ERR(root->log_sql_err, data));
-    mstream_cstr(ms, "        sqlite3_free(error);" NL);
-    mstream_cstr(ms, "    }" NL);
-    mstream_cstr(ms, "    return -1;" NL);
+static void
+write_executor_interface_entries(struct mstream* ms, const struct root* root, const char* data)
+{
+    if (!root->async)
+        return;
+    mstream_fmt(ms, "    %S_executor_open," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_executor_close," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_executor_poll," NL, PREFIX(root->prefix, data));
 }
 
 static void
-write_migration_to_func(struct mstream* ms, const struct root* root, const char* data, char forwards_compat)
+write_deadline_interface_entries(struct mstream* ms, const struct root* root, const char* data)
 {
-    mstream_fmt(ms, "static int %S_migrate_to(struct %S* ctx, int target_version)" NL "{" NL, PREFIX(root->prefix, data), PREFIX(root->prefix, data));
-    write_migration_body(ms, root, data, 0, forwards_compat);
-    mstream_cstr(ms, "}" NL NL);
+    if (!root->deadlines)
+        return;
+    mstream_fmt(ms, "    %S_set_deadline," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_cancel," NL, PREFIX(root->prefix, data));
 }
 
 static void
-write_upgrade_func(struct mstream* ms, const struct root* root, const char* data)
+write_tenant_interface_entries(struct mstream* ms, const struct root* root, const char* data)
 {
-    int max_version = 0;
-    struct migration* m = root->upgrade;
-    for (; m; m = m->next)  /* List is already sorted */
-        max_version = m->version;
-
-    mstream_fmt(ms, "static int %S_upgrade(struct %S* ctx)" NL "{" NL, PREFIX(root->prefix, data), PREFIX(root->prefix, data));
-    mstream_fmt(ms, "    return %S_migrate_to(ctx, %d);" NL, PREFIX(root->prefix, data), max_version);
-    mstream_cstr(ms, "}" NL NL);
+    if (!root->tenants)
+        return;
+    mstream_fmt(ms, "    %S_tenants_open," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_tenants_close," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_tenant_get," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_tenant_release," NL, PREFIX(root->prefix, data));
 }
 
 static void
-write_reinit_func(struct mstream* ms, const struct root* root, const char* data, char forwards_compat)
+write_transaction_interface_entries(struct mstream* ms, const struct root* root, const char* data)
 {
-    mstream_fmt(ms, "static int %S_reinit(struct %S* ctx)" NL "{" NL, PREFIX(root->prefix, data), PREFIX(root->prefix, data));
-    write_migration_body(ms, root, data, 1, forwards_compat);
-    mstream_cstr(ms, "}" NL NL);
+    mstream_fmt(ms, "    %S_begin," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_begin_immediate," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_commit," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_rollback," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_savepoint," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_release," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_rollback_to," NL, PREFIX(root->prefix, data));
 }
 
 static void
@@ -2804,7 +8752,10 @@ write_debug_wrapper(struct mstream* ms, const struct root* root, const struct qu
         for (a = q->cb_args; a; a = a->next)
         {
             if (a != q->cb_args) mstream_cstr(ms, ", ");
-            mstream_fmt(ms, "%s%S", a->cast_from_sql, a->name, data);
+            if (is_str_view(a, data))
+                mstream_fmt(ms, "%S.len, %S.data", a->name, data, a->name, data);
+            else
+                mstream_fmt(ms, "%s%S", a->cast_from_sql, a->name, data);
             if (a->has_hidden_len_param)
                 mstream_fmt(ms, ", %S_len", a->name, data);
         }
@@ -2865,112 +8816,915 @@ write_debug_wrapper(struct mstream* ms, const struct root* root, const struct qu
     }
     mstream_cstr(ms, ");" NL);
 
-    if (q->cb_args)
-        mstream_fmt(ms, "    %S(\"  ", LOG_DBG(root->log_dbg, data));
+    if (q->cb_args)
+        mstream_fmt(ms, "    %S(\"  ", LOG_DBG(root->log_dbg, data));
+    for (a = q->cb_args; a; a = a->next)
+    {
+        if (a != q->cb_args) mstream_cstr(ms, " | ");
+        mstream_str(ms, a->name, data);
+    }
+    if (q->cb_args)
+        mstream_fmt(ms, "\\n\");" NL);
+
+    mstream_cstr(ms, "    result = db_sqlite3.");
+    if (g)
+        mstream_fmt(ms, "%S.", g->name, data);
+    mstream_str(ms, q->name, data);
+    mstream_cstr(ms, "(ctx");
+    for (a = q->in_args; a; a = a->next)
+    {
+        mstream_fmt(ms, ", %S", a->name, data);
+        if (a->has_hidden_len_param)
+            mstream_fmt(ms, ", %S_len", a->name, data);
+    }
+    if (q->return_arg)
+        mstream_fmt(ms, ", %S", q->return_arg->name, data);
+    if (q->cb_args)
+    {
+        mstream_cstr(ms, ", dbg_");
+        write_func_name(ms, g, q, data);
+        mstream_cstr(ms, "_on_row, dbg");
+    }
+    mstream_cstr(ms, ");" NL);
+
+    mstream_cstr(ms, "    sql = sqlite3_expanded_sql(ctx->");
+    write_func_name(ms, g, q, data);
+    mstream_cstr(ms, ");" NL);
+    mstream_fmt(ms, "    %S(\"retval=%%d\\n%%s\\n\\n\", result, sql);" NL,
+                LOG_DBG(root->log_dbg, data));
+    mstream_cstr(ms, "    sqlite3_free(sql);" NL);
+    mstream_cstr(ms, "    return result;" NL);
+    mstream_cstr(ms, "}" NL NL);
+}
+
+static int
+determine_indent(struct mstream* ms, struct str_view str, const char* data)
+{
+    int p;
+    int indent = 0;
+    int min_indent = INT_MAX;
+
+    p = 0;
+    while (p != str.len)
+    {
+        while (p != str.len)
+        {
+            if (!isspace(data[str.off + p++]))
+                break;
+            indent++;
+        }
+
+        if (min_indent > indent)
+            min_indent = indent;
+
+        while (p != str.len)
+            if (data[str.off + p++] == '\n')
+            {
+                indent = 0;
+                break;
+            }
+    }
+
+    return min_indent;
+}
+
+static void
+write_block_reindented(struct mstream* ms, int indent, struct str_view str, const char* data)
+{
+    int p, i;
+    int unindent = determine_indent(ms, str, data);
+
+    p = 0;
+    while (p != str.len)
+    {
+        i = unindent;
+        while (p != str.len && i--)
+            p++;
+
+        for (i = 0; i != indent; ++i)
+            mstream_putc(ms, ' ');
+
+        while (p != str.len)
+        {
+            char c = data[str.off + p++];
+            mstream_putc(ms, c);
+            if (c == '\n')
+                break;
+        }
+    }
+
+    mstream_cstr(ms, NL);
+}
+
+static void
+write_block_reindented_cstr(struct mstream* ms, int indent, const char* data)
+{
+    struct str_view str = {
+        0,
+        strlen(data)
+    };
+    write_block_reindented(ms, indent, str, data);
+}
+
+/*
+ * Profile layer. Queries, batch and bulk variants and functions are wrapped
+ * with functions that time the call and count errors and rows. Every thread
+ * gets its own block of counters on first use, so recording never contends
+ * with other threads. Blocks are pushed onto a lock-free list and never
+ * freed, so that the counts of threads that have exited are kept. stats()
+ * sums the blocks of all threads.
+ *
+ * Latencies go into log-linear histograms: 4 buckets per power of two,
+ * which puts every percentile within 25% of the real value.
+ */
+enum profile_op_kind
+{
+    PROFILE_QUERY,
+    PROFILE_BATCH,
+    PROFILE_BULK,
+    PROFILE_FUNCTION
+};
+
+struct profile_op
+{
+    const struct query_group* g;
+    const struct query* q;
+    const struct function* f;
+    enum profile_op_kind kind;
+};
+
+static int
+add_profile_op(struct profile_op* ops, int count, const struct query_group* g,
+    const struct query* q, const struct function* f, enum profile_op_kind kind)
+{
+    if (ops)
+    {
+        ops[count].g = g;
+        ops[count].q = q;
+        ops[count].f = f;
+        ops[count].kind = kind;
+    }
+    return count + 1;
+}
+
+/*!
+ * \brief Lists every profiled function in the order of the interface.
+ * \param[out] ops Filled in if not NULL.
+ * \return The number of profiled functions.
+ */
+static int
+collect_profile_ops(const struct root* root, struct profile_op* ops)
+{
+    const struct query_group* g;
+    const struct query* q;
+    const struct function* f;
+    int n = 0;
+
+    for (q = root->queries; q; q = q->next)
+    {
+        n = add_profile_op(ops, n, NULL, q, NULL, PROFILE_QUERY);
+        if (q->batch)
+            n = add_profile_op(ops, n, NULL, q, NULL, PROFILE_BATCH);
+        if (q->bulk)
+            n = add_profile_op(ops, n, NULL, q, NULL, PROFILE_BULK);
+    }
+    for (f = root->functions; f; f = f->next)
+        n = add_profile_op(ops, n, NULL, NULL, f, PROFILE_FUNCTION);
+    for (g = root->query_groups; g; g = g->next)
+    {
+        for (q = g->queries; q; q = q->next)
+        {
+            n = add_profile_op(ops, n, g, q, NULL, PROFILE_QUERY);
+            if (q->batch)
+                n = add_profile_op(ops, n, g, q, NULL, PROFILE_BATCH);
+            if (q->bulk)
+                n = add_profile_op(ops, n, g, q, NULL, PROFILE_BULK);
+        }
+        for (f = g->functions; f; f = f->next)
+            n = add_profile_op(ops, n, g, NULL, f, PROFILE_FUNCTION);
+    }
+
+    return n;
+}
+
+static struct profile_op*
+alloc_profile_ops(const struct root* root, int* count)
+{
+    struct profile_op* ops;
+    *count = collect_profile_ops(root, NULL);
+    ops = malloc(sizeof(*ops) * (*count ? *count : 1));
+    collect_profile_ops(root, ops);
+    return ops;
+}
+
+/*!
+ * \brief Writes the name of a profiled function, e.g. "person_add_batch"
+ * with sep='_' or "person.add_batch" with sep='.'.
+ */
+static void
+write_profile_op_name(struct mstream* ms, const struct profile_op* op, char sep, const char* data)
+{
+    if (op->g)
+    {
+        mstream_str(ms, op->g->name, data);
+        mstream_putc(ms, sep);
+    }
+    mstream_str(ms, op->q ? op->q->name : op->f->name, data);
+    if (op->kind == PROFILE_BATCH)
+        mstream_cstr(ms, "_batch");
+    else if (op->kind == PROFILE_BULK)
+        mstream_cstr(ms, "_bulk");
+}
+
+static int
+profile_op_name_len(const struct profile_op* op)
+{
+    int len = (op->g ? op->g->name.len + 1 : 0) + (op->q ? op->q->name.len : op->f->name.len);
+    return len + (op->kind == PROFILE_BATCH ? 6 : op->kind == PROFILE_BULK ? 5 : 0);
+}
+
+static void
+write_profile_header_structs(struct mstream* ms, const struct root* root, const char* data)
+{
+    struct profile_op* ops;
+    int i, count;
+
+    ops = alloc_profile_ops(root, &count);
+
+    mstream_fmt (ms, "struct %S_call_stats" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    long long calls;" NL);
+    mstream_cstr(ms, "    long long errors;   /* Calls that returned a negative value */" NL);
+    mstream_cstr(ms, "    long long rows;     /* Rows passed to callbacks, found or inserted */" NL);
+    mstream_cstr(ms, "    long long total_ns;" NL);
+    mstream_cstr(ms, "    long long max_ns;" NL);
+    mstream_cstr(ms, "    long long p50_ns;" NL);
+    mstream_cstr(ms, "    long long p99_ns;" NL);
+    mstream_cstr(ms, "    long long p999_ns;" NL);
+    mstream_cstr(ms, "};" NL NL);
+
+    mstream_fmt (ms, "struct %S_stats" NL "{" NL, PREFIX(root->prefix, data));
+    for (i = 0; i != count; ++i)
+    {
+        mstream_fmt(ms, "    struct %S_call_stats ", PREFIX(root->prefix, data));
+        write_profile_op_name(ms, &ops[i], '_', data);
+        mstream_cstr(ms, ";" NL);
+    }
+    if (count == 0)
+        mstream_cstr(ms, "    char unused;" NL);
+    mstream_cstr(ms, "};" NL NL);
+
+    free(ops);
+}
+
+static void
+write_profile_interface_decls(struct mstream* ms, const struct root* root, const char* data)
+{
+    write_block_reindented_cstr(ms, 4, "/*!" NL
+        " * \\brief Returns what the profile layer recorded, summed over all threads" NL
+        " * and connections. Percentiles are accurate to within 25%." NL
+        " * \\note The counters are process-wide and not scoped to a context. They" NL
+        " * keep counting until deinit() resets them." NL
+        " * \\param[in] ctx Unused, may be NULL." NL
+        " */");
+    mstream_fmt(ms, "    void (*stats)(struct %S* ctx, struct %S_stats* stats);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    write_block_reindented_cstr(ms, 4, "/*!" NL
+        " * \\brief Formats stats in the Prometheus text exposition format." NL
+        " * \\param[out] buf Receives the null-terminated text. The output is" NL
+        " * truncated if it doesn't fit. May be NULL if size is 0." NL
+        " * \\return The length of the full output, excluding the terminator. If" NL
+        " * this is not less than size, the output was truncated." NL
+        " */");
+    mstream_fmt(ms, "    int (*stats_prometheus)(const struct %S_stats* stats, char* buf, int size);" NL,
+        PREFIX(root->prefix, data));
+    write_block_reindented_cstr(ms, 4, "/*!" NL
+        " * \\brief Formats stats as a JSON object keyed by function name." NL
+        " * Returns the same as stats_prometheus()." NL
+        " */");
+    mstream_fmt(ms, "    int (*stats_json)(const struct %S_stats* stats, char* buf, int size);" NL,
+        PREFIX(root->prefix, data));
+}
+
+static void
+write_profile_interface_entries(struct mstream* ms, const struct root* root, const char* data)
+{
+    if (!root->profile_layer)
+        return;
+    mstream_fmt(ms, "    %S_stats," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_stats_prometheus," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_stats_json," NL, PREFIX(root->prefix, data));
+}
+
+/*!
+ * \brief Writes a Prometheus counter over all profiled functions.
+ */
+static void
+write_profile_dump_counter(struct mstream* ms, const struct root* root, const char* field, const char* help, const char* data)
+{
+    mstream_fmt (ms, "        %S_stats_write(&w, \"# HELP %S_%s_total %s\\n# TYPE %S_%s_total counter\\n\");" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), field, help, PREFIX(root->prefix, data), field);
+    mstream_fmt (ms, "        for (i = 0; i != %S_PROFILE_OPS; ++i)" NL "        {" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            sprintf(line, \"%S_%s_total{op=\\\"%%s\\\"} %%lld\\n\", %S_profile_ops[i].name, %S_stats_at(stats, i)->%s);" NL,
+        PREFIX(root->prefix, data), field, PREFIX(root->prefix, data), PREFIX(root->prefix, data), field);
+    mstream_fmt (ms, "            %S_stats_write(&w, line);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        }" NL);
+}
+
+/*!
+ * \brief Writes the counters and the stats() and stats_dump() functions.
+ * Must come before the interface tables.
+ */
+static void
+write_profile_funcs(struct mstream* ms, const struct root* root, const char* data)
+{
+    struct profile_op* ops;
+    int i, count, max_name_len = 0;
+
+    ops = alloc_profile_ops(root, &count);
+    for (i = 0; i != count; ++i)
+        if (max_name_len < profile_op_name_len(&ops[i]))
+            max_name_len = profile_op_name_len(&ops[i]);
+
+    mstream_fmt (ms, "#define %S_PROFILE_OPS %d" NL, PREFIX(root->prefix, data), count);
+    mstream_fmt (ms, "#define %S_PROFILE_BUCKETS 144" NL NL, PREFIX(root->prefix, data));
+
+    mstream_fmt (ms, "struct %S_profile_counters" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    volatile long long calls;" NL);
+    mstream_cstr(ms, "    volatile long long errors;" NL);
+    mstream_cstr(ms, "    volatile long long rows;" NL);
+    mstream_cstr(ms, "    volatile long long total_ns;" NL);
+    mstream_cstr(ms, "    volatile long long max_ns;" NL);
+    mstream_fmt (ms, "    volatile long long buckets[%S_PROFILE_BUCKETS];" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "};" NL NL);
+
+    mstream_fmt (ms, "struct %S_profile_thread" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_profile_thread* next;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    volatile long long retired;" NL);
+    mstream_fmt (ms, "    struct %S_profile_counters ops[%S_PROFILE_OPS > 0 ? %S_PROFILE_OPS : 1];" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "};" NL NL);
+
+    mstream_fmt (ms, "static volatile long long %S_profile_threads;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "/* 0 = no key, 1 = being created, 2 = created */" NL);
+    mstream_fmt (ms, "static volatile long long %S_profile_key_state;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "/* Advanced by deinit(), which frees all blocks */" NL);
+    mstream_fmt (ms, "static volatile long long %S_profile_epoch;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "static %S_THREAD_LOCAL struct %S_profile_thread* %S_profile_self;" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "static %S_THREAD_LOCAL long long %S_profile_self_epoch;" NL NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+
+    /*
+     * A thread-specific key is only used for its destructor, which marks the
+     * block of an exiting thread as retired. The next new thread takes over a
+     * retired block instead of allocating one, and keeps adding to its
+     * counters, so no counts are lost and there are never more blocks than
+     * threads that recorded at the same time.
+     */
+    mstream_cstr(ms, "#if defined(_WIN32)" NL);
+    mstream_fmt (ms, "static DWORD %S_profile_key;" NL NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "static void NTAPI" NL "%S_profile_retire(void* self)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_atomic_store(&((struct %S_profile_thread*)self)->retired, 1);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+    mstream_fmt (ms, "static int" NL "%S_profile_key_create(void)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_profile_key = FlsAlloc(%S_profile_retire);" NL, PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    return %S_profile_key == FLS_OUT_OF_INDEXES ? -1 : 0;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+    mstream_fmt (ms, "static void" NL "%S_profile_key_delete(void)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    FlsFree(%S_profile_key);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+    mstream_fmt (ms, "static void" NL "%S_profile_key_set(void* self)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    FlsSetValue(%S_profile_key, self);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL);
+    mstream_cstr(ms, "#else" NL);
+    mstream_fmt (ms, "static pthread_key_t %S_profile_key;" NL NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "static void" NL "%S_profile_retire(void* self)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_atomic_store(&((struct %S_profile_thread*)self)->retired, 1);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+    mstream_fmt (ms, "static int" NL "%S_profile_key_create(void)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    return pthread_key_create(&%S_profile_key, %S_profile_retire) == 0 ? 0 : -1;" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+    mstream_fmt (ms, "static void" NL "%S_profile_key_delete(void)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    pthread_key_delete(%S_profile_key);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+    mstream_fmt (ms, "static void" NL "%S_profile_key_set(void* self)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    pthread_setspecific(%S_profile_key, self);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL);
+    mstream_cstr(ms, "#endif" NL NL);
+
+    /* The key is created on first use, because init() may be custom */
+    mstream_fmt (ms, "static int" NL "%S_profile_key_ready(void)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    long long state;" NL);
+    mstream_fmt (ms, "    while ((state = %S_atomic_load(&%S_profile_key_state)) != 2)" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        if (state == 0 && %S_atomic_cas(&%S_profile_key_state, 0, 1))" NL "        {" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            if (%S_profile_key_create() != 0)" NL "            {" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "                %S_atomic_store(&%S_profile_key_state, 0);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "                return -1;" NL);
+    mstream_cstr(ms, "            }" NL);
+    mstream_fmt (ms, "            %S_atomic_store(&%S_profile_key_state, 2);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        }" NL);
+    mstream_cstr(ms, "    return 0;" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    /* Called by deinit(), when no other thread is using the library */
+    mstream_fmt (ms, "static void" NL "%S_profile_free(void)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_profile_thread* t = (struct %S_profile_thread*)(size_t)%S_atomic_load(&%S_profile_threads);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_profile_thread* next;" NL NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    if (%S_atomic_load(&%S_profile_key_state) == 2)" NL, PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        %S_profile_key_delete();" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_atomic_store(&%S_profile_key_state, 0);" NL, PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_atomic_store(&%S_profile_threads, 0);" NL, PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_atomic_store(&%S_profile_epoch, %S_atomic_load(&%S_profile_epoch) + 1);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    for (; t; t = next)" NL "    {" NL);
+    mstream_cstr(ms, "        next = t->next;" NL);
+    mstream_fmt (ms, "        %S(t);" NL, FREE(root->free, data));
+    mstream_cstr(ms, "    }" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    mstream_cstr(ms, "static const struct" NL "{" NL);
+    mstream_cstr(ms, "    const char* name;" NL);
+    mstream_cstr(ms, "    size_t offset;" NL);
+    mstream_fmt (ms, "} %S_profile_ops[%S_PROFILE_OPS > 0 ? %S_PROFILE_OPS : 1] = {" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    for (i = 0; i != count; ++i)
+    {
+        mstream_cstr(ms, "    { \"");
+        write_profile_op_name(ms, &ops[i], '.', data);
+        mstream_fmt (ms, "\", offsetof(struct %S_stats, ", PREFIX(root->prefix, data));
+        write_profile_op_name(ms, &ops[i], '_', data);
+        mstream_cstr(ms, ") }," NL);
+    }
+    if (count == 0)
+        mstream_cstr(ms, "    { \"\", 0 }" NL);
+    mstream_cstr(ms, "};" NL NL);
+
+    /* Monotonic clock */
+    mstream_cstr(ms, "#if defined(_WIN32)" NL);
+    mstream_fmt (ms, "static long long" NL "%S_profile_now(void)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    LARGE_INTEGER freq, now;" NL);
+    mstream_cstr(ms, "    QueryPerformanceFrequency(&freq);" NL);
+    mstream_cstr(ms, "    QueryPerformanceCounter(&now);" NL);
+    mstream_cstr(ms, "    return (long long)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);" NL);
+    mstream_cstr(ms, "}" NL);
+    mstream_cstr(ms, "#else" NL);
+    mstream_fmt (ms, "static long long" NL "%S_profile_now(void)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    struct timespec ts;" NL);
+    mstream_cstr(ms, "    clock_gettime(CLOCK_MONOTONIC, &ts);" NL);
+    mstream_cstr(ms, "    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;" NL);
+    mstream_cstr(ms, "}" NL);
+    mstream_cstr(ms, "#endif" NL NL);
+
+    /* Counters of the calling thread */
+    mstream_fmt (ms, "static struct %S_profile_counters*" NL "%S_profile_counters(int op)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_profile_thread* self = %S_profile_self;" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    long long head, epoch = %S_atomic_load(&%S_profile_epoch);" NL NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    if (self && %S_profile_self_epoch == epoch)" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        return &self->ops[op];" NL NL);
+    mstream_fmt (ms, "    if (%S_profile_key_ready() != 0)" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        return NULL;" NL NL);
+    mstream_fmt (ms, "    for (self = (struct %S_profile_thread*)(size_t)%S_atomic_load(&%S_profile_threads); self; self = self->next)" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        if (%S_atomic_load(&self->retired) && %S_atomic_cas(&self->retired, 1, 0))" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "            break;" NL NL);
+    mstream_cstr(ms, "    if (self == NULL)" NL "    {" NL);
+    mstream_fmt (ms, "        self = %S(sizeof *self);" NL, MALLOC(root->malloc, data));
+    mstream_cstr(ms, "        if (self == NULL)" NL);
+    mstream_cstr(ms, "            return NULL;" NL);
+    mstream_cstr(ms, "        memset(self, 0, sizeof *self);" NL);
+    mstream_cstr(ms, "        do {" NL);
+    mstream_fmt (ms, "            head = %S_atomic_load(&%S_profile_threads);" NL, PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            self->next = (struct %S_profile_thread*)(size_t)head;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        } while (!%S_atomic_cas(&%S_profile_threads, head, (long long)(size_t)self));" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    }" NL NL);
+    mstream_fmt (ms, "    %S_profile_key_set(self);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_profile_self = self;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_profile_self_epoch = epoch;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    return &self->ops[op];" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    /* Histogram buckets */
+    mstream_fmt (ms, "static int" NL "%S_profile_bucket(long long ns)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int msb = 2, bucket;" NL);
+    mstream_cstr(ms, "    if (ns < 4)" NL);
+    mstream_cstr(ms, "        return ns < 0 ? 0 : (int)ns;" NL);
+    mstream_cstr(ms, "    while (ns >> (msb + 1))" NL);
+    mstream_cstr(ms, "        msb++;" NL);
+    mstream_cstr(ms, "    bucket = (msb - 1) * 4 + (int)((ns >> (msb - 2)) & 3);" NL);
+    mstream_fmt (ms, "    return bucket < %S_PROFILE_BUCKETS ? bucket : %S_PROFILE_BUCKETS - 1;" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+
+    mstream_cstr(ms, "/* Largest value that falls into a bucket */" NL);
+    mstream_fmt (ms, "static long long" NL "%S_profile_bucket_max(int bucket)" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (bucket < 4)" NL);
+    mstream_cstr(ms, "        return bucket;" NL);
+    mstream_cstr(ms, "    return ((long long)(5 + bucket % 4) << (bucket / 4 - 1)) - 1;" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    /* Only the owning thread writes its counters, so plain read-modify-write
+     * is enough. The stores are atomic so that stats() never sees a torn value */
+    mstream_fmt (ms, "static void" NL "%S_profile_record(int op, long long start, int failed, long long rows)" NL "{" NL,
+        PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    long long ns = %S_profile_now() - start;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_profile_counters* c = %S_profile_counters(op);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int bucket;" NL NL);
+    mstream_cstr(ms, "    if (c == NULL)" NL);
+    mstream_cstr(ms, "        return;" NL);
+    mstream_fmt (ms, "    bucket = %S_profile_bucket(ns);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_atomic_store(&c->calls, c->calls + 1);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (failed)" NL);
+    mstream_fmt (ms, "        %S_atomic_store(&c->errors, c->errors + 1);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (rows)" NL);
+    mstream_fmt (ms, "        %S_atomic_store(&c->rows, c->rows + rows);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_atomic_store(&c->total_ns, c->total_ns + ns);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    if (ns > c->max_ns)" NL);
+    mstream_fmt (ms, "        %S_atomic_store(&c->max_ns, ns);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    %S_atomic_store(&c->buckets[bucket], c->buckets[bucket] + 1);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+
+    mstream_fmt (ms, "static long long" NL "%S_profile_percentile(const long long* buckets, long long permille, long long max_ns)" NL "{" NL,
+        PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    long long total = 0, seen = 0, rank, value;" NL);
+    mstream_cstr(ms, "    int bucket;" NL);
+    mstream_fmt (ms, "    for (bucket = 0; bucket != %S_PROFILE_BUCKETS; ++bucket)" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        total += buckets[bucket];" NL);
+    mstream_cstr(ms, "    if (total == 0)" NL);
+    mstream_cstr(ms, "        return 0;" NL NL);
+    mstream_cstr(ms, "    rank = (total * permille + 999) / 1000;" NL);
+    mstream_fmt (ms, "    for (bucket = 0; bucket != %S_PROFILE_BUCKETS; ++bucket)" NL "    {" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        seen += buckets[bucket];" NL);
+    mstream_cstr(ms, "        if (seen >= rank)" NL "        {" NL);
+    mstream_fmt (ms, "            value = %S_profile_bucket_max(bucket);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "            return value < max_ns ? value : max_ns;" NL);
+    mstream_cstr(ms, "        }" NL);
+    mstream_cstr(ms, "    }" NL);
+    mstream_cstr(ms, "    return max_ns;" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    /* stats() */
+    mstream_fmt (ms, "static struct %S_call_stats*" NL "%S_stats_at(const struct %S_stats* stats, int op)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    return (struct %S_call_stats*)((char*)stats + %S_profile_ops[op].offset);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+
+    mstream_fmt (ms, "static void" NL "%S_stats(struct %S* ctx, struct %S_stats* stats)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    long long buckets[%S_PROFILE_BUCKETS];" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_profile_thread* t;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    struct %S_call_stats* s;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    long long max_ns;" NL);
+    mstream_cstr(ms, "    int op, bucket;" NL NL);
+    mstream_cstr(ms, "    (void)ctx;" NL);
+    mstream_cstr(ms, "    memset(stats, 0, sizeof *stats);" NL);
+    mstream_fmt (ms, "    for (op = 0; op != %S_PROFILE_OPS; ++op)" NL "    {" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        s = %S_stats_at(stats, op);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        memset(buckets, 0, sizeof buckets);" NL);
+    mstream_fmt (ms, "        for (t = (struct %S_profile_thread*)(size_t)%S_atomic_load(&%S_profile_threads); t; t = t->next)" NL "        {" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            s->calls += %S_atomic_load(&t->ops[op].calls);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            s->errors += %S_atomic_load(&t->ops[op].errors);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            s->rows += %S_atomic_load(&t->ops[op].rows);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            s->total_ns += %S_atomic_load(&t->ops[op].total_ns);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            max_ns = %S_atomic_load(&t->ops[op].max_ns);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "            if (s->max_ns < max_ns)" NL);
+    mstream_cstr(ms, "                s->max_ns = max_ns;" NL);
+    mstream_fmt (ms, "            for (bucket = 0; bucket != %S_PROFILE_BUCKETS; ++bucket)" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "                buckets[bucket] += %S_atomic_load(&t->ops[op].buckets[bucket]);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        }" NL);
+    mstream_fmt (ms, "        s->p50_ns = %S_profile_percentile(buckets, 500, s->max_ns);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        s->p99_ns = %S_profile_percentile(buckets, 990, s->max_ns);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        s->p999_ns = %S_profile_percentile(buckets, 999, s->max_ns);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    }" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    /* stats_dump() */
+    mstream_fmt (ms, "struct %S_stats_writer" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    char* buf;" NL);
+    mstream_cstr(ms, "    int size;" NL);
+    mstream_cstr(ms, "    int len;" NL);
+    mstream_cstr(ms, "};" NL NL);
+
+    mstream_fmt (ms, "static void" NL "%S_stats_write(struct %S_stats_writer* w, const char* str)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int len = (int)strlen(str);" NL);
+    mstream_cstr(ms, "    int room = w->size - w->len - 1;" NL);
+    mstream_cstr(ms, "    if (room > 0)" NL);
+    mstream_cstr(ms, "        memcpy(w->buf + w->len, str, (size_t)(len < room ? len : room));" NL);
+    mstream_cstr(ms, "    w->len += len;" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    mstream_fmt (ms, "static int" NL "%S_stats_dump(const struct %S_stats* stats, int json, char* buf, int size)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    /*
+     * Longest line is a JSON object: 103 characters of text and 8 counters of
+     * up to 20 characters each. Prometheus lines repeat the prefix, but have
+     * one number with at most 21 characters.
+     */
+    mstream_fmt (ms, "    char line[%d];" NL, 2 * root->prefix.len + max_name_len + 103 + 8 * 20 + 64);
+    mstream_fmt (ms, "    struct %S_stats_writer w;" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    const struct %S_call_stats* s;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    int i;" NL NL);
+    mstream_cstr(ms, "    w.buf = buf;" NL);
+    mstream_cstr(ms, "    w.size = buf ? size : 0;" NL);
+    mstream_cstr(ms, "    w.len = 0;" NL NL);
+    mstream_cstr(ms, "    if (json)" NL "    {" NL);
+    mstream_fmt (ms, "        %S_stats_write(&w, \"{\");" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        for (i = 0; i != %S_PROFILE_OPS; ++i)" NL "        {" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            s = %S_stats_at(stats, i);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "            sprintf(line, \"%s\\n  \\\"%s\\\": {\\\"calls\\\": %lld, \\\"errors\\\": %lld, \\\"rows\\\": %lld, \"" NL);
+    mstream_cstr(ms, "                \"\\\"total_ns\\\": %lld, \\\"max_ns\\\": %lld, \\\"p50_ns\\\": %lld, \\\"p99_ns\\\": %lld, \\\"p999_ns\\\": %lld}\"," NL);
+    mstream_fmt (ms, "                i ? \",\" : \"\", %S_profile_ops[i].name, s->calls, s->errors, s->rows," NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "                s->total_ns, s->max_ns, s->p50_ns, s->p99_ns, s->p999_ns);" NL);
+    mstream_fmt (ms, "            %S_stats_write(&w, line);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        }" NL);
+    mstream_fmt (ms, "        %S_stats_write(&w, \"\\n}\\n\");" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    }" NL);
+    mstream_cstr(ms, "    else" NL "    {" NL);
+    write_profile_dump_counter(ms, root, "calls", "Number of calls.", data);
+    write_profile_dump_counter(ms, root, "errors", "Number of calls that failed.", data);
+    write_profile_dump_counter(ms, root, "rows", "Number of rows returned or inserted.", data);
+    mstream_fmt (ms, "        %S_stats_write(&w, \"# HELP %S_latency_seconds Call latency.\\n# TYPE %S_latency_seconds summary\\n\");" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "        for (i = 0; i != %S_PROFILE_OPS; ++i)" NL "        {" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            s = %S_stats_at(stats, i);" NL, PREFIX(root->prefix, data));
+    for (i = 0; i != 3; ++i)
+    {
+        static const char* quantiles[3][2] = { { "0.5", "p50_ns" }, { "0.99", "p99_ns" }, { "0.999", "p999_ns" } };
+        mstream_fmt (ms, "            sprintf(line, \"%S_latency_seconds{op=\\\"%%s\\\",quantile=\\\"%s\\\"} %%.9f\\n\", %S_profile_ops[i].name, (double)s->%s / 1e9);" NL,
+            PREFIX(root->prefix, data), quantiles[i][0], PREFIX(root->prefix, data), quantiles[i][1]);
+        mstream_fmt (ms, "            %S_stats_write(&w, line);" NL, PREFIX(root->prefix, data));
+    }
+    mstream_fmt (ms, "            sprintf(line, \"%S_latency_seconds_sum{op=\\\"%%s\\\"} %%.9f\\n\", %S_profile_ops[i].name, (double)s->total_ns / 1e9);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            %S_stats_write(&w, line);" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            sprintf(line, \"%S_latency_seconds_count{op=\\\"%%s\\\"} %%lld\\n\", %S_profile_ops[i].name, s->calls);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "            %S_stats_write(&w, line);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "        }" NL);
+    mstream_cstr(ms, "    }" NL NL);
+    mstream_cstr(ms, "    if (w.size > 0)" NL);
+    mstream_cstr(ms, "        buf[w.len < w.size ? w.len : w.size - 1] = '\\0';" NL);
+    mstream_cstr(ms, "    return w.len;" NL);
+    mstream_cstr(ms, "}" NL NL);
+
+    mstream_fmt (ms, "static int" NL "%S_stats_prometheus(const struct %S_stats* stats, char* buf, int size)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    return %S_stats_dump(stats, 0, buf, size);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+    mstream_fmt (ms, "static int" NL "%S_stats_json(const struct %S_stats* stats, char* buf, int size)" NL "{" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    return %S_stats_dump(stats, 1, buf, size);" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "}" NL NL);
+
+    free(ops);
+}
+/*!
+ * \brief Writes the callback that counts rows before forwarding them to the
+ * caller's callback.
+ */
+static void
+write_profile_on_row(struct mstream* ms, const struct root* root, const struct profile_op* op, const char* data)
+{
+    const struct query* q = op->q;
+    struct arg* a;
+
+    mstream_cstr(ms, "static int" NL "prof_");
+    write_func_name(ms, op->g, q, data);
+    mstream_cstr(ms, "_on_row(");
     for (a = q->cb_args; a; a = a->next)
     {
-        if (a != q->cb_args) mstream_cstr(ms, " | ");
-        mstream_str(ms, a->name, data);
+        mstream_fmt(ms, "%S %S, ", a->type, data, a->name, data);
+        if (a->has_hidden_len_param)
+            mstream_fmt(ms, "int %S_len, ", a->name, data);
     }
-    if (q->cb_args)
-        mstream_fmt(ms, "\\n\");" NL);
-
-    mstream_cstr(ms, "    result = db_sqlite3.");
-    if (g)
-        mstream_fmt(ms, "%S.", g->name, data);
-    mstream_str(ms, q->name, data);
-    mstream_cstr(ms, "(ctx");
-    for (a = q->in_args; a; a = a->next)
+    mstream_cstr(ms, "void* user_data)" NL "{" NL);
+    mstream_fmt (ms, "    struct %S_profile_rows* prof_rows = user_data;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    prof_rows->rows++;" NL);
+    mstream_cstr(ms, "    return ((int (*)(");
+    for (a = q->cb_args; a; a = a->next)
     {
-        mstream_fmt(ms, ", %S", a->name, data);
+        mstream_fmt(ms, "%S, ", a->type, data);
         if (a->has_hidden_len_param)
-            mstream_fmt(ms, ", %S_len", a->name, data);
+            mstream_cstr(ms, "int, ");
     }
-    if (q->cb_args)
+    mstream_cstr(ms, "void*))prof_rows->on_row)(");
+    for (a = q->cb_args; a; a = a->next)
     {
-        mstream_cstr(ms, ", dbg_");
-        write_func_name(ms, g, q, data);
-        mstream_cstr(ms, "_on_row, dbg");
+        mstream_fmt(ms, "%S, ", a->name, data);
+        if (a->has_hidden_len_param)
+            mstream_fmt(ms, "%S_len, ", a->name, data);
     }
-    mstream_cstr(ms, ");" NL);
-
-    mstream_cstr(ms, "    sql = sqlite3_expanded_sql(ctx->");
-    write_func_name(ms, g, q, data);
-    mstream_cstr(ms, ");" NL);
-    mstream_fmt(ms, "    %S(\"retval=%%d\\n%%s\\n\\n\", result, sql);" NL,
-                LOG_DBG(root->log_dbg, data));
-    mstream_cstr(ms, "    sqlite3_free(sql);" NL);
-    mstream_cstr(ms, "    return result;" NL);
+    mstream_cstr(ms, "prof_rows->user_data);" NL);
     mstream_cstr(ms, "}" NL NL);
 }
 
-static int
-determine_indent(struct mstream* ms, struct str_view str, const char* data)
+/*!
+ * \brief Writes a wrapper that times a call through "base" (db_sqlite3 or
+ * dbg_db_sqlite3) and records it as profiled function number "idx".
+ */
+static void
+write_profile_wrapper(struct mstream* ms, const struct root* root, const struct profile_op* op, int idx, const char* base, const char* data)
 {
-    int p;
-    int indent = 0;
-    int min_indent = INT_MAX;
+    const struct query* q = op->q;
+    int has_cb = q && q->cb_args && op->kind != PROFILE_BULK;
+    struct arg* a;
 
-    p = 0;
-    while (p != str.len)
+    if (has_cb && op->kind == PROFILE_QUERY)
+        write_profile_on_row(ms, root, op, data);
+
+    mstream_cstr(ms, "static int" NL "prof_");
+    write_profile_op_name(ms, op, '_', data);
+    mstream_putc(ms, '(');
+    switch (op->kind)
     {
-        while (p != str.len)
+        case PROFILE_QUERY: write_func_param_list(ms, root, op->g, q, data); break;
+        case PROFILE_BATCH: write_batch_func_param_list(ms, root, op->g, q, data); break;
+        case PROFILE_BULK: write_bulk_func_param_list(ms, root, op->g, q, data); break;
+        case PROFILE_FUNCTION:
+            mstream_fmt(ms, "struct %S* ctx", PREFIX(root->prefix, data));
+            for (a = op->f->args; a; a = a->next)
+                mstream_fmt(ms, ", %S %S", a->type, data, a->name, data);
+            break;
+    }
+    mstream_cstr(ms, ")" NL "{" NL);
+
+    if (has_cb)
+        mstream_fmt(ms, "    struct %S_profile_rows prof_rows;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    long long prof_start;" NL);
+    mstream_cstr(ms, "    int result;" NL NL);
+    if (has_cb)
+    {
+        mstream_cstr(ms, "    prof_rows.on_row = (void (*)(void))on_row;" NL);
+        mstream_cstr(ms, "    prof_rows.user_data = user_data;" NL);
+        mstream_cstr(ms, "    prof_rows.rows = 0;" NL);
+    }
+    mstream_fmt (ms, "    prof_start = %S_profile_now();" NL, PREFIX(root->prefix, data));
+    mstream_fmt (ms, "    result = %s.", base);
+    if (op->g)
+        mstream_fmt(ms, "%S.", op->g->name, data);
+    mstream_str(ms, q ? q->name : op->f->name, data);
+    if (op->kind == PROFILE_BATCH)
+        mstream_cstr(ms, "_batch(ctx, rows, count, results");
+    else if (op->kind == PROFILE_BULK)
+        mstream_cstr(ms, "_bulk(ctx, rows, count");
+    else if (op->kind == PROFILE_FUNCTION)
+    {
+        mstream_cstr(ms, "(ctx");
+        for (a = op->f->args; a; a = a->next)
+            mstream_fmt(ms, ", %S", a->name, data);
+    }
+    else
+    {
+        mstream_cstr(ms, "(ctx");
+        for (a = q->in_args; a; a = a->next)
         {
-            if (!isspace(data[str.off + p++]))
-                break;
-            indent++;
+            mstream_fmt(ms, ", %S", a->name, data);
+            if (a->has_hidden_len_param)
+                mstream_fmt(ms, ", %S_len", a->name, data);
         }
-
-        if (min_indent > indent)
-            min_indent = indent;
-
-        while (p != str.len)
-            if (data[str.off + p++] == '\n')
-            {
-                indent = 0;
-                break;
-            }
+        if (q->return_arg)
+            mstream_fmt(ms, ", %S", q->return_arg->name, data);
+    }
+    if (has_cb)
+    {
+        /* The batch variant forwards the same callback for every row */
+        mstream_cstr(ms, ", prof_");
+        write_func_name(ms, op->g, q, data);
+        mstream_cstr(ms, "_on_row, &prof_rows");
     }
+    mstream_cstr(ms, ");" NL);
 
-    return min_indent;
+    mstream_fmt(ms, "    %S_profile_record(%d, prof_start, result < 0, ", PREFIX(root->prefix, data), idx);
+    if (has_cb)
+        mstream_cstr(ms, "prof_rows.rows");
+    else if (op->kind == PROFILE_BULK)
+        mstream_cstr(ms, "result == 0 ? count : 0");
+    else if (op->kind == PROFILE_QUERY && q->type == QUERY_EXISTS)
+        mstream_cstr(ms, "result == 1");
+    else if (op->kind == PROFILE_QUERY && q->type == QUERY_SELECT_FIRST && q->return_arg)
+        mstream_cstr(ms, "result == 0");
+    else if (op->kind == PROFILE_QUERY && q->type == QUERY_SELECT_FIRST && q->return_name.len)
+        mstream_cstr(ms, "result >= 0");
+    else
+        mstream_cstr(ms, "0");
+    mstream_cstr(ms, ");" NL);
+    mstream_cstr(ms, "    return result;" NL);
+    mstream_cstr(ms, "}" NL NL);
 }
 
+/*!
+ * \brief Writes the profile wrappers and the prof_db_sqlite3 interface,
+ * which forwards everything that isn't profiled to "base".
+ */
 static void
-write_block_reindented(struct mstream* ms, int indent, struct str_view str, const char* data)
+write_profile_layer(struct mstream* ms, const struct root* root, int debug_layer, const char* data)
 {
-    int p, i;
-    int unindent = determine_indent(ms, str, data);
-
-    p = 0;
-    while (p != str.len)
+    const char* base = debug_layer ? "dbg_db_sqlite3" : "db_sqlite3";
+    const char* dbg = debug_layer ? "dbg_" : "";
+    const struct query_group* g;
+    const struct query* q;
+    const struct function* f;
+    struct profile_op* ops;
+    int i, count;
+
+    ops = alloc_profile_ops(root, &count);
+
+    mstream_fmt (ms, "struct %S_profile_rows" NL "{" NL, PREFIX(root->prefix, data));
+    mstream_cstr(ms, "    void (*on_row)(void);" NL);
+    mstream_cstr(ms, "    void* user_data;" NL);
+    mstream_cstr(ms, "    long long rows;" NL);
+    mstream_cstr(ms, "};" NL NL);
+
+    for (i = 0; i != count; ++i)
+        write_profile_wrapper(ms, root, &ops[i], i, base, data);
+
+    mstream_fmt(ms, "static struct %S_interface prof_db_sqlite3 = {" NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %s%S_open," NL, dbg, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %s%S_open_ex," NL, dbg, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %s%S_close," NL, dbg, PREFIX(root->prefix, data));
+    write_split_interface_entries(ms, root, data);
+    write_pool_interface_entries(ms, root, data);
+    write_executor_interface_entries(ms, root, data);
+    write_tenant_interface_entries(ms, root, data);
+    write_deadline_interface_entries(ms, root, data);
+    mstream_fmt(ms, "    %s%S_version," NL, dbg, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %s%S_upgrade," NL, dbg, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %s%S_reinit," NL, dbg, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %s%S_migrate_to," NL, dbg, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_prepare_all," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_busy_stats," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_query_stats," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_db_stats," NL, PREFIX(root->prefix, data));
+    mstream_fmt(ms, "    %S_explain_all," NL, PREFIX(root->prefix, data));
+    if (has_cached_queries(root))
+        mstream_fmt(ms, "    %S_cache_clear," NL, PREFIX(root->prefix, data));
+    write_profile_interface_entries(ms, root, data);
+    write_transaction_interface_entries(ms, root, data);
+    /* Global queries */
+    for (q = root->queries; q; q = q->next)
     {
-        i = unindent;
-        while (p != str.len && i--)
-            p++;
-
-        for (i = 0; i != indent; ++i)
-            mstream_putc(ms, ' ');
-
-        while (p != str.len)
+        mstream_fmt(ms, "    prof_%S," NL, q->name, data);
+        if (q->batch)
+            mstream_fmt(ms, "    prof_%S_batch," NL, q->name, data);
+        if (q->bulk)
+            mstream_fmt(ms, "    prof_%S_bulk," NL, q->name, data);
+        if (q->cursor)
+            mstream_fmt(ms, "    %S_open_cursor," NL "    %S_next," NL "    %S_close_cursor," NL,
+                q->name, data, q->name, data, q->name, data);
+        if (q->columns)
+            mstream_fmt(ms, "    %S_fetch_columns," NL "    %S_fetch_more_columns," NL "    %S_close_columns," NL "    %S_export_arrow," NL,
+                q->name, data, q->name, data, q->name, data, q->name, data);
+        if (root->async)
+            mstream_fmt(ms, "    %S_async," NL, q->name, data);
+    }
+    /* Functions */
+    for (f = root->functions; f; f = f->next)
+        mstream_fmt(ms, "    prof_%S," NL, f->name, data);
+    /* Grouped queries */
+    for (g = root->query_groups; g; g = g->next)
+    {
+        mstream_cstr(ms, "    {" NL);
+        for (q = g->queries; q; q = q->next)
         {
-            char c = data[str.off + p++];
-            mstream_putc(ms, c);
-            if (c == '\n')
-                break;
+            mstream_fmt(ms, "        prof_%S_%S," NL, g->name, data, q->name, data);
+            if (q->batch)
+                mstream_fmt(ms, "        prof_%S_%S_batch," NL, g->name, data, q->name, data);
+            if (q->bulk)
+                mstream_fmt(ms, "        prof_%S_%S_bulk," NL, g->name, data, q->name, data);
+            if (q->cursor)
+                mstream_fmt(ms, "        %S_%S_open_cursor," NL "        %S_%S_next," NL "        %S_%S_close_cursor," NL,
+                    g->name, data, q->name, data, g->name, data, q->name, data, g->name, data, q->name, data);
+            if (q->columns)
+                mstream_fmt(ms, "        %S_%S_fetch_columns," NL "        %S_%S_fetch_more_columns," NL "        %S_%S_close_columns," NL
+                    "        %S_%S_export_arrow," NL,
+                    g->name, data, q->name, data, g->name, data, q->name, data,
+                    g->name, data, q->name, data, g->name, data, q->name, data);
+            if (root->async)
+                mstream_fmt(ms, "        %S_%S_async," NL, g->name, data, q->name, data);
         }
+        for (f = g->functions; f; f = f->next)
+            mstream_fmt(ms, "        prof_%S_%S," NL, g->name, data, f->name, data);
+        mstream_cstr(ms, "    }," NL);
     }
+    mstream_cstr(ms, "};" NL NL);
 
-    mstream_cstr(ms, NL);
-}
-
-static void
-write_block_reindented_cstr(struct mstream* ms, int indent, const char* data)
-{
-    struct str_view str = {
-        0,
-        strlen(data)
-    };
-    write_block_reindented(ms, indent, str, data);
+    free(ops);
 }
 
 static int
@@ -2992,7 +9746,63 @@ gen_header(const struct root* root, const char* data, const char* file_name,
     if (root->header_preamble.len)
         mstream_fmt(&ms, NL "%S" NL, root->header_preamble, data);
 
+    if (has_columns_queries(root))
+    {
+        mstream_cstr(&ms, "#include <stdint.h>" NL NL);
+        write_arrow_c_data_interface(&ms);
+    }
+
     mstream_fmt(&ms, "struct %S;" NL, PREFIX(root->prefix, data));
+    if (root->pool)
+        mstream_fmt(&ms, "struct %S_pool;" NL, PREFIX(root->prefix, data));
+    if (root->async)
+        mstream_fmt(&ms, "struct %S_executor;" NL, PREFIX(root->prefix, data));
+    if (root->tenants)
+        mstream_fmt(&ms, "struct %S_tenants;" NL, PREFIX(root->prefix, data));
+    mstream_cstr(&ms, NL);
+
+    if (root->deadlines)
+    {
+        mstream_cstr(&ms, "/*! Returned by a query that was stopped because its deadline passed */" NL);
+        mstream_fmt (&ms, "#define %S_TIMEOUT (-2)" NL, PREFIX(root->prefix, data));
+        mstream_cstr(&ms, "/*! Returned by a query that was stopped by cancel() */" NL);
+        mstream_fmt (&ms, "#define %S_CANCELLED (-3)" NL NL, PREFIX(root->prefix, data));
+    }
+
+    /* Argument structures for batch and bulk queries */
+    for (q = root->queries; q; q = q->next)
+        if (q->batch || q->bulk)
+            write_args_struct(&ms, root, NULL, q, data);
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            if (q->batch || q->bulk)
+                write_args_struct(&ms, root, g, q, data);
+
+    /* Row structures for cursor queries */
+    for (q = root->queries; q; q = q->next)
+        if (q->cursor)
+            write_row_struct(&ms, root, NULL, q, data);
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            if (q->cursor)
+                write_row_struct(&ms, root, g, q, data);
+
+    /* Buffers for columnar queries */
+    for (q = root->queries; q; q = q->next)
+        if (q->columns)
+            write_columns_struct(&ms, root, NULL, q, data);
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            if (q->columns)
+                write_columns_struct(&ms, root, g, q, data);
+
+    write_stmt_stats_structs(&ms, root, data);
+    write_explain_struct(&ms, root, data);
+    if (root->checkpoint_pages)
+        write_wal_stats_struct(&ms, root, data);
+    if (root->profile_layer)
+        write_profile_header_structs(&ms, root, data);
+
     mstream_fmt(&ms, "struct %S_interface" NL "{" NL, PREFIX(root->prefix, data));
 
     /* Hard-coded functions */
@@ -3004,12 +9814,204 @@ gen_header(const struct root* root, const char* data, const char* file_name,
         " */");
     mstream_fmt(&ms, "    struct %S* (*open)(const char* uri);" NL,
         PREFIX(root->prefix, data));
+    write_block_reindented_cstr(&ms, 4, "/*!" NL
+        " * \\brief Same as open(), but with control over how the database is opened." NL
+        " * \\param[in] uri A file path or URI to a database file." NL
+        " * \\param[in] flags SQLITE_OPEN_* flags passed to sqlite3_open_v2(). open()" NL
+        " * uses SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE." NL
+        " * \\return If successful, the database connection is returned, which can be" NL
+        " * used for all future queries." NL
+        " */");
+    mstream_fmt(&ms, "    struct %S* (*open_ex)(const char* uri, int flags);" NL,
+        PREFIX(root->prefix, data));
     write_block_reindented_cstr(&ms, 4, "/*!" NL
         " * \\brief Closes the database connection." NL
         " * \\param[in] ctx Connection returned from the call to open()." NL
         " */");
     mstream_fmt(&ms, "    void (*close)(struct %S* ctx);" NL,
         PREFIX(root->prefix, data));
+    if (root->split)
+    {
+        write_block_reindented_cstr(&ms, 4, "/*!" NL
+            " * \\brief Opens a connection that can be shared between threads and" NL
+            " * splits reads from writes. Select and exists queries run on one of the" NL
+            " * reader connections, which are opened with SQLITE_OPEN_READONLY, and" NL
+            " * everything else runs on a single writer connection. Between begin() or" NL
+            " * savepoint() and the matching commit(), rollback(), release() or" NL
+            " * rollback_to(), the calling thread owns the writer and all of its" NL
+            " * queries run there. A cursor keeps a reader to itself until" NL
+            " * close_cursor(), and so does a columnar fetch until all rows were" NL
+            " * fetched or close_columns() is called. The database should use WAL so" NL
+            " * that readers don't block the writer." NL
+            " * \\param[in] uri A file path to a database file." NL
+            " * \\param[in] readers Number of reader connections. If 0, all queries run" NL
+            " * on the writer." NL
+            " * \\return The connection, which is closed with close(), or NULL if any of" NL
+            " * the underlying connections failed to open." NL
+            " */");
+        mstream_fmt(&ms, "    struct %S* (*open_split)(const char* uri, int readers);" NL,
+            PREFIX(root->prefix, data));
+    }
+    if (root->shards)
+    {
+        write_block_reindented_cstr(&ms, 4, "/*!" NL
+            " * \\brief Opens one connection per shard and returns a context that" NL
+            " * routes each query to the shard its \"shard-key\" hashes to. Select-all" NL
+            " * queries without a key run on every shard. Migrations, transactions and" NL
+            " * statistics apply to every shard, but transactions are not atomic" NL
+            " * across shards. If begin() or savepoint() fails on one shard, the" NL
+            " * shards that succeeded are rolled back again. If commit() or release()" NL
+            " * fails on one shard, that shard and the ones after it are rolled back," NL
+            " * while the shards before it stay committed.");
+        mstream_fmt(&ms, "     * \\param[in] uris Array of %d file paths, one per shard. A row always" NL, root->shards);
+        write_block_reindented_cstr(&ms, 4,
+            " * hashes to the same index, so the order must not change." NL
+            " * \\return The context, which is closed with close(), or NULL if any of" NL
+            " * the shards failed to open." NL
+            " */");
+        mstream_fmt(&ms, "    struct %S* (*open_shards)(const char* const* uris);" NL,
+            PREFIX(root->prefix, data));
+    }
+    if (root->pool)
+    {
+        write_block_reindented_cstr(&ms, 4, "/*!" NL
+            " * \\brief Opens a pool of connections to the same database." NL
+            " * Every connection has its own set of prepared statements, and is opened" NL
+            " * with SQLITE_OPEN_NOMUTEX, because it is only ever used by one thread" NL
+            " * at a time." NL
+            " * \\param[in] uri A file path to a database file." NL
+            " * \\param[in] connections Number of connections to open." NL
+            " * \\return The pool, or NULL if any of the connections failed to open." NL
+            " */");
+        mstream_fmt(&ms, "    struct %S_pool* (*pool_open)(const char* uri, int connections);" NL,
+            PREFIX(root->prefix, data));
+        write_block_reindented_cstr(&ms, 4, "/*!" NL
+            " * \\brief Closes all connections in the pool. All connections must have" NL
+            " * been released before calling this." NL
+            " */");
+        mstream_fmt(&ms, "    void (*pool_close)(struct %S_pool* pool);" NL,
+            PREFIX(root->prefix, data));
+        write_block_reindented_cstr(&ms, 4, "/*!" NL
+            " * \\brief Takes an idle connection out of the pool. This function is" NL
+            " * thread-safe and never blocks." NL
+            " * \\return A connection, or NULL if all connections are in use." NL
+            " */");
+        mstream_fmt(&ms, "    struct %S* (*pool_acquire)(struct %S_pool* pool);" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        write_block_reindented_cstr(&ms, 4, "/*!" NL
+            " * \\brief Returns a connection obtained from pool_acquire() to the pool." NL
+            " * This function is thread-safe." NL
+            " */");
+        mstream_fmt(&ms, "    void (*pool_release)(struct %S_pool* pool, struct %S* ctx);" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        if (root->checkpoint_pages)
+        {
+            write_block_reindented_cstr(&ms, 4, "/*!" NL
+                " * \\brief Gets the size of the WAL after the last commit, and how often" NL
+                " * and how long the pool's checkpoint thread ran." NL
+                " */");
+            mstream_fmt(&ms, "    void (*pool_wal_stats)(struct %S_pool* pool, struct %S_wal_stats* stats);" NL,
+                PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        }
+    }
+    if (root->async)
+    {
+        write_block_reindented_cstr(&ms, 4, "/*!" NL
+            " * \\brief Starts the threads that execute the *_async() queries." NL
+            " * There is one writer thread and the given number of reader threads, each" NL
+            " * with its own connection. Queries that modify the database run on the" NL
+            " * writer in the order they were submitted, select and exists queries are" NL
+            " * spread over the readers. The database should be upgraded before this is" NL
+            " * called, and should use WAL so that readers don't block the writer." NL
+            " * \\param[in] uri A file path to a database file." NL
+            " * \\param[in] readers Number of reader threads. If 0, all queries run on" NL
+            " * the writer." NL
+            " * \\param[in] notify_fd If negative, completion callbacks are called on the" NL
+            " * worker threads. Otherwise, completions are queued and 8 bytes are written" NL
+            " * to this file descriptor (e.g. an eventfd) every time one is ready. Call" NL
+            " * executor_poll() once the descriptor becomes readable." NL
+            " * \\return The executor, or NULL if any of the connections or threads" NL
+            " * failed to start." NL
+            " */");
+        mstream_fmt(&ms, "    struct %S_executor* (*executor_open)(const char* uri, int readers, int notify_fd);" NL,
+            PREFIX(root->prefix, data));
+        write_block_reindented_cstr(&ms, 4, "/*!" NL
+            " * \\brief Waits for all submitted queries to finish, delivers their" NL
+            " * completions, then stops the threads and closes all connections." NL
+            " */");
+        mstream_fmt(&ms, "    void (*executor_close)(struct %S_executor* exec);" NL,
+            PREFIX(root->prefix, data));
+        write_block_reindented_cstr(&ms, 4, "/*!" NL
+            " * \\brief Calls the completion callbacks of all finished queries on the" NL
+            " * calling thread. Only used if the executor was opened with a notify_fd." NL
+            " * Must not be called from more than one thread at a time." NL
+            " * \\return The number of completions delivered." NL
+            " */");
+        mstream_fmt(&ms, "    int (*executor_poll)(struct %S_executor* exec);" NL,
+            PREFIX(root->prefix, data));
+    }
+    if (root->tenants)
+    {
+        write_block_reindented_cstr(&ms, 4, "/*!" NL
+            " * \\brief Creates a cache of connections to many databases with the same" NL
+            " * schema, one per tenant. At most max_open connections are kept open, and" NL
+            " * the least recently used idle connection is closed on a background thread" NL
+            " * when another one is needed." NL
+            " * \\param[in] uri_fmt A file path containing \"%s\" exactly once, which" NL
+            " * is replaced with the tenant ID, e.g. \"tenants/%s.db\"." NL
+            " * \\param[in] max_open Maximum number of connections to keep open." NL
+            " * \\return The cache, or NULL if uri_fmt is invalid or the closer thread" NL
+            " * failed to start." NL
+            " */");
+        mstream_fmt(&ms, "    struct %S_tenants* (*tenants_open)(const char* uri_fmt, int max_open);" NL,
+            PREFIX(root->prefix, data));
+        write_block_reindented_cstr(&ms, 4, "/*!" NL
+            " * \\brief Closes all connections of the cache. All connections returned" NL
+            " * by tenant_get() must have been released." NL
+            " */");
+        mstream_fmt(&ms, "    void (*tenants_close)(struct %S_tenants* tenants);" NL,
+            PREFIX(root->prefix, data));
+        write_block_reindented_cstr(&ms, 4, "/*!" NL
+            " * \\brief Gets the connection of a tenant. If it isn't open yet, the" NL
+            " * database is opened and upgraded to the newest version first. Only one" NL
+            " * caller at a time gets the connection of a tenant. If another one has" NL
+            " * it, or is still opening it, this blocks until it is released." NL
+            " * \\param[in] tenant_id Must not be empty, start with '.', or contain a" NL
+            " * slash or backslash." NL
+            " * \\return The connection, which must be released with tenant_release()" NL
+            " * instead of being closed, or NULL if it failed to open or upgrade." NL
+            " */");
+        mstream_fmt(&ms, "    struct %S* (*tenant_get)(struct %S_tenants* tenants, const char* tenant_id);" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        write_block_reindented_cstr(&ms, 4, "/*!" NL
+            " * \\brief Gives back a connection returned by tenant_get(). It stays open" NL
+            " * until it is evicted." NL
+            " */");
+        mstream_fmt(&ms, "    void (*tenant_release)(struct %S_tenants* tenants, struct %S* ctx);" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    }
+    if (root->deadlines)
+    {
+        write_block_reindented_cstr(&ms, 4, "/*!" NL
+            " * \\brief Sets a deadline for all queries that run on the connection" NL
+            " * from now on. Once it has passed, running queries are stopped and return" NL
+            " * TIMEOUT, and so does every query after them, until the deadline is" NL
+            " * moved or removed." NL
+            " * \\param[in] timeout_ms Milliseconds from now, or 0 to remove the" NL
+            " * deadline." NL
+            " * \\return 0 on success, -1 if timeout_ms is negative." NL
+            " */");
+        mstream_fmt(&ms, "    int (*set_deadline)(struct %S* ctx, int timeout_ms);" NL,
+            PREFIX(root->prefix, data));
+        write_block_reindented_cstr(&ms, 4, "/*!" NL
+            " * \\brief Stops the query that is running on the connection, which then" NL
+            " * returns CANCELLED. Unlike all other functions, this may be called from" NL
+            " * any thread while the connection is in use. Does nothing if no query is" NL
+            " * running." NL
+            " */");
+        mstream_fmt(&ms, "    void (*cancel)(struct %S* ctx);" NL,
+            PREFIX(root->prefix, data));
+    }
     write_block_reindented_cstr(&ms, 4, "/*!" NL
         " * \\brief Gets the current version of the database." NL
         " * A new, empty database will always have a version of 0. Calling upgrade()" NL
@@ -3038,6 +10040,121 @@ gen_header(const struct root* root, const char* data, const char* file_name,
         " */");
     mstream_fmt(&ms, "    int (*migrate_to)(struct %S* ctx, int target_version);" NL,
         PREFIX(root->prefix, data));
+    if (root->prepare_eager)
+        write_block_reindented_cstr(&ms, 4, "/*!" NL
+            " * \\brief Compiles all statements up front." NL
+            " * Queries are not prepared on first use, so this must be called once the" NL
+            " * database has been upgraded and before any queries or transaction" NL
+            " * functions are used. Calling it again after a migration is harmless." NL
+            " * \\return 0 on success, negative if one or more statements failed to" NL
+            " * compile. Every failing statement is logged." NL
+            " */");
+    else
+        write_block_reindented_cstr(&ms, 4, "/*!" NL
+            " * \\brief Compiles all statements that haven't been used yet." NL
+            " * Statements are otherwise prepared on first use. Calling this once the" NL
+            " * database has been upgraded moves that cost out of the first queries." NL
+            " * \\return 0 on success, negative if one or more statements failed to" NL
+            " * compile. Every failing statement is logged." NL
+            " */");
+    mstream_fmt(&ms, "    int (*prepare_all)(struct %S* ctx);" NL,
+        PREFIX(root->prefix, data));
+    write_block_reindented_cstr(&ms, 4, "/*!" NL
+        " * \\brief Returns how often this connection retried after the database" NL
+        " * was busy, and the total time spent waiting in milliseconds." NL
+        " * Either pointer may be NULL." NL
+        " */");
+    mstream_fmt(&ms, "    void (*busy_stats)(struct %S* ctx, int* retries, int* wait_ms);" NL,
+        PREFIX(root->prefix, data));
+    write_block_reindented_cstr(&ms, 4, "/*!" NL
+        " * \\brief Reads SQLite's counters of one cached statement, such as the" NL
+        " * number of full table scan steps and the number of times it ran." NL
+        " * Statements are numbered from 0, in the order in which the queries are" NL
+        " * declared, followed by the transaction statements." NL
+        " * \\return 0 on success, -1 if query_id is out of range. Counting up from" NL
+        " * 0 until -1 is returned lists every statement." NL
+        " */");
+    mstream_fmt(&ms, "    int (*query_stats)(struct %S* ctx, int query_id, struct %S_stmt_stats* stats);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    write_block_reindented_cstr(&ms, 4, "/*!" NL
+        " * \\brief Reads SQLite's page cache and lookaside counters of this" NL
+        " * connection." NL
+        " * \\return 0 on success, negative on error." NL
+        " */");
+    mstream_fmt(&ms, "    int (*db_stats)(struct %S* ctx, struct %S_db_stats* stats);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    write_block_reindented_cstr(&ms, 4, "/*!" NL
+        " * \\brief Runs EXPLAIN QUERY PLAN on the statement of every query and" NL
+        " * passes each line of the plans to report_cb, which may be NULL. Lines that" NL
+        " * scan a table without an index, sort through a temporary b-tree or" NL
+        " * build an automatic index are flagged." NL
+        " * \\return The number of flagged lines, or -1 if a statement could not" NL
+        " * be explained." NL
+        " */");
+    mstream_fmt(&ms, "    int (*explain_all)(struct %S* ctx, void (*report_cb)(const struct %S_plan_row* row, void* user_data), void* user_data);" NL,
+        PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+    if (has_cached_queries(root))
+    {
+        write_block_reindented_cstr(&ms, 4, "/*!" NL
+            " * \\brief Drops every cached query result of this connection." NL
+            " * Results are invalidated automatically when this connection writes to" NL
+            " * a table, but changes made by other connections or processes are not" NL
+            " * seen. Call this after such changes." NL
+            " */");
+        mstream_fmt(&ms, "    void (*cache_clear)(struct %S* ctx);" NL,
+            PREFIX(root->prefix, data));
+    }
+    if (root->profile_layer)
+        write_profile_interface_decls(&ms, root, data);
+    write_block_reindented_cstr(&ms, 4, "/*!" NL
+        " * \\brief Begins a deferred transaction." NL
+        " * All queries up to the next call to commit() or rollback() are grouped" NL
+        " * into a single transaction, instead of each query running in its own" NL
+        " * implicit transaction." NL
+        " * \\return 0 on success, negative on error." NL
+        " */");
+    mstream_fmt(&ms, "    int (*begin)(struct %S* ctx);" NL,
+        PREFIX(root->prefix, data));
+    write_block_reindented_cstr(&ms, 4, "/*!" NL
+        " * \\brief Begins a transaction and immediately acquires the write lock." NL
+        " * Use this instead of begin() if the transaction is going to write." NL
+        " * \\return 0 on success, negative on error." NL
+        " */");
+    mstream_fmt(&ms, "    int (*begin_immediate)(struct %S* ctx);" NL,
+        PREFIX(root->prefix, data));
+    write_block_reindented_cstr(&ms, 4, "/*!" NL
+        " * \\brief Commits the transaction started with begin() or begin_immediate()." NL
+        " * \\return 0 on success, negative on error." NL
+        " */");
+    mstream_fmt(&ms, "    int (*commit)(struct %S* ctx);" NL,
+        PREFIX(root->prefix, data));
+    write_block_reindented_cstr(&ms, 4, "/*!" NL
+        " * \\brief Discards all changes made since begin() or begin_immediate()." NL
+        " * \\return 0 on success, negative on error." NL
+        " */");
+    mstream_fmt(&ms, "    int (*rollback)(struct %S* ctx);" NL,
+        PREFIX(root->prefix, data));
+    write_block_reindented_cstr(&ms, 4, "/*!" NL
+        " * \\brief Opens a nested transaction." NL
+        " * Savepoints can be nested arbitrarily deep. If no transaction is active," NL
+        " * then this starts one. Every savepoint must be closed again with either" NL
+        " * release() or rollback_to()." NL
+        " * \\return 0 on success, negative on error." NL
+        " */");
+    mstream_fmt(&ms, "    int (*savepoint)(struct %S* ctx);" NL,
+        PREFIX(root->prefix, data));
+    write_block_reindented_cstr(&ms, 4, "/*!" NL
+        " * \\brief Closes the innermost savepoint and keeps its changes." NL
+        " * \\return 0 on success, negative on error." NL
+        " */");
+    mstream_fmt(&ms, "    int (*release)(struct %S* ctx);" NL,
+        PREFIX(root->prefix, data));
+    write_block_reindented_cstr(&ms, 4, "/*!" NL
+        " * \\brief Closes the innermost savepoint and discards its changes." NL
+        " * \\return 0 on success, negative on error." NL
+        " */");
+    mstream_fmt(&ms, "    int (*rollback_to)(struct %S* ctx);" NL,
+        PREFIX(root->prefix, data));
 
     /* Global queries */
     for (q = root->queries; q; q = q->next)
@@ -3045,6 +10162,28 @@ gen_header(const struct root* root, const char* data, const char* file_name,
         mstream_cstr(&ms, "    ");
         write_func_ptr_decl(&ms, root, NULL, q, data);
         mstream_cstr(&ms, ";" NL);
+        if (q->batch)
+        {
+            mstream_cstr(&ms, "    ");
+            write_batch_func_ptr_decl(&ms, root, NULL, q, data);
+            mstream_cstr(&ms, ";" NL);
+        }
+        if (q->bulk)
+        {
+            mstream_cstr(&ms, "    ");
+            write_bulk_func_ptr_decl(&ms, root, NULL, q, data);
+            mstream_cstr(&ms, ";" NL);
+        }
+        if (q->cursor)
+            write_cursor_func_ptr_decls(&ms, root, NULL, q, "    ", data);
+        if (q->columns)
+            write_columns_func_ptr_decls(&ms, root, NULL, q, "    ", data);
+        if (root->async)
+        {
+            mstream_cstr(&ms, "    ");
+            write_async_func_ptr_decl(&ms, root, q, data);
+            mstream_cstr(&ms, ";" NL);
+        }
     }
     mstream_cstr(&ms, NL);
 
@@ -3075,6 +10214,28 @@ gen_header(const struct root* root, const char* data, const char* file_name,
             mstream_cstr(&ms, "        ");
             write_func_ptr_decl(&ms, root, NULL, q, data);
             mstream_cstr(&ms, ";" NL);
+            if (q->batch)
+            {
+                mstream_cstr(&ms, "        ");
+                write_batch_func_ptr_decl(&ms, root, g, q, data);
+                mstream_cstr(&ms, ";" NL);
+            }
+            if (q->bulk)
+            {
+                mstream_cstr(&ms, "        ");
+                write_bulk_func_ptr_decl(&ms, root, g, q, data);
+                mstream_cstr(&ms, ";" NL);
+            }
+            if (q->cursor)
+                write_cursor_func_ptr_decls(&ms, root, g, q, "        ", data);
+            if (q->columns)
+                write_columns_func_ptr_decls(&ms, root, g, q, "        ", data);
+            if (root->async)
+            {
+                mstream_cstr(&ms, "        ");
+                write_async_func_ptr_decl(&ms, root, q, data);
+                mstream_cstr(&ms, ";" NL);
+            }
         }
 
         /* Functions */
@@ -3134,9 +10295,22 @@ gen_source(const struct root* root, const char* data, const char* file_name,
         mstream_fmt(&ms, NL "%S" NL NL, root->source_includes, data);
 
     mstream_cstr(&ms, "#include <ctype.h>" NL);
+    mstream_cstr(&ms, "#include <stddef.h>" NL);
     mstream_cstr(&ms, "#include <stdlib.h>" NL);
     mstream_cstr(&ms, "#include <string.h>" NL);
     mstream_cstr(&ms, "#include <stdio.h>" NL);
+    if (root->pool || root->async || root->split || root->profile_layer)
+        write_atomics(&ms, root, data);
+    if (root->async || root->split || root->tenants || root->checkpoint_pages || root->profile_layer)
+        write_thread_includes(&ms, root, data);
+    if (root->profile_layer || root->group_commit_ops || root->deadlines || root->checkpoint_pages)
+    {
+        mstream_cstr(&ms, "#if defined(_WIN32)" NL);
+        mstream_cstr(&ms, "#include <windows.h>" NL);
+        mstream_cstr(&ms, "#else" NL);
+        mstream_cstr(&ms, "#include <time.h>" NL);
+        mstream_cstr(&ms, "#endif" NL NL);
+    }
 
     /* ------------------------------------------------------------------------
      * Context structure declaration
@@ -3147,11 +10321,113 @@ gen_source(const struct root* root, const char* data, const char* file_name,
     mstream_fmt(&ms, "    sqlite3* db;" NL);
     /* Global queries */
     for (q = root->queries; q; q = q->next)
+    {
         mstream_fmt(&ms, "    sqlite3_stmt* %S;" NL, q->name, data);
+        if (q->bulk)
+        {
+            mstream_fmt(&ms, "    sqlite3_stmt* %S_bulk;" NL, q->name, data);
+            mstream_fmt(&ms, "    sqlite3_stmt* %S_bulk_tail;" NL, q->name, data);
+        }
+        if (q->cursor)
+        {
+            mstream_fmt(&ms, "    sqlite3_stmt* %S_cursor;" NL, q->name, data);
+            mstream_fmt(&ms, "    int %S_cursor_state;" NL, q->name, data);
+            if (root->split)
+                mstream_fmt(&ms, "    struct %S* %S_cursor_ctx;" NL, PREFIX(root->prefix, data), q->name, data);
+        }
+        if (q->columns)
+        {
+            mstream_fmt(&ms, "    sqlite3_stmt* %S_columns;" NL, q->name, data);
+            mstream_fmt(&ms, "    int %S_columns_state;" NL, q->name, data);
+            if (root->split)
+                mstream_fmt(&ms, "    struct %S* %S_columns_ctx;" NL, PREFIX(root->prefix, data), q->name, data);
+        }
+        if (query_has_lookup(q))
+            mstream_fmt(&ms, "    sqlite3_stmt* %S_lookup;" NL, q->name, data);
+    }
     /* Grouped queries */
     for (g = root->query_groups; g; g = g->next)
         for (q = g->queries; q; q = q->next)
+        {
             mstream_fmt(&ms, "    sqlite3_stmt* %S_%S;" NL, g->name, data, q->name, data);
+            if (q->bulk)
+            {
+                mstream_fmt(&ms, "    sqlite3_stmt* %S_%S_bulk;" NL, g->name, data, q->name, data);
+                mstream_fmt(&ms, "    sqlite3_stmt* %S_%S_bulk_tail;" NL, g->name, data, q->name, data);
+            }
+            if (q->cursor)
+            {
+                mstream_fmt(&ms, "    sqlite3_stmt* %S_%S_cursor;" NL, g->name, data, q->name, data);
+                mstream_fmt(&ms, "    int %S_%S_cursor_state;" NL, g->name, data, q->name, data);
+                if (root->split)
+                    mstream_fmt(&ms, "    struct %S* %S_%S_cursor_ctx;" NL,
+                        PREFIX(root->prefix, data), g->name, data, q->name, data);
+            }
+            if (q->columns)
+            {
+                mstream_fmt(&ms, "    sqlite3_stmt* %S_%S_columns;" NL, g->name, data, q->name, data);
+                mstream_fmt(&ms, "    int %S_%S_columns_state;" NL, g->name, data, q->name, data);
+                if (root->split)
+                    mstream_fmt(&ms, "    struct %S* %S_%S_columns_ctx;" NL,
+                        PREFIX(root->prefix, data), g->name, data, q->name, data);
+            }
+            if (query_has_lookup(q))
+                mstream_fmt(&ms, "    sqlite3_stmt* %S_%S_lookup;" NL, g->name, data, q->name, data);
+        }
+    /* Transaction control statements */
+    mstream_cstr(&ms, "    struct {" NL);
+    mstream_cstr(&ms, "        sqlite3_stmt* begin;" NL);
+    mstream_cstr(&ms, "        sqlite3_stmt* begin_immediate;" NL);
+    mstream_cstr(&ms, "        sqlite3_stmt* commit;" NL);
+    mstream_cstr(&ms, "        sqlite3_stmt* rollback;" NL);
+    mstream_cstr(&ms, "        sqlite3_stmt* savepoint;" NL);
+    mstream_cstr(&ms, "        sqlite3_stmt* release;" NL);
+    mstream_cstr(&ms, "        sqlite3_stmt* rollback_to;" NL);
+    mstream_cstr(&ms, "    } tx;" NL);
+    /* Busy handler statistics */
+    mstream_cstr(&ms, "    struct {" NL);
+    mstream_cstr(&ms, "        int retries;" NL);
+    mstream_cstr(&ms, "        int wait_ms;" NL);
+    if (root->busy_policy == BUSY_TIMEOUT || (root->busy_policy == BUSY_SPIN && has_pragmas(root)))
+        mstream_cstr(&ms, "        int lock_wait_ms;" NL);
+    mstream_cstr(&ms, "    } busy;" NL);
+    /* Result caches */
+    if (has_cached_queries(root))
+    {
+        mstream_cstr(&ms, "    struct {" NL);
+        for (q = root->queries; q; q = q->next)
+            if (q->cache_entries && !table_is_cached(root, q->table_name, q, data))
+                mstream_fmt(&ms, "        sqlite3_uint64 %S;" NL, q->table_name, data);
+        for (g = root->query_groups; g; g = g->next)
+            for (q = g->queries; q; q = q->next)
+                if (q->cache_entries && !table_is_cached(root, q->table_name, q, data))
+                    mstream_fmt(&ms, "        sqlite3_uint64 %S;" NL, q->table_name, data);
+        mstream_cstr(&ms, "    } cache_gen;" NL);
+        for (q = root->queries; q; q = q->next)
+            if (q->cache_entries)
+                mstream_fmt(&ms, "    struct %S_%S_cache_entry* %S_cache;" NL,
+                    PREFIX(root->prefix, data), q->name, data, q->name, data);
+        for (g = root->query_groups; g; g = g->next)
+            for (q = g->queries; q; q = q->next)
+                if (q->cache_entries)
+                    mstream_fmt(&ms, "    struct %S_%S_%S_cache_entry* %S_%S_cache;" NL,
+                        PREFIX(root->prefix, data), g->name, data, q->name, data, g->name, data, q->name, data);
+    }
+    if (root->pool || root->split)
+        mstream_cstr(&ms, "    int pool_slot;" NL);
+    if (root->split)
+        mstream_fmt(&ms, "    struct %S_split* split;" NL, PREFIX(root->prefix, data));
+    if (root->shards)
+        mstream_fmt(&ms, "    struct %S** shards;" NL, PREFIX(root->prefix, data));
+    if (root->tenants)
+        mstream_fmt(&ms, "    struct %S_tenant* tenant;" NL, PREFIX(root->prefix, data));
+    if (root->deadlines)
+    {
+        mstream_cstr(&ms, "    struct {" NL);
+        mstream_cstr(&ms, "        long long at;" NL);
+        mstream_cstr(&ms, "        int expired;" NL);
+        mstream_cstr(&ms, "    } deadline;" NL);
+    }
     mstream_cstr(&ms, "};" NL);
 
     /* Error function */
@@ -3165,26 +10441,112 @@ gen_source(const struct root* root, const char* data, const char* file_name,
     if (root->source_preamble.len)
         mstream_fmt(&ms, NL "%S" NL NL, root->source_preamble, data);
 
+    /* ------------------------------------------------------------------------
+     * Connection sharing
+     * --------------------------------------------------------------------- */
+
+    if (root->pool || root->split)
+        write_pool_stack(&ms, root, data);
+    if (root->async || root->split || root->tenants || root->checkpoint_pages)
+        write_sem_funcs(&ms, root, data);
+    if (root->split)
+        write_split_funcs(&ms, root, data);
+    if (root->shards)
+        write_shard_funcs(&ms, root, data);
+
+    /* ------------------------------------------------------------------------
+     * Result caches
+     * --------------------------------------------------------------------- */
+
+    if (has_cached_queries(root))
+    {
+        for (q = root->queries; q; q = q->next)
+            if (q->cache_entries)
+                write_cache_entry_struct(&ms, root, NULL, q, data);
+        for (g = root->query_groups; g; g = g->next)
+            for (q = g->queries; q; q = q->next)
+                if (q->cache_entries)
+                    write_cache_entry_struct(&ms, root, g, q, data);
+        write_cache_funcs(&ms, root, data);
+    }
+
+    /* ------------------------------------------------------------------------
+     * Busy handling
+     * --------------------------------------------------------------------- */
+
+    write_busy_funcs(&ms, root, data);
+
+    /* ------------------------------------------------------------------------
+     * Deadlines and cancellation
+     * --------------------------------------------------------------------- */
+
+    if (root->deadlines)
+        write_deadline_funcs(&ms, root, data);
+
+    /* ------------------------------------------------------------------------
+     * Transactions
+     * --------------------------------------------------------------------- */
+
+    write_transaction_funcs(&ms, root, data);
+
+    /* ------------------------------------------------------------------------
+     * Statement statistics
+     * --------------------------------------------------------------------- */
+
+    write_stmt_stats_funcs(&ms, root, data);
+
+    /* ------------------------------------------------------------------------
+     * Query plans
+     * --------------------------------------------------------------------- */
+
+    write_explain_func(&ms, root, data);
+
     /* ------------------------------------------------------------------------
      * Query implementations
      * --------------------------------------------------------------------- */
 
+    if (has_columns_queries(root))
+        write_arrow_export_funcs(&ms, root, data);
+
     for (q = root->queries; q; q = q->next)
     {
         write_func_decl(&ms, root, NULL, q, data);
         mstream_cstr(&ms, NL "{" NL);
 
-        /* Local variables */
-        mstream_cstr(&ms, "    int ret");
-        if (q->return_name.len)
-            mstream_fmt(&ms, ", %S = -1", q->return_name, data);
-        mstream_cstr(&ms, ";" NL);
-
-        write_sqlite_prepare_stmt(&ms, root, NULL, q, data);
-        write_sqlite_bind_args(&ms, root, NULL, q, data);
-        write_sqlite_exec(&ms, root, NULL, q, data);
+        if (q->cache_entries)
+            write_cached_query_body(&ms, root, NULL, q, data);
+        else
+        {
+            /* Local variables */
+            mstream_cstr(&ms, "    int ret");
+            if (q->return_arg)
+                mstream_cstr(&ms, ", found = 0");
+            else if (q->return_name.len)
+                mstream_fmt(&ms, ", %S = -1", q->return_name, data);
+            else if (q->upsert_status)
+                mstream_cstr(&ms, ", existed, own_tx");
+            mstream_cstr(&ms, ";" NL);
+            write_str_view_locals(&ms, q, data);
+            write_split_route_query(&ms, root, NULL, q, data);
+            write_shard_route_query(&ms, root, NULL, q, data);
+            write_sqlite_read_first(&ms, root, NULL, q, data);
+            write_cache_invalidate(&ms, root, q, data);
+
+            write_sqlite_prepare_stmt(&ms, root, NULL, q, "", data);
+            write_sqlite_bind_args(&ms, root, NULL, q, "", data);
+            write_sqlite_exec(&ms, root, NULL, q, data);
+        }
 
         mstream_cstr(&ms, "}" NL NL);
+
+        if (q->batch)
+            write_batch_func(&ms, root, NULL, q, data);
+        if (q->bulk)
+            write_bulk_func(&ms, root, NULL, q, data);
+        if (q->cursor)
+            write_cursor_funcs(&ms, root, NULL, q, data);
+        if (q->columns)
+            write_columns_funcs(&ms, root, NULL, q, data);
     }
 
     for (g = root->query_groups; g; g = g->next)
@@ -3193,17 +10555,40 @@ gen_source(const struct root* root, const char* data, const char* file_name,
             write_func_decl(&ms, root, g, q, data);
             mstream_cstr(&ms, NL "{" NL);
 
-            /* Local variables */
-            mstream_cstr(&ms, "    int ret");
-            if (q->return_name.len)
-                mstream_fmt(&ms, ", %S = -1", q->return_name, data);
-            mstream_cstr(&ms, ";" NL);
-
-            write_sqlite_prepare_stmt(&ms, root, g, q, data);
-            write_sqlite_bind_args(&ms, root, g, q, data);
-            write_sqlite_exec(&ms, root, g, q, data);
+            if (q->cache_entries)
+                write_cached_query_body(&ms, root, g, q, data);
+            else
+            {
+                /* Local variables */
+                mstream_cstr(&ms, "    int ret");
+                if (q->return_arg)
+                    mstream_cstr(&ms, ", found = 0");
+                else if (q->return_name.len)
+                    mstream_fmt(&ms, ", %S = -1", q->return_name, data);
+                else if (q->upsert_status)
+                    mstream_cstr(&ms, ", existed, own_tx");
+                mstream_cstr(&ms, ";" NL);
+                write_str_view_locals(&ms, q, data);
+                write_split_route_query(&ms, root, g, q, data);
+                write_shard_route_query(&ms, root, g, q, data);
+                write_sqlite_read_first(&ms, root, g, q, data);
+                write_cache_invalidate(&ms, root, q, data);
+
+                write_sqlite_prepare_stmt(&ms, root, g, q, "", data);
+                write_sqlite_bind_args(&ms, root, g, q, "", data);
+                write_sqlite_exec(&ms, root, g, q, data);
+            }
 
             mstream_cstr(&ms, "}" NL NL);
+
+            if (q->batch)
+                write_batch_func(&ms, root, g, q, data);
+            if (q->bulk)
+                write_bulk_func(&ms, root, g, q, data);
+            if (q->cursor)
+                write_cursor_funcs(&ms, root, g, q, data);
+            if (q->columns)
+                write_columns_funcs(&ms, root, g, q, data);
         }
 
     /* ------------------------------------------------------------------------
@@ -3212,18 +10597,32 @@ gen_source(const struct root* root, const char* data, const char* file_name,
 
     for (f = root->functions; f; f = f->next)
     {
+        if (has_cached_queries(root))
+        {
+            write_cached_function(&ms, root, NULL, f, data);
+            continue;
+        }
         mstream_fmt(&ms, "static int" NL "%S(struct %S* ctx", f->name, data,
                 PREFIX(root->prefix, data));
         for (a = f->args; a; a = a->next)
             mstream_fmt(&ms, ", %S %S", a->type, data, a->name, data);
         mstream_cstr(&ms, ")" NL "{" NL);
+        write_split_route_function(&ms, root, NULL, f, data);
+        write_shard_route_function(&ms, root, NULL, f, data);
+        if (function_body_is_nested(root))
+            mstream_cstr(&ms, "    {");
         mstream_fmt(&ms, NL "%S" NL, f->body, data);
-        mstream_cstr(&ms, NL "}" NL NL);
+        mstream_cstr(&ms, function_body_is_nested(root) ? NL "    }" NL "}" NL NL : NL "}" NL NL);
     }
 
     for (g = root->query_groups; g; g = g->next)
         for (f = g->functions; f; f = f->next)
         {
+            if (has_cached_queries(root))
+            {
+                write_cached_function(&ms, root, g, f, data);
+                continue;
+            }
             mstream_fmt(&ms, "static int" NL "%S_%S(struct %S* ctx",
                     g->name, data,
                     f->name, data,
@@ -3231,47 +10630,167 @@ gen_source(const struct root* root, const char* data, const char* file_name,
             for (a = f->args; a; a = a->next)
                 mstream_fmt(&ms, ", %S %S", a->type, data, a->name, data);
             mstream_cstr(&ms, ")" NL "{" NL);
+            write_split_route_function(&ms, root, g, f, data);
+            write_shard_route_function(&ms, root, g, f, data);
+            if (function_body_is_nested(root))
+                mstream_cstr(&ms, "    {");
             mstream_fmt(&ms, NL "%S" NL, f->body, data);
-            mstream_cstr(&ms, NL "}" NL NL);
+            mstream_cstr(&ms, function_body_is_nested(root) ? NL "    }" NL "}" NL NL : NL "}" NL NL);
         }
 
+    /* ------------------------------------------------------------------------
+     * Statement preparation
+     * --------------------------------------------------------------------- */
+
+    write_prepare_all_func(&ms, root, data);
+
     /* ------------------------------------------------------------------------
      * Open and close
      * --------------------------------------------------------------------- */
 
-    mstream_fmt(&ms, "static struct %S*" NL "%S_open(const char* uri)" NL "{" NL,
+    if (has_pragmas(root))
+        write_pragma_table(&ms, root, data);
+
+    mstream_fmt(&ms, "static struct %S*" NL "%S_open_ex(const char* uri, int flags)" NL "{" NL,
             PREFIX(root->prefix, data),
             PREFIX(root->prefix, data));
-    mstream_fmt(&ms, "    int ret;" NL);
+    mstream_cstr(&ms, "    int ret;" NL);
+    if (has_pragmas(root))
+        mstream_cstr(&ms, "    int i;" NL);
     mstream_fmt(&ms, "    struct %S* ctx = %S(sizeof *ctx);" NL,
             PREFIX(root->prefix, data),
             MALLOC(root->malloc, data));
     mstream_cstr(&ms, "    if (ctx == NULL)" NL);
     mstream_cstr(&ms, "        return NULL;" NL);
     mstream_cstr(&ms, "    memset(ctx, 0, sizeof *ctx);" NL NL);
-    mstream_cstr(&ms, "    ret = sqlite3_open_v2(uri, &ctx->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);" NL);
-    mstream_cstr(&ms, "    if (ret == SQLITE_OK)" NL);
-    mstream_cstr(&ms, "        return ctx;" NL NL);
+    if (has_cached_queries(root))
+    {
+        write_cache_alloc(&ms, root, data);
+        mstream_cstr(&ms, NL);
+    }
+    mstream_cstr(&ms, "    ret = sqlite3_open_v2(uri, &ctx->db, flags, NULL);" NL);
+    mstream_cstr(&ms, "    if (ret != SQLITE_OK)" NL);
+    mstream_cstr(&ms, "        goto open_failed;" NL);
+    if (root->busy_policy == BUSY_TIMEOUT || root->busy_policy == BUSY_BACKOFF)
+        mstream_fmt(&ms, "    sqlite3_busy_handler(ctx->db, %S_busy_handler, ctx);" NL, PREFIX(root->prefix, data));
+    else if (root->busy_policy == BUSY_SPIN && has_pragmas(root))
+        mstream_fmt(&ms, "    sqlite3_busy_handler(ctx->db, %S_open_busy_handler, ctx);" NL, PREFIX(root->prefix, data));
+    if (has_cached_queries(root))
+    {
+        mstream_fmt(&ms, "    sqlite3_update_hook(ctx->db, %S_cache_update_hook, ctx);" NL, PREFIX(root->prefix, data));
+        mstream_fmt(&ms, "    sqlite3_rollback_hook(ctx->db, %S_cache_rollback_hook, ctx);" NL, PREFIX(root->prefix, data));
+    }
+    if (has_pragmas(root))
+    {
+        mstream_cstr(&ms, NL);
+        mstream_fmt (&ms, "    for (i = 0; i != (int)(sizeof(%S_pragmas) / sizeof(*%S_pragmas)); ++i)" NL "    {" NL,
+            PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_fmt (&ms, "        ret = sqlite3_exec(ctx->db, %S_pragmas[i], NULL, NULL, NULL);" NL,
+            PREFIX(root->prefix, data));
+        mstream_cstr(&ms, "        if (ret != SQLITE_OK)" NL "        {" NL);
+        mstream_fmt (&ms, "            %S(\"Failed to apply \\\"%%s\\\"\\n\", %S_pragmas[i]);" NL,
+            LOG_ERR(root->log_err, data), PREFIX(root->prefix, data));
+        mstream_cstr(&ms, "            goto open_failed;" NL);
+        mstream_cstr(&ms, "        }" NL);
+        mstream_cstr(&ms, "    }" NL);
+        if (root->busy_policy == BUSY_SPIN)
+            mstream_cstr(&ms, "    sqlite3_busy_handler(ctx->db, NULL, NULL);" NL);
+    }
+    mstream_cstr(&ms, "    return ctx;" NL NL);
+    mstream_cstr(&ms, "open_failed:" NL);
     mstream_fmt(&ms, "    %S(ret, sqlite3_errstr(ret), sqlite3_errmsg(ctx->db));" NL,
                 LOG_SQL_ERR(root->log_sql_err, data));
+    mstream_cstr(&ms, "    sqlite3_close(ctx->db);" NL);
+    if (has_cached_queries(root))
+    {
+        mstream_cstr(&ms, "cache_failed:" NL);
+        mstream_fmt(&ms, "    %S_cache_free(ctx);" NL, PREFIX(root->prefix, data));
+    }
     mstream_fmt(&ms, "    %S(ctx);" NL, FREE(root->free, data));
     mstream_cstr(&ms, "    return NULL;" NL);
     mstream_cstr(&ms, "}" NL NL);
 
+    mstream_fmt(&ms, "static struct %S*" NL "%S_open(const char* uri)" NL "{" NL,
+            PREFIX(root->prefix, data),
+            PREFIX(root->prefix, data));
+    mstream_fmt(&ms, "    return %S_open_ex(uri, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);" NL,
+            PREFIX(root->prefix, data));
+    mstream_cstr(&ms, "}" NL NL);
+
     mstream_fmt(&ms, "static void" NL "%S_close(struct %S* ctx)" NL "{" NL,
             PREFIX(root->prefix, data),
             PREFIX(root->prefix, data));
+    if (root->split)
+        write_split_close(&ms, root, data);
+    if (root->shards)
+        write_shard_close(&ms, root, data);
     /* Global queries */
     for (q = root->queries; q; q = q->next)
+    {
         mstream_fmt(&ms, "    sqlite3_finalize(ctx->%S);" NL, q->name, data);
+        if (q->bulk)
+        {
+            mstream_fmt(&ms, "    sqlite3_finalize(ctx->%S_bulk);" NL, q->name, data);
+            mstream_fmt(&ms, "    sqlite3_finalize(ctx->%S_bulk_tail);" NL, q->name, data);
+        }
+        if (q->cursor)
+            mstream_fmt(&ms, "    sqlite3_finalize(ctx->%S_cursor);" NL, q->name, data);
+        if (q->columns)
+            mstream_fmt(&ms, "    sqlite3_finalize(ctx->%S_columns);" NL, q->name, data);
+        if (query_has_lookup(q))
+            mstream_fmt(&ms, "    sqlite3_finalize(ctx->%S_lookup);" NL, q->name, data);
+    }
     /* Grouped queries */
     for (g = root->query_groups; g; g = g->next)
         for (q = g->queries; q; q = q->next)
+        {
             mstream_fmt(&ms, "    sqlite3_finalize(ctx->%S_%S);" NL, g->name, data, q->name, data);
+            if (q->bulk)
+            {
+                mstream_fmt(&ms, "    sqlite3_finalize(ctx->%S_%S_bulk);" NL, g->name, data, q->name, data);
+                mstream_fmt(&ms, "    sqlite3_finalize(ctx->%S_%S_bulk_tail);" NL, g->name, data, q->name, data);
+            }
+            if (q->cursor)
+                mstream_fmt(&ms, "    sqlite3_finalize(ctx->%S_%S_cursor);" NL, g->name, data, q->name, data);
+            if (q->columns)
+                mstream_fmt(&ms, "    sqlite3_finalize(ctx->%S_%S_columns);" NL, g->name, data, q->name, data);
+            if (query_has_lookup(q))
+                mstream_fmt(&ms, "    sqlite3_finalize(ctx->%S_%S_lookup);" NL, g->name, data, q->name, data);
+        }
+    mstream_cstr(&ms, "    sqlite3_finalize(ctx->tx.begin);" NL);
+    mstream_cstr(&ms, "    sqlite3_finalize(ctx->tx.begin_immediate);" NL);
+    mstream_cstr(&ms, "    sqlite3_finalize(ctx->tx.commit);" NL);
+    mstream_cstr(&ms, "    sqlite3_finalize(ctx->tx.rollback);" NL);
+    mstream_cstr(&ms, "    sqlite3_finalize(ctx->tx.savepoint);" NL);
+    mstream_cstr(&ms, "    sqlite3_finalize(ctx->tx.release);" NL);
+    mstream_cstr(&ms, "    sqlite3_finalize(ctx->tx.rollback_to);" NL);
     mstream_cstr(&ms, "    sqlite3_close(ctx->db);" NL);
+    if (has_cached_queries(root))
+        mstream_fmt(&ms, "    %S_cache_free(ctx);" NL, PREFIX(root->prefix, data));
     mstream_fmt(&ms, "    %S(ctx);" NL, FREE(root->free, data));
     mstream_cstr(&ms, "}" NL NL);
 
+    if (root->split)
+        write_open_split_func(&ms, root, data);
+    if (root->shards)
+        write_open_shards_func(&ms, root, data);
+    if (root->pool)
+        write_pool_funcs(&ms, root, data);
+
+    /* ------------------------------------------------------------------------
+     * Async executor
+     * --------------------------------------------------------------------- */
+
+    if (root->async)
+    {
+        write_executor_funcs(&ms, root, data);
+        for (q = root->queries; q; q = q->next)
+            write_async_funcs(&ms, root, NULL, q, data);
+        for (g = root->query_groups; g; g = g->next)
+            for (q = g->queries; q; q = q->next)
+                write_async_funcs(&ms, root, g, q, data);
+    }
+
     /* ------------------------------------------------------------------------
      * Migration
      * --------------------------------------------------------------------- */
@@ -3286,22 +10805,65 @@ gen_source(const struct root* root, const char* data, const char* file_name,
     write_upgrade_func(&ms, root, data);
     write_reinit_func(&ms, root, data, forwards_compat);
 
+    /* ------------------------------------------------------------------------
+     * Tenant cache
+     * --------------------------------------------------------------------- */
+
+    if (root->tenants)
+        write_tenant_funcs(&ms, root, data);
+
+    /* ------------------------------------------------------------------------
+     * Profiling
+     * --------------------------------------------------------------------- */
+
+    if (root->profile_layer)
+        write_profile_funcs(&ms, root, data);
+
     /* ------------------------------------------------------------------------
      * Interface
      * --------------------------------------------------------------------- */
 
     mstream_fmt(&ms, "static struct %S_interface db_sqlite3 = {" NL, PREFIX(root->prefix, data));
-    mstream_fmt(&ms, "    %S_open," NL "    %S_close," NL,
+    mstream_fmt(&ms, "    %S_open," NL "    %S_open_ex," NL "    %S_close," NL,
+            PREFIX(root->prefix, data),
             PREFIX(root->prefix, data),
             PREFIX(root->prefix, data));
+    write_split_interface_entries(&ms, root, data);
+    write_pool_interface_entries(&ms, root, data);
+    write_executor_interface_entries(&ms, root, data);
+    write_tenant_interface_entries(&ms, root, data);
+    write_deadline_interface_entries(&ms, root, data);
     mstream_fmt(&ms, "    %S_version," NL, PREFIX(root->prefix, data));
     mstream_fmt(&ms, "    %S_upgrade," NL, PREFIX(root->prefix, data));
     mstream_fmt(&ms, "    %S_reinit," NL, PREFIX(root->prefix, data));
     mstream_fmt(&ms, "    %S_migrate_to," NL, PREFIX(root->prefix, data));
+    mstream_fmt(&ms, "    %S_prepare_all," NL, PREFIX(root->prefix, data));
+    mstream_fmt(&ms, "    %S_busy_stats," NL, PREFIX(root->prefix, data));
+    mstream_fmt(&ms, "    %S_query_stats," NL, PREFIX(root->prefix, data));
+    mstream_fmt(&ms, "    %S_db_stats," NL, PREFIX(root->prefix, data));
+    mstream_fmt(&ms, "    %S_explain_all," NL, PREFIX(root->prefix, data));
+    if (has_cached_queries(root))
+        mstream_fmt(&ms, "    %S_cache_clear," NL, PREFIX(root->prefix, data));
+    write_profile_interface_entries(&ms, root, data);
+    write_transaction_interface_entries(&ms, root, data);
 
     /* Global queries */
     for (q = root->queries; q; q = q->next)
+    {
         mstream_fmt(&ms, "    %S," NL, q->name, data);
+        if (q->batch)
+            mstream_fmt(&ms, "    %S_batch," NL, q->name, data);
+        if (q->bulk)
+            mstream_fmt(&ms, "    %S_bulk," NL, q->name, data);
+        if (q->cursor)
+            mstream_fmt(&ms, "    %S_open_cursor," NL "    %S_next," NL "    %S_close_cursor," NL,
+                q->name, data, q->name, data, q->name, data);
+        if (q->columns)
+            mstream_fmt(&ms, "    %S_fetch_columns," NL "    %S_fetch_more_columns," NL "    %S_close_columns," NL "    %S_export_arrow," NL,
+                q->name, data, q->name, data, q->name, data, q->name, data);
+        if (root->async)
+            mstream_fmt(&ms, "    %S_async," NL, q->name, data);
+    }
 
     /* Global functions */
     for (f = root->functions; f; f = f->next)
@@ -3314,7 +10876,23 @@ gen_source(const struct root* root, const char* data, const char* file_name,
 
         /* Queries */
         for (q = g->queries; q; q = q->next)
+        {
             mstream_fmt(&ms, "        %S_%S," NL, g->name, data, q->name, data);
+            if (q->batch)
+                mstream_fmt(&ms, "        %S_%S_batch," NL, g->name, data, q->name, data);
+            if (q->bulk)
+                mstream_fmt(&ms, "        %S_%S_bulk," NL, g->name, data, q->name, data);
+            if (q->cursor)
+                mstream_fmt(&ms, "        %S_%S_open_cursor," NL "        %S_%S_next," NL "        %S_%S_close_cursor," NL,
+                    g->name, data, q->name, data, g->name, data, q->name, data, g->name, data, q->name, data);
+            if (q->columns)
+                mstream_fmt(&ms, "        %S_%S_fetch_columns," NL "        %S_%S_fetch_more_columns," NL "        %S_%S_close_columns," NL
+                    "        %S_%S_export_arrow," NL,
+                    g->name, data, q->name, data, g->name, data, q->name, data,
+                    g->name, data, q->name, data, g->name, data, q->name, data);
+            if (root->async)
+                mstream_fmt(&ms, "        %S_%S_async," NL, g->name, data, q->name, data);
+        }
 
         /* Functions */
         for (f = g->functions; f; f = f->next)
@@ -3346,6 +10924,14 @@ gen_source(const struct root* root, const char* data, const char* file_name,
         mstream_cstr(&ms, "    return ctx;" NL);
         mstream_cstr(&ms, "}" NL NL);
 
+        mstream_fmt (&ms, "static struct %S* dbg_%S_open_ex(const char* uri, int flags)" NL "{" NL, PREFIX(root->prefix, data), PREFIX(root->prefix, data));
+        mstream_fmt (&ms, "    struct %S* ctx;" NL, PREFIX(root->prefix, data));
+        mstream_fmt (&ms, "    %S(\"Opening database \\\"%%s\\\" with flags 0x%%x\\n\", uri, flags);" NL, LOG_DBG(root->log_dbg, data));
+        mstream_cstr(&ms, "    ctx = db_sqlite3.open_ex(uri, flags);" NL);
+        mstream_fmt (&ms, "    %S(\"retval=%%p\\n\", (void*)ctx);" NL, LOG_DBG(root->log_dbg, data));
+        mstream_cstr(&ms, "    return ctx;" NL);
+        mstream_cstr(&ms, "}" NL NL);
+
         mstream_fmt (&ms, "static void dbg_%S_close(struct %S* ctx)" NL "{" NL, PREFIX(root->prefix, data), PREFIX(root->prefix, data));
         mstream_fmt (&ms, "    %S(\"Closing database\\n\");" NL, LOG_DBG(root->log_dbg, data));
         mstream_cstr(&ms, "    db_sqlite3.close(ctx);" NL);
@@ -3386,34 +10972,90 @@ gen_source(const struct root* root, const char* data, const char* file_name,
         mstream_fmt(&ms, "static struct %S_interface dbg_db_sqlite3 = {" NL, PREFIX(root->prefix, data));
         mstream_fmt(&ms,
             "    dbg_%S_open," NL
-            "    dbg_%S_close," NL
+            "    dbg_%S_open_ex," NL
+            "    dbg_%S_close," NL,
+                PREFIX(root->prefix, data),
+                PREFIX(root->prefix, data),
+                PREFIX(root->prefix, data));
+        write_split_interface_entries(&ms, root, data);
+        write_pool_interface_entries(&ms, root, data);
+        write_executor_interface_entries(&ms, root, data);
+        write_tenant_interface_entries(&ms, root, data);
+        write_deadline_interface_entries(&ms, root, data);
+        mstream_fmt(&ms,
             "    dbg_%S_version," NL
             "    dbg_%S_upgrade," NL
             "    dbg_%S_reinit," NL
             "    dbg_%S_migrate_to," NL,
-                PREFIX(root->prefix, data),
-                PREFIX(root->prefix, data),
                 PREFIX(root->prefix, data),
                 PREFIX(root->prefix, data),
                 PREFIX(root->prefix, data),
                 PREFIX(root->prefix, data));
-        /* Functions */
-        for (f = root->functions; f; f = f->next)
-            mstream_fmt(&ms, "    %S," NL, f->name, data);
+        mstream_fmt(&ms, "    %S_prepare_all," NL, PREFIX(root->prefix, data));
+        mstream_fmt(&ms, "    %S_busy_stats," NL, PREFIX(root->prefix, data));
+        mstream_fmt(&ms, "    %S_query_stats," NL, PREFIX(root->prefix, data));
+        mstream_fmt(&ms, "    %S_db_stats," NL, PREFIX(root->prefix, data));
+        mstream_fmt(&ms, "    %S_explain_all," NL, PREFIX(root->prefix, data));
+        if (has_cached_queries(root))
+            mstream_fmt(&ms, "    %S_cache_clear," NL, PREFIX(root->prefix, data));
+        write_profile_interface_entries(&ms, root, data);
+        write_transaction_interface_entries(&ms, root, data);
         /* Global queries */
         for (q = root->queries; q; q = q->next)
+        {
             mstream_fmt(&ms, "    dbg_%S," NL, q->name, data);
+            if (q->batch)
+                mstream_fmt(&ms, "    %S_batch," NL, q->name, data);
+            if (q->bulk)
+                mstream_fmt(&ms, "    %S_bulk," NL, q->name, data);
+            if (q->cursor)
+                mstream_fmt(&ms, "    %S_open_cursor," NL "    %S_next," NL "    %S_close_cursor," NL,
+                    q->name, data, q->name, data, q->name, data);
+            if (q->columns)
+                mstream_fmt(&ms, "    %S_fetch_columns," NL "    %S_fetch_more_columns," NL "    %S_close_columns," NL "    %S_export_arrow," NL,
+                    q->name, data, q->name, data, q->name, data, q->name, data);
+            if (root->async)
+                mstream_fmt(&ms, "    %S_async," NL, q->name, data);
+        }
+        /* Functions */
+        for (f = root->functions; f; f = f->next)
+            mstream_fmt(&ms, "    %S," NL, f->name, data);
         /* Grouped queries */
         for (g = root->query_groups; g; g = g->next)
         {
             mstream_cstr(&ms, "    {" NL);
             for (q = g->queries; q; q = q->next)
+            {
                 mstream_fmt(&ms, "        dbg_%S_%S," NL, g->name, data, q->name, data);
+                if (q->batch)
+                    mstream_fmt(&ms, "        %S_%S_batch," NL, g->name, data, q->name, data);
+                if (q->bulk)
+                    mstream_fmt(&ms, "        %S_%S_bulk," NL, g->name, data, q->name, data);
+                if (q->cursor)
+                    mstream_fmt(&ms, "        %S_%S_open_cursor," NL "        %S_%S_next," NL "        %S_%S_close_cursor," NL,
+                        g->name, data, q->name, data, g->name, data, q->name, data, g->name, data, q->name, data);
+                if (q->columns)
+                    mstream_fmt(&ms, "        %S_%S_fetch_columns," NL "        %S_%S_fetch_more_columns," NL "        %S_%S_close_columns," NL
+                        "        %S_%S_export_arrow," NL,
+                        g->name, data, q->name, data, g->name, data, q->name, data,
+                        g->name, data, q->name, data, g->name, data, q->name, data);
+                if (root->async)
+                    mstream_fmt(&ms, "        %S_%S_async," NL, g->name, data, q->name, data);
+            }
+            for (f = g->functions; f; f = f->next)
+                mstream_fmt(&ms, "        %S_%S," NL, g->name, data, f->name, data);
             mstream_cstr(&ms, "    }," NL);
         }
         mstream_cstr(&ms, "};" NL NL);
     }
 
+    /* ------------------------------------------------------------------------
+     * Profile layer
+     * --------------------------------------------------------------------- */
+
+    if (root->profile_layer)
+        write_profile_layer(&ms, root, debug_layer, data);
+
     /* ------------------------------------------------------------------------
      * API
      * --------------------------------------------------------------------- */
@@ -3430,6 +11072,8 @@ gen_source(const struct root* root, const char* data, const char* file_name,
     if (!custom_deinit)
     {
         mstream_fmt(&ms, "void" NL "%S_deinit(void)" NL "{" NL, PREFIX(root->prefix, data));
+        if (root->profile_layer)
+            mstream_fmt(&ms, "    %S_profile_free();" NL, PREFIX(root->prefix, data));
         mstream_cstr(&ms, "    sqlite3_shutdown();" NL);
         mstream_cstr(&ms, "}" NL NL);
     }
@@ -3440,7 +11084,8 @@ gen_source(const struct root* root, const char* data, const char* file_name,
             PREFIX(root->prefix, data),
             PREFIX(root->prefix, data));
         mstream_cstr(&ms, "    if (strcmp(\"sqlite3\", backend) == 0)" NL);
-        mstream_fmt(&ms, "        return &%sdb_sqlite3;" NL, debug_layer ? "dbg_" : "");
+        mstream_fmt(&ms, "        return &%sdb_sqlite3;" NL,
+            root->profile_layer ? "prof_" : debug_layer ? "dbg_" : "");
         mstream_fmt(&ms, "    %S(\"%S(): Unknown backend \\\"%%s\\\"\", backend);" NL,
             LOG_ERR(root->log_err, data), PREFIX(root->prefix, data));
         mstream_cstr(&ms, "    return NULL;" NL);
@@ -3458,6 +11103,234 @@ gen_source(const struct root* root, const char* data, const char* file_name,
     return 0;
 }
 
+/* ----------------------------------------------------------------------------
+ * Query plan analysis
+ * ------------------------------------------------------------------------- */
+
+#if defined(SQLGEN_ANALYZE)
+/*!
+ * \brief Turns the C string literal pieces written by write_sqlite_stmt_sql()
+ * back into a null-terminated SQL statement.
+ */
+static void
+decode_stmt_sql(struct mstream* sql, const struct mstream* literal)
+{
+    const char* p = literal->address;
+    const char* end = p + literal->write_ptr;
+    char in_string = 0;
+    for (; p < end; ++p)
+    {
+        if (*p == '"')
+            in_string = !in_string;
+        else if (in_string && *p == '\\' && p + 1 != end && p[1] == '"')
+            mstream_putc(sql, *++p);
+        else if (in_string)
+            mstream_putc(sql, *p);
+    }
+    mstream_putc(sql, '\0');
+}
+
+/* Same rules as the generated explain_all() */
+static int
+plan_is_full_scan(const char* detail)
+{
+    return strncmp(detail, "SCAN ", 5) == 0
+        && strstr(detail, " USING ") == NULL
+        && strstr(detail, "CONSTANT ROW") == NULL
+        && strstr(detail, "VIRTUAL TABLE") == NULL;
+}
+
+/*!
+ * \brief Returns true if the query's statement is generated from "table" and
+ * its input arguments end up in the WHERE clause.
+ */
+static int
+has_table_where(const struct query* q)
+{
+    struct arg* a;
+    if (q->stmt.len || q->table_name.len == 0)
+        return 0;
+
+    switch (q->type)
+    {
+        case QUERY_EXISTS:
+        case QUERY_SELECT_FIRST:
+        case QUERY_SELECT_ALL:
+        case QUERY_UPDATE:
+        case QUERY_DELETE:
+            for (a = q->in_args; a; a = a->next)
+                if (!a->update)
+                    return 1;
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+static void
+print_index_suggestion(const struct query* q, const char* data)
+{
+    struct arg* a;
+    const char* sep = "";
+    printf("    Suggestion: CREATE INDEX %.*s", q->table_name.len, data + q->table_name.off);
+    for (a = q->in_args; a; a = a->next)
+        if (!a->update)
+            printf("_%.*s", a->name.len, data + a->name.off);
+    printf(" ON %.*s(", q->table_name.len, data + q->table_name.off);
+    for (a = q->in_args; a; a = a->next)
+        if (!a->update)
+        {
+            printf("%s%.*s", sep, a->name.len, data + a->name.off);
+            sep = ", ";
+        }
+    printf(");\n");
+}
+
+/*!
+ * \brief Prints the name of a query's statement the same way explain_all()
+ * reports it, e.g. "person.add_lookup" for the lookup of a "read-first" query.
+ */
+static void
+print_query_name(FILE* fp, const struct query_group* g, const struct query* q, const char* stmt_suffix, const char* data)
+{
+    if (g)
+        fprintf(fp, "%.*s.", g->name.len, data + g->name.off);
+    fprintf(fp, "%.*s%s", q->name.len, data + q->name.off, stmt_suffix);
+}
+
+/*!
+ * \brief Prints the plan of one of a query's statements and checks it.
+ * \param[in] lookup Non-zero to analyze the lookup statement of a
+ * "read-first" or "on-conflict" query instead of its main statement.
+ */
+static int
+analyze_stmt(sqlite3* db, const struct query_group* g, const struct query* q, int lookup, const char* data)
+{
+    struct mstream literal = mstream_init_writeable();
+    struct mstream sql = mstream_init_writeable();
+    const char* stmt_suffix = lookup ? "_lookup" : "";
+    sqlite3_stmt* stmt;
+    int full_scan = 0;
+    int auto_index = 0;
+    int ret;
+
+    if (lookup)
+        write_sqlite_lookup_stmt_sql(&literal, q, data);
+    else
+        write_sqlite_stmt_sql(&literal, q, data);
+    mstream_cstr(&sql, "EXPLAIN QUERY PLAN ");
+    decode_stmt_sql(&sql, &literal);
+    free(literal.address);
+
+    print_query_name(stdout, g, q, stmt_suffix, data);
+    printf(":\n");
+
+    ret = sqlite3_prepare_v2(db, sql.address, -1, &stmt, NULL);
+    if (ret != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: Failed to prepare query \"");
+        print_query_name(stderr, g, q, stmt_suffix, data);
+        fprintf(stderr, "\": %s\n%s\n", sqlite3_errmsg(db),
+            (char*)sql.address + sizeof("EXPLAIN QUERY PLAN ") - 1);
+        free(sql.address);
+        return -1;
+    }
+    free(sql.address);
+
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        const char* detail = (const char*)sqlite3_column_text(stmt, 3);
+        if (detail == NULL)
+            continue;
+        printf("    %s\n", detail);
+        full_scan |= plan_is_full_scan(detail);
+        auto_index |= strstr(detail, "AUTOMATIC") != NULL;
+    }
+    sqlite3_finalize(stmt);
+    if (ret != SQLITE_DONE)
+    {
+        fprintf(stderr, "Error: Failed to explain query \"");
+        print_query_name(stderr, g, q, stmt_suffix, data);
+        fprintf(stderr, "\": %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    if ((full_scan || auto_index) && !lookup && has_table_where(q))
+        print_index_suggestion(q, data);
+
+    if (full_scan && q->require_index)
+    {
+        fprintf(stderr, "Error: Query \"");
+        print_query_name(stderr, g, q, stmt_suffix, data);
+        fprintf(stderr, "\" is marked \"require-index\" but does a full table scan\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+analyze_query(sqlite3* db, const struct query_group* g, const struct query* q, const char* data)
+{
+    int result = analyze_stmt(db, g, q, 0, data);
+    if (query_has_lookup(q) && analyze_stmt(db, g, q, 1, data) != 0)
+        result = -1;
+    return result;
+}
+
+/*!
+ * \brief Applies all upgrade migrations to an in-memory database and prints
+ * the query plan of every query. Fails if a statement doesn't prepare or if a
+ * "require-index" query would scan a whole table.
+ */
+static int
+analyze(const struct root* root, const char* data)
+{
+    const struct migration* m;
+    const struct query_group* g;
+    const struct query* q;
+    sqlite3* db;
+    int result = 0;
+
+    if (sqlite3_open(":memory:", &db) != SQLITE_OK)
+    {
+        fprintf(stderr, "Error: Failed to open in-memory database: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+
+    for (m = root->upgrade; m; m = m->next)
+    {
+        char* error;
+        char* sql = malloc(m->sql.len + 1);
+        memcpy(sql, data + m->sql.off, m->sql.len);
+        sql[m->sql.len] = '\0';
+        if (sqlite3_exec(db, sql, NULL, NULL, &error) != SQLITE_OK)
+        {
+            fprintf(stderr, "Error: Failed to apply upgrade %d: %s\n", m->version, error);
+            sqlite3_free(error);
+            free(sql);
+            sqlite3_close(db);
+            return -1;
+        }
+        free(sql);
+    }
+
+    for (q = root->queries; q; q = q->next)
+        if (q->stmt.len || q->type != QUERY_NONE)
+            if (analyze_query(db, NULL, q, data) != 0)
+                result = -1;
+    for (g = root->query_groups; g; g = g->next)
+        for (q = g->queries; q; q = q->next)
+            if (q->stmt.len || q->type != QUERY_NONE)
+                if (analyze_query(db, g, q, data) != 0)
+                    result = -1;
+
+    sqlite3_close(db);
+    return result;
+}
+#endif
+
 int main(int argc, char** argv)
 {
     struct parser parser;
@@ -3478,6 +11351,11 @@ int main(int argc, char** argv)
     if (post_parse(&root, mf.address) != 0)
         return -1;
 
+#if defined(SQLGEN_ANALYZE)
+    if (cfg.analyze && analyze(&root, mf.address) != 0)
+        return -1;
+#endif
+
     if (gen_header(&root, mf.address, cfg.output_header,
             cfg.custom_init_decl, cfg.custom_deinit_decl, cfg.custom_api_decl) < 0)
         return -1;
@@ -0,0 +1,109 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/analyze.h"
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+#if defined(_WIN32)
+#   define popen _popen
+#   define pclose _pclose
+#endif
+
+#define NAME sqlgen_analyze
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        analyze_init();
+        dbi = analyze("sqlite3");
+        db = dbi->open("analyze.db");
+        dbi->reinit(db);
+    }
+
+    void TearDown() override {
+        dbi->close(db);
+        analyze_deinit();
+    }
+
+    struct analyze_interface* dbi;
+    struct analyze* db;
+};
+
+/* Runs sqlgen --analyze on the given input and returns its exit status */
+static int run_analyze(const char* name, const char* input, std::string* output)
+{
+    std::string path = std::string(name) + ".sqlgen";
+    std::ofstream(path) << input;
+
+    std::string cmd = std::string("\"") + SQLGEN_EXECUTABLE + "\" -b sqlite3 --analyze"
+        " -i " + path +
+        " --header " + name + ".h"
+        " --source " + name + ".c 2>&1";
+    FILE* fp = popen(cmd.c_str(), "r");
+    if (fp == nullptr)
+        return -1;
+
+    char buf[256];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+        output->append(buf, len);
+
+    return pclose(fp);
+}
+
+static const char* people_table = R"(
+%upgrade 1 {
+    CREATE TABLE people (
+        id INTEGER PRIMARY KEY,
+        name TEXT NOT NULL,
+        age INTEGER NOT NULL
+    );
+}
+%downgrade 0 {
+    DROP TABLE people;
+}
+)";
+
+TEST_F(NAME, indexed_queries_are_generated)
+{
+    int id = dbi->person.add(db, "Alice", 20);
+    ASSERT_THAT(id, Gt(0));
+    EXPECT_THAT(dbi->person.add(db, "Alice", 20), Eq(id));
+    EXPECT_THAT(dbi->person.age(db, "Alice"), Eq(20));
+    EXPECT_THAT(dbi->person.by_age(db, 20), Eq(id));
+}
+
+TEST_F(NAME, full_scan_fails_require_index)
+{
+    std::string input = std::string("%option prefix=\"analyze_full_scan\"\n") + people_table + R"(
+%query person,age(const char* name) {
+    type select-first
+    table people
+    return age
+    require-index
+}
+)";
+    std::string output;
+    EXPECT_THAT(run_analyze("analyze_full_scan", input.c_str(), &output), Ne(0));
+    EXPECT_THAT(output, HasSubstr("\"person.age\" is marked \"require-index\""));
+    EXPECT_THAT(output, HasSubstr("CREATE INDEX people_name ON people(name);"));
+}
+
+TEST_F(NAME, lookup_full_scan_fails_require_index)
+{
+    std::string input = std::string("%option prefix=\"analyze_lookup_scan\"\n") + people_table + R"(
+%query person,add(const char* name, int age) {
+    type insert-or-get
+    table people
+    return id
+    read-first name
+    require-index
+}
+)";
+    std::string output;
+    EXPECT_THAT(run_analyze("analyze_lookup_scan", input.c_str(), &output), Ne(0));
+    EXPECT_THAT(output, HasSubstr("\"person.add_lookup\" is marked \"require-index\""));
+}
@@ -0,0 +1,178 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/async.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+#define NAME sqlgen_async
+
+using namespace testing;
+
+struct completions
+{
+    void wait(int count) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return (int)results.size() >= count; });
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<int> results;
+    std::vector<std::thread::id> threads;
+};
+
+static void on_done(int result, void* user) {
+    completions* c = static_cast<completions*>(user);
+    std::lock_guard<std::mutex> lock(c->mutex);
+    c->results.push_back(result);
+    c->threads.push_back(std::this_thread::get_id());
+    c->cv.notify_all();
+}
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        async_init();
+        dbi = async("sqlite3");
+        struct async* db = dbi->open("async.db");
+        dbi->reinit(db);
+        dbi->close(db);
+    }
+
+    void TearDown() override {
+        async_deinit();
+    }
+
+    struct async_interface* dbi;
+};
+
+TEST_F(NAME, open_rejects_negative_readers)
+{
+    ASSERT_THAT(dbi->executor_open("async.db", -1, -1), IsNull());
+}
+TEST_F(NAME, inserts_complete_on_worker_thread)
+{
+    completions c;
+    int64_t ids[3] = {-1, -1, -1};
+    struct async_executor* exec = dbi->executor_open("async.db", 2, -1);
+    ASSERT_THAT(exec, NotNull());
+
+    ASSERT_THAT(dbi->person.add_async(exec, "name1", 20, &ids[0], on_done, &c), Eq(0));
+    ASSERT_THAT(dbi->person.add_async(exec, "name2", 30, &ids[1], on_done, &c), Eq(0));
+    ASSERT_THAT(dbi->person.add_async(exec, "name1", 20, &ids[2], on_done, &c), Eq(0));
+    c.wait(3);
+    dbi->executor_close(exec);
+
+    EXPECT_THAT(c.results, ElementsAre(0, 0, 0));
+    EXPECT_THAT(c.threads[0], Ne(std::this_thread::get_id()));
+    /* Writes are executed in order on a single thread */
+    EXPECT_THAT(c.threads[1], Eq(c.threads[0]));
+    EXPECT_THAT(ids[0], Eq(1));
+    EXPECT_THAT(ids[1], Eq(2));
+    EXPECT_THAT(ids[2], Eq(1));
+}
+TEST_F(NAME, arguments_are_copied)
+{
+    completions c;
+    int64_t id = -1;
+    struct async_executor* exec = dbi->executor_open("async.db", 0, -1);
+    ASSERT_THAT(exec, NotNull());
+
+    {
+        std::string name = "temporary";
+        ASSERT_THAT(dbi->person.add_async(exec, name.c_str(), 20, &id, on_done, &c), Eq(0));
+        name.assign("overwritten");
+    }
+    dbi->executor_close(exec);
+
+    struct async* db = dbi->open("async.db");
+    int64_t found = -1;
+    EXPECT_THAT(dbi->person.add(db, "temporary", 20, &found), Eq(0));
+    EXPECT_THAT(found, Eq(id));
+    EXPECT_THAT(dbi->person.count(db), Eq(1));
+    dbi->close(db);
+}
+TEST_F(NAME, close_drains_submitted_queries)
+{
+    completions c;
+    std::vector<int64_t> ids(200, -1);
+    struct async_executor* exec = dbi->executor_open("async.db", 1, -1);
+    ASSERT_THAT(exec, NotNull());
+
+    for (int i = 0; i != 200; ++i)
+        ASSERT_THAT(dbi->person.add_async(exec, ("name" + std::to_string(i)).c_str(), i, &ids[i], on_done, &c), Eq(0));
+    dbi->executor_close(exec);
+
+    ASSERT_THAT(c.results.size(), Eq(200u));
+    for (int i = 0; i != 200; ++i)
+        EXPECT_THAT(ids[i], Eq(i + 1));
+}
+TEST_F(NAME, reads_run_on_reader_threads)
+{
+    static std::mutex names_mutex;
+    static std::vector<std::string> names;
+    completions c;
+    int64_t id;
+    struct async_executor* exec = dbi->executor_open("async.db", 2, -1);
+    ASSERT_THAT(exec, NotNull());
+
+    dbi->person.add_async(exec, "young", 10, &id, on_done, &c);
+    dbi->person.add_async(exec, "old", 80, &id, on_done, &c);
+    c.wait(2);
+
+    names.clear();
+    ASSERT_THAT(dbi->person.older_than_async(exec, 50,
+        [](const char* name, void*) {
+            std::lock_guard<std::mutex> lock(names_mutex);
+            names.push_back(name);
+            return 0;
+        }, on_done, &c), Eq(0));
+    ASSERT_THAT(dbi->person.count_async(exec, on_done, &c), Eq(0));
+    c.wait(4);
+    dbi->executor_close(exec);
+
+    EXPECT_THAT(names, ElementsAre("old"));
+    EXPECT_THAT(c.results[2] == 2 || c.results[3] == 2, IsTrue());
+    EXPECT_THAT(c.threads[2], Ne(c.threads[0]));
+    EXPECT_THAT(c.threads[3], Ne(c.threads[0]));
+}
+#if defined(__linux__)
+TEST_F(NAME, eventfd_signals_completions_for_poll)
+{
+    completions c;
+    int64_t id = -1;
+    int efd = eventfd(0, EFD_CLOEXEC);
+    ASSERT_THAT(efd, Ge(0));
+    struct async_executor* exec = dbi->executor_open("async.db", 1, efd);
+    ASSERT_THAT(exec, NotNull());
+
+    ASSERT_THAT(dbi->person.add_async(exec, "name1", 20, &id, on_done, &c), Eq(0));
+    ASSERT_THAT(dbi->person.count_async(exec, on_done, &c), Eq(0));
+
+    int delivered = 0;
+    while (delivered < 2)
+    {
+        struct pollfd pfd = {efd, POLLIN, 0};
+        ASSERT_THAT(poll(&pfd, 1, 5000), Eq(1));
+        uint64_t value;
+        ASSERT_THAT(read(efd, &value, sizeof value), Eq((ssize_t)sizeof value));
+        delivered += dbi->executor_poll(exec);
+    }
+    dbi->executor_close(exec);
+    close(efd);
+
+    EXPECT_THAT(delivered, Eq(2));
+    EXPECT_THAT(c.threads[0], Eq(std::this_thread::get_id()));
+    EXPECT_THAT(c.threads[1], Eq(std::this_thread::get_id()));
+    EXPECT_THAT(id, Eq(1));
+}
+#endif
@@ -0,0 +1,112 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/batch.h"
+
+#define NAME sqlgen_batch
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        batch_init();
+        dbi = batch("sqlite3");
+        db = dbi->open("batch.db");
+        dbi->reinit(db);
+    }
+
+    void TearDown() override {
+        dbi->close(db);
+        batch_deinit();
+    }
+
+    struct batch_interface* dbi;
+    struct batch* db;
+};
+
+static int on_count(int count, void* user) {
+    *(int*)user = count;
+    return 0;
+}
+static int on_person(int id, int age, void* user) {
+    *(int*)user += age;
+    return 0;
+}
+
+TEST_F(NAME, batch_insert_or_get_returns_ids)
+{
+    struct batch_insert_or_get_id_args rows[] = {
+        { "name1", 1 },
+        { "name3", 2 },
+        { "name4", 3 }
+    };
+    int results[3];
+    int count;
+    ASSERT_THAT(dbi->insert_or_get_id_batch(db, rows, 3, results), Eq(0));
+    ASSERT_THAT(results, ElementsAre(1, 3, 4));
+    ASSERT_THAT(dbi->person.count(db, on_count, &count), Eq(0));
+    ASSERT_THAT(count, Eq(4));
+}
+TEST_F(NAME, batch_results_may_be_null)
+{
+    struct batch_insert_or_get_id_args rows[] = {
+        { "name3", 1 },
+        { "name4", 2 }
+    };
+    int count;
+    ASSERT_THAT(dbi->insert_or_get_id_batch(db, rows, 2, NULL), Eq(0));
+    ASSERT_THAT(dbi->person.count(db, on_count, &count), Eq(0));
+    ASSERT_THAT(count, Eq(4));
+}
+TEST_F(NAME, batch_reports_failed_rows)
+{
+    struct batch_person_insert_new_args rows[] = {
+        { "name3", 1 },
+        { "name1", 2 },
+        { "name4", 3 }
+    };
+    int results[3];
+    int count;
+    ASSERT_THAT(dbi->person.insert_new_batch(db, rows, 3, results), Eq(0));
+    ASSERT_THAT(results[0], Eq(3));
+    ASSERT_THAT(results[1], Lt(0));
+    ASSERT_THAT(results[2], Eq(4));
+    ASSERT_THAT(dbi->person.count(db, on_count, &count), Eq(0));
+    ASSERT_THAT(count, Eq(4));
+}
+TEST_F(NAME, batch_with_callback)
+{
+    struct batch_person_upsert_cb_args rows[] = {
+        { "name1", 10 },
+        { "name3", 20 }
+    };
+    int results[2];
+    int age_sum = 0;
+    ASSERT_THAT(dbi->person.upsert_cb_batch(db, rows, 2, results, on_person, &age_sum), Eq(0));
+    ASSERT_THAT(results, ElementsAre(0, 0));
+    ASSERT_THAT(age_sum, Eq(30));
+}
+TEST_F(NAME, batch_inside_of_transaction)
+{
+    struct batch_insert_or_get_id_args rows[] = {
+        { "name3", 1 },
+        { "name4", 2 }
+    };
+    int count;
+    ASSERT_THAT(dbi->begin(db), Eq(0));
+    ASSERT_THAT(dbi->insert_or_get_id_batch(db, rows, 2, NULL), Eq(0));
+    ASSERT_THAT(dbi->rollback(db), Eq(0));
+    ASSERT_THAT(dbi->person.count(db, on_count, &count), Eq(0));
+    ASSERT_THAT(count, Eq(2));
+}
+TEST_F(NAME, batch_rejects_negative_count)
+{
+    struct batch_insert_or_get_id_args rows[] = {
+        { "name3", 1 }
+    };
+    int results[1] = { 42 };
+    int count;
+    ASSERT_THAT(dbi->insert_or_get_id_batch(db, rows, -1, results), Eq(-1));
+    ASSERT_THAT(results[0], Eq(42));
+    ASSERT_THAT(dbi->person.count(db, on_count, &count), Eq(0));
+    ASSERT_THAT(count, Eq(2));
+}
@@ -0,0 +1,170 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/bulk.h"
+
+#include <string>
+#include <vector>
+
+#define NAME sqlgen_bulk
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        bulk_init();
+        dbi = bulk("sqlite3");
+        db = dbi->open("bulk.db");
+        dbi->reinit(db);
+    }
+
+    void TearDown() override {
+        dbi->close(db);
+        bulk_deinit();
+    }
+
+    struct bulk_interface* dbi;
+    struct bulk* db;
+};
+
+struct stats
+{
+    int count;
+    int age_sum;
+};
+
+static int on_stats(int count, int age_sum, void* user) {
+    struct stats* s = (struct stats*)user;
+    s->count = count;
+    s->age_sum = age_sum;
+    return 0;
+}
+static int on_count(int count, void* user) {
+    *(int*)user = count;
+    return 0;
+}
+
+/* Enough rows to span several full chunks plus a partial tail */
+static std::vector<std::string> make_names(int count, const char* prefix) {
+    std::vector<std::string> names;
+    for (int i = 0; i != count; ++i)
+        names.push_back(prefix + std::to_string(i));
+    return names;
+}
+
+TEST_F(NAME, bulk_insert_new_spans_chunks_and_tail)
+{
+    std::vector<std::string> names = make_names(1000, "person");
+    std::vector<struct bulk_person_insert_new_args> rows;
+    for (const std::string& name : names)
+        rows.push_back({ name.c_str(), 1 });
+
+    struct stats s;
+    ASSERT_THAT(dbi->person.insert_new_bulk(db, rows.data(), (int)rows.size()), Eq(0));
+    ASSERT_THAT(dbi->person.stats(db, on_stats, &s), Eq(0));
+    ASSERT_THAT(s.count, Eq(1002));
+    ASSERT_THAT(s.age_sum, Eq(69 + 42 + 1000));
+}
+TEST_F(NAME, bulk_insert_new_with_zero_rows)
+{
+    struct stats s;
+    ASSERT_THAT(dbi->person.insert_new_bulk(db, NULL, 0), Eq(0));
+    ASSERT_THAT(dbi->person.stats(db, on_stats, &s), Eq(0));
+    ASSERT_THAT(s.count, Eq(2));
+}
+TEST_F(NAME, bulk_insert_new_is_all_or_nothing)
+{
+    std::vector<std::string> names = make_names(500, "person");
+    std::vector<struct bulk_person_insert_new_args> rows;
+    for (const std::string& name : names)
+        rows.push_back({ name.c_str(), 1 });
+    rows.push_back({ "name1", 1 });  /* Violates UNIQUE(name) */
+
+    struct stats s;
+    ASSERT_THAT(dbi->person.insert_new_bulk(db, rows.data(), (int)rows.size()), Eq(-1));
+    ASSERT_THAT(dbi->person.stats(db, on_stats, &s), Eq(0));
+    ASSERT_THAT(s.count, Eq(2));
+    ASSERT_THAT(s.age_sum, Eq(69 + 42));
+}
+TEST_F(NAME, bulk_insert_or_get_ignores_existing_rows)
+{
+    std::vector<std::string> names = make_names(200, "person");
+    std::vector<struct bulk_insert_or_get_person_args> rows;
+    rows.push_back({ "name1", 1 });
+    for (const std::string& name : names)
+        rows.push_back({ name.c_str(), 1 });
+    rows.push_back({ "name2", 1 });
+
+    struct stats s;
+    ASSERT_THAT(dbi->insert_or_get_person_bulk(db, rows.data(), (int)rows.size()), Eq(0));
+    ASSERT_THAT(dbi->person.stats(db, on_stats, &s), Eq(0));
+    ASSERT_THAT(s.count, Eq(202));
+    ASSERT_THAT(s.age_sum, Eq(69 + 42 + 200));
+
+    /* The single-row query is unaffected */
+    ASSERT_THAT(dbi->insert_or_get_person(db, "name1", 5), Eq(1));
+}
+TEST_F(NAME, bulk_upsert_updates_existing_rows)
+{
+    std::vector<std::string> names = make_names(100, "person");
+    std::vector<struct bulk_person_upsert_args> rows;
+    rows.push_back({ "name1", 1 });
+    for (const std::string& name : names)
+        rows.push_back({ name.c_str(), 2 });
+    rows.push_back({ "name2", 3 });
+
+    struct stats s;
+    ASSERT_THAT(dbi->person.upsert_bulk(db, rows.data(), (int)rows.size()), Eq(0));
+    ASSERT_THAT(dbi->person.stats(db, on_stats, &s), Eq(0));
+    ASSERT_THAT(s.count, Eq(102));
+    ASSERT_THAT(s.age_sum, Eq(1 + 200 + 3));
+}
+TEST_F(NAME, bulk_binds_null)
+{
+    struct bulk_insert_note_args rows[300];
+    for (int i = 0; i != 300; ++i)
+        rows[i].body = i % 3 == 0 ? NULL : "note";
+
+    int count;
+    ASSERT_THAT(dbi->insert_note_bulk(db, rows, 300), Eq(0));
+    ASSERT_THAT(dbi->count_null_notes(db, on_count, &count), Eq(0));
+    ASSERT_THAT(count, Eq(100));
+}
+TEST_F(NAME, bulk_inside_transaction)
+{
+    struct bulk_person_insert_new_args rows[] = {
+        { "name3", 1 },
+        { "name4", 2 }
+    };
+
+    struct stats s;
+    ASSERT_THAT(dbi->begin(db), Eq(0));
+    ASSERT_THAT(dbi->person.insert_new_bulk(db, rows, 2), Eq(0));
+    ASSERT_THAT(dbi->rollback(db), Eq(0));
+    ASSERT_THAT(dbi->person.stats(db, on_stats, &s), Eq(0));
+    ASSERT_THAT(s.count, Eq(2));
+}
+TEST_F(NAME, bulk_insert_or_get_fails_on_constraint_violation)
+{
+    std::vector<std::string> names = make_names(100, "person");
+    std::vector<struct bulk_insert_or_get_person_args> rows;
+    rows.push_back({ "name1", 1 });
+    for (const std::string& name : names)
+        rows.push_back({ name.c_str(), 1 });
+    rows.push_back({ NULL, 1 });  /* Violates NOT NULL */
+
+    struct stats s;
+    ASSERT_THAT(dbi->insert_or_get_person_bulk(db, rows.data(), (int)rows.size()), Eq(-1));
+    ASSERT_THAT(dbi->person.stats(db, on_stats, &s), Eq(0));
+    ASSERT_THAT(s.count, Eq(2));
+}
+TEST_F(NAME, bulk_rejects_negative_count)
+{
+    struct bulk_person_insert_new_args rows[] = {
+        { "name3", 1 }
+    };
+
+    struct stats s;
+    ASSERT_THAT(dbi->person.insert_new_bulk(db, rows, -1), Eq(-1));
+    ASSERT_THAT(dbi->person.stats(db, on_stats, &s), Eq(0));
+    ASSERT_THAT(s.count, Eq(2));
+}
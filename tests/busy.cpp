@@ -0,0 +1,64 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/busy.h"
+
+#define NAME sqlgen_busy
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        busy_init();
+        dbi = busy("sqlite3");
+        db = dbi->open("busy.db");
+        dbi->reinit(db);
+        other = dbi->open("busy.db");
+    }
+
+    void TearDown() override {
+        dbi->close(other);
+        dbi->close(db);
+        busy_deinit();
+    }
+
+    struct busy_interface* dbi;
+    struct busy* db;
+    struct busy* other;
+};
+
+TEST_F(NAME, no_retries_without_contention)
+{
+    int retries = -1, wait_ms = -1;
+    ASSERT_THAT(dbi->add_person(db, "name1"), Eq(1));
+    dbi->busy_stats(db, &retries, &wait_ms);
+    ASSERT_THAT(retries, Eq(0));
+    ASSERT_THAT(wait_ms, Eq(0));
+}
+TEST_F(NAME, gives_up_after_timeout)
+{
+    int retries, wait_ms;
+    ASSERT_THAT(dbi->begin_immediate(other), Eq(0));
+    ASSERT_THAT(dbi->add_person(db, "name1"), Eq(-1));
+    dbi->busy_stats(db, &retries, &wait_ms);
+    ASSERT_THAT(retries, Gt(0));
+    ASSERT_THAT(wait_ms, Eq(50));
+    ASSERT_THAT(dbi->rollback(other), Eq(0));
+}
+TEST_F(NAME, succeeds_once_lock_is_released)
+{
+    ASSERT_THAT(dbi->begin_immediate(other), Eq(0));
+    ASSERT_THAT(dbi->add_person(db, "name1"), Eq(-1));
+    ASSERT_THAT(dbi->commit(other), Eq(0));
+    ASSERT_THAT(dbi->add_person(db, "name1"), Eq(1));
+}
+TEST_F(NAME, stats_accumulate_and_accept_null)
+{
+    int wait_ms;
+    ASSERT_THAT(dbi->begin_immediate(other), Eq(0));
+    ASSERT_THAT(dbi->add_person(db, "name1"), Eq(-1));
+    ASSERT_THAT(dbi->begin_immediate(db), Eq(-1));
+    dbi->busy_stats(db, NULL, &wait_ms);
+    ASSERT_THAT(wait_ms, Eq(100));
+    dbi->busy_stats(db, NULL, NULL);
+    ASSERT_THAT(dbi->rollback(other), Eq(0));
+}
@@ -0,0 +1,61 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/busy_backoff.h"
+#include "sqlite3.h"
+
+#define NAME sqlgen_busy_backoff
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        busy_backoff_init();
+        dbi = busy_backoff("sqlite3");
+        db = dbi->open("busy_backoff.db");
+        dbi->reinit(db);
+        other = dbi->open("busy_backoff.db");
+    }
+
+    void TearDown() override {
+        dbi->close(other);
+        dbi->close(db);
+        busy_backoff_deinit();
+    }
+
+    struct busy_backoff_interface* dbi;
+    struct busy_backoff* db;
+    struct busy_backoff* other;
+};
+
+TEST_F(NAME, no_retries_without_contention)
+{
+    int retries = -1, wait_ms = -1;
+    ASSERT_THAT(dbi->add_person(db, "name1"), Eq(1));
+    dbi->busy_stats(db, &retries, &wait_ms);
+    ASSERT_THAT(retries, Eq(0));
+    ASSERT_THAT(wait_ms, Eq(0));
+}
+TEST_F(NAME, doubles_delay_until_maximum)
+{
+    int retries, wait_ms;
+    ASSERT_THAT(dbi->begin_immediate(other), Eq(0));
+    ASSERT_THAT(dbi->add_person(db, "name1"), Eq(-1));
+    ASSERT_THAT(dbi->errcode(db), Eq(SQLITE_BUSY));
+    dbi->busy_stats(db, &retries, &wait_ms);
+    /* 5 + 10 + 20 + 40 */
+    ASSERT_THAT(retries, Eq(4));
+    ASSERT_THAT(wait_ms, Eq(75));
+    ASSERT_THAT(dbi->rollback(other), Eq(0));
+}
+TEST_F(NAME, starts_over_with_minimum_delay)
+{
+    int retries, wait_ms;
+    ASSERT_THAT(dbi->begin_immediate(other), Eq(0));
+    ASSERT_THAT(dbi->add_person(db, "name1"), Eq(-1));
+    ASSERT_THAT(dbi->add_person(db, "name1"), Eq(-1));
+    dbi->busy_stats(db, &retries, &wait_ms);
+    ASSERT_THAT(retries, Eq(8));
+    ASSERT_THAT(wait_ms, Eq(150));
+    ASSERT_THAT(dbi->rollback(other), Eq(0));
+    ASSERT_THAT(dbi->add_person(db, "name1"), Eq(1));
+}
@@ -0,0 +1,49 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/busy_fail.h"
+#include "sqlite3.h"
+
+#define NAME sqlgen_busy_fail
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        busy_fail_init();
+        dbi = busy_fail("sqlite3");
+        db = dbi->open("busy_fail.db");
+        dbi->reinit(db);
+        other = dbi->open("busy_fail.db");
+    }
+
+    void TearDown() override {
+        dbi->close(other);
+        dbi->close(db);
+        busy_fail_deinit();
+    }
+
+    struct busy_fail_interface* dbi;
+    struct busy_fail* db;
+    struct busy_fail* other;
+};
+
+TEST_F(NAME, fails_right_away)
+{
+    int retries = -1, wait_ms = -1;
+    ASSERT_THAT(dbi->begin_immediate(other), Eq(0));
+    ASSERT_THAT(dbi->add_person(db, "name1"), Eq(-1));
+    ASSERT_THAT(dbi->errcode(db), Eq(SQLITE_BUSY));
+    ASSERT_THAT(dbi->begin_immediate(db), Eq(-1));
+    ASSERT_THAT(dbi->errcode(db), Eq(SQLITE_BUSY));
+    dbi->busy_stats(db, &retries, &wait_ms);
+    ASSERT_THAT(retries, Eq(0));
+    ASSERT_THAT(wait_ms, Eq(0));
+    ASSERT_THAT(dbi->rollback(other), Eq(0));
+}
+TEST_F(NAME, succeeds_once_lock_is_released)
+{
+    ASSERT_THAT(dbi->begin_immediate(other), Eq(0));
+    ASSERT_THAT(dbi->add_person(db, "name1"), Eq(-1));
+    ASSERT_THAT(dbi->commit(other), Eq(0));
+    ASSERT_THAT(dbi->add_person(db, "name1"), Eq(1));
+}
@@ -0,0 +1,185 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/cache.h"
+
+#include <string>
+
+#define NAME sqlgen_cache
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        int64_t id;
+        cache_init();
+        dbi = cache("sqlite3");
+        db = dbi->open("cache.db");
+        other = dbi->open("cache.db");
+        dbi->reinit(db);
+        dbi->person.add(db, "name1", 20, &id);
+        dbi->person.add(db, "name2", 30, &id);
+    }
+
+    void TearDown() override {
+        dbi->close(other);
+        dbi->close(db);
+        cache_deinit();
+    }
+
+    struct cache_interface* dbi;
+    struct cache* db;
+    struct cache* other;
+};
+
+struct person_row
+{
+    std::string name;
+    std::string nickname;
+    int calls = 0;
+};
+
+static int on_person(const char* name, const char* nickname, void* user)
+{
+    struct person_row* r = static_cast<struct person_row*>(user);
+    r->name = name;
+    r->nickname = nickname ? nickname : "(null)";
+    r->calls++;
+    return 0;
+}
+
+TEST_F(NAME, hit_returns_same_result)
+{
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(20));
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(20));
+    EXPECT_THAT(dbi->person.age(db, "name2"), Eq(30));
+    EXPECT_THAT(dbi->person.has(db, "name1"), Eq(1));
+    EXPECT_THAT(dbi->person.has(db, "name1"), Eq(1));
+}
+TEST_F(NAME, writes_from_other_connections_need_cache_clear)
+{
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(20));
+    ASSERT_THAT(dbi->person.set_age(other, "name1", 40), Eq(0));
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(20));
+    dbi->cache_clear(db);
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(40));
+}
+TEST_F(NAME, misses_are_cached)
+{
+    int64_t id;
+    EXPECT_THAT(dbi->person.has(db, "name3"), Eq(0));
+    EXPECT_THAT(dbi->person.age(db, "name3"), Eq(-1));
+    ASSERT_THAT(dbi->person.add(other, "name3", 50, &id), Eq(0));
+    EXPECT_THAT(dbi->person.has(db, "name3"), Eq(0));
+    EXPECT_THAT(dbi->person.age(db, "name3"), Eq(-1));
+    dbi->cache_clear(db);
+    EXPECT_THAT(dbi->person.has(db, "name3"), Eq(1));
+    EXPECT_THAT(dbi->person.age(db, "name3"), Eq(50));
+}
+TEST_F(NAME, generated_writes_invalidate)
+{
+    int64_t id;
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(20));
+    ASSERT_THAT(dbi->person.set_age(db, "name1", 40), Eq(0));
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(40));
+
+    EXPECT_THAT(dbi->person.has(db, "name1"), Eq(1));
+    ASSERT_THAT(dbi->person.remove(db, "name1"), Eq(0));
+    EXPECT_THAT(dbi->person.has(db, "name1"), Eq(0));
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(-1));
+
+    ASSERT_THAT(dbi->person.add(db, "name1", 60, &id), Eq(0));
+    EXPECT_THAT(dbi->person.has(db, "name1"), Eq(1));
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(60));
+}
+TEST_F(NAME, other_writes_on_same_connection_invalidate)
+{
+    int64_t age = -1;
+    struct person_row r;
+    ASSERT_THAT(dbi->person.by_id(db, 1, &age, on_person, &r), Eq(0));
+    EXPECT_THAT(r.nickname, StrEq("(null)"));
+
+    /* Not a generated query, so this is caught by the update hook */
+    ASSERT_THAT(dbi->nickname_all(db), Eq(0));
+    ASSERT_THAT(dbi->person.by_id(db, 1, &age, on_person, &r), Eq(0));
+    EXPECT_THAT(r.nickname, StrEq("nick"));
+}
+TEST_F(NAME, callback_is_replayed_from_cache)
+{
+    int64_t age = -1;
+    struct person_row r;
+    ASSERT_THAT(dbi->person.by_id(db, 2, &age, on_person, &r), Eq(0));
+    age = -1;
+    ASSERT_THAT(dbi->person.by_id(db, 2, &age, on_person, &r), Eq(0));
+    EXPECT_THAT(age, Eq(30));
+    EXPECT_THAT(r.name, StrEq("name2"));
+    EXPECT_THAT(r.calls, Eq(2));
+
+    r.calls = 0;
+    EXPECT_THAT(dbi->person.by_id(db, 3, &age, on_person, &r), Eq(-1));
+    EXPECT_THAT(dbi->person.by_id(db, 3, &age, on_person, &r), Eq(-1));
+    EXPECT_THAT(r.calls, Eq(0));
+}
+TEST_F(NAME, evicted_entries_are_reloaded)
+{
+    int64_t age = -1;
+    struct person_row r;
+
+    /* by_id only has a single entry */
+    ASSERT_THAT(dbi->person.by_id(db, 1, &age, on_person, &r), Eq(0));
+    EXPECT_THAT(r.name, StrEq("name1"));
+    ASSERT_THAT(dbi->person.by_id(db, 2, &age, on_person, &r), Eq(0));
+    EXPECT_THAT(r.name, StrEq("name2"));
+    ASSERT_THAT(dbi->person.by_id(db, 1, &age, on_person, &r), Eq(0));
+    EXPECT_THAT(r.name, StrEq("name1"));
+    EXPECT_THAT(age, Eq(20));
+}
+TEST_F(NAME, rollback_invalidates)
+{
+    ASSERT_THAT(dbi->begin(db), Eq(0));
+    ASSERT_THAT(dbi->person.set_age(db, "name1", 40), Eq(0));
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(40));
+    ASSERT_THAT(dbi->rollback(db), Eq(0));
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(20));
+}
+TEST_F(NAME, rollback_to_savepoint_invalidates)
+{
+    ASSERT_THAT(dbi->savepoint(db), Eq(0));
+    ASSERT_THAT(dbi->person.set_age(db, "name1", 40), Eq(0));
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(40));
+    ASSERT_THAT(dbi->rollback_to(db), Eq(0));
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(20));
+}
+TEST_F(NAME, migration_invalidates)
+{
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(20));
+    ASSERT_THAT(dbi->reinit(db), Eq(0));
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(-1));
+}
+TEST_F(NAME, truncating_stmt_query_invalidates)
+{
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(20));
+    EXPECT_THAT(dbi->person.has(db, "name2"), Eq(1));
+
+    /* A DELETE without WHERE truncates the table, which the update hook misses */
+    ASSERT_THAT(dbi->person.remove_all(db), Eq(0));
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(-1));
+    EXPECT_THAT(dbi->person.has(db, "name2"), Eq(0));
+}
+TEST_F(NAME, truncating_function_invalidates)
+{
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(20));
+    EXPECT_THAT(dbi->person.has(db, "name2"), Eq(1));
+
+    ASSERT_THAT(dbi->remove_all_people(db), Eq(0));
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(-1));
+    EXPECT_THAT(dbi->person.has(db, "name2"), Eq(0));
+}
+TEST_F(NAME, without_rowid_write_in_function_invalidates)
+{
+    EXPECT_THAT(dbi->tag.uses(db, "tag1"), Eq(1));
+    EXPECT_THAT(dbi->tag.uses(db, "tag1"), Eq(1));
+
+    /* The update hook isn't called for WITHOUT ROWID tables */
+    ASSERT_THAT(dbi->use_all_tags(db), Eq(0));
+    EXPECT_THAT(dbi->tag.uses(db, "tag1"), Eq(2));
+}
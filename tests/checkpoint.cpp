@@ -0,0 +1,119 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/checkpoint.h"
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+
+#define NAME sqlgen_checkpoint
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        checkpoint_init();
+        dbi = checkpoint("sqlite3");
+        struct checkpoint* db = dbi->open("checkpoint.db");
+        dbi->reinit(db);
+        dbi->close(db);
+
+        dbpool = dbi->pool_open("checkpoint.db", 2);
+        ASSERT_THAT(dbpool, NotNull());
+    }
+
+    void TearDown() override {
+        dbi->pool_close(dbpool);
+        checkpoint_deinit();
+    }
+
+    /* Every row is larger than a page, so every commit adds a few frames */
+    void add_people(struct checkpoint* db, int first, int count) {
+        std::string bio(5000, 'x');
+        for (int i = first; i != first + count; ++i)
+            ASSERT_THAT(dbi->person.add(db, ("name" + std::to_string(i)).c_str(), bio.c_str()), Eq(0));
+    }
+
+    struct checkpoint_wal_stats wait_for(std::function<bool(const struct checkpoint_wal_stats&)> done) {
+        struct checkpoint_wal_stats stats;
+        for (int i = 0; i != 500; ++i)
+        {
+            dbi->pool_wal_stats(dbpool, &stats);
+            if (done(stats))
+                break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return stats;
+    }
+
+    struct checkpoint_interface* dbi;
+    struct checkpoint_pool* dbpool;
+};
+
+TEST_F(NAME, stats_start_at_zero)
+{
+    struct checkpoint_wal_stats stats;
+    dbi->pool_wal_stats(dbpool, &stats);
+    EXPECT_THAT(stats.checkpoints, Eq(0));
+    EXPECT_THAT(stats.errors, Eq(0));
+    EXPECT_THAT(stats.total_us, Eq(0));
+}
+TEST_F(NAME, large_wal_is_checkpointed_and_restarted)
+{
+    struct checkpoint* db = dbi->pool_acquire(dbpool);
+    add_people(db, 0, 20);
+    dbi->pool_release(dbpool, db);
+
+    struct checkpoint_wal_stats stats = wait_for([](const struct checkpoint_wal_stats& s) {
+        return s.restarts + s.truncates > 0 && s.wal_frames == 0;
+    });
+    EXPECT_THAT(stats.restarts + stats.truncates, Gt(0));
+    EXPECT_THAT(stats.wal_frames, Eq(0));
+    EXPECT_THAT(stats.errors, Eq(0));
+    EXPECT_THAT(stats.max_us, Ge(stats.last_us));
+    EXPECT_THAT(stats.total_us, Ge(stats.max_us));
+
+    db = dbi->pool_acquire(dbpool);
+    EXPECT_THAT(dbi->person.count(db), Eq(20));
+    dbi->pool_release(dbpool, db);
+}
+TEST_F(NAME, small_wal_is_checkpointed_after_timeout)
+{
+    struct checkpoint* db = dbi->pool_acquire(dbpool);
+    add_people(db, 0, 1);
+    dbi->pool_release(dbpool, db);
+
+    struct checkpoint_wal_stats stats = wait_for([](const struct checkpoint_wal_stats& s) {
+        return s.checkpoints > 0;
+    });
+    EXPECT_THAT(stats.checkpoints, Gt(0));
+}
+TEST_F(NAME, open_reader_prevents_restart)
+{
+    struct checkpoint* writer = dbi->pool_acquire(dbpool);
+    struct checkpoint* reader = dbi->pool_acquire(dbpool);
+    add_people(writer, 0, 1);
+
+    /* The reader's snapshot keeps the WAL from being reset */
+    ASSERT_THAT(dbi->begin(reader), Eq(0));
+    EXPECT_THAT(dbi->person.count(reader), Eq(1));
+    add_people(writer, 1, 20);
+
+    struct checkpoint_wal_stats stats = wait_for([](const struct checkpoint_wal_stats& s) {
+        return s.busy > 0;
+    });
+    EXPECT_THAT(stats.busy, Gt(0));
+    EXPECT_THAT(stats.wal_frames, Gt(0));
+    int restarts = stats.restarts + stats.truncates;
+
+    ASSERT_THAT(dbi->commit(reader), Eq(0));
+    add_people(writer, 21, 20);
+    stats = wait_for([restarts](const struct checkpoint_wal_stats& s) {
+        return s.restarts + s.truncates > restarts;
+    });
+    EXPECT_THAT(stats.restarts + stats.truncates, Gt(restarts));
+
+    dbi->pool_release(dbpool, reader);
+    dbi->pool_release(dbpool, writer);
+}
@@ -0,0 +1,164 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/columns.h"
+#include <string>
+
+#define NAME sqlgen_columns
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        columns_init();
+        dbi = columns("sqlite3");
+        db = dbi->open("columns.db");
+        dbi->reinit(db);
+
+        memset(&cols, 0, sizeof cols);
+        cols.id = id;
+        cols.name_offsets = name_offsets;
+        cols.name_data = name_data;
+        cols.name_capacity = sizeof(name_data);
+        cols.age = age;
+        cols.age_validity = age_validity;
+        cols.nickname_offsets = nickname_offsets;
+        cols.nickname_data = nickname_data;
+        cols.nickname_capacity = sizeof(nickname_data);
+        cols.nickname_validity = nickname_validity;
+        cols.avatar_offsets = avatar_offsets;
+        cols.avatar_data = avatar_data;
+        cols.avatar_capacity = sizeof(avatar_data);
+    }
+
+    void TearDown() override {
+        dbi->close(db);
+        columns_deinit();
+    }
+
+    std::string name_at(int row) {
+        return std::string(name_data + name_offsets[row], name_offsets[row + 1] - name_offsets[row]);
+    }
+
+    struct columns_interface* dbi;
+    struct columns* db;
+
+    struct columns_person_all_columns cols;
+    int64_t id[4];
+    int32_t name_offsets[5];
+    char name_data[64];
+    int64_t age[4];
+    uint8_t age_validity[1];
+    int32_t nickname_offsets[5];
+    char nickname_data[64];
+    uint8_t nickname_validity[1];
+    int32_t avatar_offsets[5];
+    char avatar_data[64];
+};
+
+TEST_F(NAME, fetches_all_rows)
+{
+    ASSERT_THAT(dbi->person.all_fetch_columns(db, 0, &cols, 4), Eq(3));
+    EXPECT_THAT(cols.length, Eq(3));
+    EXPECT_THAT(cols.truncated, Eq(0));
+    EXPECT_THAT(id[0], Eq(1));
+    EXPECT_THAT(id[2], Eq(3));
+    EXPECT_THAT(name_at(0), StrEq("name1"));
+    EXPECT_THAT(name_at(2), StrEq("name3"));
+    EXPECT_THAT(avatar_offsets[1] - avatar_offsets[0], Eq(2));
+    EXPECT_THAT(avatar_offsets[2] - avatar_offsets[1], Eq(3));
+    EXPECT_THAT(avatar_offsets[3] - avatar_offsets[2], Eq(0));
+    EXPECT_THAT(avatar_data[2], Eq(3));
+}
+TEST_F(NAME, null_values_clear_validity_bits)
+{
+    ASSERT_THAT(dbi->person.all_fetch_columns(db, 0, &cols, 4), Eq(3));
+    EXPECT_THAT(age_validity[0] & 0x7, Eq(0x5));
+    EXPECT_THAT(cols.age_null_count, Eq(1));
+    EXPECT_THAT(age[0], Eq(69));
+    EXPECT_THAT(nickname_validity[0] & 0x7, Eq(0x5));
+    EXPECT_THAT(cols.nickname_null_count, Eq(1));
+    EXPECT_THAT(nickname_offsets[2], Eq(nickname_offsets[1]));
+}
+TEST_F(NAME, stops_at_max_rows)
+{
+    ASSERT_THAT(dbi->person.all_fetch_columns(db, 0, &cols, 2), Eq(2));
+    EXPECT_THAT(cols.truncated, Eq(1));
+    ASSERT_THAT(dbi->person.all_fetch_columns(db, 3, &cols, 2), Eq(1));
+    EXPECT_THAT(cols.truncated, Eq(0));
+    EXPECT_THAT(name_at(0), StrEq("name3"));
+}
+TEST_F(NAME, stops_when_data_buffer_is_full)
+{
+    cols.name_capacity = 12;
+    ASSERT_THAT(dbi->person.all_fetch_columns(db, 0, &cols, 4), Eq(2));
+    EXPECT_THAT(cols.truncated, Eq(1));
+    EXPECT_THAT(name_at(1), StrEq("name2"));
+}
+TEST_F(NAME, fetch_more_continues_after_max_rows)
+{
+    ASSERT_THAT(dbi->person.all_fetch_columns(db, 0, &cols, 2), Eq(2));
+    EXPECT_THAT(cols.truncated, Eq(1));
+    EXPECT_THAT(id[1], Eq(2));
+    ASSERT_THAT(dbi->person.all_fetch_more_columns(db, &cols, 2), Eq(1));
+    EXPECT_THAT(cols.length, Eq(1));
+    EXPECT_THAT(cols.truncated, Eq(0));
+    EXPECT_THAT(id[0], Eq(3));
+    EXPECT_THAT(name_at(0), StrEq("name3"));
+    EXPECT_THAT(dbi->person.all_fetch_more_columns(db, &cols, 2), Eq(0));
+}
+TEST_F(NAME, fetch_more_continues_after_full_data_buffer)
+{
+    cols.name_capacity = 12;
+    ASSERT_THAT(dbi->person.all_fetch_columns(db, 0, &cols, 4), Eq(2));
+    EXPECT_THAT(cols.truncated, Eq(1));
+    ASSERT_THAT(dbi->person.all_fetch_more_columns(db, &cols, 4), Eq(1));
+    EXPECT_THAT(cols.truncated, Eq(0));
+    EXPECT_THAT(name_at(0), StrEq("name3"));
+    EXPECT_THAT(age[0], Eq(18));
+}
+TEST_F(NAME, close_drops_remaining_rows)
+{
+    ASSERT_THAT(dbi->person.all_fetch_columns(db, 0, &cols, 1), Eq(1));
+    EXPECT_THAT(cols.truncated, Eq(1));
+    dbi->person.all_close_columns(db);
+    EXPECT_THAT(dbi->person.all_fetch_more_columns(db, &cols, 4), Eq(0));
+    EXPECT_THAT(cols.length, Eq(0));
+    EXPECT_THAT(cols.truncated, Eq(0));
+}
+TEST_F(NAME, fetch_restarts_unfinished_query)
+{
+    ASSERT_THAT(dbi->person.all_fetch_columns(db, 0, &cols, 1), Eq(1));
+    ASSERT_THAT(dbi->person.all_fetch_columns(db, 2, &cols, 1), Eq(1));
+    EXPECT_THAT(id[0], Eq(2));
+    ASSERT_THAT(dbi->person.all_fetch_more_columns(db, &cols, 4), Eq(1));
+    EXPECT_THAT(id[0], Eq(3));
+}
+TEST_F(NAME, exports_arrow_struct_array)
+{
+    struct ArrowArray array;
+    struct ArrowSchema schema;
+    ASSERT_THAT(dbi->person.all_fetch_columns(db, 0, &cols, 4), Eq(3));
+    ASSERT_THAT(dbi->person.all_export_arrow(&cols, &array, &schema), Eq(0));
+
+    EXPECT_THAT(schema.format, StrEq("+s"));
+    ASSERT_THAT(schema.n_children, Eq(5));
+    EXPECT_THAT(schema.children[0]->format, StrEq("l"));
+    EXPECT_THAT(schema.children[1]->format, StrEq("u"));
+    EXPECT_THAT(schema.children[1]->name, StrEq("name"));
+    EXPECT_THAT(schema.children[2]->flags, Eq(ARROW_FLAG_NULLABLE));
+    EXPECT_THAT(schema.children[4]->format, StrEq("z"));
+
+    EXPECT_THAT(array.length, Eq(3));
+    ASSERT_THAT(array.n_children, Eq(5));
+    EXPECT_THAT(array.children[0]->n_buffers, Eq(2));
+    EXPECT_THAT(array.children[0]->buffers[1], Eq((const void*)id));
+    EXPECT_THAT(array.children[1]->n_buffers, Eq(3));
+    EXPECT_THAT(array.children[1]->buffers[2], Eq((const void*)name_data));
+    EXPECT_THAT(array.children[3]->null_count, Eq(1));
+    EXPECT_THAT(array.children[3]->buffers[0], Eq((const void*)nickname_validity));
+
+    array.release(&array);
+    schema.release(&schema);
+    EXPECT_THAT(array.release, IsNull());
+    EXPECT_THAT(schema.release, IsNull());
+}
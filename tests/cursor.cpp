@@ -0,0 +1,128 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/cursor.h"
+
+#define NAME sqlgen_cursor
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        cursor_init();
+        dbi = cursor("sqlite3");
+        db = dbi->open("cursor.db");
+        dbi->reinit(db);
+    }
+
+    void TearDown() override {
+        dbi->close(db);
+        cursor_deinit();
+    }
+
+    struct cursor_interface* dbi;
+    struct cursor* db;
+};
+
+static int count_rows(const char* name, int age, void* user) {
+    ++*(int*)user;
+    return 0;
+}
+
+TEST_F(NAME, iterates_all_rows)
+{
+    struct cursor_older_than_row row;
+    ASSERT_THAT(dbi->older_than_open_cursor(db, 20), Eq(0));
+    ASSERT_THAT(dbi->older_than_next(db, &row), Eq(1));
+    EXPECT_THAT(row.name, StrEq("name2"));
+    EXPECT_THAT(row.age, Eq(42));
+    ASSERT_THAT(dbi->older_than_next(db, &row), Eq(1));
+    EXPECT_THAT(row.name, StrEq("name1"));
+    EXPECT_THAT(row.age, Eq(69));
+    ASSERT_THAT(dbi->older_than_next(db, &row), Eq(0));
+    dbi->older_than_close_cursor(db);
+}
+TEST_F(NAME, empty_result)
+{
+    struct cursor_older_than_row row;
+    ASSERT_THAT(dbi->older_than_open_cursor(db, 100), Eq(0));
+    ASSERT_THAT(dbi->older_than_next(db, &row), Eq(0));
+    dbi->older_than_close_cursor(db);
+}
+TEST_F(NAME, query_can_be_reused_after_close)
+{
+    struct cursor_older_than_row row;
+    int count = 0;
+    ASSERT_THAT(dbi->older_than_open_cursor(db, 20), Eq(0));
+    ASSERT_THAT(dbi->older_than_next(db, &row), Eq(1));
+    dbi->older_than_close_cursor(db);
+
+    ASSERT_THAT(dbi->older_than(db, 0, count_rows, &count), Eq(0));
+    ASSERT_THAT(count, Eq(3));
+
+    ASSERT_THAT(dbi->older_than_open_cursor(db, 50), Eq(0));
+    ASSERT_THAT(dbi->older_than_next(db, &row), Eq(1));
+    EXPECT_THAT(row.name, StrEq("name1"));
+    ASSERT_THAT(dbi->older_than_next(db, &row), Eq(0));
+    dbi->older_than_close_cursor(db);
+}
+TEST_F(NAME, null_and_blob_columns)
+{
+    struct cursor_person_all_row row;
+    ASSERT_THAT(dbi->person.all_open_cursor(db), Eq(0));
+
+    ASSERT_THAT(dbi->person.all_next(db, &row), Eq(1));
+    EXPECT_THAT(row.nickname, StrEq("nick1"));
+    ASSERT_THAT(row.avatar_len, Eq(2));
+    EXPECT_THAT(((const unsigned char*)row.avatar)[1], Eq(2));
+
+    ASSERT_THAT(dbi->person.all_next(db, &row), Eq(1));
+    EXPECT_THAT(row.nickname, IsNull());
+    ASSERT_THAT(row.avatar_len, Eq(3));
+
+    ASSERT_THAT(dbi->person.all_next(db, &row), Eq(1));
+    EXPECT_THAT(row.name, StrEq("name3"));
+    EXPECT_THAT(row.avatar_len, Eq(0));
+
+    ASSERT_THAT(dbi->person.all_next(db, &row), Eq(0));
+    dbi->person.all_close_cursor(db);
+}
+TEST_F(NAME, open_cursor_restarts_unclosed_cursor)
+{
+    struct cursor_older_than_row row;
+    ASSERT_THAT(dbi->older_than_open_cursor(db, 20), Eq(0));
+    ASSERT_THAT(dbi->older_than_next(db, &row), Eq(1));
+    EXPECT_THAT(row.name, StrEq("name2"));
+
+    ASSERT_THAT(dbi->older_than_open_cursor(db, 50), Eq(0));
+    ASSERT_THAT(dbi->older_than_next(db, &row), Eq(1));
+    EXPECT_THAT(row.name, StrEq("name1"));
+    ASSERT_THAT(dbi->older_than_next(db, &row), Eq(0));
+    dbi->older_than_close_cursor(db);
+}
+TEST_F(NAME, next_stays_done_after_last_row)
+{
+    struct cursor_older_than_row row;
+    ASSERT_THAT(dbi->older_than_open_cursor(db, 50), Eq(0));
+    ASSERT_THAT(dbi->older_than_next(db, &row), Eq(1));
+    ASSERT_THAT(dbi->older_than_next(db, &row), Eq(0));
+    ASSERT_THAT(dbi->older_than_next(db, &row), Eq(0));
+    ASSERT_THAT(dbi->older_than_next(db, &row), Eq(0));
+    dbi->older_than_close_cursor(db);
+    ASSERT_THAT(dbi->older_than_next(db, &row), Eq(0));
+}
+TEST_F(NAME, query_function_does_not_disturb_open_cursor)
+{
+    struct cursor_older_than_row row;
+    int count = 0;
+    ASSERT_THAT(dbi->older_than_open_cursor(db, 20), Eq(0));
+    ASSERT_THAT(dbi->older_than_next(db, &row), Eq(1));
+    EXPECT_THAT(row.name, StrEq("name2"));
+
+    ASSERT_THAT(dbi->older_than(db, 0, count_rows, &count), Eq(0));
+    ASSERT_THAT(count, Eq(3));
+
+    ASSERT_THAT(dbi->older_than_next(db, &row), Eq(1));
+    EXPECT_THAT(row.name, StrEq("name1"));
+    ASSERT_THAT(dbi->older_than_next(db, &row), Eq(0));
+    dbi->older_than_close_cursor(db);
+}
@@ -0,0 +1,105 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/deadlines.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#define NAME sqlgen_deadlines
+
+using namespace testing;
+
+/* Would take hours to count to, so these only ever end by being stopped */
+static const int64_t forever = INT64_C(1000000000000);
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        deadlines_init();
+        dbi = deadlines("sqlite3");
+        db = dbi->open("deadlines.db");
+        dbi->reinit(db);
+    }
+
+    void TearDown() override {
+        dbi->close(db);
+        deadlines_deinit();
+    }
+
+    struct deadlines_interface* dbi;
+    struct deadlines* db;
+};
+
+static int count_rows(int64_t x, void* user) {
+    ++*(int64_t*)user;
+    return 0;
+}
+
+TEST_F(NAME, set_deadline_rejects_negative_timeout)
+{
+    EXPECT_THAT(dbi->set_deadline(db, -1), Eq(-1));
+}
+TEST_F(NAME, queries_finish_before_deadline)
+{
+    int64_t count = 0;
+    int64_t id = -1;
+    ASSERT_THAT(dbi->set_deadline(db, 10000), Eq(0));
+    ASSERT_THAT(dbi->count_to(db, 1000, &count), Eq(0));
+    EXPECT_THAT(count, Eq(1000));
+    ASSERT_THAT(dbi->person.add(db, "name1", &id), Eq(0));
+    EXPECT_THAT(dbi->person.count(db), Eq(1));
+}
+TEST_F(NAME, deadline_stops_select_first)
+{
+    int64_t count = 0;
+    ASSERT_THAT(dbi->set_deadline(db, 20), Eq(0));
+    EXPECT_THAT(dbi->count_to(db, forever, &count), Eq(deadlines_TIMEOUT));
+
+    /* Still expired */
+    EXPECT_THAT(dbi->count_to(db, forever, &count), Eq(deadlines_TIMEOUT));
+
+    ASSERT_THAT(dbi->set_deadline(db, 0), Eq(0));
+    ASSERT_THAT(dbi->count_to(db, 1000, &count), Eq(0));
+    EXPECT_THAT(count, Eq(1000));
+}
+TEST_F(NAME, deadline_stops_select_all)
+{
+    int64_t rows = 0;
+    ASSERT_THAT(dbi->set_deadline(db, 20), Eq(0));
+    EXPECT_THAT(dbi->numbers(db, forever, count_rows, &rows), Eq(deadlines_TIMEOUT));
+    EXPECT_THAT(rows, Gt(0));
+
+    /* A new deadline starts over */
+    rows = 0;
+    ASSERT_THAT(dbi->set_deadline(db, 10000), Eq(0));
+    ASSERT_THAT(dbi->numbers(db, 100, count_rows, &rows), Eq(0));
+    EXPECT_THAT(rows, Eq(100));
+}
+TEST_F(NAME, cancel_stops_query_on_other_thread)
+{
+    int64_t count = 0;
+    std::atomic<int> ret(1);
+
+    /* The deadline only keeps the test from hanging if cancel doesn't work */
+    ASSERT_THAT(dbi->set_deadline(db, 10000), Eq(0));
+    std::thread query([&] { ret = dbi->count_to(db, forever, &count); });
+
+    /* Cancelling an idle connection does nothing, so keep trying until the query has started */
+    while (ret == 1)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        dbi->cancel(db);
+    }
+    query.join();
+    EXPECT_THAT(ret.load(), Eq(deadlines_CANCELLED));
+
+    ASSERT_THAT(dbi->count_to(db, 1000, &count), Eq(0));
+    EXPECT_THAT(count, Eq(1000));
+}
+TEST_F(NAME, cancel_on_idle_connection_does_nothing)
+{
+    int64_t count = 0;
+    dbi->cancel(db);
+    ASSERT_THAT(dbi->count_to(db, 1000, &count), Eq(0));
+    EXPECT_THAT(count, Eq(1000));
+}
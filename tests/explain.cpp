@@ -0,0 +1,90 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/explain.h"
+
+#include <string>
+#include <vector>
+
+#define NAME sqlgen_explain
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        explain_init();
+        dbi = explain("sqlite3");
+        db = dbi->open("explain.db");
+        dbi->reinit(db);
+    }
+
+    void TearDown() override {
+        dbi->close(db);
+        explain_deinit();
+    }
+
+    struct explain_interface* dbi;
+    struct explain* db;
+};
+
+struct plan_line
+{
+    std::string query;
+    std::string detail;
+    bool full_scan;
+    bool temp_btree;
+    bool auto_index;
+};
+
+static void collect_plan(const struct explain_plan_row* row, void* user) {
+    static_cast<std::vector<plan_line>*>(user)->push_back({
+        row->query, row->detail, row->full_scan != 0, row->temp_btree != 0, row->auto_index != 0 });
+}
+
+static std::vector<std::string> flagged_queries(const std::vector<plan_line>& lines) {
+    std::vector<std::string> queries;
+    for (const plan_line& line : lines)
+        if (line.full_scan || line.temp_btree || line.auto_index)
+            queries.push_back(line.query);
+    return queries;
+}
+
+TEST_F(NAME, flags_scans_sorts_and_automatic_indexes)
+{
+    std::vector<plan_line> lines;
+    ASSERT_THAT(dbi->explain_all(db, collect_plan, &lines), Eq(4));
+    EXPECT_THAT(flagged_queries(lines), ElementsAre("person.aged", "person.by_age", "pet.namesakes", "pet.namesakes"));
+
+    for (const plan_line& line : lines)
+    {
+        if (line.query == "person.age")
+        {
+            EXPECT_THAT(line.full_scan || line.temp_btree || line.auto_index, IsFalse()) << line.detail;
+        }
+        if (line.query == "person.by_age" && line.temp_btree)
+        {
+            EXPECT_THAT(line.detail, HasSubstr("ORDER BY"));
+        }
+        if (line.query == "pet.namesakes" && line.auto_index)
+        {
+            EXPECT_THAT(line.detail, HasSubstr("pets"));
+        }
+    }
+}
+TEST_F(NAME, index_clears_flags)
+{
+    std::vector<plan_line> lines;
+    ASSERT_THAT(dbi->index_age(db), Eq(0));
+    ASSERT_THAT(dbi->explain_all(db, collect_plan, &lines), Eq(2));
+    EXPECT_THAT(flagged_queries(lines), ElementsAre("pet.namesakes", "pet.namesakes"));
+}
+TEST_F(NAME, callback_is_optional)
+{
+    EXPECT_THAT(dbi->explain_all(db, NULL, NULL), Eq(4));
+}
+TEST_F(NAME, does_not_touch_cached_statements)
+{
+    struct explain_stmt_stats stats;
+    ASSERT_THAT(dbi->explain_all(db, NULL, NULL), Eq(4));
+    for (int i = 0; dbi->query_stats(db, i, &stats) == 0; ++i)
+        EXPECT_THAT(stats.prepared, Eq(0)) << stats.name;
+}
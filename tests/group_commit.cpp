@@ -0,0 +1,141 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/group_commit.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define NAME sqlgen_group_commit
+
+using namespace testing;
+
+/* Completions record how many rows another connection could see at the time */
+struct group_completions
+{
+    void wait(int count) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return (int)results.size() >= count; });
+    }
+
+    struct group_commit_interface* dbi;
+    struct group_commit* observer;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<int> results;
+    std::vector<int> visible;
+};
+
+static void on_done(int result, void* user) {
+    group_completions* c = static_cast<group_completions*>(user);
+    std::lock_guard<std::mutex> lock(c->mutex);
+    c->results.push_back(result);
+    c->visible.push_back(c->dbi->person.count(c->observer));
+    c->cv.notify_all();
+}
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        group_commit_init();
+        dbi = group_commit("sqlite3");
+        db = dbi->open("group_commit.db");
+        dbi->reinit(db);
+        c.dbi = dbi;
+        c.observer = db;
+    }
+
+    void TearDown() override {
+        dbi->close(db);
+        group_commit_deinit();
+    }
+
+    struct group_commit_interface* dbi;
+    struct group_commit* db;
+    group_completions c;
+};
+
+/*
+ * Holding the write lock keeps the writer from starting its transaction, so
+ * that all jobs are queued by the time it does, no matter how long the window
+ * is. Every group completes before the next one starts, so if the writes were
+ * split over several commits, the first completions would see fewer rows.
+ */
+TEST_F(NAME, full_group_commits_once)
+{
+    struct group_commit_executor* exec = dbi->executor_open("group_commit.db", 0, -1);
+    ASSERT_THAT(exec, NotNull());
+
+    ASSERT_THAT(dbi->begin_immediate(db), Eq(0));
+    for (int i = 0; i != 9; ++i)
+        ASSERT_THAT(dbi->person.add_async(exec, ("name" + std::to_string(i)).c_str(), i, on_done, &c), Eq(0));
+    ASSERT_THAT(dbi->commit(db), Eq(0));
+    c.wait(9);
+    dbi->executor_close(exec);
+
+    /* The ninth write doesn't fit into the group of 8 */
+    EXPECT_THAT(c.results, Each(Eq(0)));
+    EXPECT_THAT(c.visible, ElementsAre(8, 8, 8, 8, 8, 8, 8, 8, 9));
+}
+TEST_F(NAME, window_ends_partial_group)
+{
+    struct group_commit_executor* exec = dbi->executor_open("group_commit.db", 0, -1);
+    ASSERT_THAT(exec, NotNull());
+
+    ASSERT_THAT(dbi->begin_immediate(db), Eq(0));
+    for (int i = 0; i != 3; ++i)
+        ASSERT_THAT(dbi->person.add_async(exec, ("name" + std::to_string(i)).c_str(), i, on_done, &c), Eq(0));
+    ASSERT_THAT(dbi->commit(db), Eq(0));
+    c.wait(3);
+    EXPECT_THAT(c.results, ElementsAre(0, 0, 0));
+    EXPECT_THAT(c.visible, ElementsAre(3, 3, 3));
+
+    dbi->executor_close(exec);
+}
+TEST_F(NAME, failed_write_doesnt_affect_group)
+{
+    struct group_commit_executor* exec = dbi->executor_open("group_commit.db", 0, -1);
+    ASSERT_THAT(exec, NotNull());
+
+    ASSERT_THAT(dbi->person.add_async(exec, "name1", 20, on_done, &c), Eq(0));
+    ASSERT_THAT(dbi->person.add_async(exec, "name1", 30, on_done, &c), Eq(0));
+    ASSERT_THAT(dbi->person.add_async(exec, "name2", 40, on_done, &c), Eq(0));
+    dbi->executor_close(exec);
+
+    EXPECT_THAT(c.results[0], Eq(0));
+    EXPECT_THAT(c.results[1], Lt(0));
+    EXPECT_THAT(c.results[2], Eq(0));
+    EXPECT_THAT(dbi->person.count(db), Eq(2));
+}
+TEST_F(NAME, close_commits_pending_group)
+{
+    struct group_commit_executor* exec = dbi->executor_open("group_commit.db", 1, -1);
+    ASSERT_THAT(exec, NotNull());
+
+    for (int i = 0; i != 5; ++i)
+        ASSERT_THAT(dbi->person.add_async(exec, ("name" + std::to_string(i)).c_str(), i, on_done, &c), Eq(0));
+    dbi->executor_close(exec);
+
+    EXPECT_THAT(c.results, ElementsAre(0, 0, 0, 0, 0));
+    EXPECT_THAT(dbi->person.count(db), Eq(5));
+}
+TEST_F(NAME, concurrent_writers)
+{
+    struct group_commit_executor* exec = dbi->executor_open("group_commit.db", 1, -1);
+    ASSERT_THAT(exec, NotNull());
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t != 4; ++t)
+        threads.emplace_back([&, t] {
+            for (int i = 0; i != 50; ++i)
+                dbi->person.add_async(exec, ("name" + std::to_string(t * 50 + i)).c_str(), i, on_done, &c);
+        });
+    for (std::thread& thread : threads)
+        thread.join();
+    dbi->executor_close(exec);
+
+    ASSERT_THAT(c.results.size(), Eq(200u));
+    EXPECT_THAT(c.results, Each(Eq(0)));
+    EXPECT_THAT(dbi->person.count(db), Eq(200));
+}
@@ -0,0 +1,125 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/pool.h"
+
+#include <atomic>
+#include <map>
+#include <thread>
+#include <vector>
+
+#define NAME sqlgen_pool
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        pool_init();
+        dbi = pool("sqlite3");
+        dbpool = dbi->pool_open("pool.db", 4);
+        ASSERT_THAT(dbpool, NotNull());
+
+        struct pool* db = dbi->pool_acquire(dbpool);
+        dbi->reinit(db);
+        dbi->pool_release(dbpool, db);
+    }
+
+    void TearDown() override {
+        dbi->pool_close(dbpool);
+        pool_deinit();
+    }
+
+    struct pool_interface* dbi;
+    struct pool_pool* dbpool;
+};
+
+TEST_F(NAME, open_rejects_empty_pool)
+{
+    ASSERT_THAT(dbi->pool_open("pool.db", 0), IsNull());
+}
+TEST_F(NAME, acquire_returns_distinct_connections_until_exhausted)
+{
+    struct pool* conns[4];
+    for (int i = 0; i != 4; ++i)
+    {
+        conns[i] = dbi->pool_acquire(dbpool);
+        ASSERT_THAT(conns[i], NotNull());
+        for (int j = 0; j != i; ++j)
+            ASSERT_THAT(conns[i], Ne(conns[j]));
+    }
+    ASSERT_THAT(dbi->pool_acquire(dbpool), IsNull());
+
+    dbi->pool_release(dbpool, conns[2]);
+    ASSERT_THAT(dbi->pool_acquire(dbpool), Eq(conns[2]));
+
+    for (int i = 0; i != 4; ++i)
+        dbi->pool_release(dbpool, conns[i]);
+}
+TEST_F(NAME, thread_gets_its_last_connection_back)
+{
+    struct pool* a = dbi->pool_acquire(dbpool);
+    struct pool* b = dbi->pool_acquire(dbpool);
+    dbi->pool_release(dbpool, a);
+    ASSERT_THAT(dbi->pool_acquire(dbpool), Eq(a));
+    dbi->pool_release(dbpool, b);
+    dbi->pool_release(dbpool, a);
+    ASSERT_THAT(dbi->pool_acquire(dbpool), Eq(a));
+    ASSERT_THAT(dbi->pool_acquire(dbpool), Eq(b));
+    dbi->pool_release(dbpool, a);
+    dbi->pool_release(dbpool, b);
+}
+TEST_F(NAME, parked_connections_can_be_stolen)
+{
+    std::vector<struct pool*> conns;
+    for (int i = 0; i != 4; ++i)
+        conns.push_back(dbi->pool_acquire(dbpool));
+
+    /* Each thread parks one connection */
+    std::vector<std::thread> threads;
+    for (int i = 0; i != 4; ++i)
+        threads.emplace_back([this, &conns, i] { dbi->pool_release(dbpool, conns[i]); });
+    for (std::thread& t : threads)
+        t.join();
+
+    conns.clear();
+    for (int i = 0; i != 4; ++i)
+    {
+        conns.push_back(dbi->pool_acquire(dbpool));
+        ASSERT_THAT(conns.back(), NotNull());
+    }
+    for (struct pool* db : conns)
+        dbi->pool_release(dbpool, db);
+}
+TEST_F(NAME, connections_are_never_shared_between_threads)
+{
+    std::map<struct pool*, std::atomic<int>> users;
+    std::vector<struct pool*> conns;
+    for (int i = 0; i != 4; ++i)
+        conns.push_back(dbi->pool_acquire(dbpool));
+    for (struct pool* db : conns)
+    {
+        users[db] = 0;
+        dbi->pool_release(dbpool, db);
+    }
+
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i != 8; ++i)
+        threads.emplace_back([&] {
+            for (int n = 0; n != 500; ++n)
+            {
+                struct pool* db = dbi->pool_acquire(dbpool);
+                if (db == NULL)
+                    continue;
+                if (users[db]++ != 0)
+                    failures++;
+                if (dbi->person_exists(db, "name1") != 1)
+                    failures++;
+                users[db]--;
+                dbi->pool_release(dbpool, db);
+            }
+        });
+    for (std::thread& t : threads)
+        t.join();
+
+    ASSERT_THAT(failures.load(), Eq(0));
+}
@@ -0,0 +1,93 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/pragma.h"
+#include "sqlite3.h"
+#include <string>
+#include <thread>
+
+#define NAME sqlgen_pragma
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        pragma_init();
+        dbi = pragma("sqlite3");
+        db = dbi->open("pragma.db");
+        dbi->reinit(db);
+    }
+
+    void TearDown() override {
+        dbi->close(db);
+        pragma_deinit();
+    }
+
+    struct pragma_interface* dbi;
+    struct pragma* db;
+};
+
+static int on_text(const char* value, void* user) {
+    *(std::string*)user = value;
+    return 0;
+}
+static int on_int(int value, void* user) {
+    *(int*)user = value;
+    return 0;
+}
+
+TEST_F(NAME, profile_is_applied_on_open)
+{
+    std::string mode;
+    int synchronous = -1;
+    ASSERT_THAT(dbi->journal_mode(db, on_text, &mode), Eq(0));
+    ASSERT_THAT(mode, StrEq("wal"));
+    ASSERT_THAT(dbi->synchronous(db, on_int, &synchronous), Eq(0));
+    ASSERT_THAT(synchronous, Eq(1));  /* NORMAL */
+}
+TEST_F(NAME, pragma_overrides_profile)
+{
+    int cache_size = 0;
+    ASSERT_THAT(dbi->cache_size(db, on_int, &cache_size), Eq(0));
+    ASSERT_THAT(cache_size, Eq(-1234));
+}
+TEST_F(NAME, pragma_is_applied_on_open)
+{
+    int foreign_keys = -1;
+    ASSERT_THAT(dbi->foreign_keys(db, on_int, &foreign_keys), Eq(0));
+    ASSERT_THAT(foreign_keys, Eq(1));
+}
+TEST_F(NAME, open_ex_applies_pragmas)
+{
+    int foreign_keys = -1;
+    struct pragma* ro = dbi->open_ex("pragma.db", SQLITE_OPEN_READONLY);
+    ASSERT_THAT(ro, NotNull());
+    ASSERT_THAT(dbi->foreign_keys(ro, on_int, &foreign_keys), Eq(0));
+    ASSERT_THAT(foreign_keys, Eq(1));
+    dbi->close(ro);
+}
+TEST_F(NAME, open_ex_fails_without_create_flag)
+{
+    ASSERT_THAT(dbi->open_ex("pragma_does_not_exist.db", SQLITE_OPEN_READWRITE), IsNull());
+}
+TEST_F(NAME, open_waits_for_lock_instead_of_spinning)
+{
+    int retries = 0, wait_ms = 0;
+    sqlite3* other;
+    remove("pragma_locked.db");
+    ASSERT_THAT(sqlite3_open("pragma_locked.db", &other), Eq(SQLITE_OK));
+    ASSERT_THAT(sqlite3_exec(other, "CREATE TABLE t (x); BEGIN EXCLUSIVE;", NULL, NULL, NULL), Eq(SQLITE_OK));
+
+    std::thread unlock([other] {
+        sqlite3_sleep(100);
+        sqlite3_exec(other, "COMMIT", NULL, NULL, NULL);
+    });
+    struct pragma* locked = dbi->open("pragma_locked.db");
+    unlock.join();
+    sqlite3_close(other);
+
+    ASSERT_THAT(locked, NotNull());
+    dbi->busy_stats(locked, &retries, &wait_ms);
+    EXPECT_THAT(retries, Gt(0));
+    EXPECT_THAT(wait_ms, Ge(50));
+    dbi->close(locked);
+}
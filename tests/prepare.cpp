@@ -0,0 +1,102 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/prepare.h"
+
+#define NAME sqlgen_prepare
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        prepare_init();
+        dbi = prepare("sqlite3");
+        db = dbi->open("prepare.db");
+        dbi->reinit(db);
+    }
+
+    void TearDown() override {
+        dbi->close(db);
+        prepare_deinit();
+    }
+
+    struct prepare_interface* dbi;
+    struct prepare* db;
+};
+
+static int on_count(int count, void* user) {
+    *(int*)user = count;
+    return 0;
+}
+
+TEST_F(NAME, queries_work_after_prepare_all)
+{
+    int count;
+    ASSERT_THAT(dbi->prepare_all(db), Eq(0));
+    ASSERT_THAT(dbi->insert_or_get(db, "name1", 1), Eq(1));
+    ASSERT_THAT(dbi->insert_or_get(db, "name3", 1), Eq(3));
+    ASSERT_THAT(dbi->person.count(db, on_count, &count), Eq(0));
+    ASSERT_THAT(count, Eq(3));
+}
+TEST_F(NAME, prepare_all_can_be_called_again)
+{
+    ASSERT_THAT(dbi->prepare_all(db), Eq(0));
+    ASSERT_THAT(dbi->prepare_all(db), Eq(0));
+    ASSERT_THAT(dbi->insert_or_get(db, "name2", 1), Eq(2));
+}
+TEST_F(NAME, queries_fail_without_prepare_all)
+{
+    ASSERT_THAT(dbi->insert_or_get(db, "name3", 1), Eq(-1));
+    ASSERT_THAT(dbi->begin(db), Eq(-1));
+}
+TEST_F(NAME, statements_survive_migrations)
+{
+    int count;
+    ASSERT_THAT(dbi->prepare_all(db), Eq(0));
+    ASSERT_THAT(dbi->insert_or_get(db, "name3", 1), Eq(3));
+    ASSERT_THAT(dbi->reinit(db), Eq(0));
+    ASSERT_THAT(dbi->person.count(db, on_count, &count), Eq(0));
+    ASSERT_THAT(count, Eq(2));
+}
+TEST_F(NAME, transactions_and_bulk_use_prepared_statements)
+{
+    struct prepare_person_add_args rows[] = {
+        { "name3", 1 },
+        { "name4", 2 }
+    };
+    int count;
+    ASSERT_THAT(dbi->prepare_all(db), Eq(0));
+    ASSERT_THAT(dbi->begin(db), Eq(0));
+    ASSERT_THAT(dbi->person.add_bulk(db, rows, 2), Eq(0));
+    ASSERT_THAT(dbi->commit(db), Eq(0));
+    ASSERT_THAT(dbi->person.count(db, on_count, &count), Eq(0));
+    ASSERT_THAT(count, Eq(4));
+}
+TEST_F(NAME, prepare_all_fails_if_tables_are_missing)
+{
+    int count;
+    ASSERT_THAT(dbi->migrate_to(db, 0), Eq(0));
+    ASSERT_THAT(dbi->prepare_all(db), Eq(-1));
+    ASSERT_THAT(dbi->upgrade(db), Eq(0));
+    ASSERT_THAT(dbi->prepare_all(db), Eq(0));
+    ASSERT_THAT(dbi->person.count(db, on_count, &count), Eq(0));
+    ASSERT_THAT(count, Eq(2));
+}
+TEST_F(NAME, pool_connections_are_prepared_when_opened)
+{
+    int count;
+    struct prepare_pool* pool = dbi->pool_open("prepare.db", 2);
+    ASSERT_THAT(pool, NotNull());
+    struct prepare* a = dbi->pool_acquire(pool);
+    struct prepare* b = dbi->pool_acquire(pool);
+    ASSERT_THAT(dbi->insert_or_get(a, "name3", 1), Eq(3));
+    ASSERT_THAT(dbi->person.count(b, on_count, &count), Eq(0));
+    ASSERT_THAT(count, Eq(3));
+    dbi->pool_release(pool, b);
+    dbi->pool_release(pool, a);
+    dbi->pool_close(pool);
+}
+TEST_F(NAME, pool_open_fails_if_tables_are_missing)
+{
+    ASSERT_THAT(dbi->migrate_to(db, 0), Eq(0));
+    ASSERT_THAT(dbi->pool_open("prepare.db", 2), IsNull());
+}
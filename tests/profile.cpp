@@ -0,0 +1,206 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/profile.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#define NAME sqlgen_profile
+
+using namespace testing;
+
+/* Counters are process-wide, so every test looks at what changed */
+struct NAME : public Test
+{
+    void SetUp() override {
+        profile_init();
+        dbi = profile("sqlite3");
+        db = dbi->open("profile.db");
+        dbi->reinit(db);
+        dbi->stats(db, &before);
+    }
+
+    void TearDown() override {
+        dbi->close(db);
+        profile_deinit();
+    }
+
+    struct profile_stats delta() {
+        struct profile_stats after;
+        dbi->stats(db, &after);
+        long long* a = (long long*)&after;
+        const long long* b = (const long long*)&before;
+        for (size_t i = 0; i != sizeof(after) / sizeof(long long); ++i)
+            a[i] -= b[i];
+        return after;
+    }
+
+    typedef int (*dump_func)(const struct profile_stats*, char*, int);
+    std::string dump(dump_func func) {
+        struct profile_stats stats;
+        dbi->stats(db, &stats);
+        int len = func(&stats, NULL, 0);
+        std::string buf(len + 1, '\0');
+        EXPECT_THAT(func(&stats, &buf[0], len + 1), Eq(len));
+        buf.resize(len);
+        return buf;
+    }
+
+    struct profile_interface* dbi;
+    struct profile* db;
+    struct profile_stats before;
+};
+
+static int count_names(const char* name, void* user) {
+    ++*(int*)user;
+    return 0;
+}
+
+TEST_F(NAME, counts_calls_errors_and_rows)
+{
+    int names = 0;
+    ASSERT_THAT(dbi->person.add(db, "name1", 20), Eq(1));
+    ASSERT_THAT(dbi->person.add(db, "name2", 30), Eq(2));
+    ASSERT_THAT(dbi->person.age(db, "name1"), Eq(20));
+    ASSERT_THAT(dbi->person.has(db, "name2"), Eq(1));
+    ASSERT_THAT(dbi->person.has(db, "name3"), Eq(0));
+    ASSERT_THAT(dbi->person.older_than(db, 10, count_names, &names), Eq(0));
+    ASSERT_THAT(names, Eq(2));
+    ASSERT_THAT(dbi->person.insert_new(db, "name1", 40), Lt(0));
+
+    struct profile_stats d = delta();
+    EXPECT_THAT(d.person_add.calls, Eq(2));
+    EXPECT_THAT(d.person_add.errors, Eq(0));
+    EXPECT_THAT(d.person_age.calls, Eq(1));
+    EXPECT_THAT(d.person_age.rows, Eq(1));
+    EXPECT_THAT(d.person_has.calls, Eq(2));
+    EXPECT_THAT(d.person_has.rows, Eq(1));
+    EXPECT_THAT(d.person_older_than.calls, Eq(1));
+    EXPECT_THAT(d.person_older_than.rows, Eq(2));
+    EXPECT_THAT(d.person_insert_new.calls, Eq(1));
+    EXPECT_THAT(d.person_insert_new.errors, Eq(1));
+    EXPECT_THAT(d.birthday.calls, Eq(0));
+}
+TEST_F(NAME, counts_batch_bulk_and_functions)
+{
+    struct profile_person_add_args added[2] = { { "name1", 20 }, { "name2", 30 } };
+    struct profile_person_insert_new_args inserted[3] = { { "name3", 1 }, { "name4", 2 }, { "name5", 3 } };
+    ASSERT_THAT(dbi->person.add_batch(db, added, 2, NULL), Eq(0));
+    ASSERT_THAT(dbi->person.insert_new_bulk(db, inserted, 3), Eq(0));
+    ASSERT_THAT(dbi->birthday(db), Eq(0));
+
+    struct profile_stats d = delta();
+    EXPECT_THAT(d.person_add_batch.calls, Eq(1));
+    EXPECT_THAT(d.person_insert_new_bulk.calls, Eq(1));
+    EXPECT_THAT(d.person_insert_new_bulk.rows, Eq(3));
+    EXPECT_THAT(d.birthday.calls, Eq(1));
+    EXPECT_THAT(d.birthday.errors, Eq(0));
+}
+TEST_F(NAME, percentiles_are_ordered)
+{
+    for (int i = 0; i != 200; ++i)
+        dbi->person.has(db, "name1");
+
+    struct profile_stats stats;
+    dbi->stats(db, &stats);
+    EXPECT_THAT(stats.person_has.total_ns, Gt(0));
+    EXPECT_THAT(stats.person_has.p50_ns, Gt(0));
+    EXPECT_THAT(stats.person_has.p50_ns, Le(stats.person_has.p99_ns));
+    EXPECT_THAT(stats.person_has.p99_ns, Le(stats.person_has.p999_ns));
+    EXPECT_THAT(stats.person_has.p999_ns, Le(stats.person_has.max_ns));
+}
+TEST_F(NAME, sums_counters_of_all_threads)
+{
+    dbi->close(db);
+    db = NULL;
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t != 4; ++t)
+        threads.emplace_back([this] {
+            struct profile* conn = dbi->open("profile.db");
+            for (int i = 0; i != 25; ++i)
+                dbi->person.has(conn, "name1");
+            dbi->close(conn);
+        });
+    for (std::thread& thread : threads)
+        thread.join();
+
+    db = dbi->open("profile.db");
+    EXPECT_THAT(delta().person_has.calls, Eq(100));
+}
+TEST_F(NAME, keeps_counts_of_exited_threads)
+{
+    dbi->close(db);
+    db = NULL;
+
+    /* Each thread takes over the counters of the one before it */
+    for (int t = 0; t != 50; ++t)
+        std::thread([this] {
+            struct profile* conn = dbi->open("profile.db");
+            dbi->person.has(conn, "name1");
+            dbi->close(conn);
+        }).join();
+
+    db = dbi->open("profile.db");
+    EXPECT_THAT(delta().person_has.calls, Eq(50));
+}
+TEST_F(NAME, deinit_resets_counters)
+{
+    dbi->person.has(db, "name1");
+    dbi->close(db);
+    profile_deinit();
+
+    profile_init();
+    db = dbi->open("profile.db");
+    dbi->stats(db, &before);
+    EXPECT_THAT(before.person_has.calls, Eq(0));
+    dbi->person.has(db, "name1");
+    EXPECT_THAT(delta().person_has.calls, Eq(1));
+}
+TEST_F(NAME, dumps_prometheus_text)
+{
+    ASSERT_THAT(dbi->person.add(db, "name1", 20), Eq(1));
+
+    std::string text = dump(dbi->stats_prometheus);
+    EXPECT_THAT(text, HasSubstr("# TYPE profile_calls_total counter\n"));
+    EXPECT_THAT(text, HasSubstr("profile_calls_total{op=\"person.add\"} "));
+    EXPECT_THAT(text, HasSubstr("profile_errors_total{op=\"person.insert_new_bulk\"} "));
+    EXPECT_THAT(text, HasSubstr("# TYPE profile_latency_seconds summary\n"));
+    EXPECT_THAT(text, HasSubstr("profile_latency_seconds{op=\"birthday\",quantile=\"0.99\"} "));
+    EXPECT_THAT(text, HasSubstr("profile_latency_seconds_count{op=\"person.add\"} "));
+}
+TEST_F(NAME, dumps_json)
+{
+    ASSERT_THAT(dbi->person.add(db, "name1", 20), Eq(1));
+
+    std::string json = dump(dbi->stats_json);
+    EXPECT_THAT(json, StartsWith("{\n  \"birthday\": {\"calls\": "));
+    EXPECT_THAT(json, HasSubstr(",\n  \"person.add\": {\"calls\": "));
+    EXPECT_THAT(json, HasSubstr("\"p999_ns\": "));
+    EXPECT_THAT(json, EndsWith("}\n}\n"));
+}
+TEST_F(NAME, dump_truncates_and_returns_full_length)
+{
+    struct profile_stats stats;
+    char buf[16];
+    dbi->stats(db, &stats);
+
+    int len = dbi->stats_json(&stats, buf, sizeof buf);
+    EXPECT_THAT(len, Gt((int)sizeof buf));
+    EXPECT_THAT(strlen(buf), Eq(sizeof buf - 1));
+    EXPECT_THAT(std::string(buf), StrEq(dump(dbi->stats_json).substr(0, sizeof buf - 1)));
+}
+TEST_F(NAME, dumps_largest_counters)
+{
+    struct profile_stats stats;
+    long long* s = (long long*)&stats;
+    for (size_t i = 0; i != sizeof(stats) / sizeof(long long); ++i)
+        s[i] = -9223372036854775807LL - 1;
+
+    std::string json(dbi->stats_json(&stats, NULL, 0) + 1, '\0');
+    dbi->stats_json(&stats, &json[0], (int)json.size());
+    EXPECT_THAT(json, HasSubstr("\"p999_ns\": -9223372036854775808}"));
+    std::string text(dbi->stats_prometheus(&stats, NULL, 0) + 1, '\0');
+    dbi->stats_prometheus(&stats, &text[0], (int)text.size());
+    EXPECT_THAT(text, HasSubstr("_total{op=\"birthday\"} -9223372036854775808\n"));
+}
@@ -0,0 +1,124 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/read_first.h"
+
+#include <string>
+
+#define NAME sqlgen_read_first
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        read_first_init();
+        dbi = read_first("sqlite3");
+        db = dbi->open("read_first.db");
+        dbi->reinit(db);
+        other = dbi->open("read_first.db");
+    }
+
+    void TearDown() override {
+        dbi->close(other);
+        dbi->close(db);
+        read_first_deinit();
+    }
+
+    struct read_first_interface* dbi;
+    struct read_first* db;
+    struct read_first* other;
+};
+
+struct person
+{
+    int id = -1;
+    std::string name;
+    int age = -1;
+};
+
+static int on_person(int id, const char* name, int age, void* user) {
+    struct person* p = static_cast<struct person*>(user);
+    p->id = id;
+    p->name = name;
+    p->age = age;
+    return 0;
+}
+static int on_name_age(const char* name, int age, void* user) {
+    struct person* p = static_cast<struct person*>(user);
+    p->name = name;
+    p->age = age;
+    return 0;
+}
+static int fail(const char* name, int age, void* user) {
+    return -5;
+}
+
+TEST_F(NAME, inserts_on_miss_and_reads_on_hit)
+{
+    ASSERT_THAT(dbi->person.add(db, "name1", 20), Eq(1));
+    ASSERT_THAT(dbi->person.add(db, "name2", 30), Eq(2));
+    int changes = dbi->changes(db);
+
+    EXPECT_THAT(dbi->person.add(db, "name1", 20), Eq(1));
+    EXPECT_THAT(dbi->person.add(db, "name2", 99), Eq(2));
+    EXPECT_THAT(dbi->changes(db), Eq(changes));
+}
+TEST_F(NAME, hits_dont_need_the_write_lock)
+{
+    ASSERT_THAT(dbi->person.add(db, "name1", 20), Eq(1));
+    ASSERT_THAT(dbi->begin_immediate(other), Eq(0));
+
+    EXPECT_THAT(dbi->person.add(db, "name1", 20), Eq(1));
+    EXPECT_THAT(dbi->person.add(db, "name2", 30), Lt(0));
+
+    ASSERT_THAT(dbi->commit(other), Eq(0));
+    EXPECT_THAT(dbi->person.add(db, "name2", 30), Eq(2));
+}
+TEST_F(NAME, finds_rows_inserted_by_other_connections)
+{
+    ASSERT_THAT(dbi->person.add(other, "name1", 20), Eq(1));
+    EXPECT_THAT(dbi->person.add(db, "name1", 20), Eq(1));
+}
+TEST_F(NAME, callback_sees_the_existing_row)
+{
+    struct person p;
+    ASSERT_THAT(dbi->person.add(db, "name1", 20), Eq(1));
+
+    ASSERT_THAT(dbi->person.add_cb(db, "name1", 50, on_person, &p), Eq(0));
+    EXPECT_THAT(p.id, Eq(1));
+    EXPECT_THAT(p.name, StrEq("name1"));
+    EXPECT_THAT(p.age, Eq(20));
+
+    ASSERT_THAT(dbi->person.add_cb(db, "name2", 30, on_person, &p), Eq(0));
+    EXPECT_THAT(p.id, Eq(2));
+    EXPECT_THAT(p.age, Eq(30));
+}
+TEST_F(NAME, return_and_callback_on_hit)
+{
+    struct person p;
+    ASSERT_THAT(dbi->person.add(db, "name1", 20), Eq(1));
+
+    ASSERT_THAT(dbi->person.add_id_and_cb(db, "name1", 50, on_name_age, &p), Eq(1));
+    EXPECT_THAT(p.name, StrEq("name1"));
+    EXPECT_THAT(p.age, Eq(20));
+    EXPECT_THAT(dbi->person.add_id_and_cb(db, "name1", 50, fail, NULL), Eq(-5));
+}
+TEST_F(NAME, typed_return_on_hit)
+{
+    int64_t id = -1;
+    ASSERT_THAT(dbi->person.add_typed(db, "name1", 20, &id), Eq(0));
+    EXPECT_THAT(id, Eq(1));
+    id = -1;
+    ASSERT_THAT(dbi->person.add_typed(db, "name1", 20, &id), Eq(0));
+    EXPECT_THAT(id, Eq(1));
+}
+TEST_F(NAME, without_return_looks_up_all_key_columns)
+{
+    ASSERT_THAT(dbi->person.ensure(db, "name1", 20), Eq(0));
+    int changes = dbi->changes(db);
+    EXPECT_THAT(dbi->person.ensure(db, "name1", 20), Eq(0));
+    EXPECT_THAT(dbi->changes(db), Eq(changes));
+
+    /* Not found by (name, age), so the insert runs and is ignored */
+    EXPECT_THAT(dbi->person.ensure(db, "name1", 30), Eq(0));
+    EXPECT_THAT(dbi->person.add(db, "name1", 0), Eq(1));
+}
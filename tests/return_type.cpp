@@ -0,0 +1,63 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/return_type.h"
+#include <string>
+
+#define NAME sqlgen_return_type
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        return_type_init();
+        dbi = return_type("sqlite3");
+        db = dbi->open("return_type.db");
+        dbi->reinit(db);
+    }
+
+    void TearDown() override {
+        dbi->close(db);
+        return_type_deinit();
+    }
+
+    struct return_type_interface* dbi;
+    struct return_type* db;
+};
+
+static int on_name(const char* name, void* user) {
+    *static_cast<std::string*>(user) = name;
+    return 0;
+}
+
+TEST_F(NAME, insert_or_get_existing_returns_int64_id)
+{
+    int64_t id = -1;
+    ASSERT_THAT(dbi->person.insert(db, "name1", 69, &id), Eq(0));
+    EXPECT_THAT(id, Eq(INT64_C(5000000000)));
+}
+TEST_F(NAME, insert_or_get_new_returns_next_id)
+{
+    int64_t id = -1;
+    ASSERT_THAT(dbi->person.insert(db, "name2", 42, &id), Eq(0));
+    EXPECT_THAT(id, Eq(INT64_C(5000000001)));
+}
+TEST_F(NAME, select_first_returns_unsigned_id)
+{
+    uint64_t id = 0;
+    ASSERT_THAT(dbi->person.id(db, "name1", &id), Eq(0));
+    EXPECT_THAT(id, Eq(UINT64_C(5000000000)));
+}
+TEST_F(NAME, select_first_not_found_leaves_value_untouched)
+{
+    uint64_t id = 1234;
+    EXPECT_THAT(dbi->person.id(db, "unknown", &id), Eq(-1));
+    EXPECT_THAT(id, Eq(1234u));
+}
+TEST_F(NAME, return_value_with_callback)
+{
+    int age = -1;
+    std::string name;
+    ASSERT_THAT(dbi->person.age_of(db, INT64_C(5000000000), &age, on_name, &name), Eq(0));
+    EXPECT_THAT(age, Eq(69));
+    EXPECT_THAT(name, StrEq("name1"));
+}
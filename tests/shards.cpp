@@ -0,0 +1,176 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/shards.h"
+
+#include <string>
+#include <vector>
+
+#define NAME sqlgen_shards
+
+using namespace testing;
+
+static const char* uris[4] = { "shards0.db", "shards1.db", "shards2.db", "shards3.db" };
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        shards_init();
+        dbi = shards("sqlite3");
+        db = dbi->open_shards(uris);
+        ASSERT_THAT(db, NotNull());
+        dbi->reinit(db);
+    }
+
+    void TearDown() override {
+        if (db)
+            dbi->close(db);
+        shards_deinit();
+    }
+
+    struct shards_interface* dbi;
+    struct shards* db;
+};
+
+static int collect_ids(int64_t id, const char* name, void* user) {
+    static_cast<std::vector<int64_t>*>(user)->push_back(id);
+    return 0;
+}
+
+TEST_F(NAME, open_fails_if_a_shard_fails)
+{
+    const char* bad[4] = { "shards0.db", "shards1.db", "does/not/exist.db", "shards3.db" };
+    EXPECT_THAT(dbi->open_shards(bad), IsNull());
+}
+TEST_F(NAME, migrations_run_on_every_shard)
+{
+    EXPECT_THAT(dbi->version(db), Eq(1));
+    for (const char* uri : uris)
+    {
+        struct shards* shard = dbi->open(uri);
+        EXPECT_THAT(dbi->version(shard), Eq(1));
+        dbi->close(shard);
+    }
+}
+TEST_F(NAME, rows_are_spread_over_shards)
+{
+    for (int i = 1; i <= 100; ++i)
+        ASSERT_THAT(dbi->person.add(db, i, ("name" + std::to_string(i)).c_str(), i), Eq(0));
+
+    /* Each row is stored exactly once, and every shard got some */
+    std::vector<int64_t> all;
+    for (const char* uri : uris)
+    {
+        std::vector<int64_t> ids;
+        struct shards* shard = dbi->open(uri);
+        ASSERT_THAT(dbi->person.all(shard, collect_ids, &ids), Eq(0));
+        dbi->close(shard);
+        EXPECT_THAT(ids.size(), Gt(0u));
+        all.insert(all.end(), ids.begin(), ids.end());
+    }
+    EXPECT_THAT(all.size(), Eq(100u));
+}
+TEST_F(NAME, keyed_queries_find_their_row)
+{
+    for (int i = 1; i <= 20; ++i)
+        ASSERT_THAT(dbi->person.add(db, i, ("name" + std::to_string(i)).c_str(), i * 2), Eq(0));
+    for (int i = 1; i <= 20; ++i)
+        EXPECT_THAT(dbi->person.age(db, i), Eq(i * 2));
+    EXPECT_THAT(dbi->person.age(db, 21), Eq(-1));
+}
+TEST_F(NAME, select_all_fans_out)
+{
+    std::vector<int64_t> ids;
+    for (int i = 1; i <= 20; ++i)
+        ASSERT_THAT(dbi->person.add(db, i, ("name" + std::to_string(i)).c_str(), i), Eq(0));
+
+    ASSERT_THAT(dbi->person.older_than(db, 15, collect_ids, &ids), Eq(0));
+    EXPECT_THAT(ids, UnorderedElementsAre(16, 17, 18, 19, 20));
+}
+TEST_F(NAME, select_all_stops_with_callback)
+{
+    int calls = 0;
+    for (int i = 1; i <= 20; ++i)
+        ASSERT_THAT(dbi->person.add(db, i, ("name" + std::to_string(i)).c_str(), i), Eq(0));
+
+    EXPECT_THAT(dbi->person.all(db, [](int64_t, const char*, void* user) {
+        return ++*static_cast<int*>(user) == 3 ? 7 : 0;
+    }, &calls), Eq(7));
+    EXPECT_THAT(calls, Eq(3));
+}
+TEST_F(NAME, functions_run_on_every_shard)
+{
+    for (int i = 1; i <= 20; ++i)
+        ASSERT_THAT(dbi->person.add(db, i, ("name" + std::to_string(i)).c_str(), i), Eq(0));
+    ASSERT_THAT(dbi->birthday(db), Eq(0));
+    for (int i = 1; i <= 20; ++i)
+        EXPECT_THAT(dbi->person.age(db, i), Eq(i + 1));
+}
+TEST_F(NAME, text_keys)
+{
+    ASSERT_THAT(dbi->tag.add(db, "red"), Eq(0));
+    ASSERT_THAT(dbi->tag.add(db, "green"), Eq(0));
+    EXPECT_THAT(dbi->tag.add(db, "red"), Lt(0));
+    EXPECT_THAT(dbi->tag.has(db, "red"), Eq(1));
+    EXPECT_THAT(dbi->tag.has(db, "green"), Eq(1));
+    EXPECT_THAT(dbi->tag.has(db, "blue"), Eq(0));
+}
+TEST_F(NAME, batch_and_transactions_cover_all_shards)
+{
+    std::vector<int64_t> ids;
+    struct shards_person_add_args rows[3] = { { 1, "name1", 10 }, { 2, "name2", 20 }, { 3, "name3", 30 } };
+    int results[3] = { -1, -1, -1 };
+    ASSERT_THAT(dbi->person.add_batch(db, rows, 3, results), Eq(0));
+    EXPECT_THAT(results, ElementsAre(0, 0, 0));
+
+    ASSERT_THAT(dbi->begin(db), Eq(0));
+    for (int i = 4; i <= 10; ++i)
+        ASSERT_THAT(dbi->person.add(db, i, ("name" + std::to_string(i)).c_str(), i), Eq(0));
+    ASSERT_THAT(dbi->rollback(db), Eq(0));
+
+    ASSERT_THAT(dbi->person.all(db, collect_ids, &ids), Eq(0));
+    EXPECT_THAT(ids, UnorderedElementsAre(1, 2, 3));
+}
+TEST_F(NAME, failed_begin_rolls_back_other_shards)
+{
+    /* Lock the third shard, so begin_immediate() gets SQLITE_BUSY there */
+    struct shards* other = dbi->open(uris[2]);
+    ASSERT_THAT(other, NotNull());
+    ASSERT_THAT(dbi->begin_immediate(other), Eq(0));
+
+    EXPECT_THAT(dbi->begin_immediate(db), Eq(-1));
+    EXPECT_THAT(dbi->in_transaction(db), Eq(0));
+
+    ASSERT_THAT(dbi->rollback(other), Eq(0));
+    dbi->close(other);
+    ASSERT_THAT(dbi->begin_immediate(db), Eq(0));
+    EXPECT_THAT(dbi->commit(db), Eq(0));
+}
+TEST_F(NAME, failed_commit_rolls_back_remaining_shards)
+{
+    /* A reader on the third shard makes its commit fail with SQLITE_BUSY */
+    struct shards* other = dbi->open(uris[2]);
+    ASSERT_THAT(other, NotNull());
+    ASSERT_THAT(dbi->begin(other), Eq(0));
+    ASSERT_THAT(dbi->person.age(other, 1), Eq(-1));
+
+    ASSERT_THAT(dbi->begin(db), Eq(0));
+    for (int i = 1; i <= 100; ++i)
+        ASSERT_THAT(dbi->person.add(db, i, ("name" + std::to_string(i)).c_str(), i), Eq(0));
+    EXPECT_THAT(dbi->commit(db), Eq(-1));
+    EXPECT_THAT(dbi->in_transaction(db), Eq(0));
+
+    ASSERT_THAT(dbi->rollback(other), Eq(0));
+    dbi->close(other);
+
+    /* Shards before the failed one committed, the others rolled back */
+    for (int shard = 0; shard != 4; ++shard)
+    {
+        std::vector<int64_t> ids;
+        struct shards* single = dbi->open(uris[shard]);
+        ASSERT_THAT(dbi->person.all(single, collect_ids, &ids), Eq(0));
+        if (shard < 2)
+            EXPECT_THAT(ids, Not(IsEmpty()));
+        else
+            EXPECT_THAT(ids, IsEmpty());
+        dbi->close(single);
+    }
+}
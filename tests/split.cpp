@@ -0,0 +1,274 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/split.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define NAME sqlgen_split
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        split_init();
+        dbi = split("sqlite3");
+        struct split* db = dbi->open("split.db");
+        dbi->reinit(db);
+        dbi->close(db);
+    }
+
+    void TearDown() override {
+        split_deinit();
+    }
+
+    struct split_interface* dbi;
+};
+
+static int collect_names(const char* name, void* user) {
+    static_cast<std::vector<std::string>*>(user)->push_back(name);
+    return 0;
+}
+
+TEST_F(NAME, open_rejects_negative_readers)
+{
+    ASSERT_THAT(dbi->open_split("split.db", -1), IsNull());
+}
+TEST_F(NAME, reads_see_committed_writes)
+{
+    int64_t id = -1;
+    std::vector<std::string> names;
+    struct split* db = dbi->open_split("split.db", 2);
+    ASSERT_THAT(db, NotNull());
+
+    ASSERT_THAT(dbi->person.add(db, "young", 10, &id), Eq(0));
+    EXPECT_THAT(id, Eq(1));
+    ASSERT_THAT(dbi->person.add(db, "old", 80, &id), Eq(0));
+    EXPECT_THAT(id, Eq(2));
+    EXPECT_THAT(dbi->person.count(db), Eq(2));
+    ASSERT_THAT(dbi->person.older_than(db, 50, collect_names, &names), Eq(0));
+    EXPECT_THAT(names, ElementsAre("old"));
+    EXPECT_THAT(dbi->version(db), Eq(1));
+
+    dbi->close(db);
+}
+TEST_F(NAME, transaction_reads_its_own_writes)
+{
+    int64_t id = -1;
+    struct split* db = dbi->open_split("split.db", 1);
+    ASSERT_THAT(db, NotNull());
+
+    ASSERT_THAT(dbi->begin(db), Eq(0));
+    ASSERT_THAT(dbi->person.add(db, "name1", 20, &id), Eq(0));
+    EXPECT_THAT(dbi->person.count(db), Eq(1));
+
+    /* Other threads read from a reader, which doesn't see the uncommitted row */
+    int other = -1;
+    std::thread([&] { other = dbi->person.count(db); }).join();
+    EXPECT_THAT(other, Eq(0));
+
+    ASSERT_THAT(dbi->commit(db), Eq(0));
+    std::thread([&] { other = dbi->person.count(db); }).join();
+    EXPECT_THAT(other, Eq(1));
+
+    dbi->close(db);
+}
+TEST_F(NAME, rollback_releases_the_writer)
+{
+    int64_t id = -1;
+    struct split* db = dbi->open_split("split.db", 1);
+    ASSERT_THAT(db, NotNull());
+
+    ASSERT_THAT(dbi->begin(db), Eq(0));
+    ASSERT_THAT(dbi->savepoint(db), Eq(0));
+    ASSERT_THAT(dbi->person.add(db, "name1", 20, &id), Eq(0));
+    ASSERT_THAT(dbi->rollback_to(db), Eq(0));
+    ASSERT_THAT(dbi->rollback(db), Eq(0));
+
+    /* Another thread can take the writer now */
+    int ret = -1;
+    std::thread([&] { ret = dbi->person.add(db, "name2", 30, &id); }).join();
+    EXPECT_THAT(ret, Eq(0));
+    EXPECT_THAT(dbi->person.count(db), Eq(1));
+
+    dbi->close(db);
+}
+TEST_F(NAME, commit_releases_the_writer_after_unreleased_savepoint)
+{
+    int64_t id = -1;
+    struct split* db = dbi->open_split("split.db", 1);
+    ASSERT_THAT(db, NotNull());
+
+    ASSERT_THAT(dbi->begin(db), Eq(0));
+    ASSERT_THAT(dbi->savepoint(db), Eq(0));
+    ASSERT_THAT(dbi->person.add(db, "name1", 20, &id), Eq(0));
+    ASSERT_THAT(dbi->commit(db), Eq(0));
+
+    int ret = -1;
+    std::thread([&] { ret = dbi->person.add(db, "name2", 30, &id); }).join();
+    EXPECT_THAT(ret, Eq(0));
+    EXPECT_THAT(dbi->person.count(db), Eq(2));
+
+    dbi->close(db);
+}
+TEST_F(NAME, rollback_releases_the_writer_after_unreleased_savepoint)
+{
+    int64_t id = -1;
+    struct split* db = dbi->open_split("split.db", 1);
+    ASSERT_THAT(db, NotNull());
+
+    ASSERT_THAT(dbi->begin(db), Eq(0));
+    ASSERT_THAT(dbi->savepoint(db), Eq(0));
+    ASSERT_THAT(dbi->savepoint(db), Eq(0));
+    ASSERT_THAT(dbi->person.add(db, "name1", 20, &id), Eq(0));
+    ASSERT_THAT(dbi->rollback(db), Eq(0));
+
+    int ret = -1;
+    std::thread([&] { ret = dbi->person.add(db, "name2", 30, &id); }).join();
+    EXPECT_THAT(ret, Eq(0));
+    EXPECT_THAT(dbi->person.count(db), Eq(1));
+
+    dbi->close(db);
+}
+TEST_F(NAME, concurrent_reads_and_writes)
+{
+    struct split* db = dbi->open_split("split.db", 2);
+    ASSERT_THAT(db, NotNull());
+    ASSERT_THAT(dbi->prepare_all(db), Eq(0));
+
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t != 4; ++t)
+        threads.emplace_back([&, t] {
+            for (int i = 0; i != 50; ++i)
+            {
+                int64_t id;
+                if (dbi->person.add(db, ("name" + std::to_string(t * 50 + i)).c_str(), i, &id) != 0)
+                    failures++;
+                if (dbi->person.count(db) < 1)
+                    failures++;
+            }
+        });
+    for (std::thread& thread : threads)
+        thread.join();
+
+    EXPECT_THAT(failures.load(), Eq(0));
+    EXPECT_THAT(dbi->person.count(db), Eq(200));
+    dbi->close(db);
+}
+TEST_F(NAME, no_readers_runs_everything_on_writer)
+{
+    int64_t id = -1;
+    struct split* db = dbi->open_split("split.db", 0);
+    ASSERT_THAT(db, NotNull());
+
+    ASSERT_THAT(dbi->person.add(db, "name1", 20, &id), Eq(0));
+    EXPECT_THAT(dbi->person.count(db), Eq(1));
+
+    dbi->close(db);
+}
+TEST_F(NAME, cursor_runs_on_reader_and_function_on_writer)
+{
+    int64_t id = -1;
+    struct split_person_older_than_row row;
+    struct split* db = dbi->open_split("split.db", 1);
+    ASSERT_THAT(db, NotNull());
+
+    ASSERT_THAT(dbi->person.add(db, "name1", 20, &id), Eq(0));
+    ASSERT_THAT(dbi->birthday(db), Eq(0));
+
+    ASSERT_THAT(dbi->person.older_than_open_cursor(db, 20), Eq(0));
+    ASSERT_THAT(dbi->person.older_than_next(db, &row), Eq(1));
+    EXPECT_THAT(row.name, StrEq("name1"));
+
+    /* The writer is free while the cursor is open */
+    int ret = -1;
+    std::thread([&] { ret = dbi->person.add(db, "name2", 30, &id); }).join();
+    EXPECT_THAT(ret, Eq(0));
+
+    ASSERT_THAT(dbi->person.older_than_next(db, &row), Eq(0));
+    dbi->person.older_than_close_cursor(db);
+    EXPECT_THAT(dbi->person.count(db), Eq(2));
+
+    dbi->close(db);
+}
+TEST_F(NAME, commit_keeps_cursor_on_writer_open)
+{
+    int64_t id = -1;
+    struct split_person_older_than_row row;
+    struct split* db = dbi->open_split("split.db", 1);
+    ASSERT_THAT(db, NotNull());
+
+    ASSERT_THAT(dbi->begin(db), Eq(0));
+    ASSERT_THAT(dbi->person.add(db, "name1", 20, &id), Eq(0));
+    ASSERT_THAT(dbi->person.add(db, "name2", 30, &id), Eq(0));
+    /* Opened on the writer, so it sees the uncommitted rows */
+    ASSERT_THAT(dbi->person.older_than_open_cursor(db, 10), Eq(0));
+    ASSERT_THAT(dbi->person.older_than_next(db, &row), Eq(1));
+    EXPECT_THAT(row.name, StrEq("name1"));
+    ASSERT_THAT(dbi->commit(db), Eq(0));
+
+    /* The cursor still owns the writer after the commit */
+    ASSERT_THAT(dbi->person.older_than_next(db, &row), Eq(1));
+    EXPECT_THAT(row.name, StrEq("name2"));
+    ASSERT_THAT(dbi->person.older_than_next(db, &row), Eq(0));
+    dbi->person.older_than_close_cursor(db);
+
+    int ret = -1;
+    std::thread([&] { ret = dbi->person.add(db, "name3", 40, &id); }).join();
+    EXPECT_THAT(ret, Eq(0));
+
+    dbi->close(db);
+}
+TEST_F(NAME, reopening_cursor_keeps_one_connection)
+{
+    int64_t id = -1;
+    struct split_person_older_than_row row;
+    struct split* db = dbi->open_split("split.db", 0);
+    ASSERT_THAT(db, NotNull());
+
+    ASSERT_THAT(dbi->person.add(db, "name1", 20, &id), Eq(0));
+    ASSERT_THAT(dbi->person.older_than_open_cursor(db, 10), Eq(0));
+    ASSERT_THAT(dbi->person.older_than_open_cursor(db, 10), Eq(0));
+    ASSERT_THAT(dbi->person.older_than_next(db, &row), Eq(1));
+    dbi->person.older_than_close_cursor(db);
+    EXPECT_THAT(dbi->person.older_than_next(db, &row), Eq(0));
+
+    /* Closing once gave up the writer, although it was opened twice */
+    int ret = -1;
+    std::thread([&] { ret = dbi->person.add(db, "name2", 30, &id); }).join();
+    EXPECT_THAT(ret, Eq(0));
+
+    dbi->close(db);
+}
+TEST_F(NAME, columns_keep_connection_until_all_rows_are_fetched)
+{
+    int64_t id = -1;
+    int32_t offsets[2];
+    char names[16];
+    struct split_person_older_than_columns cols = {0};
+    struct split* db = dbi->open_split("split.db", 0);
+    ASSERT_THAT(db, NotNull());
+    cols.name_offsets = offsets;
+    cols.name_data = names;
+    cols.name_capacity = sizeof(names);
+
+    ASSERT_THAT(dbi->person.add(db, "name1", 20, &id), Eq(0));
+    ASSERT_THAT(dbi->person.add(db, "name2", 30, &id), Eq(0));
+    ASSERT_THAT(dbi->person.older_than_fetch_columns(db, 10, &cols, 1), Eq(1));
+    EXPECT_THAT(cols.truncated, Eq(1));
+    EXPECT_THAT(std::string(names, offsets[1]), StrEq("name1"));
+    ASSERT_THAT(dbi->person.older_than_fetch_more_columns(db, &cols, 1), Eq(1));
+    EXPECT_THAT(std::string(names, offsets[1]), StrEq("name2"));
+    ASSERT_THAT(dbi->person.older_than_fetch_more_columns(db, &cols, 1), Eq(0));
+    EXPECT_THAT(cols.truncated, Eq(0));
+
+    /* The last fetch gave up the writer */
+    int ret = -1;
+    std::thread([&] { ret = dbi->person.add(db, "name3", 40, &id); }).join();
+    EXPECT_THAT(ret, Eq(0));
+
+    dbi->close(db);
+}
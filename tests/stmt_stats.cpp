@@ -0,0 +1,94 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/stmt_stats.h"
+
+#include <string>
+#include <vector>
+
+#define NAME sqlgen_stmt_stats
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        stmt_stats_init();
+        dbi = stmt_stats("sqlite3");
+        db = dbi->open("stmt_stats.db");
+        dbi->reinit(db);
+        for (int i = 0; i != 20; ++i)
+            dbi->person.add(db, ("name" + std::to_string(i)).c_str(), i % 5);
+    }
+
+    void TearDown() override {
+        dbi->close(db);
+        stmt_stats_deinit();
+    }
+
+    struct stmt_stats_stmt_stats find(const char* name) {
+        struct stmt_stats_stmt_stats stats;
+        for (int i = 0; dbi->query_stats(db, i, &stats) == 0; ++i)
+            if (std::string(stats.name) == name)
+                return stats;
+        ADD_FAILURE() << "No statement named " << name;
+        return stats;
+    }
+
+    struct stmt_stats_interface* dbi;
+    struct stmt_stats* db;
+};
+
+static int ignore_name(const char* name, void* user) {
+    return 0;
+}
+
+TEST_F(NAME, lists_every_statement)
+{
+    struct stmt_stats_stmt_stats stats;
+    std::vector<std::string> names;
+    for (int i = 0; dbi->query_stats(db, i, &stats) == 0; ++i)
+        names.push_back(stats.name);
+    EXPECT_THAT(names, ElementsAre(
+        "person.add", "person.add_bulk", "person.add_bulk_tail",
+        "person.age", "person.aged", "person.by_age",
+        "begin", "begin_immediate", "commit", "rollback",
+        "savepoint", "release", "rollback_to"));
+    EXPECT_THAT(dbi->query_stats(db, -1, &stats), Eq(-1));
+}
+TEST_F(NAME, unprepared_statement_reports_zeros)
+{
+    struct stmt_stats_stmt_stats stats = find("person.aged");
+    EXPECT_THAT(stats.prepared, Eq(0));
+    EXPECT_THAT(stats.runs, Eq(0));
+    EXPECT_THAT(stats.vm_steps, Eq(0));
+}
+TEST_F(NAME, counts_runs_and_steps)
+{
+    struct stmt_stats_stmt_stats stats = find("person.add");
+    EXPECT_THAT(stats.prepared, Eq(1));
+    EXPECT_THAT(stats.runs, Eq(20));
+    EXPECT_THAT(stats.vm_steps, Gt(0));
+    EXPECT_THAT(stats.memused, Gt(0));
+}
+TEST_F(NAME, detects_full_scans_and_sorts)
+{
+    ASSERT_THAT(dbi->person.age(db, "name3"), Eq(3));
+    ASSERT_THAT(dbi->person.aged(db, 3, ignore_name, NULL), Eq(0));
+    ASSERT_THAT(dbi->person.by_age(db, ignore_name, NULL), Eq(0));
+
+    /* Looked up through the UNIQUE index */
+    EXPECT_THAT(find("person.age").fullscan_steps, Eq(0));
+    /* No index on age */
+    EXPECT_THAT(find("person.aged").fullscan_steps, Ge(19));
+    EXPECT_THAT(find("person.aged").sorts, Eq(0));
+    EXPECT_THAT(find("person.by_age").sorts, Gt(0));
+}
+TEST_F(NAME, reads_connection_counters)
+{
+    struct stmt_stats_db_stats stats;
+    ASSERT_THAT(dbi->person.age(db, "name3"), Eq(3));
+    ASSERT_THAT(dbi->db_stats(db, &stats), Eq(0));
+    EXPECT_THAT(stats.cache_hits, Gt(0));
+    EXPECT_THAT(stats.cache_used, Gt(0));
+    EXPECT_THAT(stats.schema_used, Gt(0));
+    EXPECT_THAT(stats.stmt_used, Gt(0));
+}
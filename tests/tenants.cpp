@@ -0,0 +1,271 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/tenants.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define NAME sqlgen_tenants
+
+using namespace testing;
+
+static const char* tenant_names[] = { "a", "b", "c", "t0", "t1", "t2", "t3", "t4", "t5" };
+
+static std::string tenant_file(const std::string& tenant, const char* suffix = "") {
+    return "tenant_" + tenant + ".db" + suffix;
+}
+
+static bool file_exists(const std::string& path) {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp)
+        fclose(fp);
+    return fp != NULL;
+}
+
+/* The last connection to a WAL database deletes the -wal file when closing */
+static bool wait_until_closed(const std::string& tenant) {
+    for (int i = 0; i != 500 && file_exists(tenant_file(tenant, "-wal")); ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return !file_exists(tenant_file(tenant, "-wal"));
+}
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        for (const char* tenant : tenant_names)
+            for (const char* suffix : { "", "-wal", "-shm" })
+                std::remove(tenant_file(tenant, suffix).c_str());
+        tenants_init();
+        dbi = tenants("sqlite3");
+    }
+
+    void TearDown() override {
+        tenants_deinit();
+    }
+
+    struct tenants_interface* dbi;
+};
+
+TEST_F(NAME, open_rejects_invalid_arguments)
+{
+    EXPECT_THAT(dbi->tenants_open("tenant.db", 4), IsNull());
+    EXPECT_THAT(dbi->tenants_open("tenant_%s_%s.db", 4), IsNull());
+    EXPECT_THAT(dbi->tenants_open("tenant_%s.db", 0), IsNull());
+}
+TEST_F(NAME, rejects_invalid_tenant_ids)
+{
+    struct tenants_tenants* cache = dbi->tenants_open("tenant_%s.db", 4);
+    ASSERT_THAT(cache, NotNull());
+    EXPECT_THAT(dbi->tenant_get(cache, ""), IsNull());
+    EXPECT_THAT(dbi->tenant_get(cache, "../a"), IsNull());
+    EXPECT_THAT(dbi->tenant_get(cache, ".a"), IsNull());
+    EXPECT_THAT(dbi->tenant_get(cache, "a/b"), IsNull());
+    EXPECT_THAT(dbi->tenant_get(cache, "a\\b"), IsNull());
+    dbi->tenants_close(cache);
+}
+TEST_F(NAME, first_get_upgrades_database)
+{
+    int64_t id = -1;
+    struct tenants_tenants* cache = dbi->tenants_open("tenant_%s.db", 4);
+    ASSERT_THAT(cache, NotNull());
+
+    struct tenants* db = dbi->tenant_get(cache, "a");
+    ASSERT_THAT(db, NotNull());
+    EXPECT_THAT(file_exists(tenant_file("a")), IsTrue());
+    EXPECT_THAT(dbi->version(db), Eq(1));
+    ASSERT_THAT(dbi->person.add(db, "name1", &id), Eq(0));
+    EXPECT_THAT(dbi->person.count(db), Eq(1));
+    dbi->tenant_release(cache, db);
+
+    dbi->tenants_close(cache);
+}
+TEST_F(NAME, cached_tenant_returns_same_connection)
+{
+    struct tenants_tenants* cache = dbi->tenants_open("tenant_%s.db", 4);
+    ASSERT_THAT(cache, NotNull());
+
+    struct tenants* a = dbi->tenant_get(cache, "a");
+    struct tenants* b = dbi->tenant_get(cache, "b");
+    ASSERT_THAT(a, NotNull());
+    ASSERT_THAT(b, NotNull());
+    EXPECT_THAT(b, Ne(a));
+    dbi->tenant_release(cache, a);
+    EXPECT_THAT(dbi->tenant_get(cache, "a"), Eq(a));
+    dbi->tenant_release(cache, a);
+    EXPECT_THAT(dbi->tenant_get(cache, "a"), Eq(a));
+    dbi->tenant_release(cache, a);
+    dbi->tenant_release(cache, b);
+
+    dbi->tenants_close(cache);
+}
+TEST_F(NAME, evicts_least_recently_used)
+{
+    int64_t id = -1;
+    struct tenants_tenants* cache = dbi->tenants_open("tenant_%s.db", 2);
+    ASSERT_THAT(cache, NotNull());
+
+    struct tenants* a = dbi->tenant_get(cache, "a");
+    ASSERT_THAT(a, NotNull());
+    ASSERT_THAT(dbi->person.add(a, "name1", &id), Eq(0));
+    dbi->tenant_release(cache, a);
+    dbi->tenant_release(cache, dbi->tenant_get(cache, "b"));
+    /* "a" was used last, so "b" is evicted when "c" is opened */
+    dbi->tenant_release(cache, dbi->tenant_get(cache, "a"));
+    dbi->tenant_release(cache, dbi->tenant_get(cache, "c"));
+    EXPECT_THAT(wait_until_closed("b"), IsTrue());
+    EXPECT_THAT(file_exists(tenant_file("a", "-wal")), IsTrue());
+    EXPECT_THAT(file_exists(tenant_file("c", "-wal")), IsTrue());
+
+    dbi->tenant_release(cache, dbi->tenant_get(cache, "b"));
+    EXPECT_THAT(wait_until_closed("a"), IsTrue());
+
+    /* Data survives being evicted */
+    a = dbi->tenant_get(cache, "a");
+    ASSERT_THAT(a, NotNull());
+    EXPECT_THAT(dbi->person.count(a), Eq(1));
+    dbi->tenant_release(cache, a);
+
+    dbi->tenants_close(cache);
+}
+TEST_F(NAME, does_not_evict_connections_in_use)
+{
+    int64_t id = -1;
+    struct tenants_tenants* cache = dbi->tenants_open("tenant_%s.db", 1);
+    ASSERT_THAT(cache, NotNull());
+
+    struct tenants* a = dbi->tenant_get(cache, "a");
+    ASSERT_THAT(a, NotNull());
+    ASSERT_THAT(dbi->begin(a), Eq(0));
+    ASSERT_THAT(dbi->person.add(a, "name1", &id), Eq(0));
+
+    dbi->tenant_release(cache, dbi->tenant_get(cache, "b"));
+    EXPECT_THAT(wait_until_closed("b"), IsTrue());
+
+    ASSERT_THAT(dbi->commit(a), Eq(0));
+    dbi->tenant_release(cache, a);
+    a = dbi->tenant_get(cache, "a");
+    ASSERT_THAT(a, NotNull());
+    EXPECT_THAT(dbi->person.count(a), Eq(1));
+    dbi->tenant_release(cache, a);
+
+    dbi->tenants_close(cache);
+}
+TEST_F(NAME, get_waits_until_tenant_is_released)
+{
+    int64_t id = -1;
+    struct tenants_tenants* cache = dbi->tenants_open("tenant_%s.db", 4);
+    ASSERT_THAT(cache, NotNull());
+
+    struct tenants* a = dbi->tenant_get(cache, "a");
+    ASSERT_THAT(a, NotNull());
+    ASSERT_THAT(dbi->begin(a), Eq(0));
+
+    std::atomic<struct tenants*> other(nullptr);
+    int other_ret = -1;
+    std::thread thread([&] {
+        /* Only returns after the transaction was committed */
+        struct tenants* db = dbi->tenant_get(cache, "a");
+        other = db;
+        if (db == nullptr)
+            return;
+        other_ret = dbi->person.add(db, "name2", &id);
+        dbi->tenant_release(cache, db);
+    });
+
+    ASSERT_THAT(dbi->person.add(a, "name1", &id), Eq(0));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_THAT(other.load(), IsNull());
+    ASSERT_THAT(dbi->commit(a), Eq(0));
+    dbi->tenant_release(cache, a);
+
+    thread.join();
+    EXPECT_THAT(other.load(), Eq(a));
+    EXPECT_THAT(other_ret, Eq(0));
+    a = dbi->tenant_get(cache, "a");
+    ASSERT_THAT(a, NotNull());
+    EXPECT_THAT(dbi->person.count(a), Eq(2));
+    dbi->tenant_release(cache, a);
+
+    dbi->tenants_close(cache);
+}
+TEST_F(NAME, concurrent_gets_of_same_tenant)
+{
+    struct tenants_tenants* cache = dbi->tenants_open("tenant_%s.db", 2);
+    ASSERT_THAT(cache, NotNull());
+
+    /* Every thread opens the same tenant, but only one of them has it at a time */
+    std::atomic<int> holders(0);
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t != 4; ++t)
+        threads.emplace_back([&, t] {
+            for (int i = 0; i != 20; ++i)
+            {
+                int64_t id;
+                struct tenants* db = dbi->tenant_get(cache, "a");
+                if (db == NULL)
+                {
+                    failures++;
+                    continue;
+                }
+                if (holders++ != 0)
+                    failures++;
+                if (dbi->person.add(db, ("name" + std::to_string(t * 20 + i)).c_str(), &id) != 0)
+                    failures++;
+                holders--;
+                dbi->tenant_release(cache, db);
+            }
+        });
+    for (std::thread& thread : threads)
+        thread.join();
+    EXPECT_THAT(failures.load(), Eq(0));
+
+    struct tenants* db = dbi->tenant_get(cache, "a");
+    ASSERT_THAT(db, NotNull());
+    EXPECT_THAT(dbi->person.count(db), Eq(80));
+    dbi->tenant_release(cache, db);
+
+    dbi->tenants_close(cache);
+}
+TEST_F(NAME, concurrent_gets)
+{
+    struct tenants_tenants* cache = dbi->tenants_open("tenant_%s.db", 3);
+    ASSERT_THAT(cache, NotNull());
+
+    /* Each thread has tenants of its own, but they all compete for the cache */
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t != 3; ++t)
+        threads.emplace_back([&, t] {
+            for (int i = 0; i != 30; ++i)
+            {
+                int64_t id;
+                std::string tenant = "t" + std::to_string(t * 2 + i % 2);
+                struct tenants* db = dbi->tenant_get(cache, tenant.c_str());
+                if (db == NULL)
+                {
+                    failures++;
+                    continue;
+                }
+                if (dbi->person.add(db, ("name" + std::to_string(i)).c_str(), &id) != 0)
+                    failures++;
+                dbi->tenant_release(cache, db);
+            }
+        });
+    for (std::thread& thread : threads)
+        thread.join();
+    EXPECT_THAT(failures.load(), Eq(0));
+
+    for (int t = 0; t != 6; ++t)
+    {
+        struct tenants* db = dbi->tenant_get(cache, ("t" + std::to_string(t)).c_str());
+        ASSERT_THAT(db, NotNull());
+        EXPECT_THAT(dbi->person.count(db), Eq(15));
+        dbi->tenant_release(cache, db);
+    }
+
+    dbi->tenants_close(cache);
+}
@@ -0,0 +1,79 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/text.h"
+#include <string>
+#include <vector>
+
+#define NAME sqlgen_text
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        text_init();
+        dbi = text("sqlite3");
+        db = dbi->open("text.db");
+        dbi->reinit(db);
+    }
+
+    void TearDown() override {
+        dbi->close(db);
+        text_deinit();
+    }
+
+    struct text_interface* dbi;
+    struct text* db;
+};
+
+struct row
+{
+    std::string name;
+    int nickname_len;
+    bool nickname_null;
+};
+
+static int on_person(struct str_view name, const char* nickname, int nickname_len, void* user) {
+    static_cast<std::vector<row>*>(user)->push_back({
+        std::string(name.data, name.len), nickname_len, nickname == NULL });
+    return 0;
+}
+static int on_get(struct str_view name, struct str_view nickname, void* user) {
+    struct str_view* out = static_cast<struct str_view*>(user);
+    out[0] = name;
+    out[1] = nickname;
+    return 0;
+}
+
+TEST_F(NAME, callback_receives_lengths)
+{
+    std::vector<row> rows;
+    ASSERT_THAT(dbi->person.all(db, on_person, &rows), Eq(0));
+    ASSERT_THAT(rows.size(), Eq(2u));
+    EXPECT_THAT(rows[0].name, StrEq("name1"));
+    EXPECT_THAT(rows[0].nickname_len, Eq(5));
+    EXPECT_THAT(rows[0].nickname_null, IsFalse());
+    EXPECT_THAT(rows[1].name, StrEq("name22"));
+    EXPECT_THAT(rows[1].nickname_len, Eq(0));
+    EXPECT_THAT(rows[1].nickname_null, IsTrue());
+}
+TEST_F(NAME, null_str_view_is_empty)
+{
+    struct str_view out[2];
+    ASSERT_THAT(dbi->person.get(db, 2, on_get, out), Eq(0));
+    EXPECT_THAT(out[0].len, Eq(6));
+    EXPECT_THAT(out[1].data, IsNull());
+    EXPECT_THAT(out[1].len, Eq(0));
+}
+TEST_F(NAME, cursor_row_has_lengths)
+{
+    struct text_person_all_row r;
+    ASSERT_THAT(dbi->person.all_open_cursor(db), Eq(0));
+    ASSERT_THAT(dbi->person.all_next(db, &r), Eq(1));
+    EXPECT_THAT(std::string(r.name.data, r.name.len), StrEq("name1"));
+    EXPECT_THAT(r.nickname_len, Eq(5));
+    ASSERT_THAT(dbi->person.all_next(db, &r), Eq(1));
+    EXPECT_THAT(r.name.len, Eq(6));
+    EXPECT_THAT(r.nickname, IsNull());
+    ASSERT_THAT(dbi->person.all_next(db, &r), Eq(0));
+    dbi->person.all_close_cursor(db);
+}
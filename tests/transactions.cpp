@@ -0,0 +1,68 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/transactions.h"
+
+#define NAME sqlgen_transactions
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        transactions_init();
+        dbi = transactions("sqlite3");
+        db = dbi->open("transactions.db");
+        dbi->reinit(db);
+    }
+
+    void TearDown() override {
+        dbi->close(db);
+        transactions_deinit();
+    }
+
+    struct transactions_interface* dbi;
+    struct transactions* db;
+};
+
+TEST_F(NAME, commit_keeps_changes)
+{
+    ASSERT_THAT(dbi->begin(db), Eq(0));
+    ASSERT_THAT(dbi->add(db, "name1"), Eq(0));
+    ASSERT_THAT(dbi->add(db, "name2"), Eq(0));
+    ASSERT_THAT(dbi->commit(db), Eq(0));
+    ASSERT_THAT(dbi->exists(db, "name1"), Eq(1));
+    ASSERT_THAT(dbi->exists(db, "name2"), Eq(1));
+}
+TEST_F(NAME, rollback_discards_changes)
+{
+    ASSERT_THAT(dbi->begin_immediate(db), Eq(0));
+    ASSERT_THAT(dbi->add(db, "name1"), Eq(0));
+    ASSERT_THAT(dbi->exists(db, "name1"), Eq(1));
+    ASSERT_THAT(dbi->rollback(db), Eq(0));
+    ASSERT_THAT(dbi->exists(db, "name1"), Eq(0));
+}
+TEST_F(NAME, commit_without_begin_returns_negative)
+{
+    ASSERT_THAT(dbi->commit(db), Lt(0));
+}
+TEST_F(NAME, nested_savepoints)
+{
+    ASSERT_THAT(dbi->begin(db), Eq(0));
+    ASSERT_THAT(dbi->add(db, "name1"), Eq(0));
+    ASSERT_THAT(dbi->savepoint(db), Eq(0));
+    ASSERT_THAT(dbi->add(db, "name2"), Eq(0));
+    ASSERT_THAT(dbi->savepoint(db), Eq(0));
+    ASSERT_THAT(dbi->add(db, "name3"), Eq(0));
+    ASSERT_THAT(dbi->rollback_to(db), Eq(0));
+    ASSERT_THAT(dbi->release(db), Eq(0));
+    ASSERT_THAT(dbi->commit(db), Eq(0));
+    ASSERT_THAT(dbi->exists(db, "name1"), Eq(1));
+    ASSERT_THAT(dbi->exists(db, "name2"), Eq(1));
+    ASSERT_THAT(dbi->exists(db, "name3"), Eq(0));
+}
+TEST_F(NAME, savepoint_outside_of_transaction)
+{
+    ASSERT_THAT(dbi->savepoint(db), Eq(0));
+    ASSERT_THAT(dbi->add(db, "name1"), Eq(0));
+    ASSERT_THAT(dbi->rollback_to(db), Eq(0));
+    ASSERT_THAT(dbi->exists(db, "name1"), Eq(0));
+}
@@ -0,0 +1,98 @@
+#include <gmock/gmock.h>
+#include "sqlgen/tests/upsert_status.h"
+
+#define NAME sqlgen_upsert_status
+
+using namespace testing;
+
+struct NAME : public Test
+{
+    void SetUp() override {
+        upsert_status_init();
+        dbi = upsert_status("sqlite3");
+        db = dbi->open("upsert_status.db");
+        dbi->reinit(db);
+    }
+
+    void TearDown() override {
+        dbi->close(db);
+        upsert_status_deinit();
+    }
+
+    struct upsert_status_interface* dbi;
+    struct upsert_status* db;
+};
+
+TEST_F(NAME, reports_inserted_updated_and_unchanged)
+{
+    EXPECT_THAT(dbi->person.put(db, "name1", "nick", 20), Eq(1));
+    EXPECT_THAT(dbi->person.put(db, "name1", "nick", 20), Eq(0));
+    EXPECT_THAT(dbi->person.put(db, "name1", "nick", 21), Eq(2));
+    EXPECT_THAT(dbi->person.put(db, "name2", "nick", 21), Eq(1));
+    EXPECT_THAT(dbi->person.age(db, "name1"), Eq(21));
+}
+TEST_F(NAME, unchanged_rows_are_not_written)
+{
+    ASSERT_THAT(dbi->person.put(db, "name1", "nick", 20), Eq(1));
+    int changes = dbi->changes(db);
+
+    EXPECT_THAT(dbi->person.put(db, "name1", "nick", 20), Eq(0));
+    EXPECT_THAT(dbi->changes(db), Eq(changes));
+    EXPECT_THAT(dbi->updates(db), Eq(0));
+
+    EXPECT_THAT(dbi->person.put(db, "name1", "nick", 30), Eq(2));
+    EXPECT_THAT(dbi->updates(db), Eq(1));
+}
+TEST_F(NAME, compares_null_values)
+{
+    ASSERT_THAT(dbi->person.put(db, "name1", NULL, 20), Eq(1));
+    EXPECT_THAT(dbi->person.put(db, "name1", NULL, 20), Eq(0));
+    EXPECT_THAT(dbi->person.put(db, "name1", "nick", 20), Eq(2));
+    EXPECT_THAT(dbi->person.put(db, "name1", NULL, 20), Eq(2));
+}
+TEST_F(NAME, key_only_upsert_does_nothing_on_conflict)
+{
+    EXPECT_THAT(dbi->tag.put(db, "name1", "tag1"), Eq(1));
+    EXPECT_THAT(dbi->tag.put(db, "name1", "tag1"), Eq(0));
+    EXPECT_THAT(dbi->tag.put(db, "name1", "tag2"), Eq(1));
+}
+TEST_F(NAME, reports_insert_of_rowid_0)
+{
+    EXPECT_THAT(dbi->counter.put(db, 0, 1), Eq(1));
+    EXPECT_THAT(dbi->counter.put(db, 0, 1), Eq(0));
+    EXPECT_THAT(dbi->counter.put(db, 0, 2), Eq(2));
+}
+TEST_F(NAME, reports_status_for_without_rowid_tables)
+{
+    EXPECT_THAT(dbi->setting.put(db, "key1", "a"), Eq(1));
+    EXPECT_THAT(dbi->setting.put(db, "key1", "a"), Eq(0));
+    EXPECT_THAT(dbi->setting.put(db, "key1", "b"), Eq(2));
+    EXPECT_THAT(dbi->setting.put(db, "key2", NULL), Eq(1));
+}
+TEST_F(NAME, reports_status_inside_transaction)
+{
+    ASSERT_THAT(dbi->begin(db), Eq(0));
+    EXPECT_THAT(dbi->person.put(db, "name1", "nick", 20), Eq(1));
+    EXPECT_THAT(dbi->person.put(db, "name1", "nick", 21), Eq(2));
+    ASSERT_THAT(dbi->rollback(db), Eq(0));
+    EXPECT_THAT(dbi->person.put(db, "name1", "nick", 21), Eq(1));
+}
+TEST_F(NAME, batch_reports_every_row)
+{
+    struct upsert_status_person_put_args rows[3] = {
+        { "name1", "nick", 20 }, { "name1", "nick", 20 }, { "name1", "nick", 21 } };
+    int results[3];
+    ASSERT_THAT(dbi->person.put_batch(db, rows, 3, results), Eq(0));
+    EXPECT_THAT(results, ElementsAre(1, 0, 2));
+}
+TEST_F(NAME, bulk_skips_unchanged_rows)
+{
+    struct upsert_status_person_put_args rows[3] = {
+        { "name1", "nick", 20 }, { "name2", "nick", 30 }, { "name3", NULL, 40 } };
+    ASSERT_THAT(dbi->person.put_bulk(db, rows, 3), Eq(0));
+
+    rows[1].age = 31;
+    ASSERT_THAT(dbi->person.put_bulk(db, rows, 3), Eq(0));
+    EXPECT_THAT(dbi->updates(db), Eq(1));
+    EXPECT_THAT(dbi->person.age(db, "name2"), Eq(31));
+}